@@ -0,0 +1,532 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ccm.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(CCM_NO_AESNI)
+#define CCM_AESNI
+#include <wmmintrin.h>
+#endif
+
+#define CCM_BLOCK_LEN 16
+#define CCM_ROUNDS 10
+
+/* Frames processed together by the batch functions, each contributing up to two blocks per step */
+#define CCM_BATCH_LEN 4
+#define CCM_MAX_LANES (2 * CCM_BATCH_LEN)
+
+/* The given byte replicated in the 8 lanes of a 64 bit word */
+#define CCM_LANES(b) (0x0101010101010101ULL * (uint8_t) (b))
+#define CCM_ROTL8(x, k) ((((x) << (k)) & CCM_LANES(0xff << (k))) | (((x) >> (8 - (k))) & CCM_LANES(0xff >> (8 - (k)))))
+
+/* IEEE 802.15.4-2006 security level and MIC length of each SL_* suite, indexed by suite */
+static const uint8_t ccm_suites[8][2] = {
+  {0x00, 0},  // SL_NONE
+  {0x04, 0},  // SL_AES_CTR
+  {0x07, 16}, // SL_AES_CCM_128
+  {0x06, 8},  // SL_AES_CCM_64
+  {0x05, 4},  // SL_AES_CCM_32
+  {0x03, 16}, // SL_AES_CBC_MAC_128
+  {0x02, 8},  // SL_AES_CBC_MAC_64
+  {0x01, 4}   // SL_AES_CBC_MAC_32
+};
+
+/*
+ * The progress of CCM* over one message. The CBC-MAC chain and the counter blocks are advanced in steps, each
+ * encrypting at most one block of either, so that the blocks of several messages can go through the cipher
+ * together: the MAC of a sealed block must be computed before the block is encrypted, the MAC of an opened block
+ * after it has been decrypted.
+ */
+typedef struct {
+  const ccm_key_t *key;
+  uint8_t nonce[CCM_NONCE_LEN];
+  const uint8_t *aad;
+  uint16_t aad_len;
+  uint8_t *msg;
+  uint16_t msg_len;
+  uint8_t mic_len;
+  bool decrypt;
+  uint8_t x[CCM_BLOCK_LEN];
+  uint8_t s0[CCM_BLOCK_LEN];
+  uint8_t a[CCM_BLOCK_LEN];
+  uint16_t aad_blocks;
+  uint16_t msg_blocks;
+  uint16_t mac_total;
+  uint16_t mac_done;
+  uint16_t ctr_next;
+  bool mac_lane;
+  bool ctr_lane;
+} ccm_state_t;
+
+/* Multiplies each byte of a by the byte of b in the same lane, in GF(2^8) and in constant time */
+uint64_t _ccm_gf_mul8(uint64_t a, uint64_t b) {
+  uint64_t r = 0;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    r ^= a & (((b >> i) & CCM_LANES(0x01)) * 0xff);
+    a = ((a & CCM_LANES(0x7f)) << 1) ^ (((a >> 7) & CCM_LANES(0x01)) * 0x1b);
+  }
+
+  return r;
+}
+
+/* The AES S-box applied to 8 bytes at once: the inverse is computed as x^254, then the affine transform applied */
+uint64_t _ccm_sub_bytes8(uint64_t x) {
+  uint64_t x2 = _ccm_gf_mul8(x, x);
+  uint64_t x3 = _ccm_gf_mul8(x2, x);
+  uint64_t x12 = _ccm_gf_mul8(x3, x3);
+  x12 = _ccm_gf_mul8(x12, x12);
+  uint64_t y = _ccm_gf_mul8(x12, x3);
+
+  for (uint8_t i = 0; i < 4; i++) {
+    y = _ccm_gf_mul8(y, y);
+  }
+
+  y = _ccm_gf_mul8(y, x12);
+  y = _ccm_gf_mul8(y, x2);
+
+  return y ^ CCM_ROTL8(y, 1) ^ CCM_ROTL8(y, 2) ^ CCM_ROTL8(y, 3) ^ CCM_ROTL8(y, 4) ^ CCM_LANES(0x63);
+}
+
+void _ccm_sub_bytes(uint8_t *buf, uint8_t len) {
+  for (uint8_t i = 0; i < len; i += 8) {
+    uint8_t n = (len - i) < 8 ? (len - i) : 8;
+    uint64_t w = 0;
+
+    memcpy(&w, &buf[i], n);
+    w = _ccm_sub_bytes8(w);
+    memcpy(&buf[i], &w, n);
+  }
+}
+
+uint8_t _ccm_xtime(uint8_t b) {
+  return (uint8_t) ((b << 1) ^ (0x1b & -(b >> 7)));
+}
+
+void _ccm_xor(uint8_t *dst, const uint8_t *src, uint8_t len) {
+  for (uint8_t i = 0; i < len; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+void _ccm_portable_encrypt(const ccm_key_t *key, uint8_t *block) {
+  uint8_t t[CCM_BLOCK_LEN];
+
+  _ccm_xor(block, key->round_keys, CCM_BLOCK_LEN);
+
+  for (uint8_t round = 1; round <= CCM_ROUNDS; round++) {
+    _ccm_sub_bytes(block, CCM_BLOCK_LEN);
+
+    // ShiftRows: the state is stored column by column
+    for (uint8_t i = 0; i < CCM_BLOCK_LEN; i++) {
+      t[i] = block[(i + 4 * (i & 0x03)) & 0x0f];
+    }
+
+    if (round < CCM_ROUNDS) {
+      for (uint8_t c = 0; c < CCM_BLOCK_LEN; c += 4) {
+        uint8_t all = t[c] ^ t[c + 1] ^ t[c + 2] ^ t[c + 3];
+        uint8_t first = t[c];
+
+        block[c] = t[c] ^ all ^ _ccm_xtime(t[c] ^ t[c + 1]);
+        block[c + 1] = t[c + 1] ^ all ^ _ccm_xtime(t[c + 1] ^ t[c + 2]);
+        block[c + 2] = t[c + 2] ^ all ^ _ccm_xtime(t[c + 2] ^ t[c + 3]);
+        block[c + 3] = t[c + 3] ^ all ^ _ccm_xtime(t[c + 3] ^ first);
+      }
+    } else {
+      memcpy(block, t, CCM_BLOCK_LEN);
+    }
+
+    _ccm_xor(block, &key->round_keys[round * CCM_BLOCK_LEN], CCM_BLOCK_LEN);
+  }
+}
+
+#ifdef CCM_AESNI
+__attribute__((target("aes,sse2")))
+void _ccm_aesni_encrypt_lanes(const ccm_key_t **keys, uint8_t **blocks, uint8_t lanes) {
+  __m128i x[CCM_MAX_LANES];
+
+  for (uint8_t l = 0; l < lanes; l++) {
+    x[l] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) blocks[l]), _mm_loadu_si128((const __m128i *) keys[l]->round_keys));
+  }
+
+  // the lanes are independent, so the latency of each AESENC is hidden by the others
+  for (uint8_t round = 1; round < CCM_ROUNDS; round++) {
+    for (uint8_t l = 0; l < lanes; l++) {
+      x[l] = _mm_aesenc_si128(x[l], _mm_loadu_si128((const __m128i *) &keys[l]->round_keys[round * CCM_BLOCK_LEN]));
+    }
+  }
+
+  for (uint8_t l = 0; l < lanes; l++) {
+    x[l] = _mm_aesenclast_si128(x[l], _mm_loadu_si128((const __m128i *) &keys[l]->round_keys[CCM_ROUNDS * CCM_BLOCK_LEN]));
+    _mm_storeu_si128((__m128i *) blocks[l], x[l]);
+  }
+}
+
+bool _ccm_has_aesni(void) {
+  // detected once, a concurrent first call just detects it twice
+  static int8_t has_aesni = -1;
+
+  if (has_aesni < 0) {
+    __builtin_cpu_init();
+    has_aesni = __builtin_cpu_supports("aes") ? 1 : 0;
+  }
+
+  return has_aesni;
+}
+#endif
+
+/* Encrypts each block with its own key */
+void _ccm_encrypt_lanes(const ccm_key_t **keys, uint8_t **blocks, uint8_t lanes) {
+#ifdef CCM_AESNI
+  if (_ccm_has_aesni()) {
+    _ccm_aesni_encrypt_lanes(keys, blocks, lanes);
+    return;
+  }
+#endif
+
+  for (uint8_t l = 0; l < lanes; l++) {
+    _ccm_portable_encrypt(keys[l], blocks[l]);
+  }
+}
+
+void ccm_key_init(ccm_key_t *key, const uint8_t *raw_key) {
+  uint8_t *w = key->round_keys;
+  uint8_t rcon = 0x01;
+  uint8_t t[4];
+
+  memcpy(w, raw_key, CCM_BLOCK_LEN);
+
+  for (uint8_t i = CCM_BLOCK_LEN; i < sizeof(key->round_keys); i += 4) {
+    if (i % CCM_BLOCK_LEN) {
+      memcpy(t, &w[i - 4], 4);
+    } else {
+      t[0] = w[i - 3];
+      t[1] = w[i - 2];
+      t[2] = w[i - 1];
+      t[3] = w[i - 4];
+      _ccm_sub_bytes(t, 4);
+      t[0] ^= rcon;
+      rcon = _ccm_xtime(rcon);
+    }
+
+    for (uint8_t j = 0; j < 4; j++) {
+      w[i + j] = w[i + j - CCM_BLOCK_LEN] ^ t[j];
+    }
+  }
+}
+
+void ccm_encrypt_block(const ccm_key_t *key, uint8_t *block) {
+  _ccm_encrypt_lanes(&key, &block, 1);
+}
+
+uint8_t ccm_mic_length(uint8_t security_level) {
+  return ccm_suites[security_level & 0x07][1];
+}
+
+void _ccm_format_block(uint8_t *block, uint8_t flags, const uint8_t *nonce, uint16_t value) {
+  block[0] = flags;
+  memcpy(&block[1], nonce, CCM_NONCE_LEN);
+  block[14] = (value >> 8);
+  block[15] = (value & 0xff);
+}
+
+void _ccm_init_state(ccm_state_t *st, const ccm_key_t *key, const uint8_t *nonce, const uint8_t *aad, uint16_t aad_len,
+  uint8_t *msg, uint16_t msg_len, uint8_t mic_len, bool decrypt) {
+  st->key = key;
+  memcpy(st->nonce, nonce, CCM_NONCE_LEN);
+  st->aad = aad;
+  st->aad_len = aad_len;
+  st->msg = msg;
+  st->msg_len = msg_len;
+  st->mic_len = mic_len;
+  st->decrypt = decrypt;
+
+  // the additional data is preceded by its 2 byte length
+  st->aad_blocks = aad_len ? (aad_len + 2 + CCM_BLOCK_LEN - 1) / CCM_BLOCK_LEN : 0;
+  st->msg_blocks = (msg_len + CCM_BLOCK_LEN - 1) / CCM_BLOCK_LEN;
+  st->mac_total = mic_len ? 1 + st->aad_blocks + st->msg_blocks : 0;
+  st->mac_done = 0;
+
+  // without MIC, the A0 block masking it is not needed
+  st->ctr_next = mic_len ? 0 : 1;
+}
+
+bool _ccm_state_done(ccm_state_t *st) {
+  return st->mac_done == st->mac_total && st->ctr_next > st->msg_blocks;
+}
+
+/* Adds to the lanes the next MAC block and the next counter block of the message, if they can be computed */
+void _ccm_prepare_step(ccm_state_t *st, const ccm_key_t **keys, uint8_t **blocks, uint8_t *lanes) {
+  st->mac_lane = false;
+  st->ctr_lane = false;
+
+  if (st->mac_done < st->mac_total) {
+    uint16_t index = st->mac_done;
+
+    if (index == 0) {
+      uint8_t flags = (st->aad_len ? 0x40 : 0x00) | (((st->mic_len - 2) / 2) << 3) | 0x01;
+      _ccm_format_block(st->x, flags, st->nonce, st->msg_len);
+      st->mac_lane = true;
+    } else if (index <= st->aad_blocks) {
+      uint16_t pos = (index - 1) * CCM_BLOCK_LEN;
+
+      for (uint8_t i = 0; i < CCM_BLOCK_LEN; i++, pos++) {
+        if (pos < 2) {
+          st->x[i] ^= pos ? (st->aad_len & 0xff) : (st->aad_len >> 8);
+        } else if (pos - 2 < st->aad_len) {
+          st->x[i] ^= st->aad[pos - 2];
+        }
+      }
+
+      st->mac_lane = true;
+    } else {
+      uint16_t block = index - 1 - st->aad_blocks;
+
+      // an opened block must have been decrypted
+      if (!st->decrypt || st->ctr_next > block + 1) {
+        uint16_t pos = block * CCM_BLOCK_LEN;
+        uint16_t n = st->msg_len - pos;
+
+        _ccm_xor(st->x, &st->msg[pos], n < CCM_BLOCK_LEN ? n : CCM_BLOCK_LEN);
+        st->mac_lane = true;
+      }
+    }
+
+    if (st->mac_lane) {
+      keys[*lanes] = st->key;
+      blocks[(*lanes)++] = st->x;
+    }
+  }
+
+  if (st->ctr_next <= st->msg_blocks) {
+    uint16_t absorbed = st->mac_done + (st->mac_lane ? 1 : 0);
+
+    // a sealed block must have been added to the MAC
+    if (st->decrypt || st->ctr_next == 0 || !st->mac_total || absorbed >= 1 + st->aad_blocks + st->ctr_next) {
+      uint8_t *a = st->ctr_next ? st->a : st->s0;
+
+      _ccm_format_block(a, 0x01, st->nonce, st->ctr_next);
+      keys[*lanes] = st->key;
+      blocks[(*lanes)++] = a;
+      st->ctr_lane = true;
+    }
+  }
+}
+
+void _ccm_finish_step(ccm_state_t *st) {
+  if (st->mac_lane) {
+    st->mac_done++;
+  }
+
+  if (st->ctr_lane) {
+    if (st->ctr_next) {
+      uint16_t pos = (st->ctr_next - 1) * CCM_BLOCK_LEN;
+      uint16_t n = st->msg_len - pos;
+
+      _ccm_xor(&st->msg[pos], st->a, n < CCM_BLOCK_LEN ? n : CCM_BLOCK_LEN);
+    }
+
+    st->ctr_next++;
+  }
+}
+
+void _ccm_run(ccm_state_t *states, uint8_t count) {
+  const ccm_key_t *keys[CCM_MAX_LANES];
+  uint8_t *blocks[CCM_MAX_LANES];
+
+  for (;;) {
+    uint8_t lanes = 0;
+
+    for (uint8_t i = 0; i < count; i++) {
+      if (!_ccm_state_done(&states[i])) {
+        _ccm_prepare_step(&states[i], keys, blocks, &lanes);
+      } else {
+        states[i].mac_lane = false;
+        states[i].ctr_lane = false;
+      }
+    }
+
+    if (!lanes) {
+      break;
+    }
+
+    _ccm_encrypt_lanes(keys, blocks, lanes);
+
+    for (uint8_t i = 0; i < count; i++) {
+      _ccm_finish_step(&states[i]);
+    }
+  }
+}
+
+void _ccm_seal_finish(ccm_state_t *st, uint8_t *mic) {
+  for (uint8_t i = 0; i < st->mic_len; i++) {
+    mic[i] = st->x[i] ^ st->s0[i];
+  }
+}
+
+bool _ccm_open_finish(ccm_state_t *st, const uint8_t *mic) {
+  uint8_t diff = 0;
+
+  for (uint8_t i = 0; i < st->mic_len; i++) {
+    diff |= mic[i] ^ st->x[i] ^ st->s0[i];
+  }
+
+  if (diff) {
+    memset(st->msg, 0, st->msg_len);
+  }
+
+  return !diff;
+}
+
+void ccm_seal(const ccm_key_t *key, const uint8_t *nonce, const uint8_t *aad, uint16_t aad_len, uint8_t *msg,
+  uint16_t msg_len, uint8_t *mic, uint8_t mic_len) {
+  ccm_state_t st;
+
+  _ccm_init_state(&st, key, nonce, aad, aad_len, msg, msg_len, mic_len, false);
+  _ccm_run(&st, 1);
+  _ccm_seal_finish(&st, mic);
+}
+
+bool ccm_open(const ccm_key_t *key, const uint8_t *nonce, const uint8_t *aad, uint16_t aad_len, uint8_t *msg,
+  uint16_t msg_len, const uint8_t *mic, uint8_t mic_len) {
+  ccm_state_t st;
+
+  _ccm_init_state(&st, key, nonce, aad, aad_len, msg, msg_len, mic_len, true);
+  _ccm_run(&st, 1);
+  return _ccm_open_finish(&st, mic);
+}
+
+bool ccm_frame_nonce(ieee802_15_4_frame_t *frame, const uint8_t *src_eui, uint8_t security_level, uint8_t *nonce) {
+  const uint8_t *eui = src_eui;
+
+  // a short source address is not unique, the sender must then be named by the caller
+  if (!eui) {
+    if (EXTRACT_FCSRCADDR(*frame->fc_high) != FCADDR_EXT) {
+      return false;
+    }
+
+    eui = frame->src_addr;
+  }
+
+  // addresses and counters are transmitted least significant byte first
+  for (uint8_t i = 0; i < 8; i++) {
+    nonce[i] = eui[7 - i];
+  }
+
+  for (uint8_t i = 0; i < 4; i++) {
+    nonce[8 + i] = frame->frame_counter[3 - i];
+  }
+
+  nonce[12] = ccm_suites[security_level & 0x07][0];
+
+  return true;
+}
+
+/* Sets up CCM* for a frame: encrypting suites authenticate the headers and encrypt the payload, the others
+ * authenticate the whole frame. A frame whose nonce cannot be built gets a state with nothing to do. */
+bool _ccm_init_frame_state(ccm_state_t *st, const ccm_key_t *key, ieee802_15_4_frame_t *frame, const uint8_t *src_eui,
+  uint8_t security_level, bool decrypt) {
+  uint8_t nonce[CCM_NONCE_LEN];
+  uint16_t header_len = frame->header_len + frame->sec_header_len;
+  uint8_t mic_len = ccm_mic_length(security_level);
+
+  if (!ccm_frame_nonce(frame, src_eui, security_level, nonce)) {
+    _ccm_init_state(st, key, nonce, NULL, 0, NULL, 0, 0, decrypt);
+    return false;
+  }
+
+  if (ccm_suites[security_level & 0x07][0] & 0x04) {
+    _ccm_init_state(st, key, nonce, frame->backing_buffer, header_len, frame->payload, frame->payload_len, mic_len, decrypt);
+  } else {
+    _ccm_init_state(st, key, nonce, frame->backing_buffer, header_len + frame->payload_len, NULL, 0, mic_len, decrypt);
+  }
+
+  return true;
+}
+
+uint8_t ccm_secure_frame(const ccm_key_t *key, ieee802_15_4_frame_t *frame, const uint8_t *src_eui, uint8_t security_level) {
+  ccm_job_t job = { key, frame, src_eui, security_level, false };
+
+  ccm_secure_frames(&job, 1);
+  return job.ok ? ccm_mic_length(security_level) : 0;
+}
+
+bool ccm_unsecure_frame(const ccm_key_t *key, ieee802_15_4_frame_t *frame, const uint8_t *src_eui, uint8_t security_level) {
+  ccm_job_t job = { key, frame, src_eui, security_level, false };
+
+  return ccm_unsecure_frames(&job, 1) == 1;
+}
+
+void ccm_secure_frames(ccm_job_t *jobs, uint16_t count) {
+  ccm_state_t states[CCM_BATCH_LEN];
+
+  for (uint16_t first = 0; first < count; first += CCM_BATCH_LEN) {
+    uint8_t n = (count - first) < CCM_BATCH_LEN ? (count - first) : CCM_BATCH_LEN;
+
+    for (uint8_t i = 0; i < n; i++) {
+      ccm_job_t *job = &jobs[first + i];
+      job->ok = _ccm_init_frame_state(&states[i], job->key, job->frame, job->src_eui, job->security_level, false);
+    }
+
+    _ccm_run(states, n);
+
+    for (uint8_t i = 0; i < n; i++) {
+      ieee802_15_4_frame_t *frame = jobs[first + i].frame;
+
+      if (jobs[first + i].ok) {
+        _ccm_seal_finish(&states[i], frame->payload + frame->payload_len);
+      }
+    }
+  }
+}
+
+uint16_t ccm_unsecure_frames(ccm_job_t *jobs, uint16_t count) {
+  ccm_state_t states[CCM_BATCH_LEN];
+  uint16_t verified = 0;
+
+  for (uint16_t first = 0; first < count; first += CCM_BATCH_LEN) {
+    uint8_t n = (count - first) < CCM_BATCH_LEN ? (count - first) : CCM_BATCH_LEN;
+
+    for (uint8_t i = 0; i < n; i++) {
+      ccm_job_t *job = &jobs[first + i];
+      job->ok = _ccm_init_frame_state(&states[i], job->key, job->frame, job->src_eui, job->security_level, true);
+    }
+
+    _ccm_run(states, n);
+
+    for (uint8_t i = 0; i < n; i++) {
+      ieee802_15_4_frame_t *frame = jobs[first + i].frame;
+
+      if (jobs[first + i].ok) {
+        jobs[first + i].ok = _ccm_open_finish(&states[i], frame->payload + frame->payload_len);
+      } else {
+        memset(frame->payload, 0, frame->payload_len);
+      }
+
+      verified += jobs[first + i].ok;
+    }
+  }
+
+  return verified;
+}
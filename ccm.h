@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef CCM_H
+#define	CCM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "osnp.h"
+
+/*
+ * Software AES-CCM* for IEEE 802.15.4 frames, for hubs and gateways whose radio does not apply security itself. The
+ * portable core uses neither tables nor data-dependent branches, so its timing does not depend on keys or data. On
+ * x86, built with GCC or Clang, AES-NI is used instead when the CPU supports it, unless CCM_NO_AESNI is defined.
+ *
+ * The nonce is the source EUI-64 and the frame counter, both most significant byte first, followed by the IEEE
+ * 802.15.4-2006 security level matching the SL_* suite. The MAC header and the auxiliary security header are
+ * authenticated, the payload is encrypted by the SL_AES_CTR and SL_AES_CCM_* suites and authenticated by all but
+ * SL_AES_CTR. The MIC follows the payload. A short source address does not identify the sender, so frames sent from
+ * one are only processed if the caller gives the sender EUI-64.
+ */
+
+/* Length of the CCM nonce */
+#define CCM_NONCE_LEN 13
+
+/**
+ * An expanded AES-128 key. Expanding a key is much slower than using it, so a hub keeps one for each key in use.
+ */
+typedef struct {
+  uint8_t round_keys[176];
+} ccm_key_t;
+
+/**
+ * A frame to secure or to verify with ccm_secure_frames or ccm_unsecure_frames.
+ */
+typedef struct {
+  const ccm_key_t *key;
+  ieee802_15_4_frame_t *frame;
+  const uint8_t *src_eui;
+  uint8_t security_level;
+  bool ok;
+} ccm_job_t;
+
+/**
+ * Expands an AES-128 key.
+ *
+ * @param key the output expanded key
+ * @param raw_key the 16 bytes of the key
+ */
+void ccm_key_init(ccm_key_t *key, const uint8_t *raw_key);
+
+/**
+ * Encrypts a single 16 byte block in place.
+ *
+ * @param key the expanded key
+ * @param block the block
+ */
+void ccm_encrypt_block(const ccm_key_t *key, uint8_t *block);
+
+/**
+ * Returns the MIC length of a security suite.
+ *
+ * @param security_level one of the SL_* values
+ * @return the MIC length, in bytes, 0 if the suite has no MIC
+ */
+uint8_t ccm_mic_length(uint8_t security_level);
+
+/**
+ * Applies CCM* to a message in place, with a 2 byte length field.
+ *
+ * @param key the expanded key
+ * @param nonce the CCM_NONCE_LEN bytes of the nonce
+ * @param aad the additional authenticated data
+ * @param aad_len the length of the additional authenticated data, less than 0xff00
+ * @param msg the message, encrypted in place
+ * @param msg_len the length of the message
+ * @param mic the output MIC
+ * @param mic_len the MIC length: 0, 4, 6, 8, 10, 12, 14 or 16
+ */
+void ccm_seal(const ccm_key_t *key, const uint8_t *nonce, const uint8_t *aad, uint16_t aad_len, uint8_t *msg,
+  uint16_t msg_len, uint8_t *mic, uint8_t mic_len);
+
+/**
+ * Reverses ccm_seal in place and checks the MIC in constant time. If the MIC does not match the message is zeroed.
+ *
+ * @param key the expanded key
+ * @param nonce the CCM_NONCE_LEN bytes of the nonce
+ * @param aad the additional authenticated data
+ * @param aad_len the length of the additional authenticated data, less than 0xff00
+ * @param msg the encrypted message, decrypted in place
+ * @param msg_len the length of the message
+ * @param mic the received MIC
+ * @param mic_len the MIC length
+ * @return true if the MIC matches
+ */
+bool ccm_open(const ccm_key_t *key, const uint8_t *nonce, const uint8_t *aad, uint16_t aad_len, uint8_t *msg,
+  uint16_t msg_len, const uint8_t *mic, uint8_t mic_len);
+
+/**
+ * Builds the nonce of a secured frame.
+ *
+ * @param frame the frame, whose frame counter is read
+ * @param src_eui the EUI-64 of the sender, as transmitted, or NULL to take it from the extended source address
+ * @param security_level one of the SL_* values
+ * @param nonce the output CCM_NONCE_LEN bytes
+ * @return false if src_eui is NULL and the frame has no extended source address
+ */
+bool ccm_frame_nonce(ieee802_15_4_frame_t *frame, const uint8_t *src_eui, uint8_t security_level, uint8_t *nonce);
+
+/**
+ * Secures a frame in place: the payload is encrypted according to the suite and the MIC is written after it. The
+ * backing buffer must have room for the MIC.
+ *
+ * @param key the expanded key
+ * @param frame the frame, with security enabled and its frame counter set
+ * @param src_eui the EUI-64 of the sender, or NULL to take it from the extended source address
+ * @param security_level one of the SL_* values
+ * @return the length of the MIC written after the payload, 0 if the nonce cannot be built and the frame is left as is
+ */
+uint8_t ccm_secure_frame(const ccm_key_t *key, ieee802_15_4_frame_t *frame, const uint8_t *src_eui, uint8_t security_level);
+
+/**
+ * Verifies and decrypts a frame in place. The payload length must not include the MIC, which follows the payload,
+ * as is the case for frames parsed by osnp_parse_frame with OSNP_MIC_LENGTH matching the suite.
+ *
+ * @param key the expanded key
+ * @param frame the received frame
+ * @param src_eui the EUI-64 of the sender, or NULL to take it from the extended source address
+ * @param security_level one of the SL_* values
+ * @return true if the MIC matches, otherwise, or if the nonce cannot be built, the payload is zeroed
+ */
+bool ccm_unsecure_frame(const ccm_key_t *key, ieee802_15_4_frame_t *frame, const uint8_t *src_eui, uint8_t security_level);
+
+/**
+ * Secures many frames in one call, typically all frames a hub is about to send. The ok field of each job is set,
+ * false only if the nonce of the frame cannot be built.
+ *
+ * @param jobs the frames to secure
+ * @param count the number of jobs
+ */
+void ccm_secure_frames(ccm_job_t *jobs, uint16_t count);
+
+/**
+ * Verifies and decrypts many frames in one call, setting the ok field of each job.
+ *
+ * @param jobs the frames to verify
+ * @param count the number of jobs
+ * @return the number of frames whose MIC matches
+ */
+uint16_t ccm_unsecure_frames(ccm_job_t *jobs, uint16_t count);
+
+#endif	/* CCM_H */
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "compact.h"
+
+#include <string.h>
+
+/* A zigzag encoded 32-bit value takes at most 5 bytes in LEB128 */
+#define COMPACT_VARINT_MAX_LEN 5
+
+static uint32_t _compact_zigzag(int32_t value) {
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static int32_t _compact_unzigzag(uint32_t value) {
+  return (int32_t) ((value >> 1) ^ (0 - (value & 1)));
+}
+
+static int8_t _compact_find(uint16_t *tags, uint8_t tags_len, uint16_t tag) {
+  for (uint8_t i = 0; i < tags_len; i++) {
+    if (tags[i] == tag) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/* Tells whether report id a is newer than b, ids being 7-bit counters */
+static bool _compact_newer(uint8_t a, uint8_t b) {
+  uint8_t distance = (a - b) & 0x7f;
+
+  return distance && distance < 0x40;
+}
+
+void compact_encoder_init(compact_encoder_t *encoder) {
+  encoder->tags_len = 0;
+  encoder->reference.tags = 0;
+  encoder->reference.id = COMPACT_NO_REPORT;
+  encoder->report_id = 0;
+  encoder->building = 0;
+  encoder->reports_since_keyframe = 0;
+  encoder->has_reference = false;
+  encoder->building_keyframe = false;
+
+  for (uint8_t i = 0; i < COMPACT_PENDING_REPORTS; i++) {
+    encoder->pending[i].id = COMPACT_NO_REPORT;
+  }
+}
+
+bool compact_begin(compact_encoder_t *encoder, tlv_writer_t *writer) {
+  uint8_t header[2];
+  uint8_t header_len;
+
+  // the oldest pending report is given up for the new one
+  encoder->building = (encoder->building + 1) % COMPACT_PENDING_REPORTS;
+  encoder->report_id = (encoder->report_id + 1) & 0x7f;
+
+  compact_report_t *report = &encoder->pending[encoder->building];
+
+  // until a new keyframe is delivered the decoder still holds the reference, so differences go on meanwhile
+  if (!encoder->has_reference || encoder->reports_since_keyframe >= COMPACT_KEYFRAME_INTERVAL) {
+    report->tags = 0;
+    encoder->reports_since_keyframe = 0;
+    encoder->building_keyframe = true;
+    header[0] = COMPACT_KEYFRAME | encoder->report_id;
+    header_len = 1;
+  } else {
+    // readings left out of the report keep their reference value
+    *report = encoder->reference;
+    encoder->building_keyframe = false;
+    header[0] = encoder->report_id;
+    header[1] = encoder->reference.id;
+    header_len = 2;
+  }
+
+  report->id = encoder->report_id;
+
+  return tlv_writer_open(writer, COMPACT_TAG) && tlv_writer_put_raw(writer, header, header_len);
+}
+
+bool compact_put_int(compact_encoder_t *encoder, tlv_writer_t *writer, uint16_t tag, int32_t value) {
+  uint8_t buf[2 + COMPACT_VARINT_MAX_LEN];
+  compact_report_t *report = &encoder->pending[encoder->building];
+  int8_t slot = _compact_find(encoder->tags, encoder->tags_len, tag);
+  int32_t delta = value;
+
+  if (encoder->building_keyframe) {
+    if (slot < 0) {
+      if (encoder->tags_len == COMPACT_MAX_TAGS) {
+        return false;
+      }
+
+      slot = encoder->tags_len++;
+      encoder->tags[slot] = tag;
+    }
+  } else {
+    if (slot < 0 || !(encoder->reference.tags & (1 << slot))) {
+      encoder->has_reference = false;
+      return false;
+    }
+
+    delta = (int32_t) ((uint32_t) value - (uint32_t) encoder->reference.values[slot]);
+  }
+
+  report->values[slot] = value;
+  report->tags |= (1 << slot);
+
+  uint16_t len = tlv_write_tag(buf, tag);
+  uint32_t zigzag = _compact_zigzag(delta);
+
+  while (zigzag > 0x7f) {
+    buf[len++] = (zigzag & 0x7f) | 0x80;
+    zigzag >>= 7;
+  }
+
+  buf[len++] = zigzag;
+
+  return tlv_writer_put_raw(writer, buf, len);
+}
+
+bool compact_put_bools(compact_encoder_t *encoder, tlv_writer_t *writer, uint16_t tag, bool *values, uint8_t count) {
+  uint32_t bits = 0;
+
+  for (uint8_t i = 0; i < count && i < 32; i++) {
+    if (values[i]) {
+      bits |= ((uint32_t) 1 << i);
+    }
+  }
+
+  return compact_put_int(encoder, writer, tag, (int32_t) bits);
+}
+
+bool compact_end(compact_encoder_t *encoder, tlv_writer_t *writer) {
+  if (encoder->reports_since_keyframe < 0xff) {
+    encoder->reports_since_keyframe++;
+  }
+
+  return tlv_writer_close(writer) && !writer->error;
+}
+
+void compact_encoder_delivered(compact_encoder_t *encoder, uint8_t id, bool delivered) {
+  for (uint8_t i = 0; i < COMPACT_PENDING_REPORTS; i++) {
+    compact_report_t *report = &encoder->pending[i];
+
+    if (report->id != id) {
+      continue;
+    }
+
+    // a late confirmation of an older report must not move the reference back
+    if (delivered && (encoder->reference.id == COMPACT_NO_REPORT || _compact_newer(id, encoder->reference.id))) {
+      encoder->reference = *report;
+      encoder->has_reference = true;
+    }
+
+    report->id = COMPACT_NO_REPORT;
+  }
+}
+
+bool compact_report_id(uint8_t *payload, uint16_t len, uint8_t *out_id) {
+  tlv_reader_t reader;
+  tlv_reader_t items;
+  uint16_t tag;
+  uint16_t value_len;
+  uint8_t *value;
+
+  tlv_reader_init(&reader, payload, len);
+
+  if (!tlv_reader_enter(&reader, &items, &tag) || tag != 0xE2) {
+    return false;
+  }
+
+  while (tlv_reader_next(&items, &tag, &value_len, &value)) {
+    if (tag == COMPACT_TAG && value_len) {
+      *out_id = value[0] & 0x7f;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void compact_decoder_init(compact_decoder_t *decoder) {
+  decoder->tags_len = 0;
+  decoder->last = 0;
+
+  for (uint8_t i = 0; i < COMPACT_DECODER_HISTORY; i++) {
+    decoder->history[i].tags = 0;
+    decoder->history[i].id = COMPACT_NO_REPORT;
+  }
+}
+
+/* Returns the newest report decoded with the given id, or NULL */
+static compact_report_t *_compact_find_report(compact_decoder_t *decoder, uint8_t id) {
+  uint8_t i = decoder->last;
+
+  for (uint8_t n = 0; n < COMPACT_DECODER_HISTORY; n++) {
+    if (decoder->history[i].id == id) {
+      return &decoder->history[i];
+    }
+
+    i = i ? i - 1 : COMPACT_DECODER_HISTORY - 1;
+  }
+
+  return NULL;
+}
+
+bool compact_decode(compact_decoder_t *decoder, uint8_t *value, uint16_t len) {
+  compact_report_t report;
+  compact_report_t *reference = NULL;
+  uint16_t pos = 1;
+
+  if (!len) {
+    return false;
+  }
+
+  bool keyframe = value[0] & COMPACT_KEYFRAME;
+  uint8_t id = value[0] & 0x7f;
+
+  // a report with the same id from 128 reports ago can no longer be a reference
+  compact_report_t *stale = _compact_find_report(decoder, id);
+
+  if (stale) {
+    stale->id = COMPACT_NO_REPORT;
+  }
+
+  if (keyframe) {
+    report.tags = 0;
+  } else {
+    if (len < 2 || !(reference = _compact_find_report(decoder, value[1] & 0x7f))) {
+      return false;
+    }
+
+    report = *reference;
+    pos = 2;
+  }
+
+  report.id = id;
+
+  while (pos < len) {
+    uint16_t tag = value[pos++];
+
+    // tags are at most two bytes long, like in tlv.c
+    if ((tag & 0x1f) == 0x1f) {
+      if (pos == len || (value[pos] & 0x80)) {
+        return false;
+      }
+
+      tag = (tag << 8) | value[pos++];
+    }
+
+    uint32_t zigzag = 0;
+    uint8_t shift = 0;
+
+    do {
+      if (pos == len || shift == 7 * COMPACT_VARINT_MAX_LEN) {
+        return false;
+      }
+
+      zigzag |= (uint32_t) (value[pos] & 0x7f) << shift;
+      shift += 7;
+    } while (value[pos++] & 0x80);
+
+    int32_t delta = _compact_unzigzag(zigzag);
+    int8_t slot = _compact_find(decoder->tags, decoder->tags_len, tag);
+
+    if (keyframe) {
+      if (slot < 0) {
+        if (decoder->tags_len == COMPACT_MAX_TAGS) {
+          return false;
+        }
+
+        slot = decoder->tags_len++;
+        decoder->tags[slot] = tag;
+      }
+
+      report.values[slot] = delta;
+    } else {
+      if (slot < 0 || !(reference->tags & (1 << slot))) {
+        return false;
+      }
+
+      report.values[slot] = (int32_t) ((uint32_t) reference->values[slot] + (uint32_t) delta);
+    }
+
+    report.tags |= (1 << slot);
+  }
+
+  decoder->last = (decoder->last + 1) % COMPACT_DECODER_HISTORY;
+  decoder->history[decoder->last] = report;
+
+  return true;
+}
+
+bool compact_get_int(compact_decoder_t *decoder, uint16_t tag, int32_t *out_value) {
+  compact_report_t *report = &decoder->history[decoder->last];
+  int8_t slot = _compact_find(decoder->tags, decoder->tags_len, tag);
+
+  if (slot < 0 || !(report->tags & (1 << slot))) {
+    return false;
+  }
+
+  *out_value = report->values[slot];
+
+  return true;
+}
+
+bool compact_get_bools(compact_decoder_t *decoder, uint16_t tag, bool *out_values, uint8_t count) {
+  int32_t bits;
+
+  if (!compact_get_int(decoder, tag, &bits)) {
+    return false;
+  }
+
+  for (uint8_t i = 0; i < count && i < 32; i++) {
+    out_values[i] = ((uint32_t) bits >> i) & 1;
+  }
+
+  return true;
+}
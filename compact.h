@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef COMPACT_H
+#define	COMPACT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "tlv.h"
+
+/*
+ * Compact encoding of integer readings, for periodic notifications of slowly changing values. The readings of a
+ * report are written in a single primitive object tagged COMPACT_TAG, whose value is a header followed by each
+ * reading as its own tag and a zigzag LEB128 varint, without length. Booleans are packed in the bits of one reading.
+ *
+ * Every report has a 7-bit id, counting up. Keyframes carry absolute values and their header is COMPACT_KEYFRAME
+ * plus the id. Other reports carry differences and their header is the id followed by the id of the reference
+ * report. The encoder sends keyframes until the delivery of one is confirmed. After that it sends differences from
+ * the last report confirmed through compact_encoder_delivered, and a reading missing from that report keeps the value
+ * it had in the report's own reference. The encoder keeps the readings of the last COMPACT_PENDING_REPORTS reports
+ * (default 2) until their outcome is reported, so confirmations may come late or out of order. A new keyframe is sent
+ * every COMPACT_KEYFRAME_INTERVAL reports. The decoder keeps the last COMPACT_DECODER_HISTORY reports it decoded
+ * (default 4, more than the reports an encoder has in flight) and rejects differences from a report it does not
+ * hold, resynchronizing at the next keyframe. Since a report is a single object, the notification queue replacing a
+ * queued report with a newer one keeps it consistent.
+ */
+
+#ifndef COMPACT_TAG
+#define COMPACT_TAG 0xC0
+#endif
+
+/* Maximum number of distinct tags an encoder or decoder tracks, at most 8 */
+#ifndef COMPACT_MAX_TAGS
+#define COMPACT_MAX_TAGS 8
+#endif
+
+#if COMPACT_MAX_TAGS > 8
+#error "COMPACT_MAX_TAGS must not exceed 8"
+#endif
+
+#ifndef COMPACT_KEYFRAME_INTERVAL
+#define COMPACT_KEYFRAME_INTERVAL 16
+#endif
+
+#ifndef COMPACT_PENDING_REPORTS
+#define COMPACT_PENDING_REPORTS 2
+#endif
+
+#ifndef COMPACT_DECODER_HISTORY
+#define COMPACT_DECODER_HISTORY 4
+#endif
+
+#define COMPACT_KEYFRAME 0x80
+
+/* The id of an unused report */
+#define COMPACT_NO_REPORT 0xff
+
+/**
+ * The readings of a report by slot of the tags table, with a bit in tags for each slot holding one.
+ */
+typedef struct {
+  int32_t values[COMPACT_MAX_TAGS];
+  uint8_t tags;
+  uint8_t id;
+} compact_report_t;
+
+/**
+ * The state of the sending side. pending holds the reports whose outcome is not known yet, reference the last one
+ * confirmed.
+ */
+typedef struct {
+  uint16_t tags[COMPACT_MAX_TAGS];
+  compact_report_t reference;
+  compact_report_t pending[COMPACT_PENDING_REPORTS];
+  uint8_t tags_len;
+  uint8_t report_id;
+  uint8_t building;
+  uint8_t reports_since_keyframe;
+  bool has_reference;
+  bool building_keyframe;
+} compact_encoder_t;
+
+/**
+ * The state of the receiving side. history holds the last reports decoded, the last one at index last.
+ */
+typedef struct {
+  uint16_t tags[COMPACT_MAX_TAGS];
+  compact_report_t history[COMPACT_DECODER_HISTORY];
+  uint8_t tags_len;
+  uint8_t last;
+} compact_decoder_t;
+
+/**
+ * Initializes an encoder. The first report will be a keyframe.
+ *
+ * @param encoder the encoder
+ */
+void compact_encoder_init(compact_encoder_t *encoder);
+
+/**
+ * Opens a report in the given writer, deciding whether it is a keyframe.
+ *
+ * @param encoder the encoder
+ * @param writer the writer
+ * @return true on success, false if the report does not fit
+ */
+bool compact_begin(compact_encoder_t *encoder, tlv_writer_t *writer);
+
+/**
+ * Writes a reading in the open report. A tag which was not in the keyframe the report refers to cannot be written
+ * and makes the next report a keyframe.
+ *
+ * @param encoder the encoder
+ * @param writer the writer
+ * @param tag the tag of the reading
+ * @param value the reading
+ * @return true on success, false if the reading does not fit or cannot be encoded in this report
+ */
+bool compact_put_int(compact_encoder_t *encoder, tlv_writer_t *writer, uint16_t tag, int32_t value);
+
+/**
+ * Writes up to 32 booleans as a reading, the first in the least significant bit.
+ *
+ * @param encoder the encoder
+ * @param writer the writer
+ * @param tag the tag of the reading
+ * @param values the booleans
+ * @param count the number of booleans
+ * @return true on success, false as for compact_put_int
+ */
+bool compact_put_bools(compact_encoder_t *encoder, tlv_writer_t *writer, uint16_t tag, bool *values, uint8_t count);
+
+/**
+ * Closes the open report.
+ *
+ * @param encoder the encoder
+ * @param writer the writer
+ * @return true on success, false if the writer had an error
+ */
+bool compact_end(compact_encoder_t *encoder, tlv_writer_t *writer);
+
+/**
+ * Reports the delivery outcome of a report, for example from OSNP_DELIVERY_HANDLER. A delivered report becomes the
+ * reference of the following reports, unless a newer one has been delivered already. Outcomes of reports the encoder
+ * no longer keeps are ignored.
+ *
+ * @param encoder the encoder
+ * @param id the id of the report, as found by compact_report_id
+ * @param delivered true if the frame carrying the report was acknowledged
+ */
+void compact_encoder_delivered(compact_encoder_t *encoder, uint8_t id, bool delivered);
+
+/**
+ * Finds the id of the report carried by a notification, for example in osnp_transmit_frame, to report the delivery
+ * of the frame later.
+ *
+ * @param payload the payload of the frame, holding the 0xE2 object
+ * @param len the length of the payload
+ * @param out_id the output id
+ * @return true if the notification carries a report
+ */
+bool compact_report_id(uint8_t *payload, uint16_t len, uint8_t *out_id);
+
+/**
+ * Initializes a decoder, which then waits for a keyframe.
+ *
+ * @param decoder the decoder
+ */
+void compact_decoder_init(compact_decoder_t *decoder);
+
+/**
+ * Decodes a report.
+ *
+ * @param decoder the decoder
+ * @param value the value of the COMPACT_TAG object
+ * @param len the length of the value
+ * @return true on success, false if the report is malformed or refers to a report the decoder does not hold
+ */
+bool compact_decode(compact_decoder_t *decoder, uint8_t *value, uint16_t len);
+
+/**
+ * Returns a reading of the last report decoded.
+ *
+ * @param decoder the decoder
+ * @param tag the tag of the reading
+ * @param out_value the output reading
+ * @return true if the last report decoded holds the tag
+ */
+bool compact_get_int(compact_decoder_t *decoder, uint16_t tag, int32_t *out_value);
+
+/**
+ * Returns booleans written by compact_put_bools in the last report decoded.
+ *
+ * @param decoder the decoder
+ * @param tag the tag of the reading
+ * @param out_values the output booleans
+ * @return true if the last report decoded holds the tag
+ * @return true if the decoder knows the tag
+ */
+bool compact_get_bools(compact_decoder_t *decoder, uint16_t tag, bool *out_values, uint8_t count);
+
+#endif	/* COMPACT_H */
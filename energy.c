@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "energy.h"
+
+#include <string.h>
+
+void energy_report_init(energy_report_t *report) {
+  memset(report, 0, sizeof(energy_report_t));
+}
+
+void energy_add(energy_report_t *report, const energy_profile_t *profile, uint8_t state, uint32_t time_ms, bool rx_on,
+  uint32_t tx_frames, uint32_t tx_bytes) {
+  if (state >= ENERGY_STATES) {
+    return;
+  }
+
+  float time = time_ms / 1000.0f;
+  float tx = ((float) tx_bytes + (float) tx_frames * ENERGY_PHY_OVERHEAD) * (ENERGY_BYTE_US / 1e6f) +
+    (float) tx_frames * (ENERGY_TURNAROUND_US / 1e6f);
+  float ack = (float) tx_frames * (ENERGY_ACK_WAIT_US / 1e6f);
+  float rx;
+  float sleep;
+
+  // without a clock the state time is 0, and the transmissions alone are accounted
+  if (rx_on) {
+    rx = time > tx ? time - tx : 0;
+    sleep = 0;
+  } else {
+    rx = ack;
+    sleep = time > tx + ack ? time - tx - ack : 0;
+  }
+
+  report->tx_s[state] += tx;
+  report->rx_s[state] += rx;
+  report->sleep_s[state] += sleep;
+  report->charge_uah[state] += (tx * profile->tx_ua + rx * profile->rx_ua + sleep * profile->sleep_ua) / 3600.0f;
+}
+
+#ifdef OSNP_STATS
+void energy_add_stats(energy_report_t *report, const energy_profile_t *profile, const osnp_stats_t *since,
+  const osnp_stats_t *stats, bool rx_always_on) {
+  for (uint8_t state = 0; state < ENERGY_STATES; state++) {
+    bool rx_on = (state != ASSOCIATED) || rx_always_on;
+
+    // the unsigned differences hold across a wraparound of the counters
+    uint32_t time_ms = stats->state_time[state] - since->state_time[state];
+    uint32_t tx_frames = stats->tx_frames[state] - since->tx_frames[state];
+    uint32_t tx_bytes = stats->tx_bytes[state] - since->tx_bytes[state];
+
+    energy_add(report, profile, state, time_ms, rx_on, tx_frames, tx_bytes);
+  }
+}
+#endif
+
+float energy_average_ua(const energy_report_t *report) {
+  float time = 0;
+  float charge = 0;
+
+  for (uint8_t state = 0; state < ENERGY_STATES; state++) {
+    time += report->tx_s[state] + report->rx_s[state] + report->sleep_s[state];
+    charge += report->charge_uah[state];
+  }
+
+  return time > 0 ? charge * 3600.0f / time : 0;
+}
+
+float energy_battery_hours(const energy_report_t *report, uint32_t capacity_mah) {
+  float current = energy_average_ua(report);
+
+  return current > 0 ? capacity_mah * 1000.0f / current : 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef ENERGY_H
+#define	ENERGY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "osnp.h"
+
+/*
+ * Radio energy model. The figures kept by the stack with OSNP_STATS are turned into time spent transmitting,
+ * listening and sleeping in each state, and into the charge drawn according to the current profile of the radio.
+ * The radio listens for the whole time spent in SCANNING_CHANNELS, WAITING_ASSOCIATION_REQUEST and
+ * WAITING_PENDING_DATA, and in ASSOCIATED only on RX_ALWAYS_ON devices: poll driven ones sleep between polls, but for
+ * the acknowledgement wait following each transmission. Transmissions are timed from the bytes they put on air.
+ * Clear channel assessments and retransmissions done by the radio itself are not seen by the stack.
+ *
+ * A report can add up the figures of any number of devices, its average current then being that of one device.
+ * The average current in uA is also the charge drawn per hour in uAh.
+ */
+
+#define ENERGY_STATES 4
+
+/* 802.15.4 O-QPSK PHY at 2.4GHz: 250kbps, 32us per byte */
+#define ENERGY_BYTE_US 32
+
+/* Preamble, start of frame delimiter and length byte preceding every frame */
+#define ENERGY_PHY_OVERHEAD 6
+
+/* RX to TX turnaround, spent in transmit mode before every frame */
+#define ENERGY_TURNAROUND_US 192
+
+/* Listened after every transmission: TX to RX turnaround and a 5-byte acknowledgement with its PHY overhead */
+#define ENERGY_ACK_WAIT_US (ENERGY_TURNAROUND_US + (5 + ENERGY_PHY_OVERHEAD) * ENERGY_BYTE_US)
+
+/* MRF24J40 at 0 dBm output power: 23mA transmitting, 19mA receiving, 2uA sleeping */
+#define ENERGY_PROFILE_MRF24J40 { 23000, 19000, 2 }
+
+/**
+ * The supply current of the radio in each mode, in uA.
+ */
+typedef struct {
+  uint32_t tx_ua;
+  uint32_t rx_ua;
+  uint32_t sleep_ua;
+} energy_profile_t;
+
+/**
+ * Time spent in each radio mode, in seconds, and charge drawn, in uAh, by state.
+ */
+typedef struct {
+  float tx_s[ENERGY_STATES];
+  float rx_s[ENERGY_STATES];
+  float sleep_s[ENERGY_STATES];
+  float charge_uah[ENERGY_STATES];
+} energy_report_t;
+
+/**
+ * Clears a report.
+ *
+ * @param report the report
+ */
+void energy_report_init(energy_report_t *report);
+
+/**
+ * Adds the time spent in a state to a report.
+ *
+ * @param report the report
+ * @param profile the current profile of the radio
+ * @param state the state
+ * @param time_ms the time spent in the state, in milliseconds
+ * @param rx_on whether the radio listens throughout the state
+ * @param tx_frames the transmissions made in the state
+ * @param tx_bytes the bytes they put on air, without PHY overhead
+ */
+void energy_add(energy_report_t *report, const energy_profile_t *profile, uint8_t state, uint32_t time_ms, bool rx_on,
+  uint32_t tx_frames, uint32_t tx_bytes);
+
+#ifdef OSNP_STATS
+/**
+ * Adds what a stack instance did between two copies of its statistics to a report. The counters, state_time
+ * first, wrap around freely, so the copies must be taken less than 2^32 ms (about 49 days) apart: a report over a
+ * longer time adds up consecutive intervals. Statistics cleared to 0 stand for the initialization of the stack.
+ *
+ * @param report the report
+ * @param profile the current profile of the radio
+ * @param since the earlier copy of the statistics
+ * @param stats the later copy of the statistics, whose state_time needs OSNP_CLOCK
+ * @param rx_always_on whether the device has the RX_ALWAYS_ON capability
+ */
+void energy_add_stats(energy_report_t *report, const energy_profile_t *profile, const osnp_stats_t *since,
+  const osnp_stats_t *stats, bool rx_always_on);
+#endif
+
+/**
+ * Returns the average current drawn over the time covered by a report.
+ *
+ * @param report the report
+ * @return the average current in uA, or the charge drawn per hour in uAh, 0 if the report is empty
+ */
+float energy_average_ua(const energy_report_t *report);
+
+/**
+ * Projects the battery life at the average current of a report.
+ *
+ * @param report the report
+ * @param capacity_mah the battery capacity, in mAh
+ * @return the battery life in hours, 0 if the report is empty
+ */
+float energy_battery_hours(const energy_report_t *report, uint32_t capacity_mah);
+
+#endif	/* ENERGY_H */
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hub_bulk.h"
+
+#include <string.h>
+
+/* Fragment value: transfer id, flags and 14-bit fragment number big endian, data */
+#define HUB_BULK_HEADER_LEN 3
+
+void hub_bulk_init(hub_bulk_t *bulk) {
+  // transfer ids start at 1, so the first fragment of any transfer starts a new one
+  bulk->id = 0;
+  bulk->done = false;
+  bulk->last = -1;
+  bulk->received = 0;
+}
+
+static bool _hub_bulk_has(hub_bulk_t *bulk, uint16_t seq) {
+  return seq < HUB_BULK_MAX_FRAGMENTS && (bulk->received & ((uint32_t) 1 << seq));
+}
+
+uint8_t hub_bulk_fragment_received(hub_bulk_t *bulk, uint8_t *value, uint16_t len, uint8_t *ack) {
+  uint8_t result = 0;
+
+  if (len < HUB_BULK_HEADER_LEN || len - HUB_BULK_HEADER_LEN > HUB_BULK_FRAGMENT_LEN) {
+    return 0;
+  }
+
+  uint16_t seq = ((value[1] & 0x3f) << 8) | value[2];
+
+  if (value[0] != bulk->id) {
+    hub_bulk_init(bulk);
+    bulk->id = value[0];
+  }
+
+  // fragments past the largest transfer are not stored, and are never acknowledged
+  if (seq < HUB_BULK_MAX_FRAGMENTS && !_hub_bulk_has(bulk, seq)) {
+    bulk->received |= ((uint32_t) 1 << seq);
+    bulk->len[seq] = len - HUB_BULK_HEADER_LEN;
+    memcpy(bulk->data[seq], &value[HUB_BULK_HEADER_LEN], len - HUB_BULK_HEADER_LEN);
+    result |= HUB_BULK_STORED;
+  }
+
+  if ((value[1] & OSNP_BULK_LAST) && seq < HUB_BULK_MAX_FRAGMENTS) {
+    bulk->last = seq;
+  }
+
+  uint16_t base = 0;
+
+  while (_hub_bulk_has(bulk, base)) {
+    base++;
+  }
+
+  if (!bulk->done && bulk->last >= 0 && base > bulk->last) {
+    bulk->done = true;
+    result |= HUB_BULK_COMPLETE;
+  }
+
+  if (value[1] & OSNP_BULK_ACK_REQ) {
+    ack[0] = OSNP_BULK_ACK_TAG;
+    ack[1] = HUB_BULK_ACK_LEN - 2;
+    ack[2] = bulk->id;
+    ack[3] = base >> 8;
+    ack[4] = base & 0xff;
+    ack[5] = 0;
+
+    for (uint8_t n = 0; n < 8; n++) {
+      if (_hub_bulk_has(bulk, base + 1 + n)) {
+        ack[5] |= (1 << n);
+      }
+    }
+
+    result |= HUB_BULK_ACK;
+  }
+
+  return result;
+}
+
+uint16_t hub_bulk_reassemble(hub_bulk_t *bulk, uint8_t *stream, uint16_t cap) {
+  uint16_t stream_len = 0;
+
+  if (!bulk->done) {
+    return 0;
+  }
+
+  for (int16_t i = 0; i <= bulk->last; i++) {
+    if (bulk->len[i] > cap - stream_len) {
+      return 0;
+    }
+
+    memcpy(&stream[stream_len], bulk->data[i], bulk->len[i]);
+    stream_len += bulk->len[i];
+  }
+
+  return stream_len;
+}
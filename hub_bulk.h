@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HUB_BULK_H
+#define	HUB_BULK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "osnp.h"
+
+/*
+ * Reassembly of bulk transfers on the hub side (see "Bulk transfer" in osnp.h). A hub_bulk_t holds the fragments of
+ * the transfer a device is sending: fragments of a new transfer id discard the previous one, duplicates are ignored,
+ * and the acknowledgement a device asks for gives the first missing fragment and which of the following ones have
+ * arrived, so that only the missing ones are sent again. Once every fragment up to the last one has arrived the
+ * stream is put back together with hub_bulk_reassemble.
+ */
+
+/* Largest transfer reassembled, in fragments, up to 32 */
+#ifndef HUB_BULK_MAX_FRAGMENTS
+#define HUB_BULK_MAX_FRAGMENTS 32
+#endif
+
+#if HUB_BULK_MAX_FRAGMENTS > 32
+#error "HUB_BULK_MAX_FRAGMENTS must not exceed 32"
+#endif
+
+/* Largest data of a fragment: a frame payload less the 5 bytes of the fragment header */
+#define HUB_BULK_FRAGMENT_LEN (IEEE802_15_4_MAX_FRAME_LEN - 5)
+
+/* Length of the acknowledgement written by hub_bulk_fragment_received */
+#define HUB_BULK_ACK_LEN 6
+
+/* Outcome of hub_bulk_fragment_received, as flags */
+#define HUB_BULK_STORED 0x01
+#define HUB_BULK_COMPLETE 0x02
+#define HUB_BULK_ACK 0x04
+
+/**
+ * The transfer being received from a device. last is -1 until the final fragment has arrived.
+ */
+typedef struct {
+  uint8_t id;
+  bool done;
+  int16_t last;
+  uint32_t received;
+  uint8_t len[HUB_BULK_MAX_FRAGMENTS];
+  uint8_t data[HUB_BULK_MAX_FRAGMENTS][HUB_BULK_FRAGMENT_LEN];
+} hub_bulk_t;
+
+/**
+ * Initializes the reassembly state of a device, which then waits for any transfer.
+ *
+ * @param bulk the reassembly state
+ */
+void hub_bulk_init(hub_bulk_t *bulk);
+
+/**
+ * Stores a fragment received from the device.
+ *
+ * @param bulk the reassembly state
+ * @param value the value of the OSNP_BULK_FRAGMENT_TAG object
+ * @param len the length of the value
+ * @param ack the buffer of HUB_BULK_ACK_LEN bytes receiving the OSNP_BULK_ACK_TAG object to send to the device
+ * @return HUB_BULK_STORED if the fragment was new, HUB_BULK_COMPLETE if it completed the transfer and HUB_BULK_ACK
+ *         if ack has been written, combined; 0 for duplicates and malformed or oversized fragments
+ */
+uint8_t hub_bulk_fragment_received(hub_bulk_t *bulk, uint8_t *value, uint16_t len, uint8_t *ack);
+
+/**
+ * Puts the stream of a completed transfer back together.
+ *
+ * @param bulk the reassembly state
+ * @param stream the buffer receiving the stream
+ * @param cap the capacity of the buffer
+ * @return the length of the stream, 0 if the transfer is not complete or does not fit
+ */
+uint16_t hub_bulk_reassemble(hub_bulk_t *bulk, uint8_t *stream, uint16_t cap);
+
+#endif	/* HUB_BULK_H */
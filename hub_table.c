@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hub_table.h"
+
+#include <string.h>
+
+#define HUB_INDEX_MASK ((uint16_t) (HUB_INDEX_LEN - 1))
+
+static bool _hub_has_short_address(uint8_t *short_address) {
+  return short_address[0] != 0xff || short_address[1] != 0xff;
+}
+
+/*
+ * Fibonacci hashing of the 16-bit short address, the probing starts from the top bits of the product.
+ */
+static uint16_t _hub_hash_short(uint8_t *short_address) {
+  uint32_t key = short_address[0] | (short_address[1] << 8);
+
+  return (uint16_t) ((uint32_t) (key * 0x9E3779B1UL) >> (32 - HUB_INDEX_BITS));
+}
+
+/*
+ * FNV-1a of the EUI, which varies in different bytes depending on the manufacturer.
+ */
+static uint16_t _hub_hash_eui(uint8_t *eui) {
+  uint32_t hash = 0x811C9DC5UL;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    hash = (uint32_t) ((hash ^ eui[i]) * 0x01000193UL);
+  }
+
+  return (uint16_t) (hash >> (32 - HUB_INDEX_BITS));
+}
+
+static uint16_t _hub_hash(hub_table_t *table, bool by_eui, uint16_t device) {
+  return by_eui ? _hub_hash_eui(table->devices[device].eui) : _hub_hash_short(table->devices[device].short_address);
+}
+
+/*
+ * Returns the slot of the index holding the device with the given key or, if there is none, the empty slot
+ * terminating its probe sequence. The load factor guarantees that there is one.
+ */
+static uint16_t _hub_index_slot(hub_table_t *table, bool by_eui, uint8_t *key) {
+  uint16_t *index = by_eui ? table->by_eui : table->by_short;
+  uint16_t slot = by_eui ? _hub_hash_eui(key) : _hub_hash_short(key);
+
+  while (index[slot] != HUB_NONE) {
+    hub_device_t *device = &table->devices[index[slot]];
+
+    if (!memcmp(by_eui ? device->eui : device->short_address, key, by_eui ? 8 : 2)) {
+      break;
+    }
+
+    slot = (slot + 1) & HUB_INDEX_MASK;
+  }
+
+  return slot;
+}
+
+/*
+ * Empties a slot of an index, moving back the entries following it which would otherwise become unreachable, so
+ * that no tombstones accumulate in a long running hub.
+ */
+static void _hub_index_remove(hub_table_t *table, bool by_eui, uint16_t slot) {
+  uint16_t *index = by_eui ? table->by_eui : table->by_short;
+  uint16_t next = slot;
+
+  while (1) {
+    next = (next + 1) & HUB_INDEX_MASK;
+
+    if (index[next] == HUB_NONE) {
+      break;
+    }
+
+    uint16_t home = _hub_hash(table, by_eui, index[next]);
+
+    // the entry stays if its home lies cyclically in (slot, next]
+    if (((uint16_t) (next - home) & HUB_INDEX_MASK) < ((uint16_t) (next - slot) & HUB_INDEX_MASK)) {
+      continue;
+    }
+
+    index[slot] = index[next];
+    slot = next;
+  }
+
+  index[slot] = HUB_NONE;
+}
+
+void hub_table_init(hub_table_t *table) {
+  memset(table->by_short, 0xff, sizeof(table->by_short));
+  memset(table->by_eui, 0xff, sizeof(table->by_eui));
+
+  // free devices and frames are linked through their queue_head and next fields
+  for (uint16_t i = 0; i < HUB_MAX_DEVICES; i++) {
+    table->devices[i].used = false;
+    table->devices[i].queue_head = (i + 1 < HUB_MAX_DEVICES) ? i + 1 : HUB_NONE;
+  }
+
+  for (uint16_t i = 0; i < HUB_SLAB_LEN; i++) {
+    table->slab[i].next = (i + 1 < HUB_SLAB_LEN) ? i + 1 : HUB_NONE;
+  }
+
+  table->free_devices = 0;
+  table->free_frames = 0;
+  table->devices_len = 0;
+  table->frames_len = 0;
+  table->expired = 0;
+}
+
+bool hub_table_set_short_address(hub_table_t *table, hub_device_t *device, uint8_t *short_address) {
+  uint16_t id = device - table->devices;
+  uint16_t slot;
+
+  if (_hub_has_short_address(short_address)) {
+    slot = _hub_index_slot(table, false, short_address);
+
+    if (table->by_short[slot] != HUB_NONE) {
+      return table->by_short[slot] == id;
+    }
+  }
+
+  if (_hub_has_short_address(device->short_address)) {
+    _hub_index_remove(table, false, _hub_index_slot(table, false, device->short_address));
+  }
+
+  memcpy(device->short_address, short_address, 2);
+
+  if (_hub_has_short_address(short_address)) {
+    // the removal may have moved the empty slot found before
+    table->by_short[_hub_index_slot(table, false, short_address)] = id;
+  }
+
+  return true;
+}
+
+hub_device_t *hub_table_add(hub_table_t *table, uint8_t *eui, uint8_t *short_address) {
+  uint16_t slot = _hub_index_slot(table, true, eui);
+  hub_device_t *device;
+
+  if (table->by_eui[slot] != HUB_NONE) {
+    device = &table->devices[table->by_eui[slot]];
+    return hub_table_set_short_address(table, device, short_address) ? device : NULL;
+  }
+
+  if (table->free_devices == HUB_NONE) {
+    return NULL;
+  }
+
+  if (_hub_has_short_address(short_address) && table->by_short[_hub_index_slot(table, false, short_address)] != HUB_NONE) {
+    return NULL;
+  }
+
+  uint16_t id = table->free_devices;
+  device = &table->devices[id];
+  table->free_devices = device->queue_head;
+
+  memset(device, 0, sizeof(hub_device_t));
+  memcpy(device->eui, eui, 8);
+  device->short_address[0] = 0xff;
+  device->short_address[1] = 0xff;
+  device->queue_head = HUB_NONE;
+  device->queue_tail = HUB_NONE;
+  device->used = true;
+
+  table->by_eui[slot] = id;
+  table->devices_len++;
+  hub_table_set_short_address(table, device, short_address);
+
+  return device;
+}
+
+void hub_table_remove(hub_table_t *table, hub_device_t *device) {
+  uint8_t no_short_address[2] = { 0xff, 0xff };
+  uint16_t id = device - table->devices;
+
+  hub_flush(table, device);
+  hub_table_set_short_address(table, device, no_short_address);
+  _hub_index_remove(table, true, _hub_index_slot(table, true, device->eui));
+
+  device->used = false;
+  device->queue_head = table->free_devices;
+  table->free_devices = id;
+  table->devices_len--;
+}
+
+hub_device_t *hub_table_find_short(hub_table_t *table, uint8_t *short_address) {
+  uint16_t id = table->by_short[_hub_index_slot(table, false, short_address)];
+
+  return id == HUB_NONE ? NULL : &table->devices[id];
+}
+
+hub_device_t *hub_table_find_eui(hub_table_t *table, uint8_t *eui) {
+  uint16_t id = table->by_eui[_hub_index_slot(table, true, eui)];
+
+  return id == HUB_NONE ? NULL : &table->devices[id];
+}
+
+hub_device_t *hub_table_find_source(hub_table_t *table, ieee802_15_4_frame_t *frame) {
+  switch (EXTRACT_FCSRCADDR(*frame->fc_high)) {
+    case FCADDR_SHORT:
+      return hub_table_find_short(table, frame->src_addr);
+    case FCADDR_EXT:
+      return hub_table_find_eui(table, frame->src_addr);
+  }
+
+  return NULL;
+}
+
+bool hub_accept_frame_counter(hub_device_t *device, ieee802_15_4_frame_t *frame) {
+  if (!frame->frame_counter) {
+    return false;
+  }
+
+  uint32_t counter = frame->frame_counter[0] | (frame->frame_counter[1] << 8) | ((uint32_t) frame->frame_counter[2] << 16) | ((uint32_t) frame->frame_counter[3] << 24);
+
+  // the next counter would wrap around to 0 and let every earlier frame be replayed
+  if (counter < device->rx_frame_counter || counter == UINT32_MAX) {
+    return false;
+  }
+
+  device->rx_frame_counter = counter + 1;
+
+  return true;
+}
+
+bool hub_enqueue(hub_table_t *table, hub_device_t *device, uint8_t frame_type, uint8_t *payload, uint16_t payload_len, uint32_t now, uint32_t persistence) {
+  if (device->queue_len == HUB_DEVICE_QUEUE_LEN || table->free_frames == HUB_NONE || payload_len > HUB_FRAME_PAYLOAD_LEN) {
+    return false;
+  }
+
+  uint16_t id = table->free_frames;
+  hub_frame_t *frame = &table->slab[id];
+  table->free_frames = frame->next;
+
+  memcpy(frame->payload, payload, payload_len);
+  frame->payload_len = payload_len;
+  frame->frame_type = frame_type;
+  frame->next = HUB_NONE;
+  frame->queued_at = now;
+  // an expiry time equal to the queuing time means none
+  frame->expires_at = persistence ? now + persistence : now;
+
+  if (device->queue_tail == HUB_NONE) {
+    device->queue_head = id;
+  } else {
+    table->slab[device->queue_tail].next = id;
+  }
+
+  device->queue_tail = id;
+  device->queue_len++;
+  table->frames_len++;
+
+  return true;
+}
+
+void hub_dequeue(hub_table_t *table, hub_device_t *device) {
+  uint16_t id = device->queue_head;
+
+  if (id == HUB_NONE) {
+    return;
+  }
+
+  hub_frame_t *frame = &table->slab[id];
+  device->queue_head = frame->next;
+
+  if (device->queue_head == HUB_NONE) {
+    device->queue_tail = HUB_NONE;
+  }
+
+  frame->next = table->free_frames;
+  table->free_frames = id;
+  device->queue_len--;
+  table->frames_len--;
+}
+
+void hub_flush(hub_table_t *table, hub_device_t *device) {
+  while (device->queue_len) {
+    hub_dequeue(table, device);
+  }
+}
+
+static bool _hub_expired(hub_frame_t *frame, uint32_t now) {
+  return frame->expires_at != frame->queued_at && (int32_t) (now - frame->expires_at) >= 0;
+}
+
+hub_frame_t *hub_peek(hub_table_t *table, hub_device_t *device, uint32_t now) {
+  // frames queued later never expire earlier with a common persistence time, so the head is checked first
+  while (device->queue_head != HUB_NONE && _hub_expired(&table->slab[device->queue_head], now)) {
+    hub_dequeue(table, device);
+    table->expired++;
+  }
+
+  return device->queue_head == HUB_NONE ? NULL : &table->slab[device->queue_head];
+}
+
+bool hub_pending_for(hub_table_t *table, ieee802_15_4_frame_t *frame, uint32_t now) {
+  hub_device_t *device = hub_table_find_source(table, frame);
+
+  return device && hub_peek(table, device, now);
+}
+
+void hub_expire(hub_table_t *table, uint32_t now) {
+  for (uint16_t i = 0; i < HUB_MAX_DEVICES; i++) {
+    if (table->devices[i].used && table->devices[i].queue_len) {
+      hub_peek(table, &table->devices[i], now);
+    }
+  }
+}
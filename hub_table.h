@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef HUB_TABLE_H
+#define	HUB_TABLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "osnp.h"
+
+/*
+ * Device table and indirect transmission queues for the hub side of the protocol. Devices are kept in a fixed
+ * array and found through two open addressing indexes, by short address and by EUI, with linear probing and a load
+ * factor of at most 1/2, so that the lookup done for every poll takes constant time. Frames waiting for a device to
+ * poll are kept in per-device FIFO queues backed by a slab shared by all devices, and are dropped once their
+ * persistence time has elapsed. Nothing is allocated after hub_table_init.
+ *
+ * Times are in ticks of any unit chosen by the caller, in 32 bits, compared so that they can wrap around.
+ */
+
+/* Maximum number of devices, up to 32767 */
+#ifndef HUB_MAX_DEVICES
+#define HUB_MAX_DEVICES 1024
+#endif
+
+/* Number of frames shared by the queues of all devices, up to 65535 */
+#ifndef HUB_SLAB_LEN
+#define HUB_SLAB_LEN 256
+#endif
+
+/* Maximum number of frames queued for a single device */
+#ifndef HUB_DEVICE_QUEUE_LEN
+#define HUB_DEVICE_QUEUE_LEN 4
+#endif
+
+/* Largest payload of a queued frame */
+#ifndef HUB_FRAME_PAYLOAD_LEN
+#define HUB_FRAME_PAYLOAD_LEN 110
+#endif
+
+#if HUB_MAX_DEVICES > 32767
+#error "HUB_MAX_DEVICES must not exceed 32767"
+#endif
+
+#if HUB_SLAB_LEN > 65535
+#error "HUB_SLAB_LEN must not exceed 65535"
+#endif
+
+#if HUB_FRAME_PAYLOAD_LEN > 255
+#error "HUB_FRAME_PAYLOAD_LEN must not exceed 255"
+#endif
+
+/* Both indexes have the smallest power of two of slots keeping the load factor under 1/2 */
+#if HUB_MAX_DEVICES <= 64
+#define HUB_INDEX_BITS 7
+#elif HUB_MAX_DEVICES <= 256
+#define HUB_INDEX_BITS 9
+#elif HUB_MAX_DEVICES <= 1024
+#define HUB_INDEX_BITS 11
+#elif HUB_MAX_DEVICES <= 4096
+#define HUB_INDEX_BITS 13
+#else
+#define HUB_INDEX_BITS 16
+#endif
+
+#define HUB_INDEX_LEN (1UL << HUB_INDEX_BITS)
+
+#define HUB_NONE 0xffff
+
+/**
+ * A queued frame: its type and payload, the header being built when it is transmitted.
+ */
+typedef struct {
+  uint8_t payload[HUB_FRAME_PAYLOAD_LEN];
+  uint8_t payload_len;
+  uint8_t frame_type;
+  uint16_t next;
+  uint32_t queued_at;
+  uint32_t expires_at;
+} hub_frame_t;
+
+/**
+ * A device known to the hub. short_address is 0xffff while the device has none.
+ */
+typedef struct {
+  uint8_t eui[8];
+  uint8_t short_address[2];
+  uint8_t rx_key[16];
+  uint8_t tx_key[16];
+  uint32_t rx_frame_counter;
+  uint32_t tx_frame_counter;
+  uint16_t queue_head;
+  uint16_t queue_tail;
+  uint8_t queue_len;
+  bool used;
+  void *user_data;
+} hub_device_t;
+
+typedef struct {
+  hub_device_t devices[HUB_MAX_DEVICES];
+  uint16_t by_short[HUB_INDEX_LEN];
+  uint16_t by_eui[HUB_INDEX_LEN];
+  hub_frame_t slab[HUB_SLAB_LEN];
+  uint16_t free_devices;
+  uint16_t free_frames;
+  uint16_t devices_len;
+  uint16_t frames_len;
+  uint32_t expired;
+} hub_table_t;
+
+/**
+ * Initializes an empty table.
+ *
+ * @param table the table
+ */
+void hub_table_init(hub_table_t *table);
+
+/**
+ * Adds a device, or updates the short address of the device with the given EUI if it is already known.
+ *
+ * @param table the table
+ * @param eui the EUI of the device
+ * @param short_address the short address of the device, 0xffff for none
+ * @return the device, NULL if the table is full or the short address belongs to another device
+ */
+hub_device_t *hub_table_add(hub_table_t *table, uint8_t *eui, uint8_t *short_address);
+
+/**
+ * Removes a device, dropping its queued frames.
+ *
+ * @param table the table
+ * @param device the device
+ */
+void hub_table_remove(hub_table_t *table, hub_device_t *device);
+
+/**
+ * Changes the short address of a device.
+ *
+ * @param table the table
+ * @param device the device
+ * @param short_address the new short address, 0xffff for none
+ * @return true on success, false if the short address belongs to another device
+ */
+bool hub_table_set_short_address(hub_table_t *table, hub_device_t *device, uint8_t *short_address);
+
+/**
+ * Finds a device by short address.
+ *
+ * @param table the table
+ * @param short_address the short address, in frame order
+ * @return the device, NULL if unknown
+ */
+hub_device_t *hub_table_find_short(hub_table_t *table, uint8_t *short_address);
+
+/**
+ * Finds a device by EUI.
+ *
+ * @param table the table
+ * @param eui the EUI, in frame order
+ * @return the device, NULL if unknown
+ */
+hub_device_t *hub_table_find_eui(hub_table_t *table, uint8_t *eui);
+
+/**
+ * Finds the sender of a frame parsed by osnp_parse_frame.
+ *
+ * @param table the table
+ * @param frame the frame
+ * @return the device, NULL if unknown or if the frame has no source address
+ */
+hub_device_t *hub_table_find_source(hub_table_t *table, ieee802_15_4_frame_t *frame);
+
+/**
+ * Checks the frame counter of a secured frame from the device against replays, and stores it if it is newer. A
+ * counter of 0xffffffff is rejected, since no frame could follow it: the device must be given new keys first.
+ *
+ * @param device the device
+ * @param frame the frame
+ * @return true if the frame is not a replay
+ */
+bool hub_accept_frame_counter(hub_device_t *device, ieee802_15_4_frame_t *frame);
+
+/**
+ * Queues a frame for a device until it polls.
+ *
+ * @param table the table
+ * @param device the device
+ * @param frame_type the frame type, one of FCFRTYP_*
+ * @param payload the payload
+ * @param payload_len the payload length
+ * @param now the current time
+ * @param persistence the time after which the frame is dropped if not transmitted, 0 to keep it until then
+ * @return true on success, false if the queue of the device or the slab is full, or the payload too large
+ */
+bool hub_enqueue(hub_table_t *table, hub_device_t *device, uint8_t frame_type, uint8_t *payload, uint16_t payload_len, uint32_t now, uint32_t persistence);
+
+/**
+ * Returns the oldest frame queued for a device, after dropping the expired ones.
+ *
+ * @param table the table
+ * @param device the device
+ * @param now the current time
+ * @return the frame, NULL if there is none
+ */
+hub_frame_t *hub_peek(hub_table_t *table, hub_device_t *device, uint32_t now);
+
+/**
+ * Removes the oldest frame queued for a device, once it has been delivered.
+ *
+ * @param table the table
+ * @param device the device
+ */
+void hub_dequeue(hub_table_t *table, hub_device_t *device);
+
+/**
+ * Removes all frames queued for a device.
+ *
+ * @param table the table
+ * @param device the device
+ */
+void hub_flush(hub_table_t *table, hub_device_t *device);
+
+/**
+ * Tells whether frames are pending for the sender of a frame, which is the value of the frame pending bit of the
+ * acknowledgement of a data request. It only looks up the sender and the head of its queue.
+ *
+ * @param table the table
+ * @param frame the received frame, parsed by osnp_parse_frame
+ * @param now the current time
+ * @return true if frames are pending
+ */
+bool hub_pending_for(hub_table_t *table, ieee802_15_4_frame_t *frame, uint32_t now);
+
+/**
+ * Drops the expired frames of all devices, returning their slab entries. Expired frames are otherwise only
+ * dropped when their device polls.
+ *
+ * @param table the table
+ * @param now the current time
+ */
+void hub_expire(hub_table_t *table, uint32_t now);
+
+#endif	/* HUB_TABLE_H */
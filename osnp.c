@@ -28,488 +28,2426 @@
 #include <string.h>
 #include <stdint.h>
 
-#define SCANNING_CHANNELS 0
-#define WAITING_ASSOCIATION_REQUEST 1
-#define ASSOCIATED 2
-#define WAITING_PENDING_DATA 3
+#ifndef OSNP_GET_DEVICE_INFO_HANDLER
+#define OSNP_GET_DEVICE_INFO_HANDLER NULL
+#endif
+
+#ifndef OSNP_CONFIGURE_HANDLER
+#define OSNP_CONFIGURE_HANDLER NULL
+#endif
+
+#ifndef OSNP_GET_DATA_HANDLER
+#define OSNP_GET_DATA_HANDLER NULL
+#endif
+
+#ifndef OSNP_PERFORM_HANDLER
+#define OSNP_PERFORM_HANDLER NULL
+#endif
+
+#ifdef OSNP_SUBSCRIPTIONS
+#if defined(OSNP_SUBSCRIBE_HANDLER) || defined(OSNP_UNSUBSCRIBE_HANDLER)
+#error "OSNP_SUBSCRIPTIONS implements OSNP_SUBSCRIBE and OSNP_UNSUBSCRIBE, their handlers must not be defined"
+#endif
+
+#ifndef OSNP_CLOCK
+#error "OSNP_SUBSCRIPTIONS needs OSNP_CLOCK"
+#endif
+
+#if OSNP_SUBSCRIPTIONS < 1 || OSNP_SUBSCRIPTIONS > 32
+#error "OSNP_SUBSCRIPTIONS must be between 1 and 32"
+#endif
+
+// declared here since the handler table refers to them
+uint8_t _osnp_subscribe(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure);
+uint8_t _osnp_unsubscribe(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure);
+
+#define OSNP_SUBSCRIBE_HANDLER _osnp_subscribe
+#define OSNP_UNSUBSCRIBE_HANDLER _osnp_unsubscribe
+#endif
+
+#ifndef OSNP_SUBSCRIBE_HANDLER
+#define OSNP_SUBSCRIBE_HANDLER NULL
+#endif
+
+#ifndef OSNP_UNSUBSCRIBE_HANDLER
+#define OSNP_UNSUBSCRIBE_HANDLER NULL
+#endif
+
+#if defined(OSNP_POLL_SLOTS) && !defined(OSNP_CLOCK)
+#error "OSNP_POLL_SLOTS needs OSNP_CLOCK"
+#endif
+
+#if defined(OSNP_GROUPS) && (OSNP_GROUPS < 1 || OSNP_GROUPS > 16)
+#error "OSNP_GROUPS must be between 1 and 16"
+#endif
+
+#if defined(OSNP_GROUPS) && defined(OSNP_RX_RING_LEN)
+#if !defined(OSNP_KEYS_LOCK) || !defined(OSNP_KEYS_UNLOCK)
+#error "OSNP_GROUPS with OSNP_RX_RING_LEN needs OSNP_KEYS_LOCK and OSNP_KEYS_UNLOCK"
+#endif
+#else
+#define OSNP_KEYS_LOCK()
+#define OSNP_KEYS_UNLOCK()
+#endif
+
+#ifdef OSNP_POLL_SLOTS
+#define OSNP_CAPABILITY_POLL_SLOTS POLL_SLOTS
+#else
+#define OSNP_CAPABILITY_POLL_SLOTS 0
+#endif
+
+/* Indexed by command tag - OSNP_GET_DEVICE_INFO. Being const, it is placed in program memory. */
+static const osnp_command_handler_t osnp_command_handlers[] = {
+  OSNP_GET_DEVICE_INFO_HANDLER,
+  OSNP_CONFIGURE_HANDLER,
+  OSNP_GET_DATA_HANDLER,
+  OSNP_PERFORM_HANDLER,
+  OSNP_SUBSCRIBE_HANDLER,
+  OSNP_UNSUBSCRIBE_HANDLER
+};
+
+#define OSNP_COMMAND_HANDLERS_LEN (sizeof(osnp_command_handlers) / sizeof(osnp_command_handler_t))
+
+#ifndef OSNP_SCAN_DWELL
+#define OSNP_SCAN_DWELL 250
+#endif
+
+#ifndef OSNP_SCAN_DWELL_QUIET
+#define OSNP_SCAN_DWELL_QUIET 50
+#endif
+
+#ifndef OSNP_ENERGY_DETECT_QUIET
+#define OSNP_ENERGY_DETECT_QUIET 16
+#endif
+
+#ifndef OSNP_HUB_CHANNELS
+#define OSNP_HUB_CHANNELS 0x0000
+#endif
+
+#define OSNP_CHANNEL_BIT(channel) (((uint16_t) 1) << (channel))
+
+#ifndef OSNP_POLL_INTERVAL_MIN
+#define OSNP_POLL_INTERVAL_MIN 1000
+#endif
+
+#ifndef OSNP_POLL_INTERVAL_MAX
+#define OSNP_POLL_INTERVAL_MAX 30000
+#endif
+
+#ifndef OSNP_COUNTER_LOG_RECORDS
+#define OSNP_COUNTER_LOG_RECORDS 4
+#endif
+
+#ifndef OSNP_FRAME_COUNTER_WINDOW_MAX
+#define OSNP_FRAME_COUNTER_WINDOW_MAX (OSNP_FRAME_COUNTER_WINDOW * 64)
+#endif
+
+#ifndef OSNP_COUNTER_LOG_PERIOD
+#define OSNP_COUNTER_LOG_PERIOD 3600000
+#endif
+
+#ifndef OSNP_REPLAY_WINDOW
+#define OSNP_REPLAY_WINDOW 32
+#endif
+
+#if OSNP_REPLAY_WINDOW < 1 || OSNP_REPLAY_WINDOW > 32
+#error "OSNP_REPLAY_WINDOW must be between 1 and 32"
+#endif
+
+#ifndef OSNP_MCMD_RETRIES
+#define OSNP_MCMD_RETRIES 2
+#endif
+
+#ifndef OSNP_RESPONSE_RETRIES
+#define OSNP_RESPONSE_RETRIES 2
+#endif
+
+#ifndef OSNP_NOTIFICATION_RETRIES
+#define OSNP_NOTIFICATION_RETRIES 1
+#endif
+
+#ifndef OSNP_TX_BACKOFF_UNIT
+#define OSNP_TX_BACKOFF_UNIT 4
+#endif
+
+#ifndef OSNP_TX_BACKOFF_MIN_BE
+#define OSNP_TX_BACKOFF_MIN_BE 1
+#endif
+
+#ifndef OSNP_TX_BACKOFF_MAX_BE
+#define OSNP_TX_BACKOFF_MAX_BE 5
+#endif
+
+#if OSNP_TX_POOL_LEN < 1 || OSNP_TX_POOL_LEN > 8
+#error "OSNP_TX_POOL_LEN must be between 1 and 8"
+#endif
+
+#ifndef OSNP_BULK_RETRIES
+#define OSNP_BULK_RETRIES 4
+#endif
+
+#if defined(OSNP_BULK_WINDOW) && (OSNP_BULK_WINDOW < 1 || OSNP_BULK_WINDOW > 8)
+#error "OSNP_BULK_WINDOW must be between 1 and 8"
+#endif
+
+#if defined(OSNP_RX_RING_LEN) && (OSNP_RX_RING_LEN < 2 || OSNP_RX_RING_LEN > 128 || (OSNP_RX_RING_LEN & (OSNP_RX_RING_LEN - 1)))
+#error "OSNP_RX_RING_LEN must be a power of 2 between 2 and 128"
+#endif
+
+/*
+ * The queue is sent whole in one notification frame: after its header template, the auxiliary security header (5
+ * bytes), the MIC and the FCS, the payload must hold the 0xE2 container (2 bytes) and the queue.
+ */
+#if defined(OSNP_NOTIFICATION_QUEUE_LEN) && (OSNP_NOTIFICATION_QUEUE_LEN > (IEEE802_15_4_MAX_FRAME_LEN - OSNP_HEADER_TEMPLATE_LEN - 5 - OSNP_MIC_LENGTH - IEEE802_15_4_FCS_LEN - 2))
+#error "OSNP_NOTIFICATION_QUEUE_LEN does not fit a notification frame with this OSNP_MIC_LENGTH"
+#endif
+
+static const uint8_t osnp_tx_retries[] = { OSNP_MCMD_RETRIES, OSNP_RESPONSE_RETRIES, OSNP_NOTIFICATION_RETRIES };
+
+#ifndef OSNP_MULTI_INSTANCE
+/*
+ * With a single instance, ctx is the address of a static object: the compiler resolves every ctx->field access
+ * to a direct memory access, exactly as with separate globals.
+ */
+static osnp_ctx_t osnp_instance;
+#define ctx (&osnp_instance)
+#endif
+
+#ifdef OSNP_STATS
+#define OSNP_STATS_INC(field) (ctx->stats.field++)
+#else
+#define OSNP_STATS_INC(field)
+#endif
+
+#if defined(OSNP_STATS) && defined(OSNP_CLOCK)
+/*
+ * Charges the time elapsed since the previous call to the current state. It is called on entry to every callback
+ * which can change the state, before any change, so each interval goes to the state held throughout it.
+ */
+void _osnp_stats_account_time(OSNP_CTX_PARAM) {
+  uint32_t now = OSNP_CLOCK();
+
+  ctx->stats.state_time[ctx->state] += now - ctx->stats_clock;
+  ctx->stats_clock = now;
+}
+
+#define OSNP_STATS_ACCOUNT_TIME() _osnp_stats_account_time(OSNP_CTX_ARG)
+#else
+#define OSNP_STATS_ACCOUNT_TIME()
+#endif
+
+/*
+ * Frame counter persistence. The counter log is a ring of OSNP_COUNTER_LOG_RECORDS records, each holding a sequence
+ * tag, the rx and tx frame counters reserved so far and a CRC-8 of the preceding bytes. Records are written to the
+ * slots in turn, so every slot wears at the same rate, and the valid record with the newest tag is the one in force:
+ * a record torn by a power loss fails the CRC and the previous one applies, whose reserved counters have not been
+ * used yet.
+ */
+uint8_t _osnp_crc8(uint8_t *buf, uint8_t len) {
+  uint8_t crc = 0xff;
+
+  while (len--) {
+    crc ^= *buf++;
+
+    for (uint8_t i = 0; i < 8; i++) {
+      crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x07) : (uint8_t) (crc << 1);
+    }
+  }
+
+  return crc;
+}
+
+void _osnp_write_counter_le(uint8_t *buf, uint32_t counter) {
+#ifdef LITTLE_ENDIAN
+  memcpy(buf, (uint8_t *) &counter, 4);
+#else
+  buf[0] = (counter & 0xff);
+  buf[1] = ((counter >> 8) & 0xff);
+  buf[2] = ((counter >> 16) & 0xff);
+  buf[3] = ((counter >> 24) & 0xff);
+#endif
+}
+
+uint32_t _osnp_read_counter_le(uint8_t *buf) {
+#ifdef LITTLE_ENDIAN
+  uint32_t counter;
+
+  // counters in frames are not aligned
+  memcpy((uint8_t *) &counter, buf, 4);
+  return counter;
+#else
+  return ((uint32_t) buf[3]) << 24 | ((uint32_t) buf[2]) << 16 | ((uint32_t) buf[1]) << 8 | buf[0];
+#endif
+}
+
+/*
+ * Loads the newest valid record of the counter log. Returns false, with both counters at zero, if there is none.
+ */
+bool _osnp_load_frame_counters(OSNP_CTX_PARAM) {
+  uint8_t record[OSNP_COUNTER_LOG_RECORD_LEN];
+  uint8_t newest = 0;
+  bool found = false;
+
+  ctx->counter_log_slot = 0;
+  ctx->rx_saved_frame_counter = 0;
+  ctx->tx_saved_frame_counter = 0;
+
+  for (uint8_t slot = 0; slot < OSNP_COUNTER_LOG_RECORDS; slot++) {
+    osnp_read_counter_log(OSNP_CTX_ARG_ (uint16_t) slot * OSNP_COUNTER_LOG_RECORD_LEN, record, OSNP_COUNTER_LOG_RECORD_LEN);
+
+    if (_osnp_crc8(record, OSNP_COUNTER_LOG_RECORD_LEN - 1) != record[OSNP_COUNTER_LOG_RECORD_LEN - 1]) {
+      continue;
+    }
+
+    // tags are compared modulo 256, unambiguous as long as the ring has less than 128 slots
+    if (found && (uint8_t) (record[0] - newest - 1) >= 0x7f) {
+      continue;
+    }
+
+    found = true;
+    newest = record[0];
+    ctx->counter_log_slot = (slot + 1) % OSNP_COUNTER_LOG_RECORDS;
+    ctx->rx_saved_frame_counter = _osnp_read_counter_le(&record[1]);
+    ctx->tx_saved_frame_counter = _osnp_read_counter_le(&record[5]);
+  }
+
+  ctx->counter_log_seq = newest + 1;
+  ctx->rx_frame_counter = ctx->rx_saved_frame_counter;
+  ctx->rx_replay_bitmap = 0xffffffff;
+  ctx->tx_frame_counter = ctx->tx_saved_frame_counter;
+
+  return found;
+}
+
+void _osnp_save_frame_counters(OSNP_CTX_PARAM) {
+  uint8_t record[OSNP_COUNTER_LOG_RECORD_LEN];
+
+  record[0] = ctx->counter_log_seq++;
+  _osnp_write_counter_le(&record[1], ctx->rx_saved_frame_counter);
+  _osnp_write_counter_le(&record[5], ctx->tx_saved_frame_counter);
+  record[OSNP_COUNTER_LOG_RECORD_LEN - 1] = _osnp_crc8(record, OSNP_COUNTER_LOG_RECORD_LEN - 1);
+
+  osnp_write_counter_log(OSNP_CTX_ARG_ (uint16_t) ctx->counter_log_slot * OSNP_COUNTER_LOG_RECORD_LEN, record, OSNP_COUNTER_LOG_RECORD_LEN);
+  OSNP_STATS_INC(counter_log_writes);
+  ctx->counter_log_slot = (ctx->counter_log_slot + 1) % OSNP_COUNTER_LOG_RECORDS;
+}
+
+/*
+ * Called when either frame counter reaches its reserved value: a single record reserves a window past both. The
+ * window doubles while reservations are used up faster than OSNP_COUNTER_LOG_PERIOD and halves when one lasts
+ * more than four periods, so busy devices write about once per period and quiet ones do not skip many counter
+ * values when they restart. The reservation right after a restart comes from the restart, not from the traffic,
+ * and leaves the window as it is.
+ */
+void _osnp_reserve_frame_counters(OSNP_CTX_PARAM) {
+  if (ctx->counter_log_elapsed < OSNP_COUNTER_LOG_PERIOD) {
+    if (ctx->frame_counter_window <= (OSNP_FRAME_COUNTER_WINDOW_MAX >> 1)) {
+      ctx->frame_counter_window <<= 1;
+    } else {
+      ctx->frame_counter_window = OSNP_FRAME_COUNTER_WINDOW_MAX;
+    }
+  } else if ((ctx->counter_log_elapsed >> 2) >= OSNP_COUNTER_LOG_PERIOD) {
+    if (ctx->frame_counter_window >= (OSNP_FRAME_COUNTER_WINDOW << 1)) {
+      ctx->frame_counter_window >>= 1;
+    } else {
+      ctx->frame_counter_window = OSNP_FRAME_COUNTER_WINDOW;
+    }
+  }
+
+  ctx->counter_log_elapsed = 0;
+  ctx->rx_saved_frame_counter = ctx->rx_frame_counter + ctx->frame_counter_window;
+  ctx->tx_saved_frame_counter = ctx->tx_frame_counter + ctx->frame_counter_window;
+  _osnp_save_frame_counters(OSNP_CTX_ARG);
+}
+
+/*
+ * Key cache. loaded_keys tracks which keys the radio or crypto engine holds, so they are only loaded again after
+ * they change or osnp_invalidate_keys is called. Loading uses a temporary buffer on the stack, since a frame may be
+ * in flight from any of the TX buffers. With groups and deferred reception osnp_select_rx_key changes the keys from
+ * the radio interrupt, so the main loop checks and loads them between OSNP_KEYS_LOCK and OSNP_KEYS_UNLOCK.
+ */
+void _osnp_use_master_key(OSNP_CTX_PARAM) {
+  uint8_t key_buf[16];
+
+  OSNP_KEYS_LOCK();
+
+  if (ctx->loaded_keys != OSNP_KEYS_MASTER) {
+    osnp_load_master_key(OSNP_CTX_ARG_ key_buf);
+    ctx->loaded_keys = OSNP_KEYS_MASTER;
+  }
+
+  OSNP_KEYS_UNLOCK();
+}
+
+void _osnp_load_session_keys(OSNP_CTX_PARAM) {
+  uint8_t key_buf[16];
+
+  osnp_load_rx_key(OSNP_CTX_ARG_ key_buf);
+  osnp_load_tx_key(OSNP_CTX_ARG_ key_buf);
+  ctx->loaded_keys = OSNP_KEYS_SESSION;
+}
+
+void _osnp_use_session_keys(OSNP_CTX_PARAM) {
+  OSNP_KEYS_LOCK();
+
+  if (ctx->loaded_keys != OSNP_KEYS_SESSION) {
+    _osnp_load_session_keys(OSNP_CTX_ARG);
+  }
+
+  OSNP_KEYS_UNLOCK();
+}
+
+void osnp_ctx_invalidate_keys(OSNP_CTX_PARAM) {
+  ctx->loaded_keys = OSNP_KEYS_NONE;
+
+  // the master key is needed right away to answer discovery, session keys are loaded at the next pending data
+  if (ctx->state < ASSOCIATED) {
+    _osnp_use_master_key(OSNP_CTX_ARG);
+  }
+}
+
+/*
+ * Header layouts. The position of the addressing fields only depends on the addressing modes and on PAN ID
+ * compression, so it is looked up in a table indexed by them. Each entry holds the offsets of the destination address,
+ * of the source PAN ID and of the source address, 0 when absent, and the length of the header. The destination PAN ID,
+ * when present, is always at offset 3.
+ */
+#define OSNP_ADDR_LEN(mode) ((mode) == FCADDR_SHORT ? 2 : ((mode) == FCADDR_EXT ? 8 : 0))
+#define OSNP_DST_END(dst) ((dst) == FCADDR_NONE ? 3 : 5 + OSNP_ADDR_LEN(dst))
+#define OSNP_SRC_PAN_LEN(src, pancomp) (((src) == FCADDR_NONE || (pancomp)) ? 0 : 2)
+
+#define OSNP_LAYOUT(dst, src, pancomp) { \
+  OSNP_ADDR_LEN(dst) ? 5 : 0, \
+  OSNP_SRC_PAN_LEN(src, pancomp) ? OSNP_DST_END(dst) : 0, \
+  OSNP_ADDR_LEN(src) ? OSNP_DST_END(dst) + OSNP_SRC_PAN_LEN(src, pancomp) : 0, \
+  OSNP_DST_END(dst) + OSNP_SRC_PAN_LEN(src, pancomp) + OSNP_ADDR_LEN(src) }
+
+#define OSNP_LAYOUTS(dst, src) OSNP_LAYOUT(dst, src, 0), OSNP_LAYOUT(dst, src, 1)
+#define OSNP_DST_LAYOUTS(dst) OSNP_LAYOUTS(dst, 0), OSNP_LAYOUTS(dst, 1), OSNP_LAYOUTS(dst, 2), OSNP_LAYOUTS(dst, 3)
+
+#define OSNP_LAYOUT_INDEX(fc_low, fc_high) ((EXTRACT_FCDSTADDR(fc_high) << 3) | (EXTRACT_FCSRCADDR(fc_high) << 1) | EXTRACT_FCPANCOMP(fc_low))
+
+static const uint8_t osnp_header_layouts[32][4] = {
+  OSNP_DST_LAYOUTS(0), OSNP_DST_LAYOUTS(1), OSNP_DST_LAYOUTS(2), OSNP_DST_LAYOUTS(3)
+};
+
+/* Frame control of the frames built from the header templates, indexed by template */
+static const uint8_t osnp_header_template_fc[OSNP_HEADER_TEMPLATES][2] = {
+  { FCFRTYP(FCFRTYP_MCMD) | FCREQACK, FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_SHORT) },
+  { FCFRTYP(FCFRTYP_DATA) | FCREQACK, FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_EXT) },
+  { FCFRTYP(FCFRTYP_MCMD) | FCREQACK | FCSECEN, FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_EXT) },
+#ifdef OSNP_BULK_WINDOW
+  { FCFRTYP(FCFRTYP_DATA) | FCREQACK | FCSECEN, FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_EXT) }
+#endif
+};
+
+uint8_t *_osnp_parse_header(uint8_t *buf, ieee802_15_4_frame_t *frame) {
+  const uint8_t *layout = osnp_header_layouts[OSNP_LAYOUT_INDEX(buf[0], buf[1])];
+
+  frame->backing_buffer = buf;
+  frame->fc_low = &buf[0];
+  frame->fc_high = &buf[1];
+  frame->seq_no = &buf[2];
+  frame->dst_pan = (EXTRACT_FCDSTADDR(buf[1]) != FCADDR_NONE) ? &buf[3] : NULL;
+  frame->dst_addr = layout[0] ? &buf[layout[0]] : NULL;
+  frame->src_pan = layout[1] ? &buf[layout[1]] : NULL;
+  frame->src_addr = layout[2] ? &buf[layout[2]] : NULL;
+  frame->header_len = layout[3];
+  buf += layout[3];
+
+  if (EXTRACT_FCSECEN(*frame->fc_low)) {
+    frame->frame_counter = buf;
+    buf += 4;
+    frame->key_counter = buf++;
+    frame->sec_header_len = 5;
+  } else {
+    frame->frame_counter = NULL;
+    frame->key_counter = NULL;
+    frame->sec_header_len = 0;
+  }
+
+  frame->payload = buf;
+
+  return buf;
+}
+
+/* Writes the frame control and the source addressing fields, leaving the sequence number and security fields */
+void _osnp_fill_header(OSNP_CTX_PARAM_ uint8_t fc_low, uint8_t fc_high, uint8_t *buf, ieee802_15_4_frame_t *frame) {
+  buf[0] = fc_low;
+  buf[1] = fc_high;
+  _osnp_parse_header(buf, frame);
+  frame->payload_len = 0;
+
+  if (frame->src_pan) {
+    memcpy(frame->src_pan, ctx->pan_id, 2);
+  }
+
+  if (frame->src_addr) {
+    if (EXTRACT_FCSRCADDR(fc_high) == FCADDR_SHORT) {
+      memcpy(frame->src_addr, ctx->short_address, 2);
+    } else {
+      memcpy(frame->src_addr, ctx->eui, 8);
+    }
+  }
+}
+
+void _osnp_write_frame_counter(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  _osnp_write_counter_le(frame->frame_counter, ctx->tx_frame_counter);
+  ctx->tx_frame_counter++;
+
+  if (ctx->tx_frame_counter >= ctx->tx_saved_frame_counter) {
+    _osnp_reserve_frame_counters(OSNP_CTX_ARG);
+  }
+
+  *frame->key_counter = 0x01;
+}
+
+/*
+ * Header templates. The frames the device sends on its own (polls, notifications, secured MAC commands and bulk
+ * fragments) always have the same header but for the sequence number and the frame counter, so it is built once
+ * whenever the addresses of the device change and each frame only copies it.
+ */
+void _osnp_build_header_templates(OSNP_CTX_PARAM) {
+  ieee802_15_4_frame_t frame;
+
+  for (uint8_t i = 0; i < OSNP_HEADER_TEMPLATES; i++) {
+    osnp_header_template_t *header_template = &ctx->header_templates[i];
+
+    _osnp_fill_header(OSNP_CTX_ARG_ osnp_header_template_fc[i][0], osnp_header_template_fc[i][1], header_template->header, &frame);
+    header_template->header_len = frame.header_len;
+    header_template->src_pan = frame.src_pan ? frame.src_pan - header_template->header : 0;
+    header_template->src_addr = frame.src_addr ? frame.src_addr - header_template->header : 0;
+    header_template->sec_header_len = frame.sec_header_len;
+  }
+}
+
+/*
+ * Transmit pool. A buffer is owned by the stack from the time it is acquired until the radio reports the final
+ * outcome of its frame: tx_pool_used has a bit for each owned buffer, tx_queue holds the buffers waiting for the
+ * radio by class and then in transmission order, and tx_in_flight the one being sent, or waiting to be sent again,
+ * while tx_busy is set.
+ */
+uint8_t *_osnp_acquire_tx_buffer(OSNP_CTX_PARAM) {
+  for (uint8_t i = 0; i < OSNP_TX_POOL_LEN; i++) {
+    if (!(ctx->tx_pool_used & (1 << i))) {
+      ctx->tx_pool_used |= (1 << i);
+      return ctx->tx_pool[i];
+    }
+  }
+
+  return NULL;
+}
+
+void _osnp_release_tx_buffer(OSNP_CTX_PARAM_ uint8_t index) {
+  ctx->tx_pool_used &= ~(1 << index);
+}
+
+#ifdef OSNP_STATS
+uint8_t _osnp_frame_len(ieee802_15_4_frame_t *frame) {
+  uint8_t len = (frame->payload - frame->backing_buffer) + frame->payload_len + IEEE802_15_4_FCS_LEN;
+
+  if (frame->sec_header_len) {
+    len += OSNP_MIC_LENGTH;
+  }
+
+  return len;
+}
+#endif
+
+/* Tells whether the frame in flight is a poll, whatever was queued before or after it */
+bool _osnp_in_flight_is_poll(OSNP_CTX_PARAM) {
+  ieee802_15_4_frame_t frame;
+
+  if (EXTRACT_FCFRTYP(ctx->tx_pool[ctx->tx_in_flight][0]) != FCFRTYP_MCMD) {
+    return false;
+  }
+
+  _osnp_parse_header(ctx->tx_pool[ctx->tx_in_flight], &frame);
+
+  return frame.payload[0] == OSNP_MCMD_DATA_REQ;
+}
+
+void _osnp_transmit_in_flight(OSNP_CTX_PARAM) {
+  ieee802_15_4_frame_t frame;
+
+  _osnp_parse_header(ctx->tx_pool[ctx->tx_in_flight], &frame);
+  frame.payload_len = ctx->tx_in_flight_payload_len;
+
+#ifdef OSNP_STATS
+  ctx->stats.tx_frames[ctx->state]++;
+  ctx->stats.tx_bytes[ctx->state] += _osnp_frame_len(&frame);
+#endif
+
+  osnp_transmit_frame(OSNP_CTX_ARG_ &frame);
+}
+
+void _osnp_transmit_next(OSNP_CTX_PARAM) {
+  if (ctx->tx_busy || !ctx->tx_queue_len) {
+    return;
+  }
+
+  ctx->tx_in_flight = ctx->tx_queue[0];
+  ctx->tx_in_flight_payload_len = ctx->tx_queue_payload_len[0];
+  ctx->tx_in_flight_class = ctx->tx_queue_class[0];
+  ctx->tx_queue_len--;
+
+  memmove(&ctx->tx_queue[0], &ctx->tx_queue[1], ctx->tx_queue_len * sizeof(ctx->tx_queue[0]));
+  memmove(&ctx->tx_queue_payload_len[0], &ctx->tx_queue_payload_len[1], ctx->tx_queue_len * sizeof(ctx->tx_queue_payload_len[0]));
+  memmove(&ctx->tx_queue_class[0], &ctx->tx_queue_class[1], ctx->tx_queue_len * sizeof(ctx->tx_queue_class[0]));
+
+  ctx->tx_attempts = 0;
+  ctx->tx_busy = true;
+  _osnp_transmit_in_flight(OSNP_CTX_ARG);
+}
+
+/*
+ * Queues a frame built in a buffer of the pool behind the queued frames of the same or a more urgent class, sending
+ * it right away if the radio is idle. The queue can take every buffer of the pool, so this never fails.
+ */
+void _osnp_transmit(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame, uint8_t tx_class) {
+  uint8_t i = ctx->tx_queue_len;
+
+  while (i && ctx->tx_queue_class[i - 1] > tx_class) {
+    i--;
+  }
+
+  uint8_t after = ctx->tx_queue_len - i;
+
+  memmove(&ctx->tx_queue[i + 1], &ctx->tx_queue[i], after * sizeof(ctx->tx_queue[0]));
+  memmove(&ctx->tx_queue_payload_len[i + 1], &ctx->tx_queue_payload_len[i], after * sizeof(ctx->tx_queue_payload_len[0]));
+  memmove(&ctx->tx_queue_class[i + 1], &ctx->tx_queue_class[i], after * sizeof(ctx->tx_queue_class[0]));
+
+  ctx->tx_queue[i] = (frame->backing_buffer - ctx->tx_pool[0]) / sizeof(ctx->tx_pool[0]);
+  ctx->tx_queue_payload_len[i] = frame->payload_len;
+  ctx->tx_queue_class[i] = tx_class;
+  ctx->tx_queue_len++;
+
+  _osnp_transmit_next(OSNP_CTX_ARG);
+}
+
+#ifdef OSNP_TX_BACKOFF
+/*
+ * Returns a random backoff delay of 1 to 2^BE units, BE growing with each attempt. The 16-bit xorshift generator
+ * is seeded from the EUI, so that devices which collided pick different delays.
+ */
+uint16_t _osnp_backoff_delay(OSNP_CTX_PARAM) {
+  uint16_t x = ctx->tx_backoff_seed;
+  uint8_t be = OSNP_TX_BACKOFF_MIN_BE + ctx->tx_attempts - 1;
+
+  x ^= x << 7;
+  x ^= x >> 9;
+  x ^= x << 8;
+  ctx->tx_backoff_seed = x;
+
+  if (be > OSNP_TX_BACKOFF_MAX_BE) {
+    be = OSNP_TX_BACKOFF_MAX_BE;
+  }
+
+  return ((x & ((1 << be) - 1)) + 1) * OSNP_TX_BACKOFF_UNIT;
+}
+#endif
+
+/*
+ * Sends the frame in flight again if it failed and its class has retries left. Returns false if the given status
+ * is the final outcome of the frame.
+ */
+bool _osnp_retransmit(OSNP_CTX_PARAM_ uint8_t status) {
+  if (status == OSNP_TX_STATUS_OK || ctx->tx_attempts >= osnp_tx_retries[ctx->tx_in_flight_class]) {
+    return false;
+  }
+
+  ctx->tx_attempts++;
+
+#ifdef OSNP_TX_BACKOFF
+  if (status == OSNP_TX_STATUS_CHANNEL_BUSY) {
+    osnp_start_backoff_timer(OSNP_CTX_ARG_ _osnp_backoff_delay(OSNP_CTX_ARG));
+    return true;
+  }
+#endif
+
+  _osnp_transmit_in_flight(OSNP_CTX_ARG);
+  return true;
+}
+
+void osnp_ctx_backoff_timer_expired_cb(OSNP_CTX_PARAM) {
+  if (ctx->tx_busy) {
+    _osnp_transmit_in_flight(OSNP_CTX_ARG);
+  }
+}
+
+/*
+ * Initializes a frame from a header template in a free TX buffer. Returns false if the pool is exhausted.
+ */
+bool _osnp_initialize_frame_from_template(OSNP_CTX_PARAM_ uint8_t index, ieee802_15_4_frame_t *frame) {
+  osnp_header_template_t *header_template = &ctx->header_templates[index];
+  uint8_t *buf = _osnp_acquire_tx_buffer(OSNP_CTX_ARG);
+
+  if (!buf) {
+    return false;
+  }
+
+  // copying the whole template, whatever its length, is a fixed size copy
+  memcpy(buf, header_template->header, OSNP_HEADER_TEMPLATE_LEN);
+  buf[2] = ctx->seq_no++;
+
+  // the fields are where the template recorded them, without parsing the frame control again
+  frame->backing_buffer = buf;
+  frame->fc_low = &buf[0];
+  frame->fc_high = &buf[1];
+  frame->seq_no = &buf[2];
+  frame->dst_pan = NULL;
+  frame->dst_addr = NULL;
+  frame->src_pan = header_template->src_pan ? &buf[header_template->src_pan] : NULL;
+  frame->src_addr = header_template->src_addr ? &buf[header_template->src_addr] : NULL;
+  frame->header_len = header_template->header_len;
+  frame->sec_header_len = header_template->sec_header_len;
+  frame->payload = &buf[frame->header_len + frame->sec_header_len];
+  frame->payload_len = 0;
+
+  if (frame->sec_header_len) {
+    frame->frame_counter = &buf[frame->header_len];
+    frame->key_counter = &buf[frame->header_len + 4];
+    _osnp_write_frame_counter(OSNP_CTX_ARG_ frame);
+  } else {
+    frame->frame_counter = NULL;
+    frame->key_counter = NULL;
+  }
+
+  return true;
+}
+
+uint16_t _osnp_payload_capacity(ieee802_15_4_frame_t *frame) {
+  uint16_t overhead = (frame->payload - frame->backing_buffer) + IEEE802_15_4_FCS_LEN;
+
+  if (frame->sec_header_len) {
+    overhead += OSNP_MIC_LENGTH;
+  }
+
+  return IEEE802_15_4_MAX_FRAME_LEN - overhead;
+}
+
+#ifdef OSNP_BULK_WINDOW
+bool osnp_bulk_write(osnp_bulk_writer_t *writer, uint8_t *data, uint16_t len) {
+  if (writer->skip >= len) {
+    writer->skip -= len;
+    return true;
+  }
+
+  data += writer->skip;
+  len -= writer->skip;
+  writer->skip = 0;
+
+  uint8_t avail = writer->cap - writer->pos;
+
+  if (len > avail) {
+    len = avail;
+    writer->more = true;
+  }
+
+  memcpy(&writer->buf[writer->pos], data, len);
+  writer->pos += len;
+
+  return !writer->more;
+}
+
+bool osnp_bulk_put_header(osnp_bulk_writer_t *writer, uint16_t tag, uint16_t len) {
+  uint8_t header[5];
+  uint16_t header_len = tlv_write_tag(header, tag);
+
+  header_len += tlv_write_length(&header[header_len], len);
+
+  return osnp_bulk_write(writer, header, header_len);
+}
+
+bool osnp_bulk_put(osnp_bulk_writer_t *writer, uint16_t tag, uint8_t *value, uint16_t len) {
+  return osnp_bulk_put_header(writer, tag, len) && osnp_bulk_write(writer, value, len);
+}
+
+/*
+ * Tells whether the fragment still has to be sent in the current round: it is in the window, not past the end of
+ * the stream and not acknowledged yet. bulk_last is 0xffff until the final fragment has been built.
+ */
+bool _osnp_bulk_pending(OSNP_CTX_PARAM_ uint16_t seq) {
+  uint16_t offset = seq - ctx->bulk_base;
+
+  if (offset >= OSNP_BULK_WINDOW || seq > ctx->bulk_last) {
+    return false;
+  }
+
+  return !offset || !(ctx->bulk_acked & (1 << (offset - 1)));
+}
+
+void _osnp_bulk_skip_acked(OSNP_CTX_PARAM) {
+  while ((uint16_t) (ctx->bulk_next - ctx->bulk_base) < OSNP_BULK_WINDOW && !_osnp_bulk_pending(OSNP_CTX_ARG_ ctx->bulk_next)) {
+    ctx->bulk_next++;
+  }
+}
+
+/*
+ * Sends the pending fragments of the current round while TX buffers are available. The round goes on from
+ * osnp_frame_sent_cb when the pool runs out.
+ */
+void _osnp_bulk_send(OSNP_CTX_PARAM) {
+  uint8_t container[2] = { ctx->bulk_tag, 0x80 };
+  uint8_t terminator[2] = { 0x00, 0x00 };
+  ieee802_15_4_frame_t tx_frame;
+  osnp_bulk_writer_t writer;
+
+  while (ctx->bulk_active && _osnp_bulk_pending(OSNP_CTX_ARG_ ctx->bulk_next)) {
+    // fragments are secured like the responses they may carry
+    if (!_osnp_initialize_frame_from_template(OSNP_CTX_ARG_ OSNP_TEMPLATE_SECURED_DATA, &tx_frame)) {
+      return;
+    }
+
+    uint16_t seq = ctx->bulk_next;
+
+    // the first fragment starts with the container, the stream then continues where the previous fragment ended
+    writer.buf = &tx_frame.payload[5];
+    writer.cap = _osnp_payload_capacity(&tx_frame) - 5;
+    writer.skip = (uint32_t) seq * writer.cap;
+    writer.pos = 0;
+    writer.more = false;
+
+    osnp_bulk_write(&writer, container, 2);
+    osnp_build_bulk(OSNP_CTX_ARG_ ctx->bulk_source, &writer);
+    osnp_bulk_write(&writer, terminator, 2);
+
+    if (!writer.more) {
+      ctx->bulk_last = seq;
+    }
+
+    ctx->bulk_next++;
+    _osnp_bulk_skip_acked(OSNP_CTX_ARG);
+
+    tx_frame.payload[0] = OSNP_BULK_FRAGMENT_TAG;
+    tx_frame.payload[1] = 3 + writer.pos;
+    tx_frame.payload[2] = ctx->bulk_id;
+    tx_frame.payload[3] = (seq >> 8) & 0x3f;
+    tx_frame.payload[4] = seq & 0xff;
+    tx_frame.payload_len = 5 + writer.pos;
+
+    if (seq == ctx->bulk_last) {
+      tx_frame.payload[3] |= OSNP_BULK_LAST;
+    }
+
+    if (!_osnp_bulk_pending(OSNP_CTX_ARG_ ctx->bulk_next)) {
+      tx_frame.payload[3] |= OSNP_BULK_ACK_REQ;
+    }
+
+    _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, (ctx->bulk_tag == 0xE1) ? OSNP_TX_CLASS_RESPONSE : OSNP_TX_CLASS_NOTIFICATION);
+  }
+}
+
+/*
+ * Starts a new round from the first fragment not acknowledged.
+ */
+void _osnp_bulk_resend(OSNP_CTX_PARAM) {
+  ctx->bulk_next = ctx->bulk_base;
+  _osnp_bulk_skip_acked(OSNP_CTX_ARG);
+  _osnp_bulk_send(OSNP_CTX_ARG);
+}
+
+uint8_t osnp_ctx_start_bulk_transfer(OSNP_CTX_PARAM_ uint8_t source, uint8_t tag) {
+  if (ctx->bulk_active || ctx->state < ASSOCIATED) {
+    return 0;
+  }
+
+  if (!++ctx->bulk_id) {
+    ctx->bulk_id = 1;
+  }
+
+  ctx->bulk_source = source;
+  ctx->bulk_tag = tag;
+  ctx->bulk_base = 0;
+  ctx->bulk_next = 0;
+  ctx->bulk_last = 0xffff;
+  ctx->bulk_acked = 0;
+  ctx->bulk_idle_polls = 0;
+  ctx->bulk_active = true;
+
+  _osnp_bulk_send(OSNP_CTX_ARG);
+
+  return ctx->bulk_id;
+}
+
+void _osnp_handle_bulk_ack(OSNP_CTX_PARAM_ uint8_t *ack, uint16_t len) {
+  if (len != 4 || !ctx->bulk_active || ack[0] != ctx->bulk_id) {
+    return;
+  }
+
+  uint16_t base = (ack[1] << 8) | ack[2];
+  uint16_t advance = base - ctx->bulk_base;
+
+  // acknowledgements never move the window back, older ones arriving late are ignored
+  if (advance > OSNP_BULK_WINDOW) {
+    return;
+  }
+
+  if (advance || (ack[3] & ~ctx->bulk_acked)) {
+    ctx->bulk_idle_polls = 0;
+  }
+
+  ctx->bulk_acked = advance ? ack[3] : (ctx->bulk_acked | ack[3]);
+  ctx->bulk_base = base;
+
+  if (ctx->bulk_last != 0xffff && base > ctx->bulk_last) {
+    ctx->bulk_active = false;
+    return;
+  }
+
+  _osnp_bulk_resend(OSNP_CTX_ARG);
+}
+
+/*
+ * Called at every poll: an unanswered round is sent again, in case the fragment asking for the acknowledgement or
+ * the acknowledgement itself got lost.
+ */
+void _osnp_bulk_timeout(OSNP_CTX_PARAM) {
+  if (!ctx->bulk_active) {
+    return;
+  }
+
+  if (++ctx->bulk_idle_polls > OSNP_BULK_RETRIES) {
+    ctx->bulk_active = false;
+    return;
+  }
+
+  _osnp_bulk_resend(OSNP_CTX_ARG);
+}
+#endif
+
+/*
+ * Builds the order in which channels are scanned: the channel of the last association first, then the other
+ * channels where a hub has been seen, then the remaining ones. With OSNP_ENERGY_DETECT the remaining channels are
+ * sorted by decreasing energy, and those at or below OSNP_ENERGY_DETECT_QUIET are marked quiet, to be only listened
+ * to for OSNP_SCAN_DWELL_QUIET in the first pass.
+ */
+void _osnp_plan_scan(OSNP_CTX_PARAM) {
+  uint16_t planned = 0;
+  uint8_t n = 0;
+
+  if (ctx->last_channel < 16) {
+    ctx->scan_order[n++] = ctx->last_channel;
+    planned |= OSNP_CHANNEL_BIT(ctx->last_channel);
+  }
+
+  for (uint8_t channel = 0; channel < 16; channel++) {
+    if ((ctx->hub_channels & ~planned) & OSNP_CHANNEL_BIT(channel)) {
+      ctx->scan_order[n++] = channel;
+      planned |= OSNP_CHANNEL_BIT(channel);
+    }
+  }
+
+  ctx->scan_quiet = 0;
+
+#ifdef OSNP_ENERGY_DETECT
+  uint8_t energy[16];
+  uint8_t known = n;
+
+  for (uint8_t channel = 0; channel < 16; channel++) {
+    if (planned & OSNP_CHANNEL_BIT(channel)) {
+      continue;
+    }
+
+    energy[channel] = osnp_energy_detect(OSNP_CTX_ARG_ channel);
+
+    if (energy[channel] <= OSNP_ENERGY_DETECT_QUIET) {
+      ctx->scan_quiet |= OSNP_CHANNEL_BIT(channel);
+    }
+
+    // insertion sort, the loudest channel first
+    uint8_t i = n++;
+
+    while (i > known && energy[ctx->scan_order[i - 1]] < energy[channel]) {
+      ctx->scan_order[i] = ctx->scan_order[i - 1];
+      i--;
+    }
+
+    ctx->scan_order[i] = channel;
+  }
+#else
+  for (uint8_t channel = 0; channel < 16; channel++) {
+    if (!(planned & OSNP_CHANNEL_BIT(channel))) {
+      ctx->scan_order[n++] = channel;
+    }
+  }
+#endif
+
+  ctx->scan_index = 0;
+}
+
+void _osnp_scan_current_channel(OSNP_CTX_PARAM) {
+  ctx->channel = ctx->scan_order[ctx->scan_index];
+  osnp_switch_channel(OSNP_CTX_ARG_ ctx->channel);
+
+  if (ctx->scan_quiet & OSNP_CHANNEL_BIT(ctx->channel)) {
+    osnp_start_channel_scanning_timer(OSNP_CTX_ARG_ OSNP_SCAN_DWELL_QUIET);
+  } else {
+    osnp_start_channel_scanning_timer(OSNP_CTX_ARG_ OSNP_SCAN_DWELL);
+  }
+}
+
+void _osnp_start_scan(OSNP_CTX_PARAM) {
+  ctx->state = SCANNING_CHANNELS;
+  _osnp_plan_scan(OSNP_CTX_ARG);
+  _osnp_scan_current_channel(OSNP_CTX_ARG);
+}
+
+void _osnp_scan_next_channel(OSNP_CTX_PARAM) {
+  // a quiet channel may just have been silent when measured: after the first pass every channel gets a full dwell
+  if (++ctx->scan_index == 16) {
+    OSNP_STATS_INC(scan_cycles);
+    _osnp_plan_scan(OSNP_CTX_ARG);
+    ctx->scan_quiet = 0;
+  }
+
+  _osnp_scan_current_channel(OSNP_CTX_ARG);
+}
+
+#ifdef OSNP_POLL_SLOTS
+/*
+ * Takes a poll slot assignment, <period, 16 bits> <delay, 16 bits> in milliseconds, from the hub: the next slot
+ * starts delay from now and the following ones every period. A period of 0 withdraws the assignment. The hub sends
+ * the delay again whenever the polls drift off the slot, so the grid is always relative to the latest reply.
+ */
+void _osnp_assign_poll_slot(OSNP_CTX_PARAM_ uint8_t *buf) {
+  uint32_t now = OSNP_CLOCK();
+
+  ctx->slot_period = (buf[0] << 8) | buf[1];
+  ctx->slot_at = now + ((buf[2] << 8) | buf[3]);
+
+  // the assignment comes with the association or after a poll, the next poll interval is counted from it
+  ctx->polled_at = now;
+}
+#endif
+
+/*
+ * Starts the poll timer for the current poll interval. With a poll slot assigned, the poll is moved to the slot
+ * nearest to the interval after the previous poll, but never earlier than the next slot to come.
+ */
+void _osnp_start_poll_timer(OSNP_CTX_PARAM) {
+#ifdef OSNP_POLL_SLOTS
+  if (ctx->slot_period) {
+    uint32_t now = OSNP_CLOCK();
+    uint32_t target = ctx->polled_at + ctx->poll_interval - (ctx->slot_period >> 1);
+
+    if ((int32_t) (target - now) < 0) {
+      target = now;
+    }
+
+    uint32_t ahead = target - ctx->slot_at;
+
+    if ((int32_t) ahead > 0) {
+      ctx->slot_at += ((ahead + ctx->slot_period - 1) / ctx->slot_period) * ctx->slot_period;
+    }
+
+    if (ctx->slot_at == now) {
+      ctx->slot_at += ctx->slot_period;
+    }
+
+    osnp_start_poll_timer(OSNP_CTX_ARG_ ctx->slot_at - now);
+    return;
+  }
+#endif
+
+  osnp_start_poll_timer(OSNP_CTX_ARG_ ctx->poll_interval);
+}
+
+#ifdef OSNP_GROUPS
+void _osnp_leave_groups(OSNP_CTX_PARAM) {
+  for (uint8_t i = 0; i < OSNP_GROUPS; i++) {
+    ctx->groups[i].address[0] = 0xff;
+    ctx->groups[i].address[1] = 0xff;
+  }
+}
+
+/*
+ * Returns the group a frame is addressed to, or NULL. Broadcasts never match, since free entries hold the broadcast
+ * address.
+ */
+osnp_group_t *_osnp_frame_group(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  if (EXTRACT_FCDSTADDR(*frame->fc_high) != FCADDR_SHORT || (frame->dst_addr[0] & frame->dst_addr[1]) == 0xff) {
+    return NULL;
+  }
+
+  for (uint8_t i = 0; i < OSNP_GROUPS; i++) {
+    if (!memcmp(ctx->groups[i].address, frame->dst_addr, 2)) {
+      return &ctx->groups[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Tells whether a frame which is not for a group is for this device. Extended addresses are left to the radio, which
+ * filters them even in the promiscuous mode needed for groups on some radios.
+ */
+bool _osnp_addressed_to_device(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  if (EXTRACT_FCDSTADDR(*frame->fc_high) != FCADDR_SHORT) {
+    return true;
+  }
+
+  return ((frame->dst_addr[0] & frame->dst_addr[1]) == 0xff) || !memcmp(frame->dst_addr, ctx->short_address, 2);
+}
+#endif
+
+/* Forgets the stored association, only keeping the channel of the hub as last_channel for the next scan */
+void _osnp_forget_association(OSNP_CTX_PARAM) {
+  uint8_t channel = 0xff;
+
+  ctx->pan_id[0] = 0x00;
+  ctx->pan_id[1] = 0x00;
+  osnp_write_pan_id(OSNP_CTX_ARG_ ctx->pan_id);
+
+  ctx->short_address[0] = 0xff;
+  ctx->short_address[1] = 0xff;
+  osnp_write_short_address(OSNP_CTX_ARG_ ctx->short_address);
+
+  _osnp_build_header_templates(OSNP_CTX_ARG);
+  osnp_write_channel(OSNP_CTX_ARG_ &channel);
+}
+
+void osnp_ctx_initialize(OSNP_CTX_PARAM) {
+  osnp_load_eui(OSNP_CTX_ARG_ ctx->eui);
+  osnp_load_pan_id(OSNP_CTX_ARG_ ctx->pan_id);
+  osnp_load_short_address(OSNP_CTX_ARG_ ctx->short_address);
+  osnp_load_channel(OSNP_CTX_ARG_ &ctx->channel);
+  _osnp_build_header_templates(OSNP_CTX_ARG);
+
+#ifdef OSNP_STATS
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+#ifdef OSNP_CLOCK
+  ctx->stats_clock = OSNP_CLOCK();
+#endif
+#endif
+
+  ctx->seq_no = 0;
+  ctx->tx_pool_used = 0;
+  ctx->tx_queue_len = 0;
+  ctx->tx_busy = false;
+
+  // folding the whole EUI, since vendors differ in which end they number devices
+  ctx->tx_backoff_seed = 0;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    ctx->tx_backoff_seed ^= (uint16_t) ctx->eui[i] << ((i & 1) << 3);
+  }
+
+  if (!ctx->tx_backoff_seed) {
+    ctx->tx_backoff_seed = 1;
+  }
+
+  ctx->hub_channels = OSNP_HUB_CHANNELS;
+  ctx->poll_interval_min = OSNP_POLL_INTERVAL_MIN;
+  ctx->poll_interval_max = OSNP_POLL_INTERVAL_MAX;
+  ctx->poll_interval = ctx->poll_interval_min;
+
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+  ctx->notification_queue_len = 0;
+  ctx->poll_after_flush = false;
+#endif
+
+#ifdef OSNP_BULK_WINDOW
+  ctx->bulk_id = 0;
+  ctx->bulk_active = false;
+#endif
+
+#ifdef OSNP_SUBSCRIPTIONS
+  ctx->subscriptions_len = 0;
+#endif
+
+#ifdef OSNP_POLL_SLOTS
+  ctx->slot_period = 0;
+#endif
+
+#ifdef OSNP_GROUPS
+  _osnp_leave_groups(OSNP_CTX_ARG);
+#endif
+
+#ifdef OSNP_RX_RING_LEN
+  ctx->rx_ring_head = 0;
+  ctx->rx_ring_tail = 0;
+  ctx->rx_ring_dropped = 0;
+#endif
+
+  ctx->frame_counter_window = OSNP_FRAME_COUNTER_WINDOW;
+  ctx->frame_counter_align_sent = false;
+
+  // the loaded counters are already at their reserved values, the first frame reserves again at once
+  ctx->counter_log_elapsed = OSNP_COUNTER_LOG_PERIOD;
+  bool counters_loaded = _osnp_load_frame_counters(OSNP_CTX_ARG);
+  ctx->loaded_keys = OSNP_KEYS_NONE;
+
+  if (ctx->channel == 0xff) {
+    ctx->last_channel = 0xff;
+    _osnp_use_master_key(OSNP_CTX_ARG);
+    _osnp_start_scan(OSNP_CTX_ARG);
+  } else if (!counters_loaded) {
+    // counting again from zero would reuse nonces under the session keys, the hub hands out new ones at association
+    ctx->last_channel = ctx->channel;
+    ctx->hub_channels |= OSNP_CHANNEL_BIT(ctx->channel);
+    _osnp_forget_association(OSNP_CTX_ARG);
+    _osnp_use_master_key(OSNP_CTX_ARG);
+    _osnp_start_scan(OSNP_CTX_ARG);
+  } else {
+    ctx->last_channel = ctx->channel;
+    ctx->hub_channels |= OSNP_CHANNEL_BIT(ctx->channel);
+    ctx->state = ASSOCIATED;
+    osnp_switch_channel(OSNP_CTX_ARG_ ctx->channel);
+    _osnp_use_session_keys(OSNP_CTX_ARG);
+    _osnp_start_poll_timer(OSNP_CTX_ARG);
+  }
+}
+
+void osnp_ctx_timer_expired_cb(OSNP_CTX_PARAM) {
+  OSNP_STATS_ACCOUNT_TIME();
+
+  switch(ctx->state) {
+    case SCANNING_CHANNELS:
+      _osnp_scan_next_channel(OSNP_CTX_ARG);
+      break;
+    case WAITING_ASSOCIATION_REQUEST:
+      // a new pass starts from the channels where a hub has been seen, including this one
+      _osnp_start_scan(OSNP_CTX_ARG);
+      break;
+    case ASSOCIATED:
+      // the poll timer is the only clock of the stack, used to measure how fast frame counters advance
+      if (ctx->counter_log_elapsed < UINT32_MAX - ctx->poll_interval) {
+        ctx->counter_log_elapsed += ctx->poll_interval;
+      }
+
+      // at most one frame counter alignment per poll interval
+      ctx->frame_counter_align_sent = false;
+
+#ifdef OSNP_BULK_WINDOW
+      _osnp_bulk_timeout(OSNP_CTX_ARG);
+#endif
+
+      osnp_ctx_poll(OSNP_CTX_ARG);
+      break;
+    case WAITING_PENDING_DATA:
+      ctx->state = ASSOCIATED;
+      _osnp_start_poll_timer(OSNP_CTX_ARG);
+      break;
+  }
+}
+
+void _osnp_handle_discovery_request(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  uint8_t *buf = _osnp_acquire_tx_buffer(OSNP_CTX_ARG);
+
+  if (!buf) {
+    return;
+  }
+
+  ieee802_15_4_frame_t tx_frame;
+  osnp_initialize_response_frame(OSNP_CTX_ARG_ frame, &tx_frame, buf);
+
+  tx_frame.payload[0] = OSNP_MCMD_DISCOVER;
+  tx_frame.payload_len = 1;
+
+  ctx->hub_channels |= OSNP_CHANNEL_BIT(ctx->channel);
+
+  _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, OSNP_TX_CLASS_MCMD);
+  osnp_stop_active_timer(OSNP_CTX_ARG);
+}
+
+void _osnp_reset_security(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  osnp_write_rx_key(OSNP_CTX_ARG_ &frame->payload[1]);
+  osnp_write_tx_key(OSNP_CTX_ARG_ &frame->payload[17]);
+
+  // frames are still exchanged with the keys in use until the next poll finding pending data
+  ctx->loaded_keys = OSNP_KEYS_NONE;
+
+  ctx->frame_counter_window = OSNP_FRAME_COUNTER_WINDOW;
+  ctx->counter_log_elapsed = 0;
+
+  ctx->rx_frame_counter = 0x00;
+  ctx->rx_saved_frame_counter = ctx->frame_counter_window;
+  ctx->rx_replay_bitmap = 0x01;
+
+  ctx->tx_frame_counter = 0x00;
+  ctx->tx_saved_frame_counter = ctx->frame_counter_window;
+
+  _osnp_save_frame_counters(OSNP_CTX_ARG);
+}
+
+void _osnp_handle_key_update(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+   _osnp_reset_security(OSNP_CTX_ARG_ frame);
+
+  uint8_t *buf = _osnp_acquire_tx_buffer(OSNP_CTX_ARG);
+
+  if (!buf) {
+    return;
+  }
+
+  ieee802_15_4_frame_t tx_frame;
+  osnp_initialize_response_frame(OSNP_CTX_ARG_ frame, &tx_frame, buf);
+  tx_frame.payload[0] = OSNP_MCMD_KEY_UPDATE_RES;
+  tx_frame.payload_len = 1;
+
+  _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, OSNP_TX_CLASS_MCMD);
+}
+
+void _osnp_send_frame_counter(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  uint32_t expected_counter = ctx->rx_frame_counter + 1;
+
+  ieee802_15_4_frame_t tx_frame;
+
+  if (!_osnp_initialize_frame_from_template(OSNP_CTX_ARG_ OSNP_TEMPLATE_SECURED_MCMD, &tx_frame)) {
+    return;
+  }
+  tx_frame.payload[0] = OSNP_MCMD_FRAME_COUNTER_ALIGN;
+  _osnp_write_counter_le(&tx_frame.payload[1], expected_counter);
+
+  tx_frame.payload_len = 5;
+
+  _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, OSNP_TX_CLASS_MCMD);
+}
+
+/*
+ * Replay protection. Bit n of rx_replay_bitmap is set when the frame with counter rx_frame_counter - n has been
+ * accepted, so frames reordered by up to OSNP_REPLAY_WINDOW counter values are accepted exactly once. Returns
+ * whether the frame must be accepted, updating the window if so.
+ */
+bool _osnp_check_replay(OSNP_CTX_PARAM_ uint32_t frame_counter) {
+  if (frame_counter > ctx->rx_frame_counter) {
+    uint32_t shift = frame_counter - ctx->rx_frame_counter;
+
+    ctx->rx_replay_bitmap = shift < 32 ? (ctx->rx_replay_bitmap << shift) | 1 : 1;
+    ctx->rx_frame_counter = frame_counter;
+
+    if (ctx->rx_frame_counter >= ctx->rx_saved_frame_counter) {
+      _osnp_reserve_frame_counters(OSNP_CTX_ARG);
+    }
+
+    return true;
+  }
+
+  uint32_t age = ctx->rx_frame_counter - frame_counter;
+
+  if (age >= OSNP_REPLAY_WINDOW || (ctx->rx_replay_bitmap & (((uint32_t) 1) << age))) {
+    return false;
+  }
+
+  ctx->rx_replay_bitmap |= ((uint32_t) 1) << age;
+  return true;
+}
+
+void _osnp_handle_frame_counter_align(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+    uint32_t new_tx_frame_counter = _osnp_read_counter_le(&frame->payload[1]);
+
+    if (new_tx_frame_counter > ctx->tx_frame_counter) {
+      ctx->tx_frame_counter = new_tx_frame_counter;
+      ctx->tx_saved_frame_counter = ctx->tx_frame_counter + ctx->frame_counter_window;
+      _osnp_save_frame_counters(OSNP_CTX_ARG);
+    }
+}
+
+void _osnp_handle_association_request(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  // with PAN ID compression the hub sends from the PAN it addresses
+  uint8_t *pan_id = frame->src_pan ? frame->src_pan : frame->dst_pan;
+
+  if (!pan_id) {
+    return;
+  }
+
+  memcpy(ctx->pan_id, pan_id, 2);
+  osnp_write_pan_id(OSNP_CTX_ARG_ ctx->pan_id);
+  osnp_write_channel(OSNP_CTX_ARG_ &ctx->channel);
+
+  ctx->last_channel = ctx->channel;
+  ctx->hub_channels |= OSNP_CHANNEL_BIT(ctx->channel);
+
+  _osnp_reset_security(OSNP_CTX_ARG_ frame);
+
+  memcpy(ctx->short_address, &frame->payload[33], 2);
+
+  osnp_write_short_address(OSNP_CTX_ARG_ ctx->short_address);
+
+  osnp_stop_active_timer(OSNP_CTX_ARG);
+
+  ctx->state = ASSOCIATED;
+  ctx->poll_interval = ctx->poll_interval_min;
+
+#ifdef OSNP_POLL_SLOTS
+  // a hub assigning slots appends the first assignment to the request
+  if (frame->payload_len >= 39) {
+    _osnp_assign_poll_slot(OSNP_CTX_ARG_ &frame->payload[35]);
+  } else {
+    ctx->slot_period = 0;
+  }
+#endif
+
+  _osnp_build_header_templates(OSNP_CTX_ARG);
+
+  ieee802_15_4_frame_t tx_frame;
+
+  if (!_osnp_initialize_frame_from_template(OSNP_CTX_ARG_ OSNP_TEMPLATE_SECURED_MCMD, &tx_frame)) {
+    return;
+  }
+  tx_frame.payload[0] = OSNP_MCMD_ASSOCIATION_RES;
+  tx_frame.payload[1] = OSNP_DEVICE_CAPABILITES | OSNP_CAPABILITY_POLL_SLOTS;
+  tx_frame.payload[2] = OSNP_SECURITY_LEVEL;
+
+  tx_frame.payload_len = 3;
+
+  _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, OSNP_TX_CLASS_MCMD);
+}
+
+void _osnp_handle_disassociation_notification(OSNP_CTX_PARAM) {
+  // only the stored channel is forgotten, the scan starts again from last_channel
+  _osnp_forget_association(OSNP_CTX_ARG);
+  _osnp_use_master_key(OSNP_CTX_ARG);
+
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+  ctx->notification_queue_len = 0;
+  ctx->poll_after_flush = false;
+#endif
+
+#ifdef OSNP_BULK_WINDOW
+  ctx->bulk_active = false;
+#endif
+
+#ifdef OSNP_SUBSCRIPTIONS
+  // the subscriptions belong to the hub being left
+  ctx->subscriptions_len = 0;
+#endif
+
+#ifdef OSNP_POLL_SLOTS
+  ctx->slot_period = 0;
+#endif
+
+#ifdef OSNP_GROUPS
+  _osnp_leave_groups(OSNP_CTX_ARG);
+#endif
+
+  osnp_stop_active_timer(OSNP_CTX_ARG);
+  _osnp_start_scan(OSNP_CTX_ARG);
+}
+
+#ifdef OSNP_GROUPS
+/*
+ * Handles OSNP_MCMD_GROUP: joins or updates the group given with its flags, frame counter and key, leaves the group
+ * given with its address alone, or leaves every group. Entries keep their index, which names the stored key.
+ */
+void _osnp_handle_group(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  uint8_t i;
+
+  if (frame->payload_len < 3) {
+    _osnp_leave_groups(OSNP_CTX_ARG);
+    return;
+  }
+
+  for (i = 0; i < OSNP_GROUPS && memcmp(ctx->groups[i].address, &frame->payload[1], 2); i++);
+
+  if (frame->payload_len < 24) {
+    if (i < OSNP_GROUPS) {
+      ctx->groups[i].address[0] = 0xff;
+      ctx->groups[i].address[1] = 0xff;
+    }
+
+    return;
+  }
+
+  if ((frame->payload[1] & frame->payload[2]) == 0xff) {
+    return;
+  }
+
+  if (i == OSNP_GROUPS) {
+    for (i = 0; i < OSNP_GROUPS && (ctx->groups[i].address[0] & ctx->groups[i].address[1]) != 0xff; i++);
+
+    if (i == OSNP_GROUPS) {
+      return;
+    }
+  }
+
+  memcpy(ctx->groups[i].address, &frame->payload[1], 2);
+  ctx->groups[i].flags = frame->payload[3];
+  ctx->groups[i].rx_frame_counter = _osnp_read_counter_le(&frame->payload[4]);
+  osnp_write_group_key(OSNP_CTX_ARG_ i, &frame->payload[8]);
+
+  // the radio may hold the previous key of the entry
+  OSNP_KEYS_LOCK();
+
+  if (ctx->loaded_keys == OSNP_KEYS_GROUP + i) {
+    ctx->loaded_keys = OSNP_KEYS_NONE;
+  }
+
+  OSNP_KEYS_UNLOCK();
+}
+#endif
+
+/*
+ * Dispatches a MAC command by its identifier. Commands shorter than their fixed fields, the identifier included, are
+ * ignored: the association request carries the keys and the short address (35 bytes), the key update the keys (33)
+ * and the frame counter alignment the counter (5).
+ */
+void _osnp_mac_command_frame_received_cb(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  if (!frame->payload_len) {
+    return;
+  }
+
+  if (ctx->state < ASSOCIATED) {
+    switch (frame->payload[0]) {
+      case OSNP_MCMD_DISCOVER:
+        _osnp_handle_discovery_request(OSNP_CTX_ARG_ frame);
+        break;
+      case OSNP_MCMD_ASSOCIATION_REQ:
+        if (frame->payload_len >= 35) {
+          _osnp_handle_association_request(OSNP_CTX_ARG_ frame);
+        }
+        break;
+    }
+  } else {
+    switch (frame->payload[0]) {
+      case OSNP_MCMD_DISASSOCIATED:
+        _osnp_handle_disassociation_notification(OSNP_CTX_ARG);
+        break;
+      case OSNP_MCMD_FRAME_COUNTER_ALIGN:
+        if (frame->payload_len >= 5) {
+          _osnp_handle_frame_counter_align(OSNP_CTX_ARG_ frame);
+        }
+        break;
+      case OSNP_MCMD_KEY_UPDATE_REQ:
+        if (frame->payload_len >= 33) {
+          _osnp_handle_key_update(OSNP_CTX_ARG_ frame);
+        }
+        break;
+#ifdef OSNP_GROUPS
+      case OSNP_MCMD_GROUP:
+        _osnp_handle_group(OSNP_CTX_ARG_ frame);
+        break;
+#endif
+#ifdef OSNP_POLL_SLOTS
+      case OSNP_MCMD_POLL_SLOT:
+        if (frame->payload_len >= 5) {
+          _osnp_assign_poll_slot(OSNP_CTX_ARG_ &frame->payload[1]);
+        }
+        break;
+#endif
+    }
+  }
+}
+
+#ifdef OSNP_STATS
+/* Fields of osnp_stats_t */
+#define OSNP_STATS_FIELDS (sizeof(osnp_stats_t) / sizeof(uint32_t))
+
+/*
+ * A page of statistics must fit the smallest response: to a hub with an extended address, whose header takes 23
+ * bytes and the auxiliary security header 5, inside the 0xE1 container, the OSNP_GET_DATA object and its own tag and
+ * length (7 bytes).
+ */
+#if (7 + 1 + OSNP_STATS_PAGE_FIELDS * 4) > (IEEE802_15_4_MAX_FRAME_LEN - 23 - 5 - OSNP_MIC_LENGTH - IEEE802_15_4_FCS_LEN)
+#error "a page of statistics does not fit a response frame with this OSNP_MIC_LENGTH"
+#endif
+
+/*
+ * Answers an OSNP_GET_DATA command whose first parameter is OSNP_STATS_TAG with a page of the statistics, leaving
+ * the remaining parameters to the application handler. Any other OSNP_GET_DATA goes to the handler unchanged.
+ */
+uint8_t _osnp_get_data(OSNP_CTX_PARAM_ osnp_command_handler_t handler, tlv_reader_t *params, tlv_writer_t *response, bool secure) {
+  uint8_t page[1 + OSNP_STATS_PAGE_FIELDS * 4];
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
+
+  if (!tlv_reader_peek_tag(params, &tag) || tag != OSNP_STATS_TAG) {
+    return handler ? handler(OSNP_CTX_ARG_ params, response, secure) : OSNP_UNSUPPORTED_COMMAND;
+  }
+
+  if (!secure) {
+    return OSNP_SECURITY_ERROR;
+  }
+
+  if (!tlv_reader_next(params, &tag, &len, &value)) {
+    return OSNP_UNSUPPORTED_PARAMETERS;
+  }
+
+  page[0] = len ? value[0] : 0;
+
+  uint16_t first = page[0] * OSNP_STATS_PAGE_FIELDS;
+
+  if (first >= OSNP_STATS_FIELDS) {
+    return OSNP_UNSUPPORTED_PARAMETERS;
+  }
+
+  uint8_t count = (OSNP_STATS_FIELDS - first) < OSNP_STATS_PAGE_FIELDS ? (OSNP_STATS_FIELDS - first) : OSNP_STATS_PAGE_FIELDS;
+  const uint32_t *counter = (const uint32_t *) &ctx->stats;
+  uint8_t *field = &page[1];
+
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t v = counter[first + i];
+
+    *field++ = v >> 24;
+    *field++ = v >> 16;
+    *field++ = v >> 8;
+    *field++ = v;
+  }
+
+  tlv_writer_put(response, OSNP_STATS_TAG, page, 1 + count * 4);
+
+  if (!tlv_reader_has_next(params)) {
+    return OSNP_SUCCESS;
+  }
+
+  return handler ? handler(OSNP_CTX_ARG_ params, response, secure) : OSNP_UNSUPPORTED_PARAMETERS;
+}
+#endif
+
+void _osnp_dispatch_command(OSNP_CTX_PARAM_ tlv_reader_t *commands, tlv_writer_t *response, bool secure) {
+  tlv_reader_t params;
+  tlv_writer_t discarded;
+  uint16_t tag;
+  uint16_t start = response->pos;
+  uint8_t depth = response->depth;
+
+  if (!tlv_reader_enter(commands, &params, &tag)) {
+    return;
+  }
+
+  if (!tlv_writer_open(response, tag)) {
+    // the command runs all the same, into a writer without room, and its response is dropped like one not fitting
+    response->error = false;
+    tlv_writer_init(&discarded, NULL, 0);
+    response = &discarded;
+  }
+
+  uint16_t value = response->pos;
+  uint8_t status = OSNP_UNSUPPORTED_COMMAND;
+
+  // tags below OSNP_GET_DEVICE_INFO wrap around and fall out of the table as well
+  uint16_t index = tag - OSNP_GET_DEVICE_INFO;
+
+  osnp_command_handler_t handler = (index < OSNP_COMMAND_HANDLERS_LEN) ? osnp_command_handlers[index] : NULL;
+
+#ifdef OSNP_STATS
+  if (tag == OSNP_GET_DATA) {
+    status = _osnp_get_data(OSNP_CTX_ARG_ handler, &params, response, secure);
+  } else
+#endif
+  if (handler) {
+    status = handler(OSNP_CTX_ARG_ &params, response, secure);
+  }
+
+  if (response == &discarded) {
+    return;
+  }
+
+  if (status != OSNP_SUCCESS) {
+    response->pos = value;
+    response->depth = depth + 1;
+    response->error = false;
+    tlv_writer_put(response, OSNP_ERROR_TAG, &status, 1);
+  }
+
+  // objects left open by the handler are closed with the response object
+  while (response->depth > depth) {
+    tlv_writer_close(response);
+  }
+
+  // a response which does not fit is dropped entirely
+  if (response->error) {
+    response->pos = start;
+    response->depth = depth;
+    response->error = false;
+  }
+}
+
+void _osnp_data_frame_received_cb(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  tlv_reader_t payload;
+  tlv_reader_t commands;
+  uint16_t tag;
+
+  tlv_reader_init(&payload, frame->payload, frame->payload_len);
+
+  if (!tlv_reader_enter(&payload, &commands, &tag)) {
+    return;
+  }
+
+#ifdef OSNP_BULK_WINDOW
+  if (tag == OSNP_BULK_ACK_TAG) {
+    _osnp_handle_bulk_ack(OSNP_CTX_ARG_ commands.buf, commands.end);
+    return;
+  }
+#endif
+
+  if (tag != 0xE0) {
+    return;
+  }
+
+  ieee802_15_4_frame_t tx_frame;
+  tlv_writer_t response;
+  uint8_t *buf = NULL;
+
+#ifdef OSNP_GROUPS
+  osnp_group_t *group = _osnp_frame_group(OSNP_CTX_ARG_ frame);
+
+  // a buffer, with its sequence number and frame counter, is only taken if the hub wants the response
+  if (!group || (group->flags & OSNP_GROUP_RESPOND)) {
+    buf = _osnp_acquire_tx_buffer(OSNP_CTX_ARG);
+  }
+
+  // the commands of a group frame are not sent again, so they run even when the response cannot be sent
+  if (!buf && !group) {
+    return;
+  }
+#else
+  buf = _osnp_acquire_tx_buffer(OSNP_CTX_ARG);
+
+  if (!buf) {
+    return;
+  }
+#endif
+
+  if (buf) {
+    osnp_initialize_response_frame(OSNP_CTX_ARG_ frame, &tx_frame, buf);
+    tlv_writer_init(&response, tx_frame.payload, _osnp_payload_capacity(&tx_frame));
+    tlv_writer_open(&response, 0xE1);
+  } else {
+    // every response is then dropped like one not fitting
+    tlv_writer_init(&response, NULL, 0);
+  }
+
+  while(tlv_reader_has_next(&commands)) {
+    _osnp_dispatch_command(OSNP_CTX_ARG_ &commands, &response, (ctx->state >= ASSOCIATED));
+  }
+
+  if (!buf) {
+    return;
+  }
+
+  // responses that did not fit are left out; a payload never exceeds 127 bytes, so closing never moves data
+  tlv_writer_close(&response);
+  tx_frame.payload_len = response.pos;
+
+#ifdef OSNP_GROUPS
+  if (group) {
+    // group frames are not acknowledged, the response is
+    *tx_frame.fc_low |= FCREQACK;
+  }
+#endif
+
+  _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, OSNP_TX_CLASS_RESPONSE);
+}
+
+void _osnp_handle_frame(OSNP_CTX_PARAM_ uint8_t *frame_buf, int16_t frame_len) {
+  ieee802_15_4_frame_t frame;
+
+  OSNP_STATS_ACCOUNT_TIME();
+
+  // truncated frames would make the handlers read past the received bytes
+  if (frame_len < 0 || !osnp_parse_frame(frame_buf, frame_len, &frame)) {
+    OSNP_STATS_INC(rx_malformed);
+    return;
+  }
+
+#ifdef OSNP_GROUPS
+  osnp_group_t *group = _osnp_frame_group(OSNP_CTX_ARG_ &frame);
+
+  // a radio receiving group addresses may pass frames for other devices as well
+  if (!group && !_osnp_addressed_to_device(OSNP_CTX_ARG_ &frame)) {
+    return;
+  }
+#endif
+
+  OSNP_STATS_INC(rx_frames);
+
+  if (ctx->state == SCANNING_CHANNELS) {
+    ctx->state = WAITING_ASSOCIATION_REQUEST;
+  } else if (ctx->state == ASSOCIATED && EXTRACT_FCFRPEN(*frame.fc_low)) {
+    ctx->state = WAITING_PENDING_DATA;
+    ctx->poll_interval = ctx->poll_interval_min;
+  }
+
+  if (ctx->state >= ASSOCIATED) {
+    // unsecured frames, like discovery broadcasts, are ignored and must not re-arm the running timer
+    if (!EXTRACT_FCSECEN(*frame.fc_low)) {
+      return;
+    }
+
+    uint32_t current_frame_counter = _osnp_read_counter_le(frame.frame_counter);
+
+#ifdef OSNP_GROUPS
+    // group frames have a counter of their own, shared by the members, and only carry commands
+    if (group) {
+      if (current_frame_counter < group->rx_frame_counter || current_frame_counter == UINT32_MAX) {
+        OSNP_STATS_INC(replay_rejects);
+      } else if (EXTRACT_FCFRTYP(*frame.fc_low) == FCFRTYP_DATA) {
+        group->rx_frame_counter = current_frame_counter + 1;
+        _osnp_data_frame_received_cb(OSNP_CTX_ARG_ &frame);
+      }
+
+      return;
+    }
+#endif
+
+    if (!_osnp_check_replay(OSNP_CTX_ARG_ current_frame_counter)) {
+      OSNP_STATS_INC(replay_rejects);
+
+      // duplicates inside the window are dropped silently, only stale frames mean the hub is out of sync
+      if ((ctx->rx_frame_counter - current_frame_counter) >= OSNP_REPLAY_WINDOW && !ctx->frame_counter_align_sent) {
+        ctx->frame_counter_align_sent = true;
+        OSNP_STATS_INC(frame_counter_aligns);
+        _osnp_send_frame_counter(OSNP_CTX_ARG_ &frame);
+      }
+
+      return;
+    }
+  }
+  
+  switch (EXTRACT_FCFRTYP(*frame.fc_low)) {
+    case FCFRTYP_DATA:
+      _osnp_data_frame_received_cb(OSNP_CTX_ARG_ &frame);
+      break;
+    case FCFRTYP_MCMD:
+      _osnp_mac_command_frame_received_cb(OSNP_CTX_ARG_ &frame);
+      break;
+  }
+}
 
-static uint8_t OSNP_PAN_ID[2];
-static uint8_t OSNP_SHORT_ADDRESS[2];
-static uint8_t OSNP_EUI[8];
+void osnp_ctx_frame_received_cb(OSNP_CTX_PARAM_ uint8_t *frame_buf, int16_t frame_len) {
+#ifdef OSNP_RX_RING_LEN
+  uint8_t head = ctx->rx_ring_head;
 
-static uint8_t tx_frame_buf[128];
+  // a length the radio cannot have received does not fit a slot either
+  if (frame_len < 0 || frame_len > IEEE802_15_4_MAX_FRAME_LEN) {
+    ctx->rx_ring_dropped++;
+    return;
+  }
+
+  // the indices run freely modulo 256, so their difference is the number of queued frames
+  if ((uint8_t) (head - ctx->rx_ring_tail) == OSNP_RX_RING_LEN) {
+    ctx->rx_ring_dropped++;
+    return;
+  }
+
+  uint8_t slot = head & (OSNP_RX_RING_LEN - 1);
+
+  memcpy(ctx->rx_ring[slot], frame_buf, frame_len);
+  ctx->rx_ring_frame_len[slot] = frame_len;
+
+  // publishing the new head hands the slot over to osnp_process
+  ctx->rx_ring_head = head + 1;
+#else
+  _osnp_handle_frame(OSNP_CTX_ARG_ frame_buf, frame_len);
+#endif
+}
 
-static uint8_t seq_no;
-static uint8_t state;
-static uint8_t channel;
+#ifdef OSNP_GROUPS
+bool osnp_ctx_select_rx_key(OSNP_CTX_PARAM_ uint8_t *frame_buf, uint8_t frame_len) {
+  ieee802_15_4_frame_t frame;
+  uint8_t key_buf[16];
 
-static uint32_t rx_frame_counter;
-static uint32_t tx_frame_counter;
+  if (!osnp_parse_frame(frame_buf, frame_len, &frame)) {
+    return false;
+  }
 
-static uint32_t rx_saved_frame_counter;
-static uint32_t tx_saved_frame_counter;
+  osnp_group_t *group = _osnp_frame_group(OSNP_CTX_ARG_ &frame);
 
-void osnp_initialize(void) {
-  osnp_load_eui(OSNP_EUI);
-  osnp_load_pan_id(OSNP_PAN_ID);
-  osnp_load_short_address(OSNP_SHORT_ADDRESS);
-  osnp_load_channel(&channel);
+  if (group) {
+    uint8_t i = group - ctx->groups;
 
-  seq_no = 0;
+    if (ctx->loaded_keys != OSNP_KEYS_GROUP + i) {
+      osnp_load_group_key(OSNP_CTX_ARG_ i, key_buf);
+      ctx->loaded_keys = OSNP_KEYS_GROUP + i;
+    }
 
-  if (channel == 0xff) {
-    channel = 0;
-    state = SCANNING_CHANNELS;
-    osnp_load_master_key(tx_frame_buf);
-    osnp_start_channel_scanning_timer();
-  } else {
-    state = ASSOCIATED;
-    osnp_load_rx_frame_counter((uint8_t *) &rx_frame_counter);
-    osnp_load_tx_frame_counter((uint8_t *) &tx_frame_counter);
+    return true;
+  }
 
-    rx_saved_frame_counter = rx_frame_counter;
-    tx_saved_frame_counter = tx_frame_counter;
+  if (!_osnp_addressed_to_device(OSNP_CTX_ARG_ &frame)) {
+    return false;
+  }
+
+  // otherwise the keys in use are left alone, the stack changes them at its own time
+  if (ctx->loaded_keys >= OSNP_KEYS_GROUP) {
+    _osnp_load_session_keys(OSNP_CTX_ARG);
+  }
+
+  return true;
+}
+#endif
+
+#ifdef OSNP_RX_RING_LEN
+uint8_t osnp_ctx_process(OSNP_CTX_PARAM) {
+  uint8_t head = ctx->rx_ring_head;
+  uint8_t tail = ctx->rx_ring_tail;
+  uint8_t processed = 0;
+
+  while (tail != head) {
+    uint8_t slot = tail & (OSNP_RX_RING_LEN - 1);
 
-    osnp_load_rx_key(tx_frame_buf);
-    osnp_load_tx_key(tx_frame_buf);
-    osnp_start_poll_timer();
+    _osnp_handle_frame(OSNP_CTX_ARG_ ctx->rx_ring[slot], ctx->rx_ring_frame_len[slot]);
+
+    // the slot can only be reused once the frame has been handled, since the frame is parsed in place
+    ctx->rx_ring_tail = ++tail;
+    processed++;
   }
 
-  osnp_switch_channel(channel);
+  return processed;
+}
+#endif
+
+void _osnp_back_off_poll_interval(OSNP_CTX_PARAM) {
+  if (ctx->poll_interval >= (ctx->poll_interval_max >> 1)) {
+    ctx->poll_interval = ctx->poll_interval_max;
+  } else {
+    ctx->poll_interval <<= 1;
+  }
 }
 
-void osnp_timer_expired_cb() {
-  switch(state) {
+void osnp_ctx_frame_sent_cb(OSNP_CTX_PARAM_ uint8_t status) {
+  OSNP_STATS_ACCOUNT_TIME();
+
+#ifdef OSNP_STATS
+  // every attempt is counted, including those sent again
+  if (status <= OSNP_TX_STATUS_CHANNEL_BUSY) {
+    ctx->stats.tx_status[status]++;
+  }
+#endif
+
+  // only the outcome of the poll itself backs off the poll interval, not that of a frame queued around it
+  bool polled = false;
+
+  if (ctx->tx_busy) {
+    // failed attempts are invisible to the state machine, which only sees the final outcome
+    if (_osnp_retransmit(OSNP_CTX_ARG_ status)) {
+      return;
+    }
+
+    polled = _osnp_in_flight_is_poll(OSNP_CTX_ARG);
+    _osnp_release_tx_buffer(OSNP_CTX_ARG_ ctx->tx_in_flight);
+    ctx->tx_busy = false;
+  }
+
+#ifdef OSNP_DELIVERY_HANDLER
+  // the handling below may already start the next frame, which takes over tx_in_flight_class
+  uint8_t tx_class = ctx->tx_in_flight_class;
+#endif
+
+  switch(ctx->state) {
     case SCANNING_CHANNELS:
-      channel = (channel + 1) % 16;
-      osnp_switch_channel(channel);
-      osnp_start_channel_scanning_timer();
+      osnp_start_channel_scanning_timer(OSNP_CTX_ARG_ OSNP_SCAN_DWELL);
       break;
     case WAITING_ASSOCIATION_REQUEST:
-      state = SCANNING_CHANNELS;
-      osnp_start_channel_scanning_timer();
+      osnp_start_association_wait_timer(OSNP_CTX_ARG);
       break;
     case ASSOCIATED:
-      osnp_poll();
-      break;
     case WAITING_PENDING_DATA:
-      state = ASSOCIATED;
-      osnp_start_poll_timer();
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+      if (ctx->poll_after_flush) {
+        ctx->poll_after_flush = false;
+        osnp_ctx_poll(OSNP_CTX_ARG);
+        break;
+      }
+#endif
+
+      if ((status == OSNP_TX_STATUS_OK) && osnp_get_pending_frames(OSNP_CTX_ARG)) {
+        // the hub has data for us and is likely to have more soon
+        ctx->poll_interval = ctx->poll_interval_min;
+        ctx->state = WAITING_PENDING_DATA;
+        _osnp_use_session_keys(OSNP_CTX_ARG);
+        osnp_start_pending_data_wait_timer(OSNP_CTX_ARG);
+      } else {
+        if (polled) {
+          _osnp_back_off_poll_interval(OSNP_CTX_ARG);
+        }
+
+        ctx->state = ASSOCIATED;
+        _osnp_start_poll_timer(OSNP_CTX_ARG);
+      }
       break;
   }
+
+#ifdef OSNP_DELIVERY_HANDLER
+  // reported after the pending data check, since the handler may transmit
+  OSNP_DELIVERY_HANDLER(OSNP_CTX_ARG_ tx_class, status);
+#endif
+
+#ifdef OSNP_BULK_WINDOW
+  // a round stopped by a full pool goes on now that a buffer is free
+  _osnp_bulk_send(OSNP_CTX_ARG);
+#endif
+
+  // frames queued while this one was in flight, or by the handling above, follow right away
+  _osnp_transmit_next(OSNP_CTX_ARG);
 }
 
-void _osnp_handle_discovery_request(ieee802_15_4_frame_t *frame) {
+void osnp_ctx_poll(OSNP_CTX_PARAM) {
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+  // queued notifications go first, the data request follows when they have been sent
+  if (ctx->notification_queue_len) {
+    ctx->poll_after_flush = true;
+    osnp_ctx_flush_notifications(OSNP_CTX_ARG);
+    return;
+  }
+#endif
+
   ieee802_15_4_frame_t tx_frame;
-  osnp_initialize_response_frame(frame, &tx_frame, tx_frame_buf);
 
-  tx_frame.payload[0] = OSNP_MCMD_DISCOVER;
+  // with every buffer taken a frame is still to be reported as sent, and the poll timer is restarted then
+  if (!_osnp_initialize_frame_from_template(OSNP_CTX_ARG_ OSNP_TEMPLATE_POLL, &tx_frame)) {
+    return;
+  }
+  tx_frame.payload[0] = OSNP_MCMD_DATA_REQ;
   tx_frame.payload_len = 1;
 
-  osnp_transmit_frame(&tx_frame);
-  osnp_stop_active_timer();
+#ifdef OSNP_POLL_SLOTS
+  ctx->polled_at = OSNP_CLOCK();
+#endif
+  _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, OSNP_TX_CLASS_MCMD);
 }
 
-void _osnp_reset_security(ieee802_15_4_frame_t *frame) {
-  osnp_write_rx_key(&frame->payload[1]);
-  osnp_write_tx_key(&frame->payload[17]);
+uint32_t osnp_ctx_get_poll_interval(OSNP_CTX_PARAM) {
+  return ctx->poll_interval;
+}
 
-  rx_frame_counter = 0x00;
-  rx_saved_frame_counter = OSNP_FRAME_COUNTER_WINDOW;
+void osnp_ctx_get_poll_interval_bounds(OSNP_CTX_PARAM_ uint32_t *min, uint32_t *max) {
+  *min = ctx->poll_interval_min;
+  *max = ctx->poll_interval_max;
+}
 
-  tx_frame_counter = 0x00;
-  tx_saved_frame_counter = OSNP_FRAME_COUNTER_WINDOW;
+void osnp_ctx_set_poll_interval_bounds(OSNP_CTX_PARAM_ uint32_t min, uint32_t max) {
+  ctx->poll_interval_min = min;
+  ctx->poll_interval_max = (max < min) ? min : max;
 
-  osnp_write_rx_frame_counter((uint8_t *) &rx_saved_frame_counter);
-  osnp_write_tx_frame_counter((uint8_t *) &tx_saved_frame_counter);
+  if (ctx->poll_interval < ctx->poll_interval_min) {
+    ctx->poll_interval = ctx->poll_interval_min;
+  } else if (ctx->poll_interval > ctx->poll_interval_max) {
+    ctx->poll_interval = ctx->poll_interval_max;
+  }
 }
 
-void _osnp_handle_key_update(ieee802_15_4_frame_t *frame) {
-   _osnp_reset_security(frame);
+#ifdef OSNP_STATS
+const osnp_stats_t *osnp_ctx_get_stats(OSNP_CTX_PARAM) {
+  OSNP_STATS_ACCOUNT_TIME();
+  return &ctx->stats;
+}
+#endif
 
+bool _osnp_transmit_notification(OSNP_CTX_PARAM) {
   ieee802_15_4_frame_t tx_frame;
-  osnp_initialize_response_frame(frame, &tx_frame, tx_frame_buf);
-  tx_frame.payload[0] = OSNP_MCMD_KEY_UPDATE_RES;
-  tx_frame.payload_len = 1;
 
-  osnp_transmit_frame(&tx_frame);
-}
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+  osnp_header_template_t *header_template = &ctx->header_templates[OSNP_TEMPLATE_NOTIFICATION];
+  uint16_t capacity = IEEE802_15_4_MAX_FRAME_LEN - header_template->header_len - header_template->sec_header_len - OSNP_MIC_LENGTH - IEEE802_15_4_FCS_LEN;
 
-void _osnp_send_frame_counter(ieee802_15_4_frame_t *frame) {
-  uint32_t expected_counter = rx_frame_counter + 1;
+  // a queue the frame cannot carry whole is kept rather than sent truncated
+  if (ctx->notification_queue_len + 2 > capacity) {
+    return false;
+  }
+#endif
 
-  ieee802_15_4_frame_t tx_frame;
-  uint8_t fc_low = FCFRTYP(FCFRTYP_MCMD) | FCREQACK | FCSECEN;
-  uint8_t fc_high = FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_EXT);
+  // queued notifications stay queued until a buffer is free
+  if (!_osnp_initialize_frame_from_template(OSNP_CTX_ARG_ OSNP_TEMPLATE_NOTIFICATION, &tx_frame)) {
+    return false;
+  }
 
-  osnp_initialize_frame(fc_low, fc_high, tx_frame_buf, &tx_frame);
-  tx_frame.payload[0] = OSNP_MCMD_FRAME_COUNTER_ALIGN;
+  tlv_writer_t notification;
+  tlv_writer_init(&notification, tx_frame.payload, _osnp_payload_capacity(&tx_frame));
+  tlv_writer_open(&notification, 0xE2);
 
-#ifdef LITTLE_ENDIAN
-    memcpy(&(tx_frame.payload[1]), (uint8_t *) &expected_counter, 4);
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+  tlv_writer_put_raw(&notification, ctx->notification_queue, ctx->notification_queue_len);
+  ctx->notification_queue_len = 0;
 #else
-    tx_frame.payload[4] = (expected_counter & 0xff);
-    tx_frame.payload[3] = ((expected_counter >> 8) & 0xff);
-    tx_frame.payload[2] = ((expected_counter >> 16) & 0xff);
-    tx_frame.payload[1] = ((expected_counter >> 24) & 0xff);
+  osnp_build_notification(OSNP_CTX_ARG_ &notification);
 #endif
 
-  tx_frame.payload_len = 5;
+  tlv_writer_close(&notification);
+  tx_frame.payload_len = notification.pos;
 
-  osnp_transmit_frame(&tx_frame);
+  _osnp_transmit(OSNP_CTX_ARG_ &tx_frame, OSNP_TX_CLASS_NOTIFICATION);
+  return true;
 }
 
-void _osnp_handle_frame_counter_align(ieee802_15_4_frame_t *frame) {
-    uint32_t new_tx_frame_counter;
-#ifdef LITTLE_ENDIAN
-    new_tx_frame_counter = *((uint32_t *) &frame->payload[1]);
-#else
-    new_tx_frame_counter = frame.payload[4] << 24 | frame.payload[3] << 16 | frame.payload[2] << 8 | frame.payload[1];
-#endif
-
-    if (new_tx_frame_counter > tx_frame_counter) {
-      tx_frame_counter = new_tx_frame_counter;
-      tx_saved_frame_counter = tx_frame_counter + OSNP_FRAME_COUNTER_WINDOW;
-      osnp_write_tx_frame_counter((uint8_t *) &tx_saved_frame_counter);
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+/*
+ * Removes the first item with the given tag found before the given position of the queue, moving down the items
+ * following it up to end. Returns the number of bytes removed.
+ */
+uint16_t _osnp_remove_queued_notification(OSNP_CTX_PARAM_ uint16_t tag, uint16_t before, uint16_t end) {
+  tlv_reader_t reader;
+  uint16_t start = 0;
+  uint16_t item_tag;
+  uint16_t len;
+  uint8_t *value;
+
+  tlv_reader_init(&reader, ctx->notification_queue, before);
+
+  while (tlv_reader_next(&reader, &item_tag, &len, &value)) {
+    if (item_tag == tag) {
+      memmove(&ctx->notification_queue[start], &ctx->notification_queue[reader.pos], end - reader.pos);
+      return reader.pos - start;
     }
-}
 
-void _osnp_handle_association_request(ieee802_15_4_frame_t *frame) {
-  memcpy(OSNP_PAN_ID, frame->src_pan, 2);
-  osnp_write_pan_id(OSNP_PAN_ID);
-  osnp_write_channel(&channel);
+    start = reader.pos;
+  }
 
-  _osnp_reset_security(frame);
+  return 0;
+}
 
-  memcpy(OSNP_SHORT_ADDRESS, &frame->payload[33], 2);
+/*
+ * Builds the notification after the queued ones and removes the older items it replaces. Returns false, leaving
+ * the queue untouched, if it does not fit.
+ */
+bool _osnp_queue_notification(OSNP_CTX_PARAM) {
+  tlv_writer_t writer;
+  tlv_reader_t reader;
+  uint16_t start = ctx->notification_queue_len;
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
 
-  osnp_write_short_address(OSNP_SHORT_ADDRESS);
+  tlv_writer_init(&writer, &ctx->notification_queue[start], OSNP_NOTIFICATION_QUEUE_LEN - start);
+  osnp_build_notification(OSNP_CTX_ARG_ &writer);
 
-  osnp_stop_active_timer();
+  if (writer.error) {
+    return false;
+  }
 
-  state = ASSOCIATED;
+  uint16_t end = start + writer.pos;
 
-  ieee802_15_4_frame_t tx_frame;
-  
-  uint8_t fc_low = FCFRTYP(FCFRTYP_MCMD) | FCREQACK | FCSECEN;
-  uint8_t fc_high = FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_EXT);
+  while (start < end) {
+    tlv_reader_init(&reader, &ctx->notification_queue[start], end - start);
 
-  osnp_initialize_frame(fc_low, fc_high, tx_frame_buf, &tx_frame);
-  tx_frame.payload[0] = OSNP_MCMD_ASSOCIATION_RES;
-  tx_frame.payload[1] = OSNP_DEVICE_CAPABILITES;
-  tx_frame.payload[2] = OSNP_SECURITY_LEVEL;
+    if (!tlv_reader_next(&reader, &tag, &len, &value)) {
+      break;
+    }
 
-  tx_frame.payload_len = 3;
+    uint16_t removed = _osnp_remove_queued_notification(OSNP_CTX_ARG_ tag, start, end);
+    start += reader.pos - removed;
+    end -= removed;
+  }
 
-  osnp_transmit_frame(&tx_frame);
+  ctx->notification_queue_len = end;
+
+  return true;
 }
 
-_osnp_handle_disassociation_notification() {
-  OSNP_PAN_ID[0] = 0x00;
-  OSNP_PAN_ID[1] = 0x00;
+void osnp_ctx_flush_notifications(OSNP_CTX_PARAM) {
+  if (!ctx->notification_queue_len || ctx->state < ASSOCIATED) {
+    return;
+  }
 
-  osnp_write_pan_id(OSNP_PAN_ID);
-  osnp_load_master_key(tx_frame_buf);
+  // with every buffer taken the queue is kept whole and flushed again when the timer expires
+  if (!_osnp_transmit_notification(OSNP_CTX_ARG)) {
+    osnp_start_notification_timer(OSNP_CTX_ARG);
+  }
+}
+#endif
 
-  OSNP_SHORT_ADDRESS[0] = 0xff;
-  OSNP_SHORT_ADDRESS[1] = 0xff;
+#ifdef OSNP_SUBSCRIPTIONS
+/*
+ * Subscriptions. The flags of a subscription tell whether it has been reported yet, the direction of the last
+ * reported move, used for hysteresis, and whether it is due in the notification being built.
+ */
+#define OSNP_SUBSCRIPTION_REPORTED 0x01
+#define OSNP_SUBSCRIPTION_ROSE 0x02
+#define OSNP_SUBSCRIPTION_FELL 0x04
+#define OSNP_SUBSCRIPTION_DUE 0x08
+
+/* Length of the value of an OSNP_SUBSCRIBE parameter with every field */
+#define OSNP_SUBSCRIPTION_CONFIG_LEN 9
+
+osnp_subscription_t *_osnp_find_subscription(OSNP_CTX_PARAM_ uint16_t tag) {
+  for (uint8_t i = 0; i < ctx->subscriptions_len; i++) {
+    if (ctx->subscriptions[i].tag == tag) {
+      return &ctx->subscriptions[i];
+    }
+  }
 
-  osnp_write_short_address(OSNP_SHORT_ADDRESS);
+  return NULL;
+}
 
-  channel = 0xff;
-  osnp_write_channel(&channel);
-  channel = 0;
+/*
+ * Checks every parameter before applying any, so a command which cannot be honoured entirely leaves the
+ * subscriptions untouched.
+ */
+uint8_t _osnp_subscribe(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure) {
+  tlv_reader_t check = *params;
+  uint8_t added = 0;
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
+  int32_t reading;
 
-  state = SCANNING_CHANNELS;
-  osnp_stop_active_timer();
-  osnp_start_channel_scanning_timer();
-}
+  if (!secure) {
+    return OSNP_SECURITY_ERROR;
+  }
 
-void _osnp_mac_command_frame_received_cb(ieee802_15_4_frame_t *frame) {
-  if (state < ASSOCIATED) {
-    switch (frame->payload[0]) {
-      case OSNP_MCMD_DISCOVER:
-        _osnp_handle_discovery_request(frame);
-        break;
-      case OSNP_MCMD_ASSOCIATION_REQ:
-        _osnp_handle_association_request(frame);
-        break;
+  while (tlv_reader_next(&check, &tag, &len, &value)) {
+    if (len > OSNP_SUBSCRIPTION_CONFIG_LEN || !osnp_read_item(OSNP_CTX_ARG_ tag, &reading)) {
+      return OSNP_UNSUPPORTED_PARAMETERS;
     }
-  } else {
-    switch (frame->payload[0]) {
-      case OSNP_MCMD_DISASSOCIATED:
-        _osnp_handle_disassociation_notification();
-        break;
-      case OSNP_MCMD_FRAME_COUNTER_ALIGN:
-        _osnp_handle_frame_counter_align(frame);
-        break;
-      case OSNP_MCMD_KEY_UPDATE_REQ:
-        _osnp_handle_key_update(frame);
-        break;
+
+    // an item given twice is counted twice, which only errs on the safe side
+    if (!_osnp_find_subscription(OSNP_CTX_ARG_ tag)) {
+      added++;
+    }
+  }
+
+  if (check.error || !tlv_reader_has_next(params)) {
+    return OSNP_UNSUPPORTED_PARAMETERS;
+  }
+
+  if (added > OSNP_SUBSCRIPTIONS - ctx->subscriptions_len) {
+    return OSNP_DEVICE_BUSY;
+  }
+
+  while (tlv_reader_next(params, &tag, &len, &value)) {
+    uint8_t config[OSNP_SUBSCRIPTION_CONFIG_LEN] = { 0 };
+    osnp_subscription_t *sub = _osnp_find_subscription(OSNP_CTX_ARG_ tag);
+
+    if (!sub) {
+      sub = &ctx->subscriptions[ctx->subscriptions_len++];
+      sub->tag = tag;
+      sub->flags = 0;
     }
+
+    memcpy(config, value, len);
+    sub->min_interval = ((uint16_t) config[0] << 8) | config[1];
+    sub->max_interval = ((uint16_t) config[2] << 8) | config[3];
+    sub->change = ((uint16_t) config[4] << 8) | config[5];
+    sub->change_percent = config[6];
+    sub->hysteresis = ((uint16_t) config[7] << 8) | config[8];
   }
+
+  return OSNP_SUCCESS;
 }
 
-void _osnp_data_frame_received_cb(ieee802_15_4_frame_t *frame) {
-  uint16_t i = 0;
+uint8_t _osnp_unsubscribe(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure) {
   uint16_t tag;
-  uint16_t end;
-  
-  i += tlv_read_tag(&frame->payload[i], &tag);
-  
-  if (tag != 0xE0) {
-    return;
+  uint16_t len;
+  uint8_t *value;
+
+  if (!secure) {
+    return OSNP_SECURITY_ERROR;
   }
-  
-  i += tlv_read_length(&frame->payload[i], &end);
-  end += i;
 
-  ieee802_15_4_frame_t tx_frame;
-  osnp_initialize_response_frame(frame, &tx_frame, tx_frame_buf);
+  if (!tlv_reader_has_next(params)) {
+    ctx->subscriptions_len = 0;
+    return OSNP_SUCCESS;
+  }
 
-  uint16_t j = 0;
-  j += tlv_write_tag(&tx_frame.payload[j], 0xE1);
-  j += tlv_write_undefined_length(&tx_frame.payload[j]);
+  // items which are not subscribed are ignored, so the command can be repeated
+  while (tlv_reader_next(params, &tag, &len, &value)) {
+    osnp_subscription_t *sub = _osnp_find_subscription(OSNP_CTX_ARG_ tag);
 
-  while(i < end) {
-    osnp_process_command(frame, &i, &tx_frame, &j, (state >= ASSOCIATED));
+    if (sub) {
+      *sub = ctx->subscriptions[--ctx->subscriptions_len];
+    }
   }
 
-  j += tlv_write_undefined_length_terminator(&tx_frame.payload[j]);
-  tx_frame.payload_len = j;
-
-  osnp_transmit_frame(&tx_frame);
+  return params->error ? OSNP_UNSUPPORTED_PARAMETERS : OSNP_SUCCESS;
 }
 
-void osnp_frame_received_cb(uint8_t *frame_buf, int16_t frame_len) {
-  ieee802_15_4_frame_t frame;
-  osnp_parse_frame(frame_buf, frame_len, &frame);
+bool _osnp_subscription_due(osnp_subscription_t *sub, int32_t reading, uint32_t elapsed) {
+  if (!(sub->flags & OSNP_SUBSCRIPTION_REPORTED)) {
+    return true;
+  }
 
-  if (state == SCANNING_CHANNELS) {
-    state = WAITING_ASSOCIATION_REQUEST;
-  } else if (state == ASSOCIATED && EXTRACT_FCFRPEN(*frame.fc_low)) {
-    state = WAITING_PENDING_DATA;
+  if (sub->max_interval && elapsed >= sub->max_interval * 1000UL) {
+    return true;
   }
 
-  if (state >= ASSOCIATED) {
-    if (!EXTRACT_FCSECEN(*frame.fc_low)) {
-      osnp_start_poll_timer();
-      return;
-    }
+  if (elapsed < sub->min_interval * 1000UL || reading == sub->reported) {
+    return false;
+  }
 
-    uint32_t current_frame_counter;
-#ifdef LITTLE_ENDIAN
-    current_frame_counter = *((uint32_t *) frame.frame_counter);
-#else
-    current_frame_counter = frame.frame_counter[3] << 24 | frame.frame_counter[2] << 16 | frame.frame_counter[1] << 8 | frame.frame_counter[0];
-#endif
+  // the magnitudes are computed unsigned, so readings far apart do not overflow
+  uint32_t moved = reading > sub->reported ? (uint32_t) reading - (uint32_t) sub->reported : (uint32_t) sub->reported - (uint32_t) reading;
+  uint32_t base = sub->reported < 0 ? 0 - (uint32_t) sub->reported : (uint32_t) sub->reported;
+  uint8_t against = (reading > sub->reported) ? OSNP_SUBSCRIPTION_FELL : OSNP_SUBSCRIPTION_ROSE;
 
-    if (current_frame_counter <= rx_frame_counter) {
-      _osnp_send_frame_counter(&frame);
-      return;
-    } else {
-      rx_frame_counter = current_frame_counter;
-      if (rx_frame_counter >= rx_saved_frame_counter) {
-        rx_saved_frame_counter += OSNP_FRAME_COUNTER_WINDOW;
-        osnp_write_rx_frame_counter((uint8_t *) &rx_saved_frame_counter);
-      }
+  if (sub->flags & against) {
+    if (moved <= sub->hysteresis) {
+      return false;
     }
+
+    moved -= sub->hysteresis;
   }
-  
-  switch (EXTRACT_FCFRTYP(*frame.fc_low)) {
-    case FCFRTYP_DATA:
-      _osnp_data_frame_received_cb(&frame);
-      break;
-    case FCFRTYP_MCMD:
-      _osnp_mac_command_frame_received_cb(&frame);
-      break;
-  }
-}
 
-void osnp_frame_sent_cb(uint8_t status) {
-  //todo: add error handling
+  if (!sub->change && !sub->change_percent) {
+    return true;
+  }
 
-  switch(state) {
-    case SCANNING_CHANNELS:
-      osnp_start_channel_scanning_timer();
-      break;
-    case WAITING_ASSOCIATION_REQUEST:
-      osnp_start_association_wait_timer();
-      break;
-    case ASSOCIATED:
-    case WAITING_PENDING_DATA:
-      if ((status == OSNP_TX_STATUS_OK) && osnp_get_pending_frames()) {
-        state = WAITING_PENDING_DATA;
-        osnp_load_rx_key(tx_frame_buf);
-        osnp_load_tx_key(tx_frame_buf);
-        osnp_start_pending_data_wait_timer();
-      } else {
-        state = ASSOCIATED;
-        osnp_start_poll_timer();
-      }
-      break;
+  if (sub->change && moved >= sub->change) {
+    return true;
   }
+
+  return sub->change_percent && moved >= (base / 100) * sub->change_percent + (base % 100) * sub->change_percent / 100;
 }
 
-void osnp_poll() {
-  ieee802_15_4_frame_t tx_frame;
-  uint8_t fc_low = FCFRTYP(FCFRTYP_MCMD) | FCREQACK;
-  uint8_t fc_high = FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_SHORT);
+/*
+ * Marks the subscribed items which are due and keeps the readings taken, which _osnp_commit_due_items makes the
+ * reported values. Returns whether anything is to be sent, which without subscriptions is always the case.
+ */
+bool _osnp_select_due_items(OSNP_CTX_PARAM) {
+  uint32_t now = OSNP_CLOCK();
+  bool due = !ctx->subscriptions_len;
 
-  osnp_initialize_frame(fc_low, fc_high, tx_frame_buf, &tx_frame);
-  tx_frame.payload[0] = OSNP_MCMD_DATA_REQ;
-  tx_frame.payload_len = 1;
-  
-  osnp_transmit_frame(&tx_frame);
-}
+  for (uint8_t i = 0; i < ctx->subscriptions_len; i++) {
+    osnp_subscription_t *sub = &ctx->subscriptions[i];
+    int32_t reading;
 
-void osnp_send_notification(void) {
-  if (state < ASSOCIATED) {
-    return;
+    sub->flags &= ~OSNP_SUBSCRIPTION_DUE;
+
+    if (!osnp_read_item(OSNP_CTX_ARG_ sub->tag, &reading) || !_osnp_subscription_due(sub, reading, now - sub->reported_at)) {
+      continue;
+    }
+
+    sub->flags |= OSNP_SUBSCRIPTION_DUE;
+    sub->reading = reading;
+    due = true;
   }
 
-  ieee802_15_4_frame_t tx_frame;
-  uint8_t fc_low = FCFRTYP(FCFRTYP_DATA) | FCREQACK;
-  uint8_t fc_high = FCDSTADDR(FCADDR_NONE) | FCSRCADDR(FCADDR_EXT);
+  return due;
+}
 
-  osnp_initialize_frame(fc_low, fc_high, tx_frame_buf, &tx_frame);
+/*
+ * Ends the notification built for the due items: if it was queued or sent their readings become the reported
+ * values, otherwise they are left to be reported by a later notification.
+ */
+void _osnp_commit_due_items(OSNP_CTX_PARAM_ bool sent) {
+  uint32_t now = OSNP_CLOCK();
 
-  uint16_t j = 0;
-  j += tlv_write_tag(&tx_frame.payload[j], 0xE2);
-  j += tlv_write_undefined_length(&tx_frame.payload[j]);
+  for (uint8_t i = 0; i < ctx->subscriptions_len; i++) {
+    osnp_subscription_t *sub = &ctx->subscriptions[i];
 
-  osnp_build_notification(&tx_frame, &j);
+    if (!(sub->flags & OSNP_SUBSCRIPTION_DUE)) {
+      continue;
+    }
 
-  j += tlv_write_undefined_length_terminator(&tx_frame.payload[j]);
-  tx_frame.payload_len = j;
+    sub->flags &= ~OSNP_SUBSCRIPTION_DUE;
 
-  osnp_transmit_frame(&tx_frame);
-}
+    if (!sent) {
+      continue;
+    }
 
-uint8_t *_osnp_parse_header(uint8_t *buf, ieee802_15_4_frame_t *frame) {
-  frame->backing_buffer = buf;
-  frame->fc_low = buf++;
-  frame->fc_high = buf++;
-  frame->seq_no = buf++;
+    if (sub->reading != sub->reported || !(sub->flags & OSNP_SUBSCRIPTION_REPORTED)) {
+      sub->flags &= ~(OSNP_SUBSCRIPTION_ROSE | OSNP_SUBSCRIPTION_FELL);
 
-  if (EXTRACT_FCDSTADDR(*frame->fc_high) != FCADDR_NONE) {
-    frame->dst_pan = buf;
-    buf += 2;
-  } else {
-    frame->dst_pan = NULL;
-    frame->dst_addr = NULL;
+      if (sub->flags & OSNP_SUBSCRIPTION_REPORTED) {
+        sub->flags |= (sub->reading > sub->reported) ? OSNP_SUBSCRIPTION_ROSE : OSNP_SUBSCRIPTION_FELL;
+      }
+    }
+
+    sub->flags |= OSNP_SUBSCRIPTION_REPORTED;
+    sub->reported = sub->reading;
+    sub->reported_at = now;
   }
+}
 
-  if (EXTRACT_FCDSTADDR(*frame->fc_high) == FCADDR_SHORT) {
-    frame->dst_addr = buf;
-    buf += 2;
-  } else if (EXTRACT_FCDSTADDR(*frame->fc_high) == FCADDR_EXT) {
-    frame->dst_addr = buf;
-    buf += 8;
+bool osnp_ctx_item_due(OSNP_CTX_PARAM_ uint16_t tag) {
+  if (!ctx->subscriptions_len) {
+    return true;
   }
 
-  if (!((EXTRACT_FCSRCADDR(*frame->fc_high) == FCADDR_NONE) || EXTRACT_FCPANCOMP(*frame->fc_low))) {
-    frame->src_pan = buf;
-    buf += 2;
-  } else {
-    frame->src_pan = NULL;
+  osnp_subscription_t *sub = _osnp_find_subscription(OSNP_CTX_ARG_ tag);
+
+  return sub && (sub->flags & OSNP_SUBSCRIPTION_DUE);
+}
+#endif
+
+bool osnp_ctx_send_notification(OSNP_CTX_PARAM) {
+  if (ctx->state < ASSOCIATED) {
+    return false;
   }
 
-  if (EXTRACT_FCSRCADDR(*frame->fc_high) == FCADDR_SHORT) {
-    frame->src_addr = buf;
-    buf += 2;
-  } else if (EXTRACT_FCSRCADDR(*frame->fc_high) == FCADDR_EXT) {
-    frame->src_addr = buf;
-    buf += 8;
-  } else {
-    frame->src_addr = NULL;
+#ifdef OSNP_SUBSCRIPTIONS
+  if (!_osnp_select_due_items(OSNP_CTX_ARG)) {
+    return false;
   }
+#endif
 
-  frame->header_len = buf - frame->backing_buffer;
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+  bool was_empty = !ctx->notification_queue_len;
+  bool sent = _osnp_queue_notification(OSNP_CTX_ARG);
 
-  if (EXTRACT_FCSECEN(*frame->fc_low)) {
-    frame->frame_counter = buf;
-    buf += 4;
-    frame->key_counter = buf++;
-    frame->sec_header_len = 5;
-  } else {
-    frame->frame_counter = NULL;
-    frame->key_counter = NULL;
-    frame->sec_header_len = 0;
+  if (!sent) {
+    osnp_ctx_flush_notifications(OSNP_CTX_ARG);
+    was_empty = true;
+
+    // a notification longer than the queue, or finding the queue still full for want of a buffer, is dropped
+    sent = _osnp_queue_notification(OSNP_CTX_ARG);
   }
 
-  frame->payload = buf;
+  if (was_empty && ctx->notification_queue_len) {
+    osnp_start_notification_timer(OSNP_CTX_ARG);
+  }
+#else
+  bool sent = _osnp_transmit_notification(OSNP_CTX_ARG);
+#endif
 
-  return buf;
+  if (!sent) {
+    OSNP_STATS_INC(notification_drops);
+  }
+
+#ifdef OSNP_SUBSCRIPTIONS
+  _osnp_commit_due_items(OSNP_CTX_ARG_ sent);
+#endif
+
+  return sent;
 }
 
-void osnp_parse_frame(uint8_t *buf, uint16_t frame_len, ieee802_15_4_frame_t *frame) {
+bool osnp_parse_frame(uint8_t *buf, uint16_t frame_len, ieee802_15_4_frame_t *frame) {
+  frame->payload_len = 0;
+
+  // the frame control and sequence number are needed to know where the other fields are
+  if (frame_len < 3) {
+    return false;
+  }
+
   buf = _osnp_parse_header(buf, frame);
   
   // Remove mic and fcs, which is calculated/verified at a lower layer
-  frame->payload_len = frame_len - frame->header_len - 2;
+  uint16_t overhead = frame->header_len + 2;
 
   if (frame->sec_header_len) {
-    frame->payload_len -= OSNP_MIC_LENGTH - frame->sec_header_len;
+    overhead += OSNP_MIC_LENGTH + frame->sec_header_len;
   }
-}
-
-void osnp_initialize_frame(uint8_t fc_low, uint8_t fc_high, uint8_t *buf, ieee802_15_4_frame_t *frame) {
-  buf[0] = fc_low;
-  buf[1] = fc_high;
-  buf[2] = seq_no++;
-  buf = _osnp_parse_header(buf, frame);
-  frame->payload_len = 0;
 
-  if (frame->src_pan) {
-    memcpy(frame->src_pan, OSNP_PAN_ID, 2);
+  if (frame_len < overhead) {
+    return false;
   }
 
-  if (frame->src_addr) {
-    if (EXTRACT_FCSRCADDR(*frame->fc_high) == FCADDR_SHORT) {
-      memcpy(frame->src_addr, OSNP_SHORT_ADDRESS, 2);
-    } else {
-      memcpy(frame->src_addr, OSNP_EUI, 8);
-    }
-  }
+  frame->payload_len = frame_len - overhead;
 
-  if (EXTRACT_FCSECEN(*frame->fc_low)) {
-#ifdef LITTLE_ENDIAN
-    memcpy(frame->frame_counter, (uint8_t *) &tx_frame_counter, 4);
-#else
-    frame->frame_counter[3] = (tx_frame_counter & 0xff);
-    frame->frame_counter[2] = ((tx_frame_counter >> 8) & 0xff);
-    frame->frame_counter[1] = ((tx_frame_counter >> 16) & 0xff);
-    frame->frame_counter[0] = ((tx_frame_counter >> 24) & 0xff);
-#endif
-    tx_frame_counter++;
+  return true;
+}
 
-    if (tx_frame_counter >= tx_saved_frame_counter) {
-      tx_saved_frame_counter += OSNP_FRAME_COUNTER_WINDOW;
-      osnp_write_tx_frame_counter((uint8_t *) &tx_saved_frame_counter);
-    }
+void osnp_initialize_frame(OSNP_CTX_PARAM_ uint8_t fc_low, uint8_t fc_high, uint8_t *buf, ieee802_15_4_frame_t *frame) {
+  _osnp_fill_header(OSNP_CTX_ARG_ fc_low, fc_high, buf, frame);
+  buf[2] = ctx->seq_no++;
 
-    *frame->key_counter = 0x01;
+  if (EXTRACT_FCSECEN(fc_low)) {
+    _osnp_write_frame_counter(OSNP_CTX_ARG_ frame);
   }
 }
 
-void osnp_initialize_response_frame(ieee802_15_4_frame_t *src_frame, ieee802_15_4_frame_t *dst_frame, uint8_t *dst_buf) {
+void osnp_initialize_response_frame(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *src_frame, ieee802_15_4_frame_t *dst_frame, uint8_t *dst_buf) {
   uint8_t fc_low = (*src_frame->fc_low & ~(FCFRPEN | FCPANCOMP));
   uint8_t fc_high = FCSRCADDR(FCADDR_EXT);
 
-  if (state >= ASSOCIATED) {
+  if (ctx->state >= ASSOCIATED) {
     fc_low |= FCSECEN;
   } else {
     fc_high |= ((*src_frame->fc_high & 0xC0) >> 4);
   }
 
-  osnp_initialize_frame(fc_low, fc_high, dst_buf, dst_frame);
+  osnp_initialize_frame(OSNP_CTX_ARG_ fc_low, fc_high, dst_buf, dst_frame);
   
   if (dst_frame->dst_pan) {
     if (src_frame->src_pan) {
       memcpy(dst_frame->dst_pan, src_frame->src_pan, 2);
-    } else {
+    } else if (src_frame->dst_pan) {
       memcpy(dst_frame->dst_pan, src_frame->dst_pan, 2);
+    } else {
+      // PAN ID compression without a destination leaves the sender PAN unknown, the broadcast PAN reaches it
+      memset(dst_frame->dst_pan, 0xff, 2);
     }
   }
 
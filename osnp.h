@@ -26,6 +26,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "tlv.h"
+
 typedef struct {
     uint8_t *backing_buffer;
     uint16_t header_len;
@@ -43,6 +45,10 @@ typedef struct {
     uint8_t *payload;
 } ieee802_15_4_frame_t;
 
+/* Frame sizes */
+#define IEEE802_15_4_MAX_FRAME_LEN 127
+#define IEEE802_15_4_FCS_LEN 2
+
 /* Frame type */
 #define FCFRTYP_BEACON	0x00
 #define FCFRTYP_DATA	0x01
@@ -101,11 +107,27 @@ typedef struct {
 #define OSNP_UNSUBSCRIBE 0xA5
 
 /* OSNP Errors */
+#define OSNP_SUCCESS 0x00
 #define OSNP_UNSUPPORTED_COMMAND 0x01
 #define OSNP_UNSUPPORTED_PARAMETERS 0x02
 #define OSNP_SECURITY_ERROR 0x03
 #define OSNP_DEVICE_BUSY 0x04
 
+/* OSNP Response Tags */
+#define OSNP_ERROR_TAG 0x80
+#define OSNP_BULK_TRANSFER_TAG 0x81
+
+/* Data object of OSNP_GET_DATA answered by the stack itself when built with OSNP_STATS, and the osnp_stats_t fields
+ * answered per object */
+#define OSNP_STATS_TAG 0xDF7F
+#define OSNP_STATS_PAGE_FIELDS 11
+
+/* Bulk transfer containers and fragment flags */
+#define OSNP_BULK_FRAGMENT_TAG 0xE3
+#define OSNP_BULK_ACK_TAG 0xE4
+#define OSNP_BULK_LAST 0x80
+#define OSNP_BULK_ACK_REQ 0x40
+
 /* MAC Commands */
 #define OSNP_MCMD_ASSOCIATION_REQ 0x01
 #define OSNP_MCMD_ASSOCIATION_RES 0x02
@@ -115,57 +137,637 @@ typedef struct {
 #define OSNP_MCMD_KEY_UPDATE_REQ 0x80
 #define OSNP_MCMD_KEY_UPDATE_RES 0x81
 #define OSNP_MCMD_FRAME_COUNTER_ALIGN 0x82
+#define OSNP_MCMD_POLL_SLOT 0x83
+#define OSNP_MCMD_GROUP 0x84
 
 /* Transmission Status */
 #define OSNP_TX_STATUS_OK 0
 #define OSNP_TX_STATUS_NOACK 1
 #define OSNP_TX_STATUS_CHANNEL_BUSY 2
 
+/* Transmission classes, in order of priority */
+#define OSNP_TX_CLASS_MCMD 0
+#define OSNP_TX_CLASS_RESPONSE 1
+#define OSNP_TX_CLASS_NOTIFICATION 2
+
+/* Stack States */
+#define SCANNING_CHANNELS 0
+#define WAITING_ASSOCIATION_REQUEST 1
+#define ASSOCIATED 2
+#define WAITING_PENDING_DATA 3
+
+/* Keys loaded in the radio or crypto engine */
+#define OSNP_KEYS_NONE 0
+#define OSNP_KEYS_MASTER 1
+#define OSNP_KEYS_SESSION 2
+#define OSNP_KEYS_GROUP 3 // the key of group i is OSNP_KEYS_GROUP + i
+
+/* Group flags */
+#define OSNP_GROUP_RESPOND 0x01
+
 /* Device Capabilities */
 #define RX_POLL_DRIVEN 0x00
 #define RX_ALWAYS_ON 0x01
+#define POLL_SLOTS 0x02
+
+/* Header templates, see _osnp_build_header_templates */
+#define OSNP_TEMPLATE_POLL 0
+#define OSNP_TEMPLATE_NOTIFICATION 1
+#define OSNP_TEMPLATE_SECURED_MCMD 2
+#ifdef OSNP_BULK_WINDOW
+#define OSNP_TEMPLATE_SECURED_DATA 3
+#define OSNP_HEADER_TEMPLATES 4
+#else
+#define OSNP_HEADER_TEMPLATES 3
+#endif
+
+/* Frame control, sequence number, source PAN ID and extended source address */
+#define OSNP_HEADER_TEMPLATE_LEN 13
+
+/*
+ * Transmit pool. Frames are built in one of OSNP_TX_POOL_LEN (1 to 8, default 1) buffers of 128 bytes and handed to
+ * the radio one at a time, in the order they were built: osnp_transmit_frame is only called again once
+ * osnp_frame_sent_cb has reported the previous frame, so the driver must report every frame it was given. Defining
+ * OSNP_TX_POOL_LEN (for all translation units, like OSNP_MULTI_INSTANCE) above 1 lets responses and notifications be
+ * built while another frame is in flight and sent back-to-back. A frame for which no buffer is free is not sent.
+ *
+ * Queued frames are sent by class: MAC commands (including polls) first, then command responses, then notifications,
+ * in the order they were built within a class. A frame failing with OSNP_TX_STATUS_NOACK or
+ * OSNP_TX_STATUS_CHANNEL_BUSY is sent again, ahead of the queue, up to OSNP_MCMD_RETRIES, OSNP_RESPONSE_RETRIES or
+ * OSNP_NOTIFICATION_RETRIES times (defaults 2, 2 and 1); the stack state machine only sees the final outcome. If
+ * OSNP_TX_BACKOFF is defined in config.h, a frame which found the channel busy is sent again after a random delay,
+ * doubling in range with each attempt, given in milliseconds to
+ *
+ *   void osnp_start_backoff_timer(OSNP_CTX_PARAM_ uint16_t delay);
+ *
+ * whose expiry must be reported through osnp_backoff_timer_expired_cb. Otherwise it is sent again right away, relying
+ * on the CSMA-CA of the radio. The final outcome of every frame can be reported to the application by defining
+ * OSNP_DELIVERY_HANDLER in config.h as the name of a function with this signature:
+ *
+ *   void my_delivery_handler(OSNP_CTX_PARAM_ uint8_t tx_class, uint8_t status);
+ */
+#ifndef OSNP_TX_POOL_LEN
+#define OSNP_TX_POOL_LEN 1
+#endif
+
+/**
+ * A cursor through which osnp_build_bulk writes the content of a bulk transfer. Only the part of the stream falling
+ * in the fragment being built is kept, so the content is written from the start for every fragment and must be the
+ * same every time.
+ */
+typedef struct {
+    uint8_t *buf;
+    uint32_t skip;
+    uint8_t pos;
+    uint8_t cap;
+    bool more;
+} osnp_bulk_writer_t;
+
+/**
+ * The header of a frame kind the stack sends on its own, without sequence number and auxiliary security header,
+ * with the offsets of its source fields (0 if absent) and the length of the auxiliary security header following it.
+ * Templates have no destination.
+ */
+typedef struct {
+    uint8_t header[OSNP_HEADER_TEMPLATE_LEN];
+    uint8_t header_len;
+    uint8_t src_pan;
+    uint8_t src_addr;
+    uint8_t sec_header_len;
+} osnp_header_template_t;
+
+/**
+ * Counters kept by the stack when built with OSNP_STATS. They run freely from osnp_initialize and wrap around.
+ */
+typedef struct {
+    uint32_t rx_frames;
+    uint32_t rx_malformed;
+    uint32_t tx_frames[4];
+    uint32_t tx_bytes[4];
+    uint32_t tx_status[3];
+    uint32_t replay_rejects;
+    uint32_t frame_counter_aligns;
+    uint32_t counter_log_writes;
+    uint32_t scan_cycles;
+    uint32_t state_time[4];
+    uint32_t notification_drops;
+} osnp_stats_t;
+
+/**
+ * A data item subscribed by the hub, with its reporting conditions, the last value reported and the reading taken
+ * for the notification being built, which becomes the reported value once the notification is queued. Intervals are
+ * in seconds, 0 meaning no limit.
+ */
+typedef struct {
+    uint16_t tag;
+    uint16_t min_interval;
+    uint16_t max_interval;
+    uint16_t change;
+    uint16_t hysteresis;
+    uint8_t change_percent;
+    uint8_t flags;
+    int32_t reported;
+    uint32_t reported_at;
+    int32_t reading;
+} osnp_subscription_t;
+
+/**
+ * A group the device is a member of, with the counter expected on the next group frame. A free entry has the
+ * broadcast address.
+ */
+typedef struct {
+    uint8_t address[2];
+    uint8_t flags;
+    uint32_t rx_frame_counter;
+} osnp_group_t;
+
+/**
+ * The state of an OSNP stack instance.
+ */
+typedef struct {
+    uint8_t pan_id[2];
+    uint8_t short_address[2];
+    uint8_t eui[8];
+    uint8_t tx_pool[OSNP_TX_POOL_LEN][128];
+    uint8_t tx_pool_used;
+    uint8_t tx_queue[OSNP_TX_POOL_LEN];
+    uint8_t tx_queue_payload_len[OSNP_TX_POOL_LEN];
+    uint8_t tx_queue_class[OSNP_TX_POOL_LEN];
+    uint8_t tx_queue_len;
+    uint8_t tx_in_flight;
+    uint8_t tx_in_flight_payload_len;
+    uint8_t tx_in_flight_class;
+    uint8_t tx_attempts;
+    uint16_t tx_backoff_seed;
+    bool tx_busy;
+    osnp_header_template_t header_templates[OSNP_HEADER_TEMPLATES];
+    uint8_t seq_no;
+    uint8_t state;
+    volatile uint8_t loaded_keys;
+    uint8_t channel;
+    uint8_t last_channel;
+    uint8_t scan_order[16];
+    uint8_t scan_index;
+    uint16_t scan_quiet;
+    uint16_t hub_channels;
+    uint32_t rx_frame_counter;
+    uint32_t tx_frame_counter;
+    uint32_t rx_saved_frame_counter;
+    uint32_t tx_saved_frame_counter;
+    uint32_t rx_replay_bitmap;
+    uint32_t frame_counter_window;
+    uint32_t counter_log_elapsed;
+    uint8_t counter_log_slot;
+    uint8_t counter_log_seq;
+    bool frame_counter_align_sent;
+    uint32_t poll_interval;
+    uint32_t poll_interval_min;
+    uint32_t poll_interval_max;
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+    uint8_t notification_queue[OSNP_NOTIFICATION_QUEUE_LEN];
+    uint8_t notification_queue_len;
+    bool poll_after_flush;
+#endif
+#ifdef OSNP_BULK_WINDOW
+    uint16_t bulk_base;
+    uint16_t bulk_next;
+    uint16_t bulk_last;
+    uint8_t bulk_acked;
+    uint8_t bulk_id;
+    uint8_t bulk_source;
+    uint8_t bulk_tag;
+    uint8_t bulk_idle_polls;
+    bool bulk_active;
+#endif
+#ifdef OSNP_RX_RING_LEN
+    uint8_t rx_ring[OSNP_RX_RING_LEN][128];
+    uint8_t rx_ring_frame_len[OSNP_RX_RING_LEN];
+    volatile uint8_t rx_ring_head;
+    volatile uint8_t rx_ring_tail;
+    volatile uint16_t rx_ring_dropped;
+#endif
+#ifdef OSNP_STATS
+    osnp_stats_t stats;
+    uint32_t stats_clock;
+#endif
+#ifdef OSNP_SUBSCRIPTIONS
+    osnp_subscription_t subscriptions[OSNP_SUBSCRIPTIONS];
+    uint8_t subscriptions_len;
+#endif
+#ifdef OSNP_GROUPS
+    osnp_group_t groups[OSNP_GROUPS];
+#endif
+#ifdef OSNP_POLL_SLOTS
+    uint16_t slot_period;
+    uint32_t slot_at;
+    uint32_t polled_at;
+#endif
+#ifdef OSNP_MULTI_INSTANCE
+    void *user_data;
+#endif
+} osnp_ctx_t;
+
+/*
+ * Instance selection. When OSNP_MULTI_INSTANCE is defined (it must be defined for all translation units, usually
+ * on the compiler command line) the stack API is available as osnp_ctx_* functions taking the instance to operate
+ * on, and every config.h callback receives that instance as its first parameter. Otherwise the stack runs a single
+ * static instance, the osnp_* functions below are the implementation itself and config.h callbacks take no instance
+ * parameter, so that the generated code is the same as when the state was kept in plain globals.
+ *
+ * The OSNP_CTX_* macros expand to the instance parameter/argument where needed and must be used to declare the
+ * callbacks in config.h.
+ */
+#ifdef OSNP_MULTI_INSTANCE
+#define OSNP_CTX_PARAM osnp_ctx_t *ctx
+#define OSNP_CTX_PARAM_ osnp_ctx_t *ctx,
+#define OSNP_CTX_ARG ctx
+#define OSNP_CTX_ARG_ ctx,
+#else
+#define OSNP_CTX_PARAM void
+#define OSNP_CTX_PARAM_
+#define OSNP_CTX_ARG
+#define OSNP_CTX_ARG_
+
+#define osnp_ctx_initialize osnp_initialize
+#define osnp_ctx_timer_expired_cb osnp_timer_expired_cb
+#define osnp_ctx_frame_received_cb osnp_frame_received_cb
+#define osnp_ctx_frame_sent_cb osnp_frame_sent_cb
+#define osnp_ctx_backoff_timer_expired_cb osnp_backoff_timer_expired_cb
+#define osnp_ctx_poll osnp_poll
+#define osnp_ctx_invalidate_keys osnp_invalidate_keys
+#define osnp_ctx_send_notification osnp_send_notification
+#define osnp_ctx_flush_notifications osnp_flush_notifications
+#define osnp_ctx_process osnp_process
+#define osnp_ctx_start_bulk_transfer osnp_start_bulk_transfer
+#define osnp_ctx_get_poll_interval osnp_get_poll_interval
+#define osnp_ctx_get_poll_interval_bounds osnp_get_poll_interval_bounds
+#define osnp_ctx_set_poll_interval_bounds osnp_set_poll_interval_bounds
+#define osnp_ctx_get_stats osnp_get_stats
+#define osnp_ctx_item_due osnp_item_due
+#define osnp_ctx_select_rx_key osnp_select_rx_key
+#endif
+
+/*
+ * Channel scanning. A device looking for a hub listens first on the channel of its last association, then on the
+ * other channels where it has seen a hub (including those in the OSNP_HUB_CHANNELS bitmask of config.h), then on the
+ * remaining ones. osnp_start_channel_scanning_timer receives how long to listen, in milliseconds: OSNP_SCAN_DWELL,
+ * or OSNP_SCAN_DWELL_QUIET for quiet channels. If OSNP_ENERGY_DETECT is defined in config.h, the stack calls
+ *
+ *   uint8_t osnp_energy_detect(OSNP_CTX_PARAM_ uint8_t channel);
+ *
+ * to measure the remaining channels at the start of each pass: they are scanned loudest first, and in the first pass
+ * after the scan starts those measuring at most OSNP_ENERGY_DETECT_QUIET are quiet. A channel whose hub is idle
+ * measures quiet as well, so the following passes listen to every channel for OSNP_SCAN_DWELL.
+ */
+
+/*
+ * Frame counter persistence. Instead of storing the frame counters at fixed addresses, the stack keeps a log of
+ * OSNP_COUNTER_LOG_RECORDS (default 4) records of OSNP_COUNTER_LOG_RECORD_LEN bytes in a dedicated EEPROM region,
+ * accessed through
+ *
+ *   void osnp_read_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len);
+ *   void osnp_write_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len);
+ *
+ * where offset is relative to the start of the region. Each record reserves a window of counter values for both
+ * directions, starting at OSNP_FRAME_COUNTER_WINDOW and adapted to the traffic up to OSNP_FRAME_COUNTER_WINDOW_MAX
+ * so that a new record is written about every OSNP_COUNTER_LOG_PERIOD milliseconds. A blank region (all 0xff), or
+ * one without any valid record, is recovered as both counters at zero by a device which is not associated. An
+ * associated device cannot know which counters it has used, so it forgets the association and scans for the hub,
+ * which hands out new keys when it associates again: devices updated from a firmware keeping the counters elsewhere
+ * associate again once.
+ */
+#define OSNP_COUNTER_LOG_RECORD_LEN 10
+
+/*
+ * Replay protection. Secured frames are accepted once each, in any order, as long as their frame counter is within
+ * the last OSNP_REPLAY_WINDOW (1 to 32, default 32) counter values received: duplicates are dropped silently.
+ * Older frames make the device send its expected counter to the hub with OSNP_MCMD_FRAME_COUNTER_ALIGN, at most
+ * once per poll interval.
+ */
+
+/*
+ * Notification batching. When OSNP_NOTIFICATION_QUEUE_LEN is defined (for all translation units, like
+ * OSNP_MULTI_INSTANCE) osnp_send_notification does not transmit: the data items built by osnp_build_notification
+ * are added to a queue of that many bytes, replacing any queued item with the same tag, and are sent together in
+ * a single notification frame when the queue cannot take the next items, when the notification timer started
+ * through the osnp_start_notification_timer callback expires, or at the next poll. The queue must not be longer than
+ * the payload of a notification frame minus the 2 bytes of the 0xE2 container (101 bytes with a 4-byte MIC): a
+ * longer queue fails the build.
+ */
+
+/*
+ * Bulk transfer. When OSNP_BULK_WINDOW is defined (for all translation units, like OSNP_MULTI_INSTANCE, from 1 to 8)
+ * a 0xE1 or 0xE2 container too large for a frame can be streamed to the hub with osnp_start_bulk_transfer. The
+ * stack writes the container with indefinite length and calls
+ *
+ *   void osnp_build_bulk(OSNP_CTX_PARAM_ uint8_t source, osnp_bulk_writer_t *writer);
+ *
+ * from config.h to write its content for each fragment, so the content is never held in RAM. Each fragment is a
+ * secured data frame carrying
+ *
+ *   E3 <len> <transfer id> <flags | fragment number, 14 bits big endian> <data>
+ *
+ * with OSNP_BULK_LAST on the final fragment and OSNP_BULK_ACK_REQ on the last one sent in a round. Up to
+ * OSNP_BULK_WINDOW fragments are sent back-to-back, then the hub answers with
+ *
+ *   E4 04 <transfer id> <first fragment missing, 16 bits big endian> <bitmap>
+ *
+ * where bit n of the bitmap tells that fragment first + 1 + n has arrived too. The window then moves and only the
+ * missing fragments are sent again. A round left unacknowledged is sent again at the next poll, and the transfer is
+ * abandoned after OSNP_BULK_RETRIES (default 4) polls without progress. A command handler streaming its results
+ * starts the transfer with the 0xE1 tag and answers with the transfer id in an OSNP_BULK_TRANSFER_TAG object.
+ */
+
+/*
+ * Deferred reception. When OSNP_RX_RING_LEN is defined (for all translation units, like OSNP_MULTI_INSTANCE, as a
+ * power of 2 from 2 to 128) osnp_frame_received_cb only copies the frame into a ring of that many 128-byte buffers,
+ * so it can be called from the radio interrupt, and the frames are handled by osnp_process from the main loop.
+ * The interrupt only writes the head of the ring and osnp_process only the tail, so no locking is needed, but the
+ * other callbacks must not preempt osnp_process. Frames arriving with the ring full, or with a length outside 0 to
+ * 127, are dropped and counted in rx_ring_dropped. Without OSNP_RX_RING_LEN frames are handled within
+ * osnp_frame_received_cb.
+ */
+
+/*
+ * Statistics. When OSNP_STATS is defined (for all translation units, like OSNP_MULTI_INSTANCE) the stack counts in
+ * the stats field of its context the frames received, those dropped as malformed and as replays, the transmission
+ * attempts and the bytes they put on air by state, their outcome by OSNP_TX_STATUS_*, the frame counter alignments
+ * sent, the counter log writes and the completed scans of all channels. If config.h also defines OSNP_CLOCK()
+ * as an expression giving a free running time in milliseconds, the time spent in each state is accumulated in
+ * state_time, indexed by state. Last, notification_drops counts the notifications osnp_send_notification could
+ * neither queue nor send. energy.c turns these figures into a radio energy estimate.
+ *
+ * The statistics are read in pages of OSNP_STATS_PAGE_FIELDS fields, so that each fits a response whatever the hub
+ * address and the MIC length. A secured OSNP_GET_DATA command whose first parameter is an OSNP_STATS_TAG object,
+ * whose value is the 1-byte page number or empty for page 0, is answered by the stack with an OSNP_STATS_TAG object
+ * holding the page number followed by the fields of osnp_stats_t in order from OSNP_STATS_PAGE_FIELDS times the page
+ * number on, each as a 4-byte big-endian number: fields 0 to 10 in page 0 and 11 to 21 in page 1 (45 bytes each).
+ * Whatever OSNP_GET_DATA_HANDLER returns for the remaining parameters, if any, follows. A page past the last fields
+ * is answered with OSNP_UNSUPPORTED_PARAMETERS. Without OSNP_STATS neither the counters nor the code updating them
+ * are compiled.
+ */
+
+/*
+ * Subscriptions. When OSNP_SUBSCRIPTIONS is defined (for all translation units, like OSNP_MULTI_INSTANCE, as the
+ * number of data items which can be subscribed, from 1 to 32) the stack implements OSNP_SUBSCRIBE and
+ * OSNP_UNSUBSCRIBE itself and decides which data items osnp_send_notification reports. config.h must then define
+ * OSNP_CLOCK() and must not define OSNP_SUBSCRIBE_HANDLER or OSNP_UNSUBSCRIBE_HANDLER, and the device provides
+ *
+ *   bool osnp_read_item(OSNP_CTX_PARAM_ uint16_t tag, int32_t *value);
+ *
+ * returning the current reading of a data item, or false if the device has no such item. Each parameter of a
+ * secured OSNP_SUBSCRIBE is a primitive object tagged with the data item, whose value holds, as big-endian numbers,
+ *
+ *   <min interval, 16 bits> <max interval, 16 bits> <change, 16 bits> <change percent, 8 bits> <hysteresis, 16 bits>
+ *
+ * where fields left out at the end are 0. Subscribing an item again changes its conditions. OSNP_UNSUBSCRIBE takes
+ * the tags of the items to drop, or no parameter to drop them all; subscriptions are also dropped when the device
+ * leaves the network. Every time the application calls osnp_send_notification each subscribed item is read and is
+ * due if it has not been reported yet, if max interval has elapsed since its last report, or if min interval has
+ * elapsed and it moved from the last reported value by at least change or by at least change percent of that value
+ * (by any amount if both are 0). A move back against the previous reported one must exceed the threshold by
+ * hysteresis too, so noise around a level is not reported. If no item is due nothing is sent, otherwise
+ * osnp_build_notification writes only the items for which osnp_item_due returns true. Without subscriptions every
+ * item is due, so a device behaves as without OSNP_SUBSCRIPTIONS until the hub subscribes.
+ */
+
+/*
+ * Poll slots. When OSNP_POLL_SLOTS is defined (for all translation units, like OSNP_MULTI_INSTANCE) the device
+ * reports POLL_SLOTS among its capabilities in OSNP_MCMD_ASSOCIATION_RES and lets the hub spread the polls of its
+ * devices over time instead of having them collide. config.h must then define OSNP_CLOCK(). The hub assigns a slot
+ * by appending to OSNP_MCMD_ASSOCIATION_REQ, or sending later in a secured OSNP_MCMD_POLL_SLOT, the big-endian fields
+ *
+ *   <period, 16 bits> <delay, 16 bits>
+ *
+ * in milliseconds: the next slot starts delay after the frame is received and the following ones every period, with
+ * a period of 0 withdrawing the assignment. Polls are then moved to the slot nearest to the poll interval after the
+ * previous poll, so the interval still grows and shrinks with the traffic but in whole periods. The device clock
+ * drifts against the hub's and each poll is late by its CSMA backoff, so the hub is expected to check the arrival of
+ * the polls against the slot and send OSNP_MCMD_POLL_SLOT again when they move off it. The assignment is dropped
+ * when the device leaves the network or restarts, and it polls on its own interval until the hub assigns a new one.
+ */
+
+/*
+ * Groups. When OSNP_GROUPS is defined (for all translation units, like OSNP_MULTI_INSTANCE, as the number of groups a
+ * device can be a member of) the hub can reach many devices with a single data frame, addressed to the short address
+ * of a group and secured with the key of the group. The hub makes a device join a group with a secured
+ *
+ *   OSNP_MCMD_GROUP <address, 2 bytes> <flags, 1 byte> <frame counter, 4 bytes LE> <key, 16 bytes>
+ *
+ * where the frame counter is the one of the next group frame, and makes it leave with the address alone, or leave
+ * every group with no parameter. Joining a group the device is a member of updates it; joins beyond OSNP_GROUPS are
+ * ignored. Group addresses are short addresses other than the broadcast one, not used by any device. Group frames
+ * carry 0xE0 commands only, with a frame counter of their own shared by the members, and members answer them only if
+ * the group has the OSNP_GROUP_RESPOND flag; the commands are run either way. Groups are dropped when the device
+ * leaves the network or restarts. The keys are kept by the device through
+ *
+ *   void osnp_write_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *key);
+ *   void osnp_load_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *tmp_buf);
+ *
+ * where group is the index of the entry, and osnp_load_group_key loads the key in the radio or crypto engine as the
+ * rx key, like osnp_load_rx_key. Since the key depends on the destination of the frame, the radio driver calls
+ * osnp_select_rx_key before the frame is decrypted, and the radio must not filter out the group addresses: a radio
+ * with a single short address filter is put in promiscuous mode, and the stack drops the frames of other devices.
+ * Only devices with the radio on receive a group frame, so the hub sends poll-driven members a unicast copy. With
+ * OSNP_RX_RING_LEN, osnp_select_rx_key runs in the radio interrupt while the main loop may be loading keys itself,
+ * so config.h must define OSNP_KEYS_LOCK() and OSNP_KEYS_UNLOCK() to mask and unmask that interrupt.
+ */
+
+/*
+ * Command handlers. A device implements a command by defining the matching OSNP_*_HANDLER macro in config.h as the
+ * name of a function with this signature, for example:
+ *
+ *   uint8_t my_get_data(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure);
+ *   #define OSNP_GET_DATA_HANDLER my_get_data
+ *
+ * The handlers are collected at compile time in a const table indexed by command tag. The handler reads the
+ * parameters of its own command from params and writes its results into response, which is already inside the
+ * response object carrying the command tag. It returns OSNP_SUCCESS or an OSNP error code: in the latter case
+ * anything it wrote is discarded and the response object only contains the OSNP_ERROR_TAG object with the code.
+ * Commands without a handler are answered with OSNP_UNSUPPORTED_COMMAND. The secure flag tells whether the command
+ * arrived in a secured frame, handlers must refuse commands requiring security with OSNP_SECURITY_ERROR.
+ *
+ * OSNP_GET_DEVICE_INFO_HANDLER, OSNP_CONFIGURE_HANDLER, OSNP_GET_DATA_HANDLER, OSNP_PERFORM_HANDLER,
+ * OSNP_SUBSCRIBE_HANDLER and OSNP_UNSUBSCRIBE_HANDLER can be defined.
+ */
+typedef uint8_t (*osnp_command_handler_t)(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure);
 
 /**
  * Initialize the OSNP state machine.
  */
-void osnp_initialize(void);
+void osnp_ctx_initialize(OSNP_CTX_PARAM);
 
 /**
  * Callback on any OSNP-related timer interrupt.
  */
-void osnp_timer_expired_cb(void);
+void osnp_ctx_timer_expired_cb(OSNP_CTX_PARAM);
 
-/** Callback on frame receive event */
-void osnp_frame_received_cb(uint8_t *frame_buf, int16_t frame_len);
+/** Callback on frame receive event. With OSNP_RX_RING_LEN the frame is only queued for osnp_process */
+void osnp_ctx_frame_received_cb(OSNP_CTX_PARAM_ uint8_t *frame_buf, int16_t frame_len);
 
-/** Callback on frame receive event */
-void osnp_frame_sent_cb(uint8_t status);
+/** Callback on frame sent event */
+void osnp_ctx_frame_sent_cb(OSNP_CTX_PARAM_ uint8_t status);
+
+/**
+ * Callback on expiry of the timer started by osnp_start_backoff_timer, only used with OSNP_TX_BACKOFF.
+ */
+void osnp_ctx_backoff_timer_expired_cb(OSNP_CTX_PARAM);
 
 /**
  * Polls the OSNP Hub asking if data is available.
  */
-void osnp_poll(void);
+void osnp_ctx_poll(OSNP_CTX_PARAM);
+
+/**
+ * Tells the stack that the keys loaded through osnp_load_master_key, osnp_load_rx_key and osnp_load_tx_key have been
+ * lost, for example because the radio has been powered down. The stack otherwise loads them only when they change.
+ */
+void osnp_ctx_invalidate_keys(OSNP_CTX_PARAM);
+
+/**
+ * Returns the interval, in milliseconds, passed to osnp_start_poll_timer. It drops to the minimum as soon as the hub
+ * signals pending data and doubles after every poll which finds none, up to the maximum. The bounds default to
+ * OSNP_POLL_INTERVAL_MIN and OSNP_POLL_INTERVAL_MAX from config.h; giving both the same value polls at a fixed rate.
+ *
+ * @return the current poll interval
+ */
+uint32_t osnp_ctx_get_poll_interval(OSNP_CTX_PARAM);
+
+/**
+ * Returns the bounds of the poll interval, in milliseconds.
+ *
+ * @param min the output minimum interval
+ * @param max the output maximum interval
+ */
+void osnp_ctx_get_poll_interval_bounds(OSNP_CTX_PARAM_ uint32_t *min, uint32_t *max);
+
+/**
+ * Sets the bounds of the poll interval, in milliseconds. The current interval is clamped to them and applies from
+ * the next poll.
+ *
+ * @param min the minimum interval, used while the hub has data for the device
+ * @param max the maximum interval, reached after consecutive empty polls
+ */
+void osnp_ctx_set_poll_interval_bounds(OSNP_CTX_PARAM_ uint32_t min, uint32_t max);
 
 /**
  * Constructs and send a notification. It will invoke osnp_build_notification callback to fill the
- * actual notification body
+ * actual notification body. With OSNP_NOTIFICATION_QUEUE_LEN the notification is queued instead, and the callback
+ * is invoked a second time if the queue had to be flushed to make room for it.
+ *
+ * @return false if nothing was sent, because the device is not associated, no subscribed item is due or the
+ *         notification could neither be queued nor sent
+ */
+bool osnp_ctx_send_notification(OSNP_CTX_PARAM);
+
+#ifdef OSNP_SUBSCRIPTIONS
+/**
+ * Tells osnp_build_notification whether a data item must be written in the notification being built.
+ *
+ * @param tag the tag of the data item
+ * @return true if the item is due, or if there are no subscriptions
+ */
+bool osnp_ctx_item_due(OSNP_CTX_PARAM_ uint16_t tag);
+#endif
+
+#ifdef OSNP_GROUPS
+/**
+ * Loads the rx key of a received frame in the radio or crypto engine, before it is decrypted: the key of the group
+ * for a frame addressed to one, otherwise the session keys if a group key had replaced them. It is called from the
+ * same context as osnp_frame_received_cb.
+ *
+ * @param frame_buf the received frame
+ * @param frame_len the length of the frame
+ * @return false if the frame is addressed to another device and must be dropped
+ */
+bool osnp_ctx_select_rx_key(OSNP_CTX_PARAM_ uint8_t *frame_buf, uint8_t frame_len);
+#endif
+
+#ifdef OSNP_STATS
+/**
+ * Returns the statistics of the instance, with the time of the current state accounted up to now.
+ *
+ * @return the statistics, valid until the next call into the stack
+ */
+const osnp_stats_t *osnp_ctx_get_stats(OSNP_CTX_PARAM);
+#endif
+
+#ifdef OSNP_NOTIFICATION_QUEUE_LEN
+/**
+ * Sends the queued notifications, if any. Must be called when the notification timer expires.
+ */
+void osnp_ctx_flush_notifications(OSNP_CTX_PARAM);
+#endif
+
+#ifdef OSNP_BULK_WINDOW
+/**
+ * Starts streaming a container built by osnp_build_bulk to the hub. Only one transfer runs at a time.
+ *
+ * @param source passed to osnp_build_bulk, to tell what to write
+ * @param tag the container tag, 0xE1 for command responses or 0xE2 for notifications
+ * @return the transfer id, never 0, or 0 if a transfer is running or the device is not associated
+ */
+uint8_t osnp_ctx_start_bulk_transfer(OSNP_CTX_PARAM_ uint8_t source, uint8_t tag);
+
+/**
+ * Writes raw bytes of a bulk transfer content.
+ *
+ * @param writer the writer
+ * @param data the bytes
+ * @param len the number of bytes
+ * @return false once the fragment being built is full, the rest of the content can then be skipped
+ */
+bool osnp_bulk_write(osnp_bulk_writer_t *writer, uint8_t *data, uint16_t len);
+
+/**
+ * Writes the tag and length of a TLV object, whose value is then written with osnp_bulk_write or further objects.
+ * Lengths must be known beforehand, since nothing can be back-patched in a stream.
+ *
+ * @param writer the writer
+ * @param tag the tag
+ * @param len the length of the value
+ * @return false once the fragment being built is full
+ */
+bool osnp_bulk_put_header(osnp_bulk_writer_t *writer, uint16_t tag, uint16_t len);
+
+/**
+ * Writes a primitive TLV object.
+ *
+ * @param writer the writer
+ * @param tag the tag
+ * @param value the value
+ * @param len the length of the value
+ * @return false once the fragment being built is full
+ */
+bool osnp_bulk_put(osnp_bulk_writer_t *writer, uint16_t tag, uint8_t *value, uint16_t len);
+#endif
+
+#ifdef OSNP_RX_RING_LEN
+/**
+ * Handles the frames queued by osnp_frame_received_cb up to the time of the call. Frames arriving meanwhile are left
+ * for the next call, so a burst of traffic cannot hold the main loop indefinitely.
+ *
+ * @return the number of frames handled
  */
-void osnp_send_notification(void);
+uint8_t osnp_ctx_process(OSNP_CTX_PARAM);
+#endif
 
 /**
  * Associates the given buffer to the frame and sets all pointers at the correct place for easy access to all fields
- * of the frame. No data is copied.
+ * of the frame. No data is copied. Only the first frame_len bytes of the buffer are read, but the pointers are only
+ * guaranteed to lie within them if the frame is valid.
  *
  * @param buf the buffer where the frame has been received
  * @param frame_len the total len of the received frame
  * @param frame a zero'ed frame structure
+ * @return true if the frame is long enough for its header, security fields, MIC and FCS
  */
-void osnp_parse_frame(uint8_t *buf, uint16_t frame_len, ieee802_15_4_frame_t *frame);
+bool osnp_parse_frame(uint8_t *buf, uint16_t frame_len, ieee802_15_4_frame_t *frame);
 
 /**
  * Initializes the frame with the given frame control and security control parameters. This sets all pointers
  * at the correct place according the Frame Control bytes. It also sets the sequence counter, and the source
- * address according to the Source Addressing Mode using the OSNP_PAN, OSNP_SHORT_ADDRESS and OSNP_EUI variables as needed.
+ * address according to the Source Addressing Mode using the PAN ID, short address and EUI of the instance as needed.
  * 
  * @param fc_low The low byte of the control frame
  * @param fc_high The high byte of the control frame
@@ -173,18 +775,18 @@ void osnp_parse_frame(uint8_t *buf, uint16_t frame_len, ieee802_15_4_frame_t *fr
  * @param buf The buffer backing this frame
  * @param frame The frame to initialize
  */
-void osnp_initialize_frame(uint8_t fc_low, uint8_t fc_high, uint8_t *buf, ieee802_15_4_frame_t *frame);
+void osnp_initialize_frame(OSNP_CTX_PARAM_ uint8_t fc_low, uint8_t fc_high, uint8_t *buf, ieee802_15_4_frame_t *frame);
 
 /**
  * Initializes the destination frame as a response to the source frame. This means copying most of the header, but the source becomes the destination
- * and the source uses the OSNP_PAN, OSNP_SHORT_ADDRESS and OSNP_EUI field, according to the addressing mode.
+ * and the source uses the PAN ID, short address and EUI of the instance, according to the addressing mode.
  * The security frame counter is also not copied.
  *
  * @param src_frame the source frame
  * @param dst_frame the destination frame
  * @param dst_buf the backing buffer of the destination frame
  */
-void osnp_initialize_response_frame(ieee802_15_4_frame_t *src_frame, ieee802_15_4_frame_t *dst_frame, uint8_t *dst_buf);
+void osnp_initialize_response_frame(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *src_frame, ieee802_15_4_frame_t *dst_frame, uint8_t *dst_buf);
 
 #endif	/* OSNP_H */
 
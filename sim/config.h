@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * OSNP configuration for the host simulator. Every device is an OSNP_MULTI_INSTANCE stack instance whose
+ * callbacks are implemented by device.c on top of the simulated clock, radio medium and EEPROM.
+ */
+
+#ifndef CONFIG_H
+#define	CONFIG_H
+
+#include "osnp.h"
+#include "tlv.h"
+
+#define OSNP_FRAME_COUNTER_WINDOW 64
+#define OSNP_COUNTER_LOG_RECORDS 8
+#define OSNP_MIC_LENGTH 4
+#define OSNP_SECURITY_LEVEL SL_AES_CCM_32
+#define OSNP_DEVICE_CAPABILITES sim_device_capabilities(ctx)
+#define OSNP_SCAN_DWELL sim_scan_dwell()
+#define OSNP_SCAN_DWELL_QUIET sim_scan_dwell_quiet()
+#define OSNP_ENERGY_DETECT
+#define OSNP_TX_BACKOFF
+#define OSNP_POLL_INTERVAL_MIN sim_poll_interval_min()
+#define OSNP_POLL_INTERVAL_MAX sim_poll_interval_max()
+#define OSNP_CLOCK() sim_clock_ms()
+
+// osnp_select_rx_key is called from the event loop, which never preempts osnp_process
+#define OSNP_KEYS_LOCK()
+#define OSNP_KEYS_UNLOCK()
+
+uint8_t sim_device_capabilities(osnp_ctx_t *ctx);
+uint32_t sim_scan_dwell(void);
+uint32_t sim_scan_dwell_quiet(void);
+uint32_t sim_poll_interval_min(void);
+uint32_t sim_poll_interval_max(void);
+uint32_t sim_clock_ms(void);
+
+#define OSNP_GET_DATA_HANDLER sim_get_data
+
+uint8_t sim_get_data(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure);
+
+#define OSNP_DELIVERY_HANDLER sim_delivery
+
+void sim_delivery(OSNP_CTX_PARAM_ uint8_t tx_class, uint8_t status);
+
+void osnp_load_eui(OSNP_CTX_PARAM_ uint8_t *eui);
+void osnp_load_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id);
+void osnp_load_short_address(OSNP_CTX_PARAM_ uint8_t *short_address);
+void osnp_load_channel(OSNP_CTX_PARAM_ uint8_t *channel);
+void osnp_load_master_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf);
+void osnp_load_rx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf);
+void osnp_load_tx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf);
+void osnp_read_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len);
+
+void osnp_write_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id);
+void osnp_write_short_address(OSNP_CTX_PARAM_ uint8_t *short_address);
+void osnp_write_channel(OSNP_CTX_PARAM_ uint8_t *channel);
+void osnp_write_rx_key(OSNP_CTX_PARAM_ uint8_t *key);
+void osnp_write_tx_key(OSNP_CTX_PARAM_ uint8_t *key);
+void osnp_write_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len);
+void osnp_write_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *key);
+void osnp_load_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *tmp_buf);
+
+void osnp_start_channel_scanning_timer(OSNP_CTX_PARAM_ uint32_t dwell);
+void osnp_start_association_wait_timer(OSNP_CTX_PARAM);
+void osnp_start_poll_timer(OSNP_CTX_PARAM_ uint32_t interval);
+void osnp_start_pending_data_wait_timer(OSNP_CTX_PARAM);
+void osnp_start_notification_timer(OSNP_CTX_PARAM);
+void osnp_start_backoff_timer(OSNP_CTX_PARAM_ uint16_t delay);
+void osnp_stop_active_timer(OSNP_CTX_PARAM);
+
+void osnp_switch_channel(OSNP_CTX_PARAM_ uint8_t channel);
+void osnp_transmit_frame(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame);
+bool osnp_get_pending_frames(OSNP_CTX_PARAM);
+uint8_t osnp_energy_detect(OSNP_CTX_PARAM_ uint8_t channel);
+
+void osnp_build_notification(OSNP_CTX_PARAM_ tlv_writer_t *notification);
+bool osnp_read_item(OSNP_CTX_PARAM_ uint16_t tag, int32_t *value);
+void osnp_build_bulk(OSNP_CTX_PARAM_ uint8_t source, osnp_bulk_writer_t *writer);
+
+#endif	/* CONFIG_H */
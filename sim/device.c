@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sim.h"
+#include "config.h"
+#include "tlv.h"
+
+#include <string.h>
+
+/*
+ * Simulated device: implements the config.h callbacks of an OSNP stack instance on top of the virtual clock,
+ * the simulated radio and an in-memory EEPROM, and runs a trivial sensor application on top of it.
+ */
+
+#define DEV(ctx) ((sim_device_t *) (ctx)->user_data)
+
+static uint32_t _sim_device_node(sim_device_t *dev) {
+  return dev->id + 1;
+}
+
+static void _sim_device_start_timer(sim_device_t *dev, sim_time_t duration) {
+  sim_schedule(sim.now + duration, SIM_EV_TIMER, _sim_device_node(dev), ++dev->timer_gen);
+}
+
+static void _sim_device_track_association(sim_device_t *dev) {
+  bool associated = dev->osnp.state >= ASSOCIATED;
+
+  if (associated && !dev->was_associated) {
+    if (dev->lost_association_time) {
+      sim_histogram_add(&sim.stats.reassociation_latency, sim.now - dev->lost_association_time);
+    } else {
+      sim_histogram_add(&sim.stats.association_latency, sim.now - dev->boot_time);
+    }
+  } else if (!associated && dev->was_associated) {
+    // the hub forgets the compact reference of a device which associates again
+    dev->lost_association_time = sim.now;
+    compact_encoder_init(&dev->compact);
+  }
+
+  dev->was_associated = associated;
+}
+
+bool sim_device_rx_on(sim_device_t *dev) {
+  // not booted yet
+  if (dev->osnp.user_data == NULL) {
+    return false;
+  }
+
+  return dev->always_on || dev->osnp.state != ASSOCIATED;
+}
+
+void sim_device_boot(sim_device_t *dev) {
+  dev->boot_time = sim.now;
+  dev->osnp.user_data = dev;
+  osnp_ctx_initialize(&dev->osnp);
+  compact_encoder_init(&dev->compact);
+  _sim_device_track_association(dev);
+
+  if (sim.config.notification_period) {
+    sim_schedule(sim.now + sim.config.notification_period, SIM_EV_APP, _sim_device_node(dev), 0);
+  }
+}
+
+void sim_device_timer_expired(sim_device_t *dev) {
+  osnp_ctx_timer_expired_cb(&dev->osnp);
+  _sim_device_track_association(dev);
+}
+
+void sim_device_frame_received(sim_device_t *dev, uint8_t *buf, uint16_t len) {
+  // like the security interrupt of the radio, before the frame is decrypted
+  if (!osnp_ctx_select_rx_key(&dev->osnp, buf, len)) {
+    return;
+  }
+
+  if (dev->osnp.loaded_keys >= OSNP_KEYS_GROUP) {
+    sim.stats.group_deliveries++;
+  }
+
+  // like the radio interrupt, this only queues the frame: the main loop handles it right after
+  osnp_ctx_frame_received_cb(&dev->osnp, buf, len);
+  sim_schedule(sim.now, SIM_EV_PROCESS, _sim_device_node(dev), 0);
+}
+
+void sim_device_process(sim_device_t *dev) {
+  osnp_ctx_process(&dev->osnp);
+  _sim_device_track_association(dev);
+}
+
+void sim_device_frame_sent(sim_device_t *dev, uint8_t status) {
+  if (dev->poll_in_flight) {
+    dev->poll_in_flight = false;
+
+    if (status == OSNP_TX_STATUS_OK && dev->radio.last_ack_pending) {
+      dev->polls_with_data++;
+    }
+  }
+
+  osnp_ctx_frame_sent_cb(&dev->osnp, status);
+  _sim_device_track_association(dev);
+}
+
+void sim_device_app_event(sim_device_t *dev) {
+  // slowly drifting reading
+  dev->sensor_value += (sim_random() % 3) - 1;
+
+  // with subscriptions, readings which did not change enough are not sent
+  if (osnp_ctx_send_notification(&dev->osnp)) {
+    dev->notifications++;
+  }
+
+  sim_time_t jitter = sim.config.notification_period / 10;
+  sim_time_t next = sim.config.notification_period - jitter + (jitter ? sim_random() % (2 * jitter) : 0);
+  sim_schedule(sim.now + next, SIM_EV_APP, _sim_device_node(dev), 0);
+}
+
+void sim_device_notification_timer_expired(sim_device_t *dev) {
+  osnp_ctx_flush_notifications(&dev->osnp);
+}
+
+void sim_device_backoff_timer_expired(sim_device_t *dev) {
+  osnp_ctx_backoff_timer_expired_cb(&dev->osnp);
+}
+
+void sim_delivery(OSNP_CTX_PARAM_ uint8_t tx_class, uint8_t status) {
+  if (status != OSNP_TX_STATUS_OK) {
+    sim.stats.undelivered[tx_class]++;
+  }
+
+  if (tx_class == OSNP_TX_CLASS_NOTIFICATION && DEV(ctx)->compact_in_flight) {
+    compact_encoder_delivered(&DEV(ctx)->compact, DEV(ctx)->compact_report, status == OSNP_TX_STATUS_OK);
+  }
+}
+
+uint8_t sim_device_capabilities(osnp_ctx_t *ctx) {
+  return DEV(ctx)->always_on ? RX_ALWAYS_ON : RX_POLL_DRIVEN;
+}
+
+uint32_t sim_scan_dwell(void) {
+  return sim.config.scan_time / 1000;
+}
+
+uint32_t sim_scan_dwell_quiet(void) {
+  return (sim.config.scan_time_quiet ? sim.config.scan_time_quiet : sim.config.scan_time) / 1000;
+}
+
+uint32_t sim_poll_interval_min(void) {
+  return sim.config.poll_time / 1000;
+}
+
+uint32_t sim_poll_interval_max(void) {
+  return (sim.config.poll_time_max > sim.config.poll_time ? sim.config.poll_time_max : sim.config.poll_time) / 1000;
+}
+
+uint32_t sim_clock_ms(void) {
+  return sim.now / 1000;
+}
+
+void osnp_load_eui(OSNP_CTX_PARAM_ uint8_t *eui) {
+  memcpy(eui, DEV(ctx)->eui, 8);
+}
+
+void osnp_load_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id) {
+  memcpy(pan_id, DEV(ctx)->eeprom.pan_id, 2);
+}
+
+void osnp_load_short_address(OSNP_CTX_PARAM_ uint8_t *short_address) {
+  memcpy(short_address, DEV(ctx)->eeprom.short_address, 2);
+}
+
+void osnp_load_channel(OSNP_CTX_PARAM_ uint8_t *channel) {
+  *channel = DEV(ctx)->eeprom.channel;
+}
+
+void osnp_load_master_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  DEV(ctx)->key_loads++;
+}
+
+void osnp_load_rx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memcpy(tmp_buf, DEV(ctx)->eeprom.rx_key, 16);
+  DEV(ctx)->key_loads++;
+}
+
+void osnp_load_tx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memcpy(tmp_buf, DEV(ctx)->eeprom.tx_key, 16);
+  DEV(ctx)->key_loads++;
+}
+
+void osnp_load_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *tmp_buf) {
+  memcpy(tmp_buf, DEV(ctx)->eeprom.group_keys[group], 16);
+  DEV(ctx)->key_loads++;
+}
+
+void osnp_read_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len) {
+  memcpy(buf, &DEV(ctx)->eeprom.counter_log[offset], len);
+}
+
+void osnp_write_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id) {
+  memcpy(DEV(ctx)->eeprom.pan_id, pan_id, 2);
+  DEV(ctx)->eeprom.writes++;
+}
+
+void osnp_write_short_address(OSNP_CTX_PARAM_ uint8_t *short_address) {
+  memcpy(DEV(ctx)->eeprom.short_address, short_address, 2);
+  DEV(ctx)->eeprom.writes++;
+}
+
+void osnp_write_channel(OSNP_CTX_PARAM_ uint8_t *channel) {
+  DEV(ctx)->eeprom.channel = *channel;
+  DEV(ctx)->eeprom.writes++;
+}
+
+void osnp_write_rx_key(OSNP_CTX_PARAM_ uint8_t *key) {
+  memcpy(DEV(ctx)->eeprom.rx_key, key, 16);
+  DEV(ctx)->eeprom.writes++;
+}
+
+void osnp_write_tx_key(OSNP_CTX_PARAM_ uint8_t *key) {
+  memcpy(DEV(ctx)->eeprom.tx_key, key, 16);
+  DEV(ctx)->eeprom.writes++;
+}
+
+void osnp_write_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *key) {
+  memcpy(DEV(ctx)->eeprom.group_keys[group], key, 16);
+  DEV(ctx)->eeprom.writes++;
+}
+
+void osnp_write_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len) {
+  sim_eeprom_t *eeprom = &DEV(ctx)->eeprom;
+
+  memcpy(&eeprom->counter_log[offset], buf, len);
+
+  for (uint16_t i = offset; i < offset + len; i++) {
+    eeprom->counter_log_wear[i]++;
+  }
+
+  eeprom->writes++;
+  eeprom->counter_writes++;
+}
+
+void osnp_start_channel_scanning_timer(OSNP_CTX_PARAM_ uint32_t dwell) {
+  _sim_device_start_timer(DEV(ctx), SIM_MS(dwell));
+}
+
+void osnp_start_association_wait_timer(OSNP_CTX_PARAM) {
+  _sim_device_start_timer(DEV(ctx), sim.config.association_wait_time);
+}
+
+void osnp_start_poll_timer(OSNP_CTX_PARAM_ uint32_t interval) {
+  _sim_device_start_timer(DEV(ctx), SIM_MS(interval));
+}
+
+void osnp_start_pending_data_wait_timer(OSNP_CTX_PARAM) {
+  _sim_device_start_timer(DEV(ctx), sim.config.pending_data_wait_time);
+}
+
+void osnp_start_notification_timer(OSNP_CTX_PARAM) {
+  sim_device_t *dev = DEV(ctx);
+  sim_schedule(sim.now + sim.config.notification_latency, SIM_EV_NOTIFICATION_TIMER, _sim_device_node(dev), ++dev->notification_timer_gen);
+}
+
+void osnp_start_backoff_timer(OSNP_CTX_PARAM_ uint16_t delay) {
+  sim_device_t *dev = DEV(ctx);
+  sim_schedule(sim.now + SIM_MS(delay), SIM_EV_BACKOFF_TIMER, _sim_device_node(dev), ++dev->backoff_timer_gen);
+}
+
+void osnp_stop_active_timer(OSNP_CTX_PARAM) {
+  DEV(ctx)->timer_gen++;
+}
+
+void osnp_switch_channel(OSNP_CTX_PARAM_ uint8_t channel) {
+  DEV(ctx)->radio.channel = channel;
+}
+
+void osnp_transmit_frame(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  sim_device_t *dev = DEV(ctx);
+  uint8_t buf[128];
+  uint16_t len = frame->header_len + frame->sec_header_len + frame->payload_len;
+
+  memcpy(buf, frame->backing_buffer, len);
+
+  // the radio appends the MIC (not computed here) and the FCS
+  if (frame->sec_header_len) {
+    memset(&buf[len], 0, OSNP_MIC_LENGTH);
+    len += OSNP_MIC_LENGTH;
+  }
+
+  buf[len++] = 0;
+  buf[len++] = 0;
+
+  // the frame on air is the one whose delivery is reported next
+  if (sim.config.compact_notifications && EXTRACT_FCFRTYP(*frame->fc_low) == FCFRTYP_DATA) {
+    dev->compact_in_flight = compact_report_id(frame->payload, frame->payload_len, &dev->compact_report);
+  }
+
+  if (!sim_radio_transmit(_sim_device_node(dev), buf, len)) {
+    return;
+  }
+
+  if (EXTRACT_FCFRTYP(*frame->fc_low) == FCFRTYP_MCMD && frame->payload[0] == OSNP_MCMD_DATA_REQ) {
+    dev->polls++;
+    dev->poll_in_flight = true;
+  }
+}
+
+bool osnp_get_pending_frames(OSNP_CTX_PARAM) {
+  return DEV(ctx)->radio.last_ack_pending;
+}
+
+uint8_t osnp_energy_detect(OSNP_CTX_PARAM_ uint8_t channel) {
+  return sim_channel_energy(channel);
+}
+
+/* Data items of the simulated sensor */
+#define SIM_DATA_SENSOR_VALUE 0x81
+#define SIM_DATA_LOG 0x82
+#define SIM_DATA_BATTERY 0x83
+#define SIM_DATA_FLAGS 0x85
+
+/* The battery discharges by 1mV a minute from this voltage */
+#define SIM_BATTERY_FULL_MV 3300
+
+/* The log returned through a bulk transfer: records of a 4-byte timestamp and a 2-byte reading */
+#define SIM_LOG_RECORDS 48
+#define SIM_LOG_RECORD_LEN 6
+
+static void _sim_device_put_sensor_value(sim_device_t *dev, tlv_writer_t *writer) {
+  uint8_t value[2] = { dev->sensor_value >> 8, dev->sensor_value & 0xff };
+  tlv_writer_put(writer, SIM_DATA_SENSOR_VALUE, value, 2);
+}
+
+uint8_t sim_get_data(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure) {
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
+
+  if (!secure) {
+    return OSNP_SECURITY_ERROR;
+  }
+
+  // no parameters means all data items
+  if (!tlv_reader_has_next(params)) {
+    _sim_device_put_sensor_value(DEV(ctx), response);
+  }
+
+  while (tlv_reader_next(params, &tag, &len, &value)) {
+    if (tag == SIM_DATA_LOG) {
+      // the log does not fit in a frame, it follows in a bulk transfer
+      uint8_t id = osnp_ctx_start_bulk_transfer(ctx, 0, 0xE1);
+
+      if (!id) {
+        return OSNP_DEVICE_BUSY;
+      }
+
+      tlv_writer_put(response, OSNP_BULK_TRANSFER_TAG, &id, 1);
+      continue;
+    }
+
+    if (tag != SIM_DATA_SENSOR_VALUE) {
+      return OSNP_UNSUPPORTED_PARAMETERS;
+    }
+
+    _sim_device_put_sensor_value(DEV(ctx), response);
+  }
+
+  return params->error ? OSNP_UNSUPPORTED_PARAMETERS : OSNP_SUCCESS;
+}
+
+static uint16_t _sim_device_battery(sim_device_t *dev) {
+  return SIM_BATTERY_FULL_MV - (sim.now - dev->boot_time) / SIM_MS(60000);
+}
+
+bool osnp_read_item(OSNP_CTX_PARAM_ uint16_t tag, int32_t *value) {
+  sim_device_t *dev = DEV(ctx);
+
+  switch (tag) {
+    case SIM_DATA_SENSOR_VALUE:
+      *value = (int16_t) dev->sensor_value;
+      return true;
+    case SIM_DATA_BATTERY:
+      *value = _sim_device_battery(dev);
+      return true;
+    case SIM_DATA_FLAGS:
+      *value = dev->always_on | ((dev->sensor_value & 0x8000) ? 2 : 0);
+      return true;
+    default:
+      return false;
+  }
+}
+
+void osnp_build_notification(OSNP_CTX_PARAM_ tlv_writer_t *notification) {
+  sim_device_t *dev = DEV(ctx);
+  uint16_t battery = _sim_device_battery(dev);
+  bool flags[2] = { dev->always_on, dev->sensor_value & 0x8000 };
+
+  if (!sim.config.compact_notifications) {
+    uint8_t value[2] = { battery >> 8, battery & 0xff };
+    uint8_t flags_value = flags[0] | (flags[1] << 1);
+
+    if (osnp_ctx_item_due(ctx, SIM_DATA_SENSOR_VALUE)) {
+      _sim_device_put_sensor_value(dev, notification);
+    }
+
+    if (osnp_ctx_item_due(ctx, SIM_DATA_BATTERY)) {
+      tlv_writer_put(notification, SIM_DATA_BATTERY, value, 2);
+    }
+
+    if (osnp_ctx_item_due(ctx, SIM_DATA_FLAGS)) {
+      tlv_writer_put(notification, SIM_DATA_FLAGS, &flags_value, 1);
+    }
+
+    return;
+  }
+
+  // the sensor value is signed, so that its drift around zero stays a small difference
+  compact_begin(&dev->compact, notification);
+
+  if (osnp_ctx_item_due(ctx, SIM_DATA_SENSOR_VALUE)) {
+    compact_put_int(&dev->compact, notification, SIM_DATA_SENSOR_VALUE, (int16_t) dev->sensor_value);
+  }
+
+  if (osnp_ctx_item_due(ctx, SIM_DATA_BATTERY)) {
+    compact_put_int(&dev->compact, notification, SIM_DATA_BATTERY, battery);
+  }
+
+  if (osnp_ctx_item_due(ctx, SIM_DATA_FLAGS)) {
+    compact_put_bools(&dev->compact, notification, SIM_DATA_FLAGS, flags, 2);
+  }
+
+  compact_end(&dev->compact, notification);
+}
+
+void osnp_build_bulk(OSNP_CTX_PARAM_ uint8_t source, osnp_bulk_writer_t *writer) {
+  sim_device_t *dev = DEV(ctx);
+
+  // the records are derived from the device and their index, so every fragment sees the same content
+  if (!osnp_bulk_put_header(writer, OSNP_GET_DATA, SIM_LOG_RECORDS * (SIM_LOG_RECORD_LEN + 2))) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < SIM_LOG_RECORDS; i++) {
+    uint32_t timestamp = i * 60;
+    uint16_t reading = (dev->id * 7 + i) & 0xffff;
+    uint8_t record[SIM_LOG_RECORD_LEN] = { timestamp >> 24, timestamp >> 16, timestamp >> 8, timestamp, reading >> 8, reading };
+
+    if (!osnp_bulk_put(writer, SIM_DATA_LOG, record, SIM_LOG_RECORD_LEN)) {
+      return;
+    }
+  }
+}
@@ -0,0 +1,893 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sim.h"
+#include "config.h"
+#include "tlv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Scriptable hub. It broadcasts discovery requests, associates every device answering them, queues frames for
+ * poll-driven devices until they poll (indirect transmission) and sends them directly to always-on devices. Devices
+ * and their queues are kept in a hub_table_t, like a real hub would.
+ *
+ * The script is a text file with one directive per line ('#' starts a comment):
+ *
+ *   discover <period_ms>                             discovery broadcast period (0 disables discovery)
+ *   persistence <ms>                                 drop frames queued longer (0, the default, keeps them)
+ *   slots <period_ms> <width_ms>                     assign poll slots of width_ms to the devices, period_ms apart
+ *   at <ms> command <device|*> <hex>                 queue a 0xE0 command container with the given content
+ *   every <ms> [from <ms>] command <device|*> <hex>  same, repeated
+ *   at <ms> disassociate <device|*>                  queue a disassociation notification
+ *   at <ms> restart <down_ms>                        the hub goes silent for down_ms, dropping its outbox
+ *   at <ms> join <group> <device|*>                  queue an OSNP_MCMD_GROUP making the devices join the group
+ *   at <ms> group <group> <hex>                      send a 0xE0 command container to the members of the group
+ *
+ * Device numbers are zero based, groups are numbered from 0 to SIM_HUB_GROUPS - 1.
+ */
+
+#define SIM_HUB_DISCOVERY_EVENT 0xffffffff
+#define SIM_HUB_RESUME_EVENT 0xfffffffe
+
+static const uint8_t sim_eui_tag[4] = { 'O', 'S', 'I', 'M' };
+
+static int32_t _sim_hub_device_by_eui(uint8_t *eui) {
+  if (memcmp(&eui[4], sim_eui_tag, 4)) {
+    return -1;
+  }
+
+  uint32_t id = eui[0] | eui[1] << 8 | eui[2] << 16 | (uint32_t) eui[3] << 24;
+
+  return id < sim.config.num_devices ? (int32_t) id : -1;
+}
+
+/**
+ * Finds the sender of a frame in the device table, adding simulated devices the first time they are heard from.
+ */
+static int32_t _sim_hub_source_device(sim_hub_t *hub, ieee802_15_4_frame_t *frame) {
+  uint8_t no_short_address[2] = { 0xff, 0xff };
+  hub_device_t *entry = hub_table_find_source(&hub->table, frame);
+
+  if (entry) {
+    return (sim_hub_device_t *) entry->user_data - hub->devices;
+  }
+
+  if (EXTRACT_FCSRCADDR(*frame->fc_high) != FCADDR_EXT) {
+    return -1;
+  }
+
+  int32_t device = _sim_hub_device_by_eui(frame->src_addr);
+
+  if (device < 0 || !(entry = hub_table_add(&hub->table, frame->src_addr, no_short_address))) {
+    return -1;
+  }
+
+  entry->user_data = &hub->devices[device];
+  hub->devices[device].entry = entry;
+
+  return device;
+}
+
+static uint32_t _sim_hub_ticks(void) {
+  return (uint32_t) sim.now;
+}
+
+void sim_device_eui(uint32_t id, uint8_t *eui) {
+  eui[0] = id & 0xff;
+  eui[1] = (id >> 8) & 0xff;
+  eui[2] = (id >> 16) & 0xff;
+  eui[3] = (id >> 24) & 0xff;
+  memcpy(&eui[4], sim_eui_tag, 4);
+}
+
+/**
+ * Builds a frame from the hub to the given device (or broadcast if device is -1). Secured frames get the next
+ * frame counter of the device, a (dummy) MIC is appended like the radio would do, as is the FCS.
+ */
+static uint16_t _sim_hub_build_frame(sim_hub_t *hub, uint8_t *buf, uint8_t frame_type, int32_t device, bool secure, uint8_t *payload, uint16_t payload_len) {
+  uint8_t fc_low = FCFRTYP(frame_type);
+  uint8_t fc_high = FCSRCADDR(FCADDR_EXT);
+  uint16_t i = 3;
+
+  if (device < 0) {
+    fc_high |= FCDSTADDR(FCADDR_SHORT);
+  } else if (hub->devices[device].associated) {
+    fc_low |= FCREQACK | FCPANCOMP;
+    fc_high |= FCDSTADDR(FCADDR_SHORT);
+  } else {
+    fc_low |= FCREQACK;
+    fc_high |= FCDSTADDR(FCADDR_EXT);
+  }
+
+  if (secure) {
+    fc_low |= FCSECEN;
+  }
+
+  buf[0] = fc_low;
+  buf[1] = fc_high;
+  buf[2] = hub->seq_no++;
+
+  if (device < 0) {
+    memset(&buf[i], 0xff, 4);
+    i += 4;
+  } else if (hub->devices[device].associated) {
+    memcpy(&buf[i], hub->pan_id, 2);
+    buf[i + 2] = (device + 1) & 0xff;
+    buf[i + 3] = ((device + 1) >> 8) & 0xff;
+    i += 4;
+  } else {
+    buf[i++] = 0xff;
+    buf[i++] = 0xff;
+    sim_device_eui(device, &buf[i]);
+    i += 8;
+  }
+
+  if (!(fc_low & FCPANCOMP)) {
+    memcpy(&buf[i], hub->pan_id, 2);
+    i += 2;
+  }
+
+  memcpy(&buf[i], hub->eui, 8);
+  i += 8;
+
+  if (secure) {
+    uint32_t counter = hub->devices[device].entry->tx_frame_counter++;
+    buf[i++] = counter & 0xff;
+    buf[i++] = (counter >> 8) & 0xff;
+    buf[i++] = (counter >> 16) & 0xff;
+    buf[i++] = (counter >> 24) & 0xff;
+    buf[i++] = 0x01;
+  }
+
+  memcpy(&buf[i], payload, payload_len);
+  i += payload_len;
+
+  if (secure) {
+    memset(&buf[i], 0, OSNP_MIC_LENGTH);
+    i += OSNP_MIC_LENGTH;
+  }
+
+  buf[i++] = 0;
+  buf[i++] = 0;
+
+  return i;
+}
+
+/**
+ * Builds a data frame to the members of a group, secured with the next frame counter of the group. Group frames
+ * are not acknowledged.
+ */
+static uint16_t _sim_hub_build_group_frame(sim_hub_t *hub, uint8_t *buf, uint8_t group, uint8_t *payload, uint16_t payload_len) {
+  uint32_t counter = hub->group_counter[group]++;
+  uint16_t i = 0;
+
+  buf[i++] = FCFRTYP(FCFRTYP_DATA) | FCPANCOMP | FCSECEN;
+  buf[i++] = FCDSTADDR(FCADDR_SHORT) | FCSRCADDR(FCADDR_EXT);
+  buf[i++] = hub->seq_no++;
+  memcpy(&buf[i], hub->pan_id, 2);
+  buf[i + 2] = group;
+  buf[i + 3] = SIM_GROUP_ADDRESS >> 8;
+  i += 4;
+  memcpy(&buf[i], hub->eui, 8);
+  i += 8;
+  buf[i++] = counter & 0xff;
+  buf[i++] = (counter >> 8) & 0xff;
+  buf[i++] = (counter >> 16) & 0xff;
+  buf[i++] = (counter >> 24) & 0xff;
+  buf[i++] = 0x01;
+  memcpy(&buf[i], payload, payload_len);
+  i += payload_len;
+  memset(&buf[i], 0, OSNP_MIC_LENGTH);
+  i += OSNP_MIC_LENGTH;
+  buf[i++] = 0;
+  buf[i++] = 0;
+
+  return i;
+}
+
+/**
+ * Start of the next poll slot of the device, not before now. Slots are laid on a grid from time 0, the devices
+ * taking the slots of each period in turn.
+ */
+static sim_time_t _sim_hub_next_slot(sim_hub_t *hub, int32_t device) {
+  sim_time_t offset = (device % (hub->slot_period / hub->slot_width)) * hub->slot_width;
+
+  if (sim.now <= offset) {
+    return offset;
+  }
+
+  return offset + ((sim.now - offset + hub->slot_period - 1) / hub->slot_period) * hub->slot_period;
+}
+
+/**
+ * Writes the <period> <delay> fields of a poll slot assignment. The delay is taken when the frame goes on air, so
+ * it is not stale by the time spent in the outbox.
+ */
+static void _sim_hub_write_slot(sim_hub_t *hub, int32_t device, uint8_t *buf) {
+  uint16_t period = hub->slot_period / 1000;
+  uint16_t delay = (_sim_hub_next_slot(hub, device) - sim.now) / 1000;
+
+  buf[0] = period >> 8;
+  buf[1] = period & 0xff;
+  buf[2] = delay >> 8;
+  buf[3] = delay & 0xff;
+}
+
+static void _sim_hub_kick(sim_hub_t *hub) {
+  if (hub->radio.busy || !hub->outbox_len || sim.now < hub->down_until) {
+    return;
+  }
+
+  sim_hub_out_t *out = &hub->outbox[hub->outbox_head];
+
+  if (out->slot_field) {
+    _sim_hub_write_slot(hub, out->device, &out->buf[out->slot_field]);
+  }
+
+  sim_radio_transmit(SIM_HUB_NODE, out->buf, out->len);
+}
+
+static sim_hub_out_t *_sim_hub_outbox_push(sim_hub_t *hub) {
+  if (hub->outbox_len == SIM_HUB_OUTBOX_LEN) {
+    return NULL;
+  }
+
+  sim_hub_out_t *out = &hub->outbox[(hub->outbox_head + hub->outbox_len++) % SIM_HUB_OUTBOX_LEN];
+  out->device = -1;
+  out->indirect = false;
+  out->slot_field = 0;
+
+  return out;
+}
+
+static void _sim_hub_send_direct(sim_hub_t *hub, int32_t device, uint8_t frame_type, bool secure, uint8_t *payload, uint16_t payload_len) {
+  sim_hub_out_t *out = _sim_hub_outbox_push(hub);
+
+  if (out) {
+    out->device = device;
+    out->len = _sim_hub_build_frame(hub, out->buf, frame_type, device, secure, payload, payload_len);
+    _sim_hub_kick(hub);
+  }
+}
+
+/**
+ * Hands the oldest queued frame of the device to the radio. Frame counters are assigned at this point so that
+ * they reach the device in order.
+ */
+static void _sim_hub_send_queued(sim_hub_t *hub, int32_t device) {
+  sim_hub_device_t *dev = &hub->devices[device];
+
+  // the frame in the outbox stays at the head of the queue, and is not expired, until it is sent
+  if (dev->in_outbox) {
+    return;
+  }
+
+  hub_frame_t *frame = hub_peek(&hub->table, dev->entry, _sim_hub_ticks());
+
+  if (!frame) {
+    return;
+  }
+
+  sim_hub_out_t *out = _sim_hub_outbox_push(hub);
+
+  if (!out) {
+    return;
+  }
+
+  out->device = device;
+  out->indirect = true;
+  out->len = _sim_hub_build_frame(hub, out->buf, frame->frame_type, device, true, frame->payload, frame->payload_len);
+
+  if (dev->entry->queue_len > 1) {
+    out->buf[0] |= FCFRPEN;
+  }
+
+  // the fields end the payload, before the MIC and the FCS
+  if (frame->frame_type == FCFRTYP_MCMD && frame->payload[0] == OSNP_MCMD_POLL_SLOT) {
+    out->slot_field = out->len - 2 - OSNP_MIC_LENGTH - 4;
+  }
+
+  dev->in_outbox = true;
+  _sim_hub_kick(hub);
+}
+
+static void _sim_hub_enqueue(sim_hub_t *hub, int32_t device, uint8_t frame_type, uint8_t *payload, uint16_t payload_len) {
+  sim_hub_device_t *dev = &hub->devices[device];
+
+  if (!dev->associated || !hub_enqueue(&hub->table, dev->entry, frame_type, payload, payload_len, _sim_hub_ticks(), hub->persistence)) {
+    return;
+  }
+
+  if (dev->always_on) {
+    _sim_hub_send_queued(hub, device);
+  }
+}
+
+static void _sim_hub_associate(sim_hub_t *hub, int32_t device) {
+  uint8_t payload[39];
+
+  memset(payload, 0, sizeof(payload));
+  payload[0] = OSNP_MCMD_ASSOCIATION_REQ;
+  // keys are not used by the simulated radios
+  payload[33] = (device + 1) & 0xff;
+  payload[34] = ((device + 1) >> 8) & 0xff;
+
+  hub_table_set_short_address(&hub->table, hub->devices[device].entry, &payload[33]);
+  hub->devices[device].association_pending = true;
+
+  if (!hub->slot_period) {
+    _sim_hub_send_direct(hub, device, FCFRTYP_MCMD, false, payload, 35);
+    return;
+  }
+
+  // the first slot assignment follows the short address, written when the frame goes on air
+  sim_hub_out_t *out = _sim_hub_outbox_push(hub);
+
+  if (out) {
+    out->device = device;
+    out->len = _sim_hub_build_frame(hub, out->buf, FCFRTYP_MCMD, device, false, payload, sizeof(payload));
+    out->slot_field = out->len - 2 - 4;
+    _sim_hub_kick(hub);
+  }
+}
+
+/**
+ * Checks a poll of a device with an assigned slot against the slot, and sends the assignment again when the poll
+ * does not end within it. Only polls finding the queue empty are checked, so a correction already queued is not
+ * repeated.
+ */
+static void _sim_hub_check_slot(sim_hub_t *hub, int32_t device) {
+  sim_hub_device_t *dev = &hub->devices[device];
+
+  if (!hub->slot_period || !dev->poll_slots || dev->in_outbox || hub_peek(&hub->table, dev->entry, _sim_hub_ticks())) {
+    return;
+  }
+
+  // how late the poll is on the last slot of the device
+  sim_time_t offset = _sim_hub_next_slot(hub, device) % hub->slot_period;
+  sim_time_t late = (sim.now + hub->slot_period - offset) % hub->slot_period;
+
+  sim_histogram_add(&sim.stats.slot_error, late < hub->slot_period - late ? late : hub->slot_period - late);
+
+  if (late < hub->slot_width) {
+    return;
+  }
+
+  uint8_t payload[5] = { OSNP_MCMD_POLL_SLOT, 0, 0, 0, 0 };
+
+  sim.stats.slot_corrections++;
+  _sim_hub_enqueue(hub, device, FCFRTYP_MCMD, payload, sizeof(payload));
+}
+
+static void _sim_hub_mac_command_received(sim_hub_t *hub, int32_t device, ieee802_15_4_frame_t *frame) {
+  sim_hub_device_t *dev = &hub->devices[device];
+
+  switch (frame->payload[0]) {
+    case OSNP_MCMD_DISCOVER:
+      if (!dev->association_pending) {
+        dev->associated = false;
+        _sim_hub_associate(hub, device);
+      }
+      break;
+    case OSNP_MCMD_ASSOCIATION_RES:
+      dev->associated = true;
+      dev->association_pending = false;
+      dev->always_on = frame->payload[1] & RX_ALWAYS_ON;
+      dev->poll_slots = frame->payload[1] & POLL_SLOTS;
+      dev->groups = 0;
+      dev->entry->tx_frame_counter = 1;
+      hub_flush(&hub->table, dev->entry);
+      compact_decoder_init(&dev->compact);
+      hub_bulk_init(&dev->bulk);
+      break;
+    case OSNP_MCMD_DATA_REQ:
+      if (dev->associated) {
+        _sim_hub_check_slot(hub, device);
+      }
+      break;
+    case OSNP_MCMD_FRAME_COUNTER_ALIGN:
+      sim.stats.frame_counter_alignments++;
+      dev->entry->tx_frame_counter = frame->payload[1] | frame->payload[2] << 8 | frame->payload[3] << 16 | (uint32_t) frame->payload[4] << 24;
+      break;
+  }
+}
+
+/**
+ * Checks that a completed bulk transfer holds the whole log of the device: a 0xE1 container of indefinite length
+ * with a GET_DATA object of log records.
+ */
+static void _sim_hub_bulk_complete(sim_hub_t *hub, sim_hub_device_t *dev) {
+  uint8_t stream[HUB_BULK_MAX_FRAGMENTS * HUB_BULK_FRAGMENT_LEN];
+  tlv_reader_t reader;
+  tlv_reader_t responses;
+  tlv_reader_t records;
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
+  uint32_t count = 0;
+
+  uint16_t stream_len = hub_bulk_reassemble(&dev->bulk, stream, sizeof(stream));
+
+  tlv_reader_init(&reader, stream, stream_len);
+
+  if (!tlv_reader_enter(&reader, &responses, &tag) || tag != 0xE1 ||
+      !tlv_reader_enter(&responses, &records, &tag) || tag != OSNP_GET_DATA) {
+    return;
+  }
+
+  while (tlv_reader_next(&records, &tag, &len, &value)) {
+    count++;
+  }
+
+  if (records.error || !count) {
+    return;
+  }
+
+  sim.stats.bulk_transfers++;
+  sim.stats.bulk_bytes += stream_len;
+  sim_histogram_add(&sim.stats.bulk_latency, sim.now - dev->command_queued_at);
+}
+
+/**
+ * Stores a bulk transfer fragment and, when the device asks for it, queues the acknowledgement of its window.
+ */
+static void _sim_hub_fragment_received(sim_hub_t *hub, int32_t device, uint8_t *value, uint16_t len) {
+  sim_hub_device_t *dev = &hub->devices[device];
+  uint8_t ack[HUB_BULK_ACK_LEN];
+  uint8_t result = hub_bulk_fragment_received(&dev->bulk, value, len, ack);
+
+  if (result & HUB_BULK_STORED) {
+    sim.stats.bulk_fragments++;
+  }
+
+  if (result & HUB_BULK_COMPLETE) {
+    _sim_hub_bulk_complete(hub, dev);
+  }
+
+  if (result & HUB_BULK_ACK) {
+    _sim_hub_enqueue(hub, device, FCFRTYP_DATA, ack, sizeof(ack));
+  }
+}
+
+static void _sim_hub_data_received(sim_hub_t *hub, int32_t device, ieee802_15_4_frame_t *frame) {
+  sim_hub_device_t *dev = &hub->devices[device];
+  tlv_reader_t payload;
+  uint16_t tag;
+
+  tlv_reader_init(&payload, frame->payload, frame->payload_len);
+
+  if (!tlv_reader_peek_tag(&payload, &tag)) {
+    return;
+  }
+
+  if (tag == 0xE1) {
+    sim.stats.responses_received++;
+
+    if (dev->command_outstanding) {
+      dev->command_outstanding = false;
+      sim_histogram_add(&sim.stats.command_latency, sim.now - dev->command_queued_at);
+    }
+  } else if (tag == 0xE2) {
+    uint16_t len;
+    uint8_t *value;
+
+    sim.stats.notifications_received++;
+    sim.stats.notification_bytes += frame->payload_len;
+
+    if (!tlv_reader_next(&payload, &tag, &len, &value)) {
+      return;
+    }
+
+    tlv_reader_t items;
+    tlv_reader_init(&items, value, len);
+
+    while (tlv_reader_next(&items, &tag, &len, &value)) {
+      if (tag == COMPACT_TAG) {
+        if (compact_decode(&dev->compact, value, len)) {
+          sim.stats.compact_decoded++;
+
+          if (value[0] & COMPACT_KEYFRAME) {
+            sim.stats.compact_keyframes++;
+          }
+        } else {
+          sim.stats.compact_undecodable++;
+        }
+      }
+    }
+  } else if (tag == OSNP_BULK_FRAGMENT_TAG) {
+    uint16_t len;
+    uint8_t *value;
+
+    if (tlv_reader_next(&payload, &tag, &len, &value)) {
+      _sim_hub_fragment_received(hub, device, value, len);
+    }
+  }
+}
+
+void sim_hub_frame_received(sim_hub_t *hub, uint8_t *buf, uint16_t len) {
+  ieee802_15_4_frame_t frame;
+
+  if (!osnp_parse_frame(buf, len, &frame)) {
+    return;
+  }
+
+  int32_t device = _sim_hub_source_device(hub, &frame);
+
+  if (device < 0) {
+    return;
+  }
+
+  switch (EXTRACT_FCFRTYP(*frame.fc_low)) {
+    case FCFRTYP_MCMD:
+      _sim_hub_mac_command_received(hub, device, &frame);
+      break;
+    case FCFRTYP_DATA:
+      _sim_hub_data_received(hub, device, &frame);
+      break;
+  }
+
+  // the stack waits for pending frames after the ack of any frame, not only of data requests, but only if the ack
+  // said so: a frame queued while handling this one waits for the next poll
+  if (EXTRACT_FCREQACK(*frame.fc_low) && hub->devices[device].associated && (hub->devices[device].always_on || hub->devices[device].ack_pending)) {
+    _sim_hub_send_queued(hub, device);
+  }
+}
+
+bool sim_hub_pending_for(sim_hub_t *hub, uint8_t *buf, uint16_t len) {
+  ieee802_15_4_frame_t frame;
+  hub_device_t *entry;
+
+  if (!osnp_parse_frame(buf, len, &frame) || !(entry = hub_table_find_source(&hub->table, &frame))) {
+    return false;
+  }
+
+  sim_hub_device_t *dev = entry->user_data;
+
+  dev->ack_pending = dev->associated && (dev->in_outbox || hub_peek(&hub->table, entry, _sim_hub_ticks()));
+  return dev->ack_pending;
+}
+
+void sim_hub_frame_sent(sim_hub_t *hub, uint8_t status) {
+  sim_hub_out_t *out = &hub->outbox[hub->outbox_head];
+  hub->outbox_head = (hub->outbox_head + 1) % SIM_HUB_OUTBOX_LEN;
+  hub->outbox_len--;
+
+  if (out->device >= 0) {
+    sim_hub_device_t *dev = &hub->devices[out->device];
+
+    if (out->indirect) {
+      dev->in_outbox = false;
+
+      // the queue is flushed if the device associated again meanwhile
+      if (status == OSNP_TX_STATUS_OK && dev->entry->queue_len) {
+        hub_frame_t *frame = &hub->table.slab[dev->entry->queue_head];
+
+        if (frame->frame_type == FCFRTYP_DATA && frame->payload[0] == 0xE0) {
+          dev->command_queued_at = sim.now - (uint32_t) (_sim_hub_ticks() - frame->queued_at);
+          dev->command_outstanding = true;
+        } else if (frame->frame_type == FCFRTYP_MCMD && frame->payload[0] == OSNP_MCMD_DISASSOCIATED) {
+          dev->associated = false;
+        } else if (frame->frame_type == FCFRTYP_MCMD && frame->payload[0] == OSNP_MCMD_GROUP) {
+          dev->groups |= 1 << frame->payload[1];
+        }
+
+        if (dev->associated) {
+          hub_dequeue(&hub->table, dev->entry);
+        } else {
+          hub_flush(&hub->table, dev->entry);
+        }
+
+        if (dev->always_on) {
+          _sim_hub_send_queued(hub, out->device);
+        }
+      }
+    } else if (status != OSNP_TX_STATUS_OK) {
+      dev->association_pending = false;
+    }
+  }
+
+  _sim_hub_kick(hub);
+}
+
+/**
+ * Sends a command to the members of a group: one group frame for the members with the radio on, and a unicast copy
+ * queued for each poll-driven member, which would not hear the group frame.
+ */
+static void _sim_hub_send_group(sim_hub_t *hub, uint8_t group, uint8_t *payload, uint16_t payload_len) {
+  bool listening = false;
+
+  for (uint32_t d = 0; d < sim.config.num_devices; d++) {
+    sim_hub_device_t *dev = &hub->devices[d];
+
+    if (!dev->associated || !(dev->groups & (1 << group))) {
+      continue;
+    }
+
+    if (dev->always_on) {
+      listening = true;
+    } else {
+      sim.stats.commands_sent++;
+      sim.stats.group_copies++;
+      _sim_hub_enqueue(hub, d, FCFRTYP_DATA, payload, payload_len);
+    }
+  }
+
+  sim_hub_out_t *out = listening ? _sim_hub_outbox_push(hub) : NULL;
+
+  if (out) {
+    sim.stats.group_frames++;
+    out->len = _sim_hub_build_group_frame(hub, out->buf, group, payload, payload_len);
+    _sim_hub_kick(hub);
+  }
+}
+
+static void _sim_hub_run_action(sim_hub_t *hub, sim_action_t *action) {
+  uint32_t first = action->target < 0 ? 0 : (uint32_t) action->target;
+  uint32_t last = action->target < 0 ? sim.config.num_devices : first + 1;
+  uint8_t payload[100];
+  uint8_t mcmd = OSNP_MCMD_DISASSOCIATED;
+  uint16_t len;
+
+  switch (action->type) {
+    case SIM_ACTION_COMMAND:
+      len = tlv_write_tag(payload, 0xE0);
+      len += tlv_write_length(&payload[len], action->data_len);
+      memcpy(&payload[len], action->data, action->data_len);
+      len += action->data_len;
+
+      for (uint32_t d = first; d < last && d < sim.config.num_devices; d++) {
+        if (hub->devices[d].associated) {
+          sim.stats.commands_sent++;
+          _sim_hub_enqueue(hub, d, FCFRTYP_DATA, payload, len);
+        }
+      }
+      break;
+    case SIM_ACTION_DISASSOCIATE:
+      for (uint32_t d = first; d < last && d < sim.config.num_devices; d++) {
+        _sim_hub_enqueue(hub, d, FCFRTYP_MCMD, &mcmd, 1);
+      }
+      break;
+    case SIM_ACTION_JOIN:
+      // keys are not used by the simulated radios
+      memset(payload, 0, 24);
+      payload[0] = OSNP_MCMD_GROUP;
+      payload[1] = action->group;
+      payload[2] = SIM_GROUP_ADDRESS >> 8;
+      payload[4] = hub->group_counter[action->group] & 0xff;
+      payload[5] = (hub->group_counter[action->group] >> 8) & 0xff;
+      payload[6] = (hub->group_counter[action->group] >> 16) & 0xff;
+      payload[7] = (hub->group_counter[action->group] >> 24) & 0xff;
+
+      for (uint32_t d = first; d < last && d < sim.config.num_devices; d++) {
+        _sim_hub_enqueue(hub, d, FCFRTYP_MCMD, payload, 24);
+      }
+      break;
+    case SIM_ACTION_GROUP_COMMAND:
+      len = tlv_write_tag(payload, 0xE0);
+      len += tlv_write_length(&payload[len], action->data_len);
+      memcpy(&payload[len], action->data, action->data_len);
+      len += action->data_len;
+      sim.stats.group_commands++;
+      _sim_hub_send_group(hub, action->group, payload, len);
+      break;
+    case SIM_ACTION_RESTART:
+      hub->down_until = sim.now + action->duration;
+      // only the frame already on air survives
+      hub->outbox_len = hub->radio.busy ? 1 : 0;
+
+      for (uint32_t d = 0; d < sim.config.num_devices; d++) {
+        hub->devices[d].in_outbox = false;
+        hub->devices[d].association_pending = false;
+      }
+
+      sim_schedule(hub->down_until, SIM_EV_HUB, SIM_HUB_NODE, SIM_HUB_RESUME_EVENT);
+      break;
+  }
+}
+
+void sim_hub_event(sim_hub_t *hub, uint32_t action) {
+  if (action == SIM_HUB_DISCOVERY_EVENT) {
+    if (sim.now >= hub->down_until) {
+      uint8_t payload = OSNP_MCMD_DISCOVER;
+      _sim_hub_send_direct(hub, -1, FCFRTYP_MCMD, false, &payload, 1);
+    }
+
+    sim_schedule(sim.now + hub->discover_period, SIM_EV_HUB, SIM_HUB_NODE, SIM_HUB_DISCOVERY_EVENT);
+  } else if (action == SIM_HUB_RESUME_EVENT) {
+    _sim_hub_kick(hub);
+  } else if (sim.now >= hub->down_until || hub->actions[action].type == SIM_ACTION_RESTART) {
+    sim_action_t *a = &hub->actions[action];
+    _sim_hub_run_action(hub, a);
+
+    if (a->every) {
+      sim_schedule(sim.now + a->every, SIM_EV_HUB, SIM_HUB_NODE, action);
+    }
+  } else if (hub->actions[action].every) {
+    sim_schedule(sim.now + hub->actions[action].every, SIM_EV_HUB, SIM_HUB_NODE, action);
+  }
+}
+
+void sim_hub_start(sim_hub_t *hub) {
+  hub->devices = calloc(sim.config.num_devices, sizeof(sim_hub_device_t));
+  hub_table_init(&hub->table);
+
+  if (hub->discover_period) {
+    sim_schedule(0, SIM_EV_HUB, SIM_HUB_NODE, SIM_HUB_DISCOVERY_EVENT);
+  }
+
+  for (uint32_t i = 0; i < hub->actions_len; i++) {
+    sim_schedule(hub->actions[i].at, SIM_EV_HUB, SIM_HUB_NODE, i);
+  }
+}
+
+static int _sim_parse_target(const char *s, int32_t *target) {
+  if (!strcmp(s, "*")) {
+    *target = -1;
+    return 0;
+  }
+
+  char *end;
+  long v = strtol(s, &end, 10);
+
+  if (*end || v < 0) {
+    return -1;
+  }
+
+  *target = (int32_t) v;
+  return 0;
+}
+
+static int _sim_parse_hex(const char *s, uint8_t *out, uint16_t max, uint16_t *out_len) {
+  uint16_t len = 0;
+
+  while (s[0] && s[1]) {
+    unsigned int byte;
+
+    if (len == max || sscanf(s, "%2x", &byte) != 1) {
+      return -1;
+    }
+
+    out[len++] = byte;
+    s += 2;
+  }
+
+  *out_len = len;
+  return s[0] ? -1 : 0;
+}
+
+int sim_hub_load_script(sim_hub_t *hub, const char *path) {
+  FILE *f = fopen(path, "r");
+
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  char line[512];
+  uint32_t line_no = 0;
+
+  while (fgets(line, sizeof(line), f)) {
+    char *argv[8];
+    int argc = 0;
+    line_no++;
+
+    char *hash = strchr(line, '#');
+
+    if (hash) {
+      *hash = '\0';
+    }
+
+    for (char *tok = strtok(line, " \t\r\n"); tok && argc < 8; tok = strtok(NULL, " \t\r\n")) {
+      argv[argc++] = tok;
+    }
+
+    if (!argc) {
+      continue;
+    }
+
+    if (!strcmp(argv[0], "discover") && argc == 2) {
+      hub->discover_period = SIM_MS(atol(argv[1]));
+      continue;
+    }
+
+    if (!strcmp(argv[0], "persistence") && argc == 2) {
+      hub->persistence = SIM_MS(atol(argv[1]));
+      continue;
+    }
+
+    if (!strcmp(argv[0], "slots") && argc == 3) {
+      hub->slot_period = SIM_MS(atol(argv[1]));
+      hub->slot_width = SIM_MS(atol(argv[2]));
+
+      if (!hub->slot_width || hub->slot_width > hub->slot_period || hub->slot_period > SIM_MS(UINT16_MAX)) {
+        goto error;
+      }
+      continue;
+    }
+
+    sim_action_t action;
+    memset(&action, 0, sizeof(action));
+    int i = 2;
+
+    if (!strcmp(argv[0], "at") && argc > 2) {
+      action.at = SIM_MS(atol(argv[1]));
+    } else if (!strcmp(argv[0], "every") && argc > 2) {
+      action.every = SIM_MS(atol(argv[1]));
+      action.at = action.every;
+
+      if (!strcmp(argv[2], "from") && argc > 4) {
+        action.at = SIM_MS(atol(argv[3]));
+        i = 4;
+      }
+    } else {
+      goto error;
+    }
+
+    if (!strcmp(argv[i], "command") && argc == i + 3) {
+      action.type = SIM_ACTION_COMMAND;
+
+      if (_sim_parse_target(argv[i + 1], &action.target) || _sim_parse_hex(argv[i + 2], action.data, sizeof(action.data), &action.data_len)) {
+        goto error;
+      }
+    } else if (!strcmp(argv[i], "disassociate") && argc == i + 2) {
+      action.type = SIM_ACTION_DISASSOCIATE;
+
+      if (_sim_parse_target(argv[i + 1], &action.target)) {
+        goto error;
+      }
+    } else if (!strcmp(argv[i], "join") && argc == i + 3) {
+      action.type = SIM_ACTION_JOIN;
+      action.group = atoi(argv[i + 1]);
+
+      if (action.group >= SIM_HUB_GROUPS || _sim_parse_target(argv[i + 2], &action.target)) {
+        goto error;
+      }
+    } else if (!strcmp(argv[i], "group") && argc == i + 3) {
+      action.type = SIM_ACTION_GROUP_COMMAND;
+      action.group = atoi(argv[i + 1]);
+
+      if (action.group >= SIM_HUB_GROUPS || _sim_parse_hex(argv[i + 2], action.data, sizeof(action.data), &action.data_len)) {
+        goto error;
+      }
+    } else if (!strcmp(argv[i], "restart") && argc == i + 2) {
+      action.type = SIM_ACTION_RESTART;
+      action.duration = SIM_MS(atol(argv[i + 1]));
+    } else {
+      goto error;
+    }
+
+    hub->actions = realloc(hub->actions, (hub->actions_len + 1) * sizeof(sim_action_t));
+    hub->actions[hub->actions_len++] = action;
+    continue;
+
+error:
+    fprintf(stderr, "%s:%u: invalid directive\n", path, line_no);
+    fclose(f);
+    return -1;
+  }
+
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "usage: %s [options]\n"
+    "  -n <devices>       number of devices (default 20)\n"
+    "  -t <seconds>       simulated time (default 300)\n"
+    "  -s <seed>          random seed (default 1)\n"
+    "  -l <ratio>         random frame loss ratio (default 0)\n"
+    "  -c <channel>       hub channel, 0-15 (default 7)\n"
+    "  -a <ratio>         ratio of always-on devices (default 0)\n"
+    "  -b <ms>            devices boot uniformly within this time (default 5000)\n"
+    "  -p <ms>            minimum poll interval (default 1000)\n"
+    "  -M <ms>            maximum poll interval, reached after empty polls (default: same as -p)\n"
+    "  -N <ms>            notification period, 0 to disable (default 10000)\n"
+    "  -L <ms>            maximum latency of queued notifications (default 0)\n"
+    "  -C                 compact (delta/varint) notification encoding\n"
+    "  -S <ms>            channel scanning dwell time (default 250)\n"
+    "  -Q <ms>            dwell time on quiet channels, 0 for the same as -S (default 50)\n"
+    "  -A <ms>            association wait time (default 500)\n"
+    "  -P <ms>            pending data wait time (default 50)\n"
+    "  -E <mAh>           battery capacity for the battery life estimate (default 230)\n"
+    "  -f <script>        hub script\n", name);
+}
+
+static double _ms(sim_time_t t) {
+  return t / 1000.0;
+}
+
+static void _print_histogram(const char *name, sim_histogram_t *h) {
+  printf("%-24s n=%-7u p50=%9.1fms p90=%9.1fms p99=%9.1fms max=%9.1fms\n", name, h->samples_len,
+    _ms(sim_histogram_percentile(h, 0.5)), _ms(sim_histogram_percentile(h, 0.9)),
+    _ms(sim_histogram_percentile(h, 0.99)), _ms(sim_histogram_percentile(h, 1.0)));
+}
+
+/* The radio times accounted by the simulated medium, as a reference for the model of energy.c */
+static void _add_measured_energy(energy_report_t *report, energy_profile_t *profile, sim_device_t *dev) {
+  double tx = dev->radio.tx_time / 1e6;
+  double rx = (dev->radio.rx_time + (dev->radio.rx_on ? sim.now - dev->radio.rx_since : 0)) / 1e6;
+  double sleep = (sim.now - dev->boot_time) / 1e6 - tx - rx;
+
+  // not split by state, the medium does not know it
+  report->tx_s[ASSOCIATED] += tx;
+  report->rx_s[ASSOCIATED] += rx;
+  report->sleep_s[ASSOCIATED] += sleep;
+  report->charge_uah[ASSOCIATED] += (tx * profile->tx_ua + rx * profile->rx_ua + sleep * profile->sleep_ua) / 3600;
+}
+
+static void _print_energy(const char *name, energy_report_t *report) {
+  double tx = 0;
+  double rx = 0;
+  double sleep = 0;
+
+  for (uint8_t state = 0; state < ENERGY_STATES; state++) {
+    tx += report->tx_s[state];
+    rx += report->rx_s[state];
+    sleep += report->sleep_s[state];
+  }
+
+  double total = tx + rx + sleep > 0 ? tx + rx + sleep : 1;
+
+  printf("%-24s %.1f uAh/h (tx %.3f%%, rx %.3f%%, sleep %.3f%%)\n", name, energy_average_ua(report),
+    100 * tx / total, 100 * rx / total, 100 * sleep / total);
+}
+
+static void _report(void) {
+  sim_stats_t *st = &sim.stats;
+  double seconds = sim.config.duration / 1e6;
+  uint32_t associated = 0;
+  uint64_t polls = 0;
+  uint64_t polls_with_data = 0;
+  uint64_t notifications = 0;
+  uint64_t eeprom_writes = 0;
+  uint64_t counter_writes = 0;
+  uint64_t key_loads = 0;
+  uint64_t rx_dropped = 0;
+  osnp_stats_t stack = { 0 };
+  const osnp_stats_t boot = { 0 };
+  energy_profile_t profile = ENERGY_PROFILE_MRF24J40;
+  energy_report_t modeled;
+  energy_report_t measured;
+  uint32_t eeprom_writes_max = 0;
+  uint32_t counter_wear_max = 0;
+  double radio_on_sum = 0;
+  double radio_on_max = 0;
+  sim_time_t tx_time = 0;
+
+  energy_report_init(&modeled);
+  energy_report_init(&measured);
+
+  for (uint32_t i = 0; i < sim.config.num_devices; i++) {
+    sim_device_t *dev = &sim.devices[i];
+    double radio_on = (double) (dev->radio.rx_time + dev->radio.tx_time) / sim.config.duration;
+
+    associated += dev->osnp.state >= ASSOCIATED;
+    polls += dev->polls;
+    polls_with_data += dev->polls_with_data;
+    notifications += dev->notifications;
+    eeprom_writes += dev->eeprom.writes;
+    counter_writes += dev->eeprom.counter_writes;
+    key_loads += dev->key_loads;
+    rx_dropped += dev->osnp.rx_ring_dropped;
+
+    // devices which have not booted yet neither draw current nor have statistics
+    if (dev->osnp.user_data) {
+      const osnp_stats_t *stats = osnp_ctx_get_stats(&dev->osnp);
+
+      // the counters of every device are summed field by field, they are all 32-bit
+      for (uint32_t j = 0; j < sizeof(osnp_stats_t) / sizeof(uint32_t); j++) {
+        ((uint32_t *) &stack)[j] += ((const uint32_t *) stats)[j];
+      }
+
+      energy_add_stats(&modeled, &profile, &boot, stats, dev->always_on);
+      _add_measured_energy(&measured, &profile, dev);
+    }
+
+    eeprom_writes_max = dev->eeprom.writes > eeprom_writes_max ? dev->eeprom.writes : eeprom_writes_max;
+
+    for (uint32_t j = 0; j < SIM_COUNTER_LOG_LEN; j++) {
+      counter_wear_max = dev->eeprom.counter_log_wear[j] > counter_wear_max ? dev->eeprom.counter_log_wear[j] : counter_wear_max;
+    }
+
+    radio_on_sum += radio_on;
+    radio_on_max = radio_on > radio_on_max ? radio_on : radio_on_max;
+    tx_time += dev->radio.tx_time;
+  }
+
+  printf("devices %u, simulated %.0fs, seed %llu, loss %.3f\n", sim.config.num_devices, seconds,
+    (unsigned long long) sim.config.seed, sim.config.loss);
+  printf("\n[association]\n");
+  printf("associated at end        %u/%u\n", associated, sim.config.num_devices);
+  _print_histogram("association latency", &st->association_latency);
+  _print_histogram("reassociation latency", &st->reassociation_latency);
+  printf("\n[traffic]\n");
+  printf("commands sent            %llu\n", (unsigned long long) st->commands_sent);
+  printf("responses received       %llu\n", (unsigned long long) st->responses_received);
+  _print_histogram("command latency", &st->command_latency);
+  printf("polls                    %llu (%.1f%% with pending data)\n", (unsigned long long) polls,
+    polls ? 100.0 * polls_with_data / polls : 0.0);
+
+  if (sim.hub.slot_period) {
+    _print_histogram("poll slot error", &st->slot_error);
+    printf("poll slot corrections    %llu\n", (unsigned long long) st->slot_corrections);
+  }
+
+  printf("notifications            %llu generated, %llu received\n", (unsigned long long) notifications,
+    (unsigned long long) st->notifications_received);
+  printf("notification payload     %llu bytes (%.1f per notification)\n", (unsigned long long) st->notification_bytes,
+    st->notifications_received ? (double) st->notification_bytes / st->notifications_received : 0.0);
+
+  if (sim.config.compact_notifications) {
+    printf("compact reports          %llu decoded (%llu keyframes), %llu undecodable\n", (unsigned long long) st->compact_decoded,
+      (unsigned long long) st->compact_keyframes, (unsigned long long) st->compact_undecodable);
+  }
+
+  printf("indirect frames expired  %u\n", sim.hub.table.expired);
+  printf("frame counter alignments %llu\n", (unsigned long long) st->frame_counter_alignments);
+  printf("bulk transfers           %llu (%llu fragments, %llu bytes)\n", (unsigned long long) st->bulk_transfers,
+    (unsigned long long) st->bulk_fragments, (unsigned long long) st->bulk_bytes);
+  _print_histogram("bulk transfer latency", &st->bulk_latency);
+
+  if (st->group_commands) {
+    printf("group commands           %llu (%llu group frames, %llu unicast copies, %llu deliveries)\n",
+      (unsigned long long) st->group_commands, (unsigned long long) st->group_frames,
+      (unsigned long long) st->group_copies, (unsigned long long) st->group_deliveries);
+  }
+
+  printf("\n[medium]\n");
+  printf("frames on air            %llu (%.1f/s)\n", (unsigned long long) st->frames_sent, st->frames_sent / seconds);
+  printf("frames delivered         %llu (%.1f/s, %.0f B/s)\n", (unsigned long long) st->frames_delivered,
+    st->frames_delivered / seconds, st->bytes_delivered / seconds);
+  printf("collisions               %llu\n", (unsigned long long) st->collisions);
+  printf("random losses            %llu\n", (unsigned long long) st->lost);
+  printf("tx failures              %llu no ack, %llu channel busy, %llu overruns\n", (unsigned long long) st->no_ack,
+    (unsigned long long) st->channel_busy, (unsigned long long) st->tx_overruns);
+  printf("undelivered after retry  %llu mac commands, %llu responses, %llu notifications\n",
+    (unsigned long long) st->undelivered[OSNP_TX_CLASS_MCMD], (unsigned long long) st->undelivered[OSNP_TX_CLASS_RESPONSE],
+    (unsigned long long) st->undelivered[OSNP_TX_CLASS_NOTIFICATION]);
+  printf("\n[devices]\n");
+  printf("radio on                 avg %.3f%%, max %.3f%%\n", 100.0 * radio_on_sum / sim.config.num_devices, 100.0 * radio_on_max);
+  printf("tx time                  avg %.1fms\n", _ms(tx_time) / sim.config.num_devices);
+  printf("eeprom writes            avg %.1f, max %u, frame counters %llu total\n",
+    (double) eeprom_writes / sim.config.num_devices, eeprom_writes_max, (unsigned long long) counter_writes);
+  printf("key loads                avg %.1f\n", (double) key_loads / sim.config.num_devices);
+  printf("rx ring drops            %llu\n", (unsigned long long) rx_dropped);
+  printf("counter log wear         max %u writes per cell\n", counter_wear_max);
+  printf("\n[stack]\n");
+  printf("frames received          %u (%u malformed, %u replays rejected)\n", stack.rx_frames, stack.rx_malformed,
+    stack.replay_rejects);
+  printf("tx attempts              %u (%u ok, %u no ack, %u channel busy)\n",
+    stack.tx_frames[0] + stack.tx_frames[1] + stack.tx_frames[2] + stack.tx_frames[3],
+    stack.tx_status[OSNP_TX_STATUS_OK], stack.tx_status[OSNP_TX_STATUS_NOACK], stack.tx_status[OSNP_TX_STATUS_CHANNEL_BUSY]);
+  printf("alignments, log writes   %u, %u\n", stack.frame_counter_aligns, stack.counter_log_writes);
+  printf("scan cycles              %u\n", stack.scan_cycles);
+  printf("time in state            scanning %.1f%%, waiting association %.1f%%, associated %.1f%%, pending data %.1f%%\n",
+    100.0 * stack.state_time[SCANNING_CHANNELS] / (seconds * 1000 * sim.config.num_devices),
+    100.0 * stack.state_time[WAITING_ASSOCIATION_REQUEST] / (seconds * 1000 * sim.config.num_devices),
+    100.0 * stack.state_time[ASSOCIATED] / (seconds * 1000 * sim.config.num_devices),
+    100.0 * stack.state_time[WAITING_PENDING_DATA] / (seconds * 1000 * sim.config.num_devices));
+  printf("\n[energy]\n");
+  _print_energy("modeled by the stack", &modeled);
+  _print_energy("measured on the medium", &measured);
+  printf("battery life             %.0f days modeled, %.0f days measured (%u mAh)\n",
+    energy_battery_hours(&modeled, sim.config.battery_capacity) / 24, energy_battery_hours(&measured, sim.config.battery_capacity) / 24,
+    sim.config.battery_capacity);
+}
+
+int main(int argc, char **argv) {
+  sim_config_t *config = &sim.config;
+  int opt;
+
+  config->num_devices = 20;
+  config->duration = SIM_MS(300000);
+  config->seed = 1;
+  config->hub_channel = 7;
+  config->boot_spread = SIM_MS(5000);
+  config->scan_time = SIM_MS(250);
+  config->scan_time_quiet = SIM_MS(50);
+  config->association_wait_time = SIM_MS(500);
+  config->poll_time = SIM_MS(1000);
+  config->pending_data_wait_time = SIM_MS(50);
+  config->notification_period = SIM_MS(10000);
+  config->battery_capacity = 230;
+  sim.hub.discover_period = SIM_MS(200);
+
+  while ((opt = getopt(argc, argv, "n:t:s:l:c:a:b:p:M:N:L:CS:Q:A:P:E:f:h")) != -1) {
+    switch (opt) {
+      case 'n': config->num_devices = atoi(optarg); break;
+      case 't': config->duration = SIM_MS(atof(optarg) * 1000); break;
+      case 's': config->seed = strtoull(optarg, NULL, 10); break;
+      case 'l': config->loss = atof(optarg); break;
+      case 'c': config->hub_channel = atoi(optarg) & 0x0f; break;
+      case 'a': config->always_on_ratio = atof(optarg); break;
+      case 'b': config->boot_spread = SIM_MS(atol(optarg)); break;
+      case 'p': config->poll_time = SIM_MS(atol(optarg)); break;
+      case 'M': config->poll_time_max = SIM_MS(atol(optarg)); break;
+      case 'N': config->notification_period = SIM_MS(atol(optarg)); break;
+      case 'L': config->notification_latency = SIM_MS(atol(optarg)); break;
+      case 'C': config->compact_notifications = true; break;
+      case 'S': config->scan_time = SIM_MS(atol(optarg)); break;
+      case 'Q': config->scan_time_quiet = SIM_MS(atol(optarg)); break;
+      case 'A': config->association_wait_time = SIM_MS(atol(optarg)); break;
+      case 'P': config->pending_data_wait_time = SIM_MS(atol(optarg)); break;
+      case 'E': config->battery_capacity = atol(optarg); break;
+      case 'f': config->script = optarg; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  if (!config->num_devices || config->num_devices > HUB_MAX_DEVICES) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  sim.rng = config->seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  if (config->script && sim_hub_load_script(&sim.hub, config->script)) {
+    return 1;
+  }
+
+  memcpy(sim.hub.eui, "OSNPHUB0", 8);
+  sim.hub.pan_id[0] = 0x34;
+  sim.hub.pan_id[1] = 0x12;
+  sim.hub.radio.channel = config->hub_channel;
+  sim_hub_start(&sim.hub);
+
+  sim.devices = calloc(config->num_devices, sizeof(sim_device_t));
+
+  for (uint32_t i = 0; i < config->num_devices; i++) {
+    sim_device_t *dev = &sim.devices[i];
+
+    dev->id = i;
+    sim_device_eui(i, dev->eui);
+    dev->always_on = sim_random_uniform() < config->always_on_ratio;
+    dev->eeprom.channel = 0xff;
+    dev->eeprom.short_address[0] = 0xff;
+    dev->eeprom.short_address[1] = 0xff;
+    memset(dev->eeprom.counter_log, 0xff, SIM_COUNTER_LOG_LEN);
+
+    sim_schedule(config->boot_spread ? sim_random() % config->boot_spread : 0, SIM_EV_BOOT, i + 1, 0);
+  }
+
+  sim_radio_update(SIM_HUB_NODE);
+  sim_run();
+  _report();
+
+  return 0;
+}
@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sim.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Discrete-event core: the event heap, the random source and the shared radio medium. The medium keeps the list
+ * of frames currently on air; frames overlapping on the same channel are all lost, the others reach every node
+ * listening on that channel and accepting the destination address, minus the configured random loss.
+ */
+
+#define SIM_MAX_ON_AIR 64
+
+typedef struct {
+  uint32_t node;
+  uint8_t channel;
+  sim_time_t start;
+  sim_time_t end;
+  bool collided;
+} sim_on_air_t;
+
+sim_t sim;
+
+static sim_on_air_t on_air[SIM_MAX_ON_AIR];
+static uint32_t on_air_len;
+static sim_time_t channel_last_end[16];
+
+void sim_schedule(sim_time_t at, uint8_t type, uint32_t node, uint32_t gen) {
+  if (sim.events_len == sim.events_cap) {
+    sim.events_cap = sim.events_cap ? sim.events_cap * 2 : 1024;
+    sim.events = realloc(sim.events, sim.events_cap * sizeof(sim_event_t));
+  }
+
+  sim_event_t ev = { at, sim.event_seq++, node, gen, type };
+  uint32_t i = sim.events_len++;
+
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    sim_event_t *p = &sim.events[parent];
+
+    if (p->at < ev.at || (p->at == ev.at && p->seq < ev.seq)) {
+      break;
+    }
+
+    sim.events[i] = *p;
+    i = parent;
+  }
+
+  sim.events[i] = ev;
+}
+
+static bool _sim_pop_event(sim_event_t *out) {
+  if (!sim.events_len) {
+    return false;
+  }
+
+  *out = sim.events[0];
+  sim_event_t last = sim.events[--sim.events_len];
+  uint32_t i = 0;
+
+  for (;;) {
+    uint32_t child = i * 2 + 1;
+
+    if (child >= sim.events_len) {
+      break;
+    }
+
+    if (child + 1 < sim.events_len) {
+      sim_event_t *l = &sim.events[child];
+      sim_event_t *r = &sim.events[child + 1];
+
+      if (r->at < l->at || (r->at == l->at && r->seq < l->seq)) {
+        child++;
+      }
+    }
+
+    sim_event_t *c = &sim.events[child];
+
+    if (last.at < c->at || (last.at == c->at && last.seq < c->seq)) {
+      break;
+    }
+
+    sim.events[i] = *c;
+    i = child;
+  }
+
+  sim.events[i] = last;
+  return true;
+}
+
+uint64_t sim_random(void) {
+  // xorshift64*
+  sim.rng ^= sim.rng >> 12;
+  sim.rng ^= sim.rng << 25;
+  sim.rng ^= sim.rng >> 27;
+
+  return sim.rng * 0x2545F4914F6CDD1DULL;
+}
+
+double sim_random_uniform(void) {
+  return (sim_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void sim_histogram_add(sim_histogram_t *h, sim_time_t sample) {
+  if (h->samples_len == h->samples_cap) {
+    h->samples_cap = h->samples_cap ? h->samples_cap * 2 : 256;
+    h->samples = realloc(h->samples, h->samples_cap * sizeof(sim_time_t));
+  }
+
+  h->samples[h->samples_len++] = sample;
+}
+
+static int _sim_compare_time(const void *a, const void *b) {
+  sim_time_t x = *(const sim_time_t *) a;
+  sim_time_t y = *(const sim_time_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+sim_time_t sim_histogram_percentile(sim_histogram_t *h, double p) {
+  if (!h->samples_len) {
+    return 0;
+  }
+
+  qsort(h->samples, h->samples_len, sizeof(sim_time_t), _sim_compare_time);
+  uint32_t i = (uint32_t) (p * (h->samples_len - 1) + 0.5);
+
+  return h->samples[i];
+}
+
+sim_radio_t *sim_node_radio(uint32_t node) {
+  if (node == SIM_HUB_NODE) {
+    return &sim.hub.radio;
+  }
+
+  return &sim.devices[node - 1].radio;
+}
+
+static bool _sim_node_rx_on(uint32_t node) {
+  if (node == SIM_HUB_NODE) {
+    return sim.now >= sim.hub.down_until;
+  }
+
+  return sim_device_rx_on(&sim.devices[node - 1]);
+}
+
+void sim_radio_update(uint32_t node) {
+  sim_radio_t *radio = sim_node_radio(node);
+  bool rx_on = _sim_node_rx_on(node);
+
+  if (radio->rx_on) {
+    radio->rx_time += sim.now - radio->rx_since;
+  }
+
+  radio->rx_on = rx_on;
+  radio->rx_since = sim.now;
+}
+
+static bool _sim_channel_busy(uint8_t channel) {
+  for (uint32_t i = 0; i < on_air_len; i++) {
+    // a frame whose CCA succeeded but is still in RX-to-TX turnaround cannot be detected yet
+    if (on_air[i].channel == channel && on_air[i].start <= sim.now) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+uint8_t sim_channel_energy(uint8_t channel) {
+  if (_sim_channel_busy(channel) || (channel_last_end[channel] && sim.now - channel_last_end[channel] < SIM_ED_WINDOW)) {
+    return 0xff;
+  }
+
+  // background noise
+  return sim_random() & 0x0f;
+}
+
+static bool _sim_node_on_air(uint32_t node) {
+  for (uint32_t i = 0; i < on_air_len; i++) {
+    if (on_air[i].node == node) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void _sim_schedule_cca(uint32_t node, sim_time_t from) {
+  sim_radio_t *radio = sim_node_radio(node);
+  sim_time_t backoff = (sim_random() % (1 << radio->be)) * SIM_BACKOFF_PERIOD;
+
+  sim_schedule(from + backoff + SIM_CCA_TIME, SIM_EV_CCA, node, radio->tx_gen);
+}
+
+static void _sim_tx_done(uint32_t node, sim_time_t at, uint8_t status) {
+  sim_radio_t *radio = sim_node_radio(node);
+
+  radio->tx_gen++;
+  sim_schedule(at, SIM_EV_TX_DONE, node, (radio->tx_gen << 2) | status);
+}
+
+bool sim_radio_transmit(uint32_t node, uint8_t *buf, uint16_t len) {
+  sim_radio_t *radio = sim_node_radio(node);
+
+  // the frame would overwrite the one still being sent
+  if (radio->busy) {
+    sim.stats.tx_overruns++;
+    return false;
+  }
+
+  memcpy(radio->tx_buf, buf, len);
+  radio->tx_len = len;
+  radio->tx_ack_req = EXTRACT_FCREQACK(buf[0]);
+  radio->busy = true;
+  radio->nb = 0;
+  radio->be = SIM_MIN_BE;
+  radio->retries = 0;
+  radio->tx_gen++;
+  radio->last_ack_pending = false;
+
+  _sim_schedule_cca(node, sim.now);
+  return true;
+}
+
+static void _sim_cca(uint32_t node) {
+  sim_radio_t *radio = sim_node_radio(node);
+
+  if (_sim_channel_busy(radio->channel)) {
+    if (++radio->nb > SIM_MAX_CSMA_BACKOFFS) {
+      sim.stats.channel_busy++;
+      _sim_tx_done(node, sim.now, OSNP_TX_STATUS_CHANNEL_BUSY);
+    } else {
+      radio->be = radio->be < SIM_MAX_BE ? radio->be + 1 : SIM_MAX_BE;
+      _sim_schedule_cca(node, sim.now);
+    }
+
+    return;
+  }
+
+  if (on_air_len == SIM_MAX_ON_AIR) {
+    _sim_tx_done(node, sim.now, OSNP_TX_STATUS_CHANNEL_BUSY);
+    return;
+  }
+
+  sim_on_air_t *tx = &on_air[on_air_len++];
+  tx->node = node;
+  tx->channel = radio->channel;
+  tx->start = sim.now + SIM_TURNAROUND_TIME;
+  tx->end = tx->start + (radio->tx_len + SIM_PHY_OVERHEAD) * SIM_BYTE_TIME;
+  tx->collided = false;
+
+  for (uint32_t i = 0; i < on_air_len - 1; i++) {
+    if (on_air[i].channel == tx->channel) {
+      on_air[i].collided = true;
+      tx->collided = true;
+    }
+  }
+
+  if (tx->collided) {
+    sim.stats.collisions++;
+  }
+
+  radio->tx_time += tx->end - sim.now;
+  sim.stats.frames_sent++;
+  sim_schedule(tx->end, SIM_EV_TX_END, node, radio->tx_gen);
+}
+
+static bool _sim_address_match(uint32_t node, uint8_t *buf, uint16_t len) {
+  ieee802_15_4_frame_t frame;
+  osnp_parse_frame(buf, len, &frame);
+
+  uint8_t mode = EXTRACT_FCDSTADDR(*frame.fc_high);
+
+  if (node == SIM_HUB_NODE) {
+    return (mode == FCADDR_NONE) || (mode == FCADDR_EXT && !memcmp(frame.dst_addr, sim.hub.eui, 8));
+  }
+
+  sim_device_t *dev = &sim.devices[node - 1];
+
+  if (mode == FCADDR_SHORT) {
+    // the radio takes the group addresses of the device too, as if it had a filter for each
+    for (uint8_t i = 0; i < OSNP_GROUPS; i++) {
+      if (!memcmp(frame.dst_addr, dev->osnp.groups[i].address, 2)) {
+        return true;
+      }
+    }
+
+    return (frame.dst_addr[0] == 0xff && frame.dst_addr[1] == 0xff) || !memcmp(frame.dst_addr, dev->osnp.short_address, 2);
+  } else if (mode == FCADDR_EXT) {
+    return !memcmp(frame.dst_addr, dev->eui, 8);
+  }
+
+  return false;
+}
+
+static bool _sim_is_broadcast(uint8_t *buf, uint16_t len) {
+  ieee802_15_4_frame_t frame;
+  osnp_parse_frame(buf, len, &frame);
+
+  return EXTRACT_FCDSTADDR(*frame.fc_high) == FCADDR_SHORT && frame.dst_addr[0] == 0xff && frame.dst_addr[1] == 0xff;
+}
+
+static bool _sim_is_group(uint8_t *buf, uint16_t len) {
+  ieee802_15_4_frame_t frame;
+  osnp_parse_frame(buf, len, &frame);
+
+  return EXTRACT_FCDSTADDR(*frame.fc_high) == FCADDR_SHORT && !_sim_is_broadcast(buf, len) && (frame.dst_addr[1] & (SIM_GROUP_ADDRESS >> 8));
+}
+
+static void _sim_deliver(uint32_t node, sim_radio_t *from) {
+  uint8_t buf[128];
+  memcpy(buf, from->tx_buf, from->tx_len);
+
+  sim.stats.frames_delivered++;
+  sim.stats.bytes_delivered += from->tx_len;
+
+  if (node == SIM_HUB_NODE) {
+    sim_hub_frame_received(&sim.hub, buf, from->tx_len);
+  } else {
+    sim_device_frame_received(&sim.devices[node - 1], buf, from->tx_len);
+  }
+}
+
+static void _sim_tx_end(uint32_t node) {
+  sim_radio_t *radio = sim_node_radio(node);
+  sim_on_air_t tx;
+  uint32_t i;
+
+  for (i = 0; i < on_air_len; i++) {
+    if (on_air[i].node == node) {
+      break;
+    }
+  }
+
+  tx = on_air[i];
+  on_air[i] = on_air[--on_air_len];
+  channel_last_end[tx.channel] = sim.now;
+
+  bool broadcast = _sim_is_broadcast(radio->tx_buf, radio->tx_len);
+  bool acked = false;
+  uint32_t nodes = sim.config.num_devices + 1;
+  // a group frame is meant for every member, other frames reach at most 8 receivers
+  uint32_t receivers_max = _sim_is_group(radio->tx_buf, radio->tx_len) ? nodes : 8;
+  uint32_t receivers[nodes];
+  uint32_t receivers_len = 0;
+
+  if (!tx.collided) {
+    for (uint32_t n = 0; n < nodes && receivers_len < receivers_max; n++) {
+      sim_radio_t *rx = sim_node_radio(n);
+
+      if (n == node || rx->channel != tx.channel || !_sim_node_rx_on(n) || _sim_node_on_air(n)) {
+        continue;
+      }
+
+      if (!_sim_address_match(n, radio->tx_buf, radio->tx_len)) {
+        continue;
+      }
+
+      if (sim_random_uniform() < sim.config.loss) {
+        sim.stats.lost++;
+        continue;
+      }
+
+      receivers[receivers_len++] = n;
+
+      if (!broadcast && radio->tx_ack_req) {
+        acked = true;
+        radio->last_ack_pending = (n == SIM_HUB_NODE) && sim_hub_pending_for(&sim.hub, radio->tx_buf, radio->tx_len);
+        // the receiver is sending the ACK
+        sim_node_radio(n)->tx_time += SIM_TURNAROUND_TIME + SIM_ACK_TIME;
+      }
+    }
+  }
+
+  // a lost ACK makes the sender retry a frame which has been received already
+  if (acked && sim.config.loss > 0 && sim_random_uniform() < sim.config.loss) {
+    sim.stats.lost++;
+    acked = false;
+  }
+
+  if (!radio->tx_ack_req || broadcast) {
+    _sim_tx_done(node, sim.now, OSNP_TX_STATUS_OK);
+  } else if (acked) {
+    _sim_tx_done(node, sim.now + SIM_TURNAROUND_TIME + SIM_ACK_TIME, OSNP_TX_STATUS_OK);
+  } else if (radio->retries++ < SIM_MAX_FRAME_RETRIES) {
+    radio->rx_time += SIM_ACK_WAIT_TIME;
+    radio->nb = 0;
+    radio->be = SIM_MIN_BE;
+    radio->tx_gen++;
+    _sim_schedule_cca(node, sim.now + SIM_ACK_WAIT_TIME);
+  } else {
+    radio->rx_time += SIM_ACK_WAIT_TIME;
+    sim.stats.no_ack++;
+    _sim_tx_done(node, sim.now + SIM_ACK_WAIT_TIME, OSNP_TX_STATUS_NOACK);
+  }
+
+  for (uint32_t r = 0; r < receivers_len; r++) {
+    _sim_deliver(receivers[r], radio);
+    sim_radio_update(receivers[r]);
+  }
+}
+
+static void _sim_dispatch(sim_event_t *ev) {
+  sim_radio_t *radio;
+
+  switch (ev->type) {
+    case SIM_EV_BOOT:
+      sim_device_boot(&sim.devices[ev->node - 1]);
+      break;
+    case SIM_EV_TIMER:
+      if (ev->gen == sim.devices[ev->node - 1].timer_gen) {
+        sim_device_timer_expired(&sim.devices[ev->node - 1]);
+      }
+      break;
+    case SIM_EV_CCA:
+      if (ev->gen == sim_node_radio(ev->node)->tx_gen) {
+        _sim_cca(ev->node);
+      }
+      break;
+    case SIM_EV_TX_END:
+      _sim_tx_end(ev->node);
+      break;
+    case SIM_EV_TX_DONE:
+      radio = sim_node_radio(ev->node);
+
+      if ((ev->gen >> 2) != radio->tx_gen) {
+        break;
+      }
+
+      radio->busy = false;
+
+      if (ev->node == SIM_HUB_NODE) {
+        sim_hub_frame_sent(&sim.hub, ev->gen & 0x03);
+      } else {
+        sim_device_frame_sent(&sim.devices[ev->node - 1], ev->gen & 0x03);
+      }
+      break;
+    case SIM_EV_NOTIFICATION_TIMER:
+      if (ev->gen == sim.devices[ev->node - 1].notification_timer_gen) {
+        sim_device_notification_timer_expired(&sim.devices[ev->node - 1]);
+      }
+      break;
+    case SIM_EV_BACKOFF_TIMER:
+      if (ev->gen == sim.devices[ev->node - 1].backoff_timer_gen) {
+        sim_device_backoff_timer_expired(&sim.devices[ev->node - 1]);
+      }
+      break;
+    case SIM_EV_PROCESS:
+      sim_device_process(&sim.devices[ev->node - 1]);
+      break;
+    case SIM_EV_APP:
+      sim_device_app_event(&sim.devices[ev->node - 1]);
+      break;
+    case SIM_EV_HUB:
+      sim_hub_event(&sim.hub, ev->gen);
+      break;
+  }
+
+  sim_radio_update(ev->node);
+}
+
+void sim_run(void) {
+  sim_event_t ev;
+
+  while (_sim_pop_event(&ev) && ev.at <= sim.config.duration) {
+    sim.now = ev.at;
+    _sim_dispatch(&ev);
+  }
+
+  sim.now = sim.config.duration;
+
+  for (uint32_t n = 0; n <= sim.config.num_devices; n++) {
+    sim_radio_update(n);
+  }
+}
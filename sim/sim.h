@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SIM_H
+#define	SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "osnp.h"
+#include "compact.h"
+#include "hub_table.h"
+#include "hub_bulk.h"
+#include "energy.h"
+
+/* Virtual time, in microseconds */
+typedef uint64_t sim_time_t;
+
+#define SIM_MS(x) ((sim_time_t) (x) * 1000)
+
+/* 802.15.4 O-QPSK PHY at 2.4GHz: 250kbps, 32us per byte, 320us backoff period */
+#define SIM_BYTE_TIME 32
+#define SIM_PHY_OVERHEAD 6
+#define SIM_BACKOFF_PERIOD 320
+#define SIM_CCA_TIME 128
+#define SIM_TURNAROUND_TIME 192
+#define SIM_ACK_TIME ((5 + SIM_PHY_OVERHEAD) * SIM_BYTE_TIME)
+#define SIM_ACK_WAIT_TIME 864
+#define SIM_MAX_FRAME_RETRIES 3
+#define SIM_MAX_CSMA_BACKOFFS 4
+#define SIM_MIN_BE 3
+#define SIM_MAX_BE 5
+
+/* Energy detection reports the peak over this window, long enough to catch the traffic of a busy channel */
+#define SIM_ED_WINDOW SIM_MS(20)
+
+#define SIM_HUB_NODE 0
+
+/* Size of the EEPROM region holding the frame counter log, must fit OSNP_COUNTER_LOG_RECORDS records */
+#define SIM_COUNTER_LOG_LEN 80
+
+/* Event types */
+#define SIM_EV_BOOT 0
+#define SIM_EV_TIMER 1
+#define SIM_EV_CCA 2
+#define SIM_EV_TX_END 3
+#define SIM_EV_TX_DONE 4
+#define SIM_EV_APP 5
+#define SIM_EV_HUB 6
+#define SIM_EV_NOTIFICATION_TIMER 7
+#define SIM_EV_PROCESS 8
+#define SIM_EV_BACKOFF_TIMER 9
+
+typedef struct {
+  sim_time_t at;
+  uint64_t seq;
+  uint32_t node;
+  uint32_t gen;
+  uint8_t type;
+} sim_event_t;
+
+typedef struct {
+  uint32_t samples_len;
+  uint32_t samples_cap;
+  sim_time_t *samples;
+} sim_histogram_t;
+
+/**
+ * The radio of a simulated node: it owns the frame being transmitted and the CSMA/retry state for it.
+ */
+typedef struct {
+  uint8_t channel;
+  bool busy;
+  uint8_t tx_buf[128];
+  uint16_t tx_len;
+  bool tx_ack_req;
+  uint8_t nb;
+  uint8_t be;
+  uint8_t retries;
+  uint32_t tx_gen;
+  bool last_ack_pending;
+  sim_time_t tx_time;
+  sim_time_t rx_time;
+  sim_time_t rx_since;
+  bool rx_on;
+} sim_radio_t;
+
+typedef struct {
+  uint8_t pan_id[2];
+  uint8_t short_address[2];
+  uint8_t channel;
+  uint8_t rx_key[16];
+  uint8_t tx_key[16];
+  uint8_t group_keys[OSNP_GROUPS][16];
+  uint8_t counter_log[SIM_COUNTER_LOG_LEN];
+  uint32_t counter_log_wear[SIM_COUNTER_LOG_LEN];
+  uint32_t writes;
+  uint32_t counter_writes;
+} sim_eeprom_t;
+
+typedef struct {
+  osnp_ctx_t osnp;
+  uint32_t id;
+  uint8_t eui[8];
+  bool always_on;
+  sim_radio_t radio;
+  sim_eeprom_t eeprom;
+  uint32_t timer_gen;
+  uint32_t notification_timer_gen;
+  uint32_t backoff_timer_gen;
+  sim_time_t boot_time;
+  sim_time_t lost_association_time;
+  bool was_associated;
+  uint16_t sensor_value;
+  compact_encoder_t compact;
+  uint8_t compact_report;
+  bool compact_in_flight;
+  bool poll_in_flight;
+  uint32_t polls;
+  uint32_t polls_with_data;
+  uint32_t notifications;
+  uint32_t key_loads;
+} sim_device_t;
+
+typedef struct {
+  bool associated;
+  bool association_pending;
+  bool always_on;
+  bool in_outbox;
+  bool poll_slots;
+  bool ack_pending;
+  uint8_t groups;
+  hub_device_t *entry;
+  sim_time_t command_queued_at;
+  bool command_outstanding;
+  hub_bulk_t bulk;
+  compact_decoder_t compact;
+} sim_hub_device_t;
+
+#define SIM_HUB_OUTBOX_LEN 256
+
+typedef struct {
+  uint8_t buf[128];
+  uint16_t len;
+  int32_t device;
+  bool indirect;
+  uint8_t slot_field;
+} sim_hub_out_t;
+
+#define SIM_ACTION_COMMAND 0
+#define SIM_ACTION_DISASSOCIATE 1
+#define SIM_ACTION_RESTART 2
+#define SIM_ACTION_JOIN 3
+#define SIM_ACTION_GROUP_COMMAND 4
+
+/* Groups of the hub, group g has the short address SIM_GROUP_ADDRESS | g, above those of the devices */
+#define SIM_HUB_GROUPS 8
+#define SIM_GROUP_ADDRESS 0x8000
+
+typedef struct {
+  sim_time_t at;
+  sim_time_t every;
+  sim_time_t duration;
+  uint8_t type;
+  int32_t target;
+  uint8_t group;
+  uint8_t data[96];
+  uint16_t data_len;
+} sim_action_t;
+
+typedef struct {
+  sim_radio_t radio;
+  uint8_t eui[8];
+  uint8_t pan_id[2];
+  sim_time_t discover_period;
+  sim_time_t down_until;
+  sim_time_t persistence;
+  sim_time_t slot_period;
+  sim_time_t slot_width;
+  uint32_t group_counter[SIM_HUB_GROUPS];
+  sim_action_t *actions;
+  uint32_t actions_len;
+  sim_hub_device_t *devices;
+  hub_table_t table;
+  sim_hub_out_t outbox[SIM_HUB_OUTBOX_LEN];
+  uint32_t outbox_head;
+  uint32_t outbox_len;
+  uint8_t seq_no;
+} sim_hub_t;
+
+typedef struct {
+  uint32_t num_devices;
+  sim_time_t duration;
+  uint64_t seed;
+  double loss;
+  uint8_t hub_channel;
+  double always_on_ratio;
+  sim_time_t boot_spread;
+  sim_time_t scan_time;
+  sim_time_t scan_time_quiet;
+  sim_time_t association_wait_time;
+  sim_time_t poll_time;
+  sim_time_t poll_time_max;
+  sim_time_t pending_data_wait_time;
+  sim_time_t notification_period;
+  sim_time_t notification_latency;
+  bool compact_notifications;
+  uint32_t battery_capacity;
+  const char *script;
+} sim_config_t;
+
+typedef struct {
+  uint64_t frames_sent;
+  uint64_t frames_delivered;
+  uint64_t bytes_delivered;
+  uint64_t collisions;
+  uint64_t lost;
+  uint64_t channel_busy;
+  uint64_t no_ack;
+  uint64_t tx_overruns;
+  uint64_t commands_sent;
+  uint64_t responses_received;
+  uint64_t notifications_received;
+  uint64_t notification_bytes;
+  uint64_t compact_decoded;
+  uint64_t compact_keyframes;
+  uint64_t compact_undecodable;
+  uint64_t frame_counter_alignments;
+  uint64_t undelivered[3];
+  uint64_t bulk_transfers;
+  uint64_t bulk_bytes;
+  uint64_t bulk_fragments;
+  uint64_t slot_corrections;
+  uint64_t group_commands;
+  uint64_t group_frames;
+  uint64_t group_copies;
+  uint64_t group_deliveries;
+  sim_histogram_t association_latency;
+  sim_histogram_t reassociation_latency;
+  sim_histogram_t command_latency;
+  sim_histogram_t bulk_latency;
+  sim_histogram_t slot_error;
+} sim_stats_t;
+
+typedef struct {
+  sim_config_t config;
+  sim_time_t now;
+  uint64_t rng;
+  uint64_t event_seq;
+  sim_event_t *events;
+  uint32_t events_len;
+  uint32_t events_cap;
+  sim_hub_t hub;
+  sim_device_t *devices;
+  sim_stats_t stats;
+} sim_t;
+
+extern sim_t sim;
+
+void sim_run(void);
+void sim_schedule(sim_time_t at, uint8_t type, uint32_t node, uint32_t gen);
+uint64_t sim_random(void);
+double sim_random_uniform(void);
+
+void sim_histogram_add(sim_histogram_t *h, sim_time_t sample);
+sim_time_t sim_histogram_percentile(sim_histogram_t *h, double p);
+
+sim_radio_t *sim_node_radio(uint32_t node);
+bool sim_radio_transmit(uint32_t node, uint8_t *buf, uint16_t len);
+uint8_t sim_channel_energy(uint8_t channel);
+void sim_radio_update(uint32_t node);
+
+void sim_device_boot(sim_device_t *dev);
+void sim_device_timer_expired(sim_device_t *dev);
+void sim_device_frame_received(sim_device_t *dev, uint8_t *buf, uint16_t len);
+void sim_device_frame_sent(sim_device_t *dev, uint8_t status);
+void sim_device_app_event(sim_device_t *dev);
+void sim_device_notification_timer_expired(sim_device_t *dev);
+void sim_device_process(sim_device_t *dev);
+void sim_device_backoff_timer_expired(sim_device_t *dev);
+bool sim_device_rx_on(sim_device_t *dev);
+
+void sim_device_eui(uint32_t id, uint8_t *eui);
+int sim_hub_load_script(sim_hub_t *hub, const char *path);
+void sim_hub_start(sim_hub_t *hub);
+void sim_hub_event(sim_hub_t *hub, uint32_t action);
+void sim_hub_frame_received(sim_hub_t *hub, uint8_t *buf, uint16_t len);
+void sim_hub_frame_sent(sim_hub_t *hub, uint8_t status);
+bool sim_hub_pending_for(sim_hub_t *hub, uint8_t *buf, uint16_t len);
+
+#endif	/* SIM_H */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "osnp.h"
+#include "tlv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Microbenchmarks of the frame parser and of the TLV codec, the code every received frame goes through. Each case
+ * runs for a fixed number of iterations and reports the time per operation, so that runs on the same machine can be
+ * compared to catch regressions of the hot paths.
+ *
+ * usage: osnp-bench [iterations]
+ */
+
+#define BENCH_DEFAULT_ITERATIONS 2000000
+
+static volatile uint32_t bench_sink;
+
+static const char *bench_addr_modes[4] = { "none", "rsvd", "short", "ext" };
+
+static double _bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void _bench_report(const char *name, uint32_t iterations, double elapsed) {
+  double ns = elapsed / iterations;
+
+  printf("%-36s %8.1f ns/op %12.0f op/s\n", name, ns, 1e9 / ns);
+}
+
+/*
+ * Builds a frame with the given frame control through the stack, as the device would, with a 20 byte payload.
+ */
+static uint16_t _bench_build_frame(uint8_t fc_low, uint8_t fc_high, uint8_t *buf) {
+  ieee802_15_4_frame_t frame;
+
+  memset(buf, 0, 128);
+  osnp_initialize_frame(fc_low, fc_high, buf, &frame);
+  frame.payload_len = 20;
+
+  for (uint8_t i = 0; i < frame.payload_len; i++) {
+    frame.payload[i] = i;
+  }
+
+  return frame.header_len + frame.sec_header_len + frame.payload_len + (frame.sec_header_len ? OSNP_MIC_LENGTH : 0) + IEEE802_15_4_FCS_LEN;
+}
+
+static void _bench_parse_frames(uint32_t iterations) {
+  static const uint8_t modes[3] = { FCADDR_NONE, FCADDR_SHORT, FCADDR_EXT };
+  uint8_t buf[128];
+  char name[64];
+
+  for (uint8_t dst = 0; dst < 3; dst++) {
+    for (uint8_t src = 0; src < 3; src++) {
+      for (uint8_t pancomp = 0; pancomp < 2; pancomp++) {
+        for (uint8_t sec = 0; sec < 2; sec++) {
+          uint8_t fc_low = FCFRTYP(FCFRTYP_DATA) | FCREQACK | (pancomp ? FCPANCOMP : 0) | (sec ? FCSECEN : 0);
+          uint8_t fc_high = FCDSTADDR(modes[dst]) | FCSRCADDR(modes[src]);
+          uint16_t len = _bench_build_frame(fc_low, fc_high, buf);
+          ieee802_15_4_frame_t frame;
+          uint32_t sum = 0;
+
+          double start = _bench_now();
+
+          for (uint32_t i = 0; i < iterations; i++) {
+            osnp_parse_frame(buf, len, &frame);
+            sum += frame.payload_len;
+          }
+
+          double elapsed = _bench_now() - start;
+          bench_sink = sum;
+
+          snprintf(name, sizeof(name), "parse dst=%-5s src=%-5s%s%s", bench_addr_modes[modes[dst]], bench_addr_modes[modes[src]],
+            pancomp ? " pc" : "   ", sec ? " sec" : "");
+          _bench_report(name, iterations, elapsed);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * A GET_DATA response like the devices send: a container with a status and a few primitive data items.
+ */
+static uint16_t _bench_encode_response(uint8_t *buf, uint16_t cap) {
+  uint8_t value[4] = { 0x01, 0x02, 0x03, 0x04 };
+  uint8_t status = 0;
+  tlv_writer_t writer;
+
+  tlv_writer_init(&writer, buf, cap);
+  tlv_writer_open(&writer, 0xE1);
+  tlv_writer_open(&writer, OSNP_GET_DATA);
+  tlv_writer_put(&writer, 0x80, &status, 1);
+
+  for (uint8_t i = 0; i < 6; i++) {
+    tlv_writer_put(&writer, 0x81 + i, value, sizeof(value));
+  }
+
+  tlv_writer_close(&writer);
+  tlv_writer_close(&writer);
+
+  return writer.pos;
+}
+
+static uint32_t _bench_decode(uint8_t *buf, uint16_t len, uint8_t depth) {
+  tlv_reader_t reader;
+  uint16_t tag;
+  uint16_t value_len;
+  uint8_t *value;
+  uint32_t sum = 0;
+
+  tlv_reader_init(&reader, buf, len);
+
+  while (tlv_reader_next(&reader, &tag, &value_len, &value)) {
+    sum += tag + value_len;
+
+    if (depth && ((tag > 0xff ? tag >> 8 : tag) & 0x20)) {
+      sum += _bench_decode(value, value_len, depth - 1);
+    }
+  }
+
+  return sum;
+}
+
+static void _bench_tlv(uint32_t iterations) {
+  uint8_t buf[128];
+  uint16_t len = 0;
+  uint32_t sum = 0;
+  uint16_t out;
+
+  double start = _bench_now();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    len = _bench_encode_response(buf, sizeof(buf));
+    sum += len;
+  }
+
+  _bench_report("tlv encode response", iterations, _bench_now() - start);
+
+  start = _bench_now();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    sum += _bench_decode(buf, len, 2);
+  }
+
+  _bench_report("tlv decode response", iterations, _bench_now() - start);
+
+  // an indefinite length container must be walked to find its end
+  uint8_t indefinite[64] = { 0xE3, 0x80 };
+  uint16_t indefinite_len = 2;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    indefinite_len += tlv_write_tag(&indefinite[indefinite_len], 0x81 + i);
+    indefinite_len += tlv_write_length(&indefinite[indefinite_len], 2);
+    indefinite[indefinite_len++] = i;
+    indefinite[indefinite_len++] = i;
+  }
+
+  indefinite_len += tlv_write_undefined_length_terminator(&indefinite[indefinite_len]);
+
+  start = _bench_now();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    sum += _bench_decode(indefinite, indefinite_len, 1);
+  }
+
+  _bench_report("tlv decode indefinite length", iterations, _bench_now() - start);
+
+  start = _bench_now();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    uint16_t tag = (i & 1) ? 0x9F00 | (i & 0x7f) : 0x80 | (i & 0x1e);
+    uint16_t n = tlv_write_tag(buf, tag);
+    n += tlv_read_tag(buf, &out);
+    sum += n + out;
+  }
+
+  _bench_report("tlv write+read tag", iterations, _bench_now() - start);
+
+  start = _bench_now();
+
+  for (uint32_t i = 0; i < iterations; i++) {
+    uint16_t n = tlv_write_length(buf, i & 0x3ff);
+    n += tlv_read_length(buf, &out);
+    sum += n + out;
+  }
+
+  _bench_report("tlv write+read length", iterations, _bench_now() - start);
+
+  bench_sink = sum;
+}
+
+int main(int argc, char **argv) {
+  uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_ITERATIONS;
+
+  if (!iterations) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  osnp_initialize();
+
+  printf("%u iterations per case\n\n", iterations);
+  _bench_parse_frames(iterations);
+  printf("\n");
+  _bench_tlv(iterations);
+
+  return 0;
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "ccm.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Unit tests of the software AES-CCM* (../ccm.c): the FIPS-197 and RFC 3610 known answers, frames secured one at a
+ * time against the batch functions and the nonce of frames without an extended source address. Built twice, with
+ * AES-NI when the CPU supports it and with CCM_NO_AESNI for the portable core.
+ *
+ * usage: osnp-ccm
+ */
+
+#define CCM_CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); ccm_failures++; } } while (0)
+
+#define CCM_TEST_FRAMES 9
+
+static int ccm_failures;
+
+/* Parses a hex string, returns the number of bytes written */
+static uint16_t _ccm_hex(const char *hex, uint8_t *out) {
+  uint16_t len = 0;
+
+  for (; hex[0] && hex[1]; hex += 2) {
+    unsigned int b;
+    sscanf(hex, "%2x", &b);
+    out[len++] = b;
+  }
+
+  return len;
+}
+
+/* Builds a data frame with a short destination address, the given source address and a secured header with the given
+ * counter, followed by payload_len bytes counting up from seed. The MIC and the FCS are left zero. */
+static void _ccm_frame(uint8_t *buf, ieee802_15_4_frame_t *frame, bool ext_src, uint32_t counter, uint8_t payload_len, uint8_t seed) {
+  uint8_t src_len = ext_src ? 8 : 2;
+
+  memset(buf, 0, IEEE802_15_4_MAX_FRAME_LEN);
+  memset(frame, 0, sizeof(*frame));
+
+  frame->backing_buffer = buf;
+  frame->fc_low = &buf[0];
+  frame->fc_high = &buf[1];
+  frame->seq_no = &buf[2];
+  frame->dst_pan = &buf[3];
+  frame->dst_addr = &buf[5];
+  frame->src_pan = &buf[7];
+  frame->src_addr = &buf[9];
+  frame->header_len = 9 + src_len;
+  frame->frame_counter = &buf[frame->header_len];
+  frame->key_counter = &buf[frame->header_len + 4];
+  frame->sec_header_len = 5;
+  frame->payload = &buf[frame->header_len + frame->sec_header_len];
+  frame->payload_len = payload_len;
+
+  buf[0] = FCFRTYP_DATA | FCSECEN;
+  buf[1] = ((ext_src ? FCADDR_EXT : FCADDR_SHORT) << 6) | (FCADDR_SHORT << 2);
+  buf[2] = seed;
+  buf[3] = 0x34;
+  buf[4] = 0x12;
+
+  for (uint8_t i = 0; i < src_len; i++) {
+    frame->src_addr[i] = 0xa0 + seed + i;
+  }
+
+  for (uint8_t i = 0; i < 4; i++) {
+    frame->frame_counter[i] = counter >> (8 * i);
+  }
+
+  *frame->key_counter = 0x01;
+
+  for (uint8_t i = 0; i < payload_len; i++) {
+    frame->payload[i] = seed + i;
+  }
+}
+
+static void _test_aes_fips197(void) {
+  static const char *vectors[][3] = {
+    // FIPS-197 appendix B and appendix C.1
+    { "2b7e151628aed2a6abf7158809cf4f3c", "3243f6a8885a308d313198a2e0370734", "3925841d02dc09fbdc118597196a0b32" },
+    { "000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff", "69c4e0d86a7b0430d8cdb78070b4c55a" },
+  };
+
+  for (uint8_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    uint8_t raw_key[16], block[16], expected[16];
+    ccm_key_t key;
+
+    _ccm_hex(vectors[i][0], raw_key);
+    _ccm_hex(vectors[i][1], block);
+    _ccm_hex(vectors[i][2], expected);
+
+    ccm_key_init(&key, raw_key);
+    ccm_encrypt_block(&key, block);
+    CCM_CHECK(!memcmp(block, expected, sizeof(block)));
+  }
+}
+
+static void _test_ccm_rfc3610(void) {
+  static const char *vectors[][5] = {
+    // RFC 3610 packet vectors #1 and #2: nonce, header, payload, encrypted payload and MIC
+    { "00000003020100a0a1a2a3a4a5", "0001020304050607", "08090a0b0c0d0e0f101112131415161718191a1b1c1d1e",
+      "588c979a61c663d2f066d0c2c0f989806d5f6b61dac384", "17e8d12cfdf926e0" },
+    { "00000004030201a0a1a2a3a4a5", "0001020304050607", "08090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+      "72c91a36e135f8cf291ca894085c87e3cc15c439c9e43a3b", "a091d56e10400916" },
+  };
+  uint8_t raw_key[16];
+  ccm_key_t key;
+
+  _ccm_hex("c0c1c2c3c4c5c6c7c8c9cacbcccdcecf", raw_key);
+  ccm_key_init(&key, raw_key);
+
+  for (uint8_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    uint8_t nonce[CCM_NONCE_LEN], aad[16], msg[32], expected[32], mic[8], expected_mic[8];
+    uint16_t aad_len, msg_len;
+
+    _ccm_hex(vectors[i][0], nonce);
+    aad_len = _ccm_hex(vectors[i][1], aad);
+    msg_len = _ccm_hex(vectors[i][2], msg);
+    _ccm_hex(vectors[i][3], expected);
+    _ccm_hex(vectors[i][4], expected_mic);
+
+    ccm_seal(&key, nonce, aad, aad_len, msg, msg_len, mic, sizeof(mic));
+    CCM_CHECK(!memcmp(msg, expected, msg_len));
+    CCM_CHECK(!memcmp(mic, expected_mic, sizeof(mic)));
+
+    CCM_CHECK(ccm_open(&key, nonce, aad, aad_len, msg, msg_len, mic, sizeof(mic)));
+    _ccm_hex(vectors[i][2], expected);
+    CCM_CHECK(!memcmp(msg, expected, msg_len));
+
+    // a modified header fails the MIC and the message is not released
+    _ccm_hex(vectors[i][3], msg);
+    aad[0] ^= 0x01;
+    CCM_CHECK(!ccm_open(&key, nonce, aad, aad_len, msg, msg_len, mic, sizeof(mic)));
+
+    for (uint16_t j = 0; j < msg_len; j++) {
+      CCM_CHECK(msg[j] == 0);
+    }
+  }
+}
+
+static void _test_frame_matches_seal(void) {
+  static const uint8_t raw_key[16] = { 0x4f, 0x53, 0x4e, 0x50, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c };
+  uint8_t buf[IEEE802_15_4_MAX_FRAME_LEN], copy[IEEE802_15_4_MAX_FRAME_LEN];
+  uint8_t nonce[CCM_NONCE_LEN], mic[4];
+  ieee802_15_4_frame_t frame;
+  ccm_key_t key;
+
+  ccm_key_init(&key, raw_key);
+  _ccm_frame(buf, &frame, true, 0x01020304, 40, 7);
+  memcpy(copy, buf, sizeof(copy));
+
+  // the nonce is the source address and the counter, most significant byte first, then the security level
+  CCM_CHECK(ccm_frame_nonce(&frame, NULL, SL_AES_CCM_32, nonce));
+  CCM_CHECK(nonce[0] == frame.src_addr[7] && nonce[7] == frame.src_addr[0]);
+  CCM_CHECK(nonce[8] == 0x01 && nonce[11] == 0x04);
+
+  CCM_CHECK(ccm_secure_frame(&key, &frame, NULL, SL_AES_CCM_32) == 4);
+
+  uint16_t header_len = frame.header_len + frame.sec_header_len;
+  ccm_seal(&key, nonce, copy, header_len, &copy[header_len], frame.payload_len, mic, sizeof(mic));
+  CCM_CHECK(!memcmp(buf, copy, header_len + frame.payload_len));
+  CCM_CHECK(!memcmp(frame.payload + frame.payload_len, mic, sizeof(mic)));
+
+  CCM_CHECK(ccm_unsecure_frame(&key, &frame, NULL, SL_AES_CCM_32));
+
+  for (uint8_t i = 0; i < frame.payload_len; i++) {
+    CCM_CHECK(frame.payload[i] == 7 + i);
+  }
+}
+
+static void _test_batch_matches_single(void) {
+  static const uint8_t levels[] = { SL_AES_CCM_32, SL_AES_CCM_64, SL_AES_CCM_128, SL_AES_CTR, SL_AES_CBC_MAC_32 };
+  static const uint8_t lengths[] = { 0, 1, 15, 16, 17, 33, 64, 80, 90 };
+  uint8_t single[CCM_TEST_FRAMES][IEEE802_15_4_MAX_FRAME_LEN], batch[CCM_TEST_FRAMES][IEEE802_15_4_MAX_FRAME_LEN];
+  ieee802_15_4_frame_t single_frames[CCM_TEST_FRAMES], batch_frames[CCM_TEST_FRAMES];
+  ccm_key_t keys[3];
+  ccm_job_t jobs[CCM_TEST_FRAMES];
+
+  for (uint8_t k = 0; k < 3; k++) {
+    uint8_t raw_key[16];
+
+    for (uint8_t i = 0; i < sizeof(raw_key); i++) {
+      raw_key[i] = 0x11 * k + i;
+    }
+
+    ccm_key_init(&keys[k], raw_key);
+  }
+
+  // more frames than a batch, with different keys, suites and lengths
+  for (uint8_t i = 0; i < CCM_TEST_FRAMES; i++) {
+    uint8_t level = levels[i % sizeof(levels)];
+
+    _ccm_frame(single[i], &single_frames[i], true, 1000 + i, lengths[i], i);
+    _ccm_frame(batch[i], &batch_frames[i], true, 1000 + i, lengths[i], i);
+
+    CCM_CHECK(ccm_secure_frame(&keys[i % 3], &single_frames[i], NULL, level) == ccm_mic_length(level));
+
+    jobs[i] = (ccm_job_t) { &keys[i % 3], &batch_frames[i], NULL, level, false };
+  }
+
+  ccm_secure_frames(jobs, CCM_TEST_FRAMES);
+
+  for (uint8_t i = 0; i < CCM_TEST_FRAMES; i++) {
+    CCM_CHECK(jobs[i].ok);
+    CCM_CHECK(!memcmp(single[i], batch[i], IEEE802_15_4_MAX_FRAME_LEN));
+  }
+
+  // one frame altered in transit fails alone
+  batch_frames[5].payload[0] ^= 0x80;
+  CCM_CHECK(ccm_unsecure_frames(jobs, CCM_TEST_FRAMES) == CCM_TEST_FRAMES - 1);
+
+  for (uint8_t i = 0; i < CCM_TEST_FRAMES; i++) {
+    CCM_CHECK(jobs[i].ok == (i != 5));
+    CCM_CHECK(ccm_unsecure_frame(&keys[i % 3], &single_frames[i], NULL, levels[i % sizeof(levels)]));
+
+    if (i != 5) {
+      CCM_CHECK(!memcmp(single[i], batch[i], IEEE802_15_4_MAX_FRAME_LEN));
+    }
+  }
+}
+
+static void _test_short_source_address(void) {
+  static const uint8_t raw_key[16] = { 0 };
+  static const uint8_t eui[8] = { 'O', 'S', 'N', 'P', 'T', 'E', 'S', 'T' };
+  uint8_t buf[IEEE802_15_4_MAX_FRAME_LEN], copy[IEEE802_15_4_MAX_FRAME_LEN], other[IEEE802_15_4_MAX_FRAME_LEN];
+  uint8_t nonce[CCM_NONCE_LEN];
+  ieee802_15_4_frame_t frame, other_frame;
+  ccm_key_t key;
+
+  ccm_key_init(&key, raw_key);
+  _ccm_frame(buf, &frame, false, 42, 20, 3);
+  memcpy(copy, buf, sizeof(copy));
+
+  // the 2 byte address and what follows it are not an EUI-64
+  CCM_CHECK(!ccm_frame_nonce(&frame, NULL, SL_AES_CCM_32, nonce));
+  CCM_CHECK(ccm_secure_frame(&key, &frame, NULL, SL_AES_CCM_32) == 0);
+  CCM_CHECK(!memcmp(buf, copy, sizeof(buf)));
+
+  // in a batch, only that frame is skipped
+  _ccm_frame(other, &other_frame, true, 42, 20, 3);
+  ccm_job_t jobs[2] = { { &key, &frame, NULL, SL_AES_CCM_32, true }, { &key, &other_frame, NULL, SL_AES_CCM_32, false } };
+  ccm_secure_frames(jobs, 2);
+  CCM_CHECK(!jobs[0].ok && jobs[1].ok);
+  CCM_CHECK(!memcmp(buf, copy, sizeof(buf)));
+
+  // with the sender named the frame is secured and verified
+  CCM_CHECK(ccm_frame_nonce(&frame, eui, SL_AES_CCM_32, nonce));
+  CCM_CHECK(nonce[0] == 'T' && nonce[7] == 'O');
+  CCM_CHECK(ccm_secure_frame(&key, &frame, eui, SL_AES_CCM_32) == 4);
+  memcpy(copy, buf, sizeof(copy));
+  CCM_CHECK(ccm_unsecure_frame(&key, &frame, eui, SL_AES_CCM_32));
+
+  // without it the frame is not released
+  memcpy(buf, copy, sizeof(buf));
+  CCM_CHECK(!ccm_unsecure_frame(&key, &frame, NULL, SL_AES_CCM_32));
+
+  for (uint8_t i = 0; i < frame.payload_len; i++) {
+    CCM_CHECK(frame.payload[i] == 0);
+  }
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} ccm_tests[] = {
+  { "AES-128 matches FIPS-197", _test_aes_fips197 },
+  { "CCM matches RFC 3610", _test_ccm_rfc3610 },
+  { "secured frame matches ccm_seal", _test_frame_matches_seal },
+  { "batch matches frames secured one at a time", _test_batch_matches_single },
+  { "short source address needs the sender EUI-64", _test_short_source_address },
+};
+
+int main(int argc, char **argv) {
+  int failed = 0;
+
+#if defined(CCM_NO_AESNI) || !defined(__GNUC__) || !(defined(__x86_64__) || defined(__i386__))
+  printf("AES: portable\n\n");
+#else
+  printf("AES: %s\n\n", __builtin_cpu_supports("aes") ? "AES-NI" : "portable");
+#endif
+
+  for (uint8_t i = 0; i < sizeof(ccm_tests) / sizeof(ccm_tests[0]); i++) {
+    int before = ccm_failures;
+
+    ccm_tests[i].run();
+
+    if (ccm_failures != before) {
+      failed++;
+    }
+
+    printf("%-48s %s\n", ccm_tests[i].name, ccm_failures != before ? "FAIL" : "ok");
+  }
+
+  printf("\n%d of %u tests failed\n", failed, (unsigned) (sizeof(ccm_tests) / sizeof(ccm_tests[0])));
+
+  return failed ? 1 : 0;
+}
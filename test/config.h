@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * OSNP configuration for the host benchmark and fuzz harness: a single instance stack whose callbacks, in host.c,
+ * do nothing. Only the frame and TLV code is exercised. The stack unit tests (stack.c, built with OSNP_STACK_TEST)
+ * run multi-instance stacks whose callbacks record what the stack does.
+ */
+
+#ifndef CONFIG_H
+#define	CONFIG_H
+
+#include "osnp.h"
+#include "tlv.h"
+
+#define OSNP_FRAME_COUNTER_WINDOW 1000
+#define OSNP_MIC_LENGTH 4
+#define OSNP_SECURITY_LEVEL SL_AES_CCM_32
+#define OSNP_DEVICE_CAPABILITES RX_POLL_DRIVEN
+
+#ifdef OSNP_STACK_TEST
+#define OSNP_COUNTER_LOG_RECORDS 4
+#define OSNP_REPLAY_WINDOW 16
+#define OSNP_CLOCK() stack_clock_ms()
+#define OSNP_DELIVERY_HANDLER stack_delivery
+#define OSNP_PERFORM_HANDLER stack_perform
+#define OSNP_KEYS_LOCK() stack_keys_lock(ctx)
+#define OSNP_KEYS_UNLOCK() stack_keys_unlock(ctx)
+#define OSNP_ENERGY_DETECT
+#define OSNP_SCAN_DWELL 250
+#define OSNP_SCAN_DWELL_QUIET 50
+
+uint32_t stack_clock_ms(void);
+void stack_delivery(OSNP_CTX_PARAM_ uint8_t tx_class, uint8_t status);
+uint8_t stack_perform(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure);
+void stack_keys_lock(OSNP_CTX_PARAM);
+void stack_keys_unlock(OSNP_CTX_PARAM);
+uint8_t osnp_energy_detect(OSNP_CTX_PARAM_ uint8_t channel);
+
+bool osnp_read_item(OSNP_CTX_PARAM_ uint16_t tag, int32_t *value);
+void osnp_build_bulk(OSNP_CTX_PARAM_ uint8_t source, osnp_bulk_writer_t *writer);
+#endif
+
+void osnp_load_eui(OSNP_CTX_PARAM_ uint8_t *eui);
+void osnp_load_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id);
+void osnp_load_short_address(OSNP_CTX_PARAM_ uint8_t *short_address);
+void osnp_load_channel(OSNP_CTX_PARAM_ uint8_t *channel);
+void osnp_load_master_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf);
+void osnp_load_rx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf);
+void osnp_load_tx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf);
+void osnp_read_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len);
+
+void osnp_write_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id);
+void osnp_write_short_address(OSNP_CTX_PARAM_ uint8_t *short_address);
+void osnp_write_channel(OSNP_CTX_PARAM_ uint8_t *channel);
+void osnp_write_rx_key(OSNP_CTX_PARAM_ uint8_t *key);
+void osnp_write_tx_key(OSNP_CTX_PARAM_ uint8_t *key);
+void osnp_write_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len);
+void osnp_write_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *key);
+void osnp_load_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *tmp_buf);
+
+void osnp_start_channel_scanning_timer(OSNP_CTX_PARAM_ uint32_t dwell);
+void osnp_start_association_wait_timer(OSNP_CTX_PARAM);
+void osnp_start_poll_timer(OSNP_CTX_PARAM_ uint32_t interval);
+void osnp_start_pending_data_wait_timer(OSNP_CTX_PARAM);
+void osnp_start_notification_timer(OSNP_CTX_PARAM);
+void osnp_stop_active_timer(OSNP_CTX_PARAM);
+
+void osnp_switch_channel(OSNP_CTX_PARAM_ uint8_t channel);
+void osnp_transmit_frame(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame);
+bool osnp_get_pending_frames(OSNP_CTX_PARAM);
+
+void osnp_build_notification(OSNP_CTX_PARAM_ tlv_writer_t *notification);
+
+#endif	/* CONFIG_H */
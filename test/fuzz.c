@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "osnp.h"
+#include "tlv.h"
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+
+/*
+ * Fuzz harness for the code handling over-the-air input: the frame parser and the TLV reader, along with the TLV
+ * writer they are checked against. Each input is copied to a buffer of its exact size, so that AddressSanitizer
+ * catches any read past it, and goes through:
+ *
+ * - osnp_parse_frame: a frame it accepts must have all its fields within the input, and building a frame with the
+ *   same frame control and fields through the stack must give back the same bytes and the same parse;
+ * - the TLV reader, on the whole input and on the payload of a valid frame: copying what it reads through the
+ *   writer must give well formed data which reads back the same, and copies again to the same bytes;
+ * - tlv_read_tag and tlv_read_length on every tag and length written by tlv_write_tag and tlv_write_length, with
+ *   values taken from the input;
+ * - osnp_frame_received_cb, for inputs no longer than a frame, with the stack brought beforehand to each of its states
+ *   by the frames a hub would send, so that the handlers of every state see truncated and malformed frames.
+ *
+ * Failed checks abort. The entry point is LLVMFuzzerTestOneInput, so the harness can be linked with libFuzzer
+ * (make fuzz-libfuzzer). Otherwise it has its own driver, which runs the corpus given on the command line and then
+ * random mutations of it:
+ *
+ * usage: osnp-fuzz [-n iterations] [-s seed] <corpus file or directory>...
+ */
+
+#define FUZZ_MAX_INPUT_LEN 256
+#define FUZZ_MAX_CORPUS 1024
+#define FUZZ_DEFAULT_ITERATIONS 200000
+
+/* Levels of constructed objects the TLV checks descend into */
+#define FUZZ_TLV_DEPTH 4
+
+#define FUZZ_CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); abort(); } } while (0)
+
+static volatile uint32_t fuzz_sink;
+
+/* Sanitizer errors abort too, so that the driver saves the input like for failed checks */
+const char *__asan_default_options(void) {
+  return "abort_on_error=1";
+}
+
+const char *__ubsan_default_options(void) {
+  return "abort_on_error=1:print_stacktrace=1";
+}
+
+static bool _fuzz_within(ieee802_15_4_frame_t *frame, uint8_t *field, uint16_t len, uint16_t end) {
+  return !field || (field >= frame->backing_buffer && field + len <= frame->backing_buffer + end);
+}
+
+static void _fuzz_touch(uint8_t *field, uint16_t len) {
+  uint32_t sum = 0;
+
+  for (uint16_t i = 0; field && i < len; i++) {
+    sum += field[i];
+  }
+
+  fuzz_sink += sum;
+}
+
+static uint16_t _fuzz_addr_len(uint8_t mode) {
+  return mode == FCADDR_SHORT ? 2 : (mode == FCADDR_EXT ? 8 : 0);
+}
+
+static void _fuzz_copy_field(ieee802_15_4_frame_t *to, uint8_t *to_field, ieee802_15_4_frame_t *from, uint8_t *from_field, uint16_t len) {
+  FUZZ_CHECK(!to_field == !from_field);
+
+  if (from_field) {
+    FUZZ_CHECK(to_field - to->backing_buffer == from_field - from->backing_buffer);
+    memcpy(to_field, from_field, len);
+  }
+}
+
+static void _fuzz_frame(uint8_t *data, uint16_t len) {
+  ieee802_15_4_frame_t frame;
+  ieee802_15_4_frame_t built;
+  ieee802_15_4_frame_t reparsed;
+  uint8_t buf[FUZZ_MAX_INPUT_LEN + 128];
+
+  if (!osnp_parse_frame(data, len, &frame)) {
+    FUZZ_CHECK(frame.payload_len == 0);
+    return;
+  }
+
+  uint16_t dst_len = _fuzz_addr_len(EXTRACT_FCDSTADDR(*frame.fc_high));
+  uint16_t src_len = _fuzz_addr_len(EXTRACT_FCSRCADDR(*frame.fc_high));
+  uint16_t mic_len = frame.sec_header_len ? OSNP_MIC_LENGTH : 0;
+  uint16_t end = len - IEEE802_15_4_FCS_LEN - mic_len;
+
+  FUZZ_CHECK(frame.header_len + frame.sec_header_len + frame.payload_len + mic_len + IEEE802_15_4_FCS_LEN == len);
+  FUZZ_CHECK(frame.payload == frame.backing_buffer + frame.header_len + frame.sec_header_len);
+  FUZZ_CHECK(_fuzz_within(&frame, frame.dst_pan, 2, frame.header_len));
+  FUZZ_CHECK(_fuzz_within(&frame, frame.dst_addr, dst_len, frame.header_len));
+  FUZZ_CHECK(_fuzz_within(&frame, frame.src_pan, 2, frame.header_len));
+  FUZZ_CHECK(_fuzz_within(&frame, frame.src_addr, src_len, frame.header_len));
+  FUZZ_CHECK(_fuzz_within(&frame, frame.frame_counter, 4, frame.header_len + frame.sec_header_len));
+  FUZZ_CHECK(_fuzz_within(&frame, frame.key_counter, 1, frame.header_len + frame.sec_header_len));
+  FUZZ_CHECK(_fuzz_within(&frame, frame.payload, frame.payload_len, end));
+
+  _fuzz_touch(frame.dst_pan, 2);
+  _fuzz_touch(frame.dst_addr, dst_len);
+  _fuzz_touch(frame.src_pan, 2);
+  _fuzz_touch(frame.src_addr, src_len);
+  _fuzz_touch(frame.frame_counter, 4);
+  _fuzz_touch(frame.key_counter, 1);
+  _fuzz_touch(frame.payload, frame.payload_len);
+
+  // build the same frame the way the stack does, then fill the fields it does not know
+  memset(buf, 0, sizeof(buf));
+  osnp_initialize_frame(*frame.fc_low, *frame.fc_high, buf, &built);
+
+  FUZZ_CHECK(built.header_len == frame.header_len && built.sec_header_len == frame.sec_header_len);
+
+  buf[2] = *frame.seq_no;
+  _fuzz_copy_field(&built, built.dst_pan, &frame, frame.dst_pan, 2);
+  _fuzz_copy_field(&built, built.dst_addr, &frame, frame.dst_addr, dst_len);
+  _fuzz_copy_field(&built, built.src_pan, &frame, frame.src_pan, 2);
+  _fuzz_copy_field(&built, built.src_addr, &frame, frame.src_addr, src_len);
+  _fuzz_copy_field(&built, built.frame_counter, &frame, frame.frame_counter, 4);
+  _fuzz_copy_field(&built, built.key_counter, &frame, frame.key_counter, 1);
+  memcpy(built.payload, frame.payload, frame.payload_len);
+  memcpy(&buf[end], &data[end], len - end);
+
+  FUZZ_CHECK(!memcmp(buf, data, len));
+  FUZZ_CHECK(osnp_parse_frame(buf, len, &reparsed));
+  FUZZ_CHECK(reparsed.payload_len == frame.payload_len && reparsed.payload - buf == frame.payload - data);
+}
+
+static bool _fuzz_is_constructed(uint16_t tag) {
+  return (tag > 0xff ? tag >> 8 : tag) & 0x20;
+}
+
+/*
+ * Copies what the reader reads to the writer. Constructed objects whose content does not parse are copied as they
+ * are, as is done by code which only looks at the outer levels. Returns false if the reader failed.
+ */
+static bool _fuzz_tlv_copy(tlv_reader_t *reader, tlv_writer_t *writer, uint8_t depth) {
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
+
+  while (tlv_reader_next(reader, &tag, &len, &value)) {
+    tlv_reader_t child;
+    tlv_writer_t scratch;
+    uint8_t scratch_buf[FUZZ_MAX_INPUT_LEN];
+
+    tlv_reader_init(&child, value, len);
+    tlv_writer_init(&scratch, scratch_buf, sizeof(scratch_buf));
+
+    if (_fuzz_is_constructed(tag) && depth && _fuzz_tlv_copy(&child, &scratch, depth - 1)) {
+      FUZZ_CHECK(!scratch.error);
+      FUZZ_CHECK(tlv_writer_open(writer, tag));
+      FUZZ_CHECK(tlv_writer_put_raw(writer, scratch_buf, scratch.pos));
+      FUZZ_CHECK(tlv_writer_close(writer));
+    } else {
+      FUZZ_CHECK(tlv_writer_put(writer, tag, value, len));
+    }
+  }
+
+  return !reader->error;
+}
+
+static void _fuzz_tlv(uint8_t *data, uint16_t len) {
+  tlv_reader_t reader;
+  tlv_writer_t writer;
+  uint8_t copy[FUZZ_MAX_INPUT_LEN + 16];
+  uint8_t copy2[FUZZ_MAX_INPUT_LEN + 16];
+
+  // the copy is never larger: definite lengths are written in their shortest form and indefinite ones take the
+  // place of their end-of-contents marker
+  tlv_reader_init(&reader, data, len);
+  tlv_writer_init(&writer, copy, sizeof(copy));
+  _fuzz_tlv_copy(&reader, &writer, FUZZ_TLV_DEPTH);
+
+  FUZZ_CHECK(!writer.error && writer.pos <= len);
+
+  uint16_t copy_len = writer.pos;
+
+  tlv_reader_init(&reader, copy, copy_len);
+  tlv_writer_init(&writer, copy2, sizeof(copy2));
+
+  FUZZ_CHECK(_fuzz_tlv_copy(&reader, &writer, FUZZ_TLV_DEPTH));
+  FUZZ_CHECK(writer.pos == copy_len && !memcmp(copy, copy2, copy_len));
+}
+
+static void _fuzz_tag_and_length(uint8_t *data, uint16_t len) {
+  uint8_t buf[4];
+  uint16_t out;
+
+  for (uint16_t i = 0; i + 1 < len; i += 2) {
+    uint16_t value = (data[i] << 8) | data[i + 1];
+    uint16_t tag = data[i];
+
+    // two byte tags have 0x1F in the low bits of the first byte and a second byte below 0x80
+    if ((tag & 0x1f) == 0x1f) {
+      tag = (tag << 8) | (data[i + 1] & 0x7f);
+    }
+
+    uint16_t n = tlv_write_tag(buf, tag);
+    FUZZ_CHECK(n == (tag > 0xff ? 2 : 1));
+    FUZZ_CHECK(tlv_read_tag(buf, &out) == n && out == tag);
+
+    n = tlv_write_length(buf, value);
+    FUZZ_CHECK(n == (value <= 0x7f ? 1 : (value <= 0xff ? 2 : 3)));
+    FUZZ_CHECK(tlv_read_length(buf, &out) == n && out == value);
+  }
+}
+
+/* Feeds a frame from the hub, addressed to the device, to the stack and completes what it sends in return */
+static void _fuzz_stack_receive(uint8_t fc_low, uint32_t counter, const uint8_t *payload, uint8_t payload_len) {
+  uint8_t buf[IEEE802_15_4_MAX_FRAME_LEN];
+  uint8_t len = 0;
+
+  buf[len++] = fc_low;
+  buf[len++] = FCDSTADDR(FCADDR_EXT) | FCSRCADDR(FCADDR_EXT);
+  buf[len++] = 0;
+  buf[len++] = 0x34;
+  buf[len++] = 0x12;
+  memcpy(&buf[len], "OSNPHOST", 8);
+  len += 8;
+  buf[len++] = 0x34;
+  buf[len++] = 0x12;
+  memcpy(&buf[len], "OSNPHUB0", 8);
+  len += 8;
+
+  if (fc_low & FCSECEN) {
+    buf[len++] = counter;
+    buf[len++] = counter >> 8;
+    buf[len++] = counter >> 16;
+    buf[len++] = counter >> 24;
+    buf[len++] = 0x01;
+  }
+
+  if (payload_len) {
+    memcpy(&buf[len], payload, payload_len);
+    len += payload_len;
+  }
+
+  memset(&buf[len], 0, OSNP_MIC_LENGTH + IEEE802_15_4_FCS_LEN);
+  len += ((fc_low & FCSECEN) ? OSNP_MIC_LENGTH : 0) + IEEE802_15_4_FCS_LEN;
+
+  osnp_frame_received_cb(buf, len);
+  osnp_frame_sent_cb(OSNP_TX_STATUS_OK);
+}
+
+/* Initializes the stack, which has no stored frame counters and scans, and brings it to the given state */
+static void _fuzz_stack_enter(uint8_t state) {
+  static const uint8_t association_request[35] = { OSNP_MCMD_ASSOCIATION_REQ, [33] = 0x01, [34] = 0x00 };
+
+  osnp_initialize();
+
+  // any frame heard while scanning means a hub is on the channel
+  if (state >= WAITING_ASSOCIATION_REQUEST) {
+    _fuzz_stack_receive(FCFRTYP(FCFRTYP_DATA), 0, NULL, 0);
+  }
+
+  if (state >= ASSOCIATED) {
+    _fuzz_stack_receive(FCFRTYP(FCFRTYP_MCMD), 0, association_request, sizeof(association_request));
+  }
+
+  // the hub announces pending data in the frame pending bit, the empty payload carries no command
+  if (state >= WAITING_PENDING_DATA) {
+    _fuzz_stack_receive(FCFRTYP(FCFRTYP_DATA) | FCSECEN | FCFRPEN, 1, NULL, 0);
+  }
+}
+
+static void _fuzz_stack(uint8_t *data, uint16_t len) {
+  if (len > IEEE802_15_4_MAX_FRAME_LEN) {
+    return;
+  }
+
+  for (uint8_t state = SCANNING_CHANNELS; state <= WAITING_PENDING_DATA; state++) {
+    _fuzz_stack_enter(state);
+
+    // the handlers may keep nothing of the frame, which is overwritten by the next one
+    uint8_t *frame = malloc(len ? len : 1);
+    memcpy(frame, data, len);
+
+    osnp_frame_received_cb(frame, len);
+    osnp_frame_sent_cb(OSNP_TX_STATUS_OK);
+
+    free(frame);
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *input, size_t size) {
+  if (size > FUZZ_MAX_INPUT_LEN) {
+    return 0;
+  }
+
+  uint8_t *data = malloc(size ? size : 1);
+  memcpy(data, input, size);
+
+  _fuzz_frame(data, size);
+  _fuzz_tlv(data, size);
+  _fuzz_tag_and_length(data, size);
+  _fuzz_stack(data, size);
+
+  ieee802_15_4_frame_t frame;
+
+  if (osnp_parse_frame(data, size, &frame) && frame.payload_len) {
+    // the payload in a buffer of its own, to catch reads past it too
+    uint8_t *payload = malloc(frame.payload_len);
+    memcpy(payload, frame.payload, frame.payload_len);
+    _fuzz_tlv(payload, frame.payload_len);
+    free(payload);
+  }
+
+  free(data);
+
+  return 0;
+}
+
+#ifndef OSNP_FUZZ_LIBFUZZER
+typedef struct {
+  uint8_t data[FUZZ_MAX_INPUT_LEN];
+  uint16_t len;
+} fuzz_input_t;
+
+static fuzz_input_t fuzz_corpus[FUZZ_MAX_CORPUS];
+static uint32_t fuzz_corpus_len;
+static fuzz_input_t fuzz_current;
+static uint64_t fuzz_rng;
+
+static uint32_t _fuzz_random(void) {
+  fuzz_rng ^= fuzz_rng << 13;
+  fuzz_rng ^= fuzz_rng >> 7;
+  fuzz_rng ^= fuzz_rng << 17;
+
+  return fuzz_rng >> 32;
+}
+
+/*
+ * Saves the input being run when a sanitizer or a failed check aborts.
+ */
+static void _fuzz_save_crash(int sig) {
+  FILE *f = fopen("crash.bin", "wb");
+
+  if (f) {
+    fwrite(fuzz_current.data, 1, fuzz_current.len, f);
+    fclose(f);
+    fprintf(stderr, "input saved to crash.bin\n");
+  }
+
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+static void _fuzz_run(fuzz_input_t *input) {
+  fuzz_current = *input;
+  LLVMFuzzerTestOneInput(input->data, input->len);
+}
+
+static void _fuzz_load_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+
+  if (!f) {
+    perror(path);
+    return;
+  }
+
+  if (fuzz_corpus_len < FUZZ_MAX_CORPUS) {
+    fuzz_input_t *input = &fuzz_corpus[fuzz_corpus_len++];
+    input->len = fread(input->data, 1, FUZZ_MAX_INPUT_LEN, f);
+  }
+
+  fclose(f);
+}
+
+static void _fuzz_load(const char *path) {
+  struct stat st;
+
+  if (stat(path, &st)) {
+    perror(path);
+    return;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    _fuzz_load_file(path);
+    return;
+  }
+
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  char file[1024];
+
+  while (dir && (entry = readdir(dir))) {
+    if (entry->d_name[0] != '.') {
+      snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+      _fuzz_load_file(file);
+    }
+  }
+
+  if (dir) {
+    closedir(dir);
+  }
+}
+
+/*
+ * Applies a few random edits, favouring the ones that make lengths and address modes inconsistent: byte and bit
+ * changes, truncation, insertion and removal of bytes and splicing with another input.
+ */
+static void _fuzz_mutate(fuzz_input_t *input) {
+  static const uint8_t interesting[] = { 0x00, 0x01, 0x1f, 0x20, 0x7f, 0x80, 0x81, 0x82, 0x83, 0xff };
+  uint8_t edits = 1 + _fuzz_random() % 4;
+
+  for (uint8_t e = 0; e < edits; e++) {
+    uint16_t pos = input->len ? _fuzz_random() % input->len : 0;
+
+    switch (_fuzz_random() % 7) {
+      case 0:
+        if (input->len) {
+          input->data[pos] ^= 1 << (_fuzz_random() % 8);
+        }
+        break;
+      case 1:
+        if (input->len) {
+          input->data[pos] = interesting[_fuzz_random() % sizeof(interesting)];
+        }
+        break;
+      case 2:
+        if (input->len) {
+          input->data[pos] = _fuzz_random();
+        }
+        break;
+      case 3:
+        input->len = input->len ? _fuzz_random() % input->len : 0;
+        break;
+      case 4:
+        if (input->len < FUZZ_MAX_INPUT_LEN) {
+          memmove(&input->data[pos + 1], &input->data[pos], input->len - pos);
+          input->data[pos] = interesting[_fuzz_random() % sizeof(interesting)];
+          input->len++;
+        }
+        break;
+      case 5:
+        if (input->len) {
+          memmove(&input->data[pos], &input->data[pos + 1], input->len - pos - 1);
+          input->len--;
+        }
+        break;
+      case 6: {
+        fuzz_input_t *other = &fuzz_corpus[_fuzz_random() % fuzz_corpus_len];
+        uint16_t from = other->len ? _fuzz_random() % other->len : 0;
+        uint16_t n = other->len - from;
+
+        if (pos + n > FUZZ_MAX_INPUT_LEN) {
+          n = FUZZ_MAX_INPUT_LEN - pos;
+        }
+
+        memcpy(&input->data[pos], &other->data[from], n);
+        input->len = pos + n > input->len ? pos + n : input->len;
+        break;
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  uint32_t iterations = FUZZ_DEFAULT_ITERATIONS;
+  uint64_t seed = 1;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      iterations = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else {
+      _fuzz_load(argv[i]);
+    }
+  }
+
+  if (!fuzz_corpus_len) {
+    fprintf(stderr, "usage: %s [-n iterations] [-s seed] <corpus file or directory>...\n", argv[0]);
+    return 1;
+  }
+
+  signal(SIGABRT, _fuzz_save_crash);
+  signal(SIGSEGV, _fuzz_save_crash);
+
+  osnp_initialize();
+  fuzz_rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  for (uint32_t n = 0; n < fuzz_corpus_len; n++) {
+    _fuzz_run(&fuzz_corpus[n]);
+  }
+
+  for (uint32_t n = 0; n < iterations; n++) {
+    fuzz_input_t input = fuzz_corpus[_fuzz_random() % fuzz_corpus_len];
+    _fuzz_mutate(&input);
+    _fuzz_run(&input);
+  }
+
+  printf("%u corpus inputs, %u mutations, seed %llu: ok\n", fuzz_corpus_len, iterations, (unsigned long long) seed);
+
+  return 0;
+}
+#endif
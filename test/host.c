@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+/*
+ * Callbacks of the host stack instance. The EUI and addresses are fixed so that built frames are reproducible,
+ * everything else does nothing.
+ */
+
+void osnp_load_eui(OSNP_CTX_PARAM_ uint8_t *eui) {
+  memcpy(eui, "OSNPHOST", 8);
+}
+
+void osnp_load_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id) {
+  pan_id[0] = 0x34;
+  pan_id[1] = 0x12;
+}
+
+void osnp_load_short_address(OSNP_CTX_PARAM_ uint8_t *short_address) {
+  short_address[0] = 0x01;
+  short_address[1] = 0x00;
+}
+
+void osnp_load_channel(OSNP_CTX_PARAM_ uint8_t *channel) {
+  *channel = 0;
+}
+
+void osnp_load_master_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memset(tmp_buf, 0, 16);
+}
+
+void osnp_load_rx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memset(tmp_buf, 0, 16);
+}
+
+void osnp_load_tx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memset(tmp_buf, 0, 16);
+}
+
+void osnp_read_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len) {
+  memset(buf, 0xff, len);
+}
+
+void osnp_write_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id) {}
+void osnp_write_short_address(OSNP_CTX_PARAM_ uint8_t *short_address) {}
+void osnp_write_channel(OSNP_CTX_PARAM_ uint8_t *channel) {}
+void osnp_write_rx_key(OSNP_CTX_PARAM_ uint8_t *key) {}
+void osnp_write_tx_key(OSNP_CTX_PARAM_ uint8_t *key) {}
+void osnp_write_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len) {}
+
+void osnp_start_channel_scanning_timer(OSNP_CTX_PARAM_ uint32_t dwell) {}
+void osnp_start_association_wait_timer(OSNP_CTX_PARAM) {}
+void osnp_start_poll_timer(OSNP_CTX_PARAM_ uint32_t interval) {}
+void osnp_start_pending_data_wait_timer(OSNP_CTX_PARAM) {}
+void osnp_start_notification_timer(OSNP_CTX_PARAM) {}
+void osnp_stop_active_timer(OSNP_CTX_PARAM) {}
+
+void osnp_switch_channel(OSNP_CTX_PARAM_ uint8_t channel) {}
+void osnp_transmit_frame(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {}
+
+bool osnp_get_pending_frames(OSNP_CTX_PARAM) {
+  return false;
+}
+
+void osnp_build_notification(OSNP_CTX_PARAM_ tlv_writer_t *notification) {}
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "hub_bulk.h"
+#include "hub_table.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Unit tests of the hub-side modules built without the stack: bulk transfer reassembly and the device table, built
+ * small by the Makefile.
+ *
+ * usage: osnp-hub
+ */
+
+#define HUB_CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); hub_failures++; } } while (0)
+
+static int hub_failures;
+
+/* Builds the value of a fragment of the given transfer whose data is len bytes counting up from seq * 16 */
+static uint16_t _hub_fragment(uint8_t *value, uint8_t id, uint16_t seq, uint8_t flags, uint8_t len) {
+  value[0] = id;
+  value[1] = flags | ((seq >> 8) & 0x3f);
+  value[2] = seq & 0xff;
+
+  for (uint8_t i = 0; i < len; i++) {
+    value[3 + i] = seq * 16 + i;
+  }
+
+  return 3 + len;
+}
+
+static void _test_in_order(void) {
+  hub_bulk_t bulk;
+  uint8_t value[128];
+  uint8_t ack[HUB_BULK_ACK_LEN];
+  uint8_t stream[64];
+  uint16_t len;
+
+  hub_bulk_init(&bulk);
+
+  len = _hub_fragment(value, 1, 0, 0, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == HUB_BULK_STORED);
+  HUB_CHECK(hub_bulk_reassemble(&bulk, stream, sizeof(stream)) == 0);
+
+  len = _hub_fragment(value, 1, 1, 0, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == HUB_BULK_STORED);
+
+  len = _hub_fragment(value, 1, 2, OSNP_BULK_LAST | OSNP_BULK_ACK_REQ, 8);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == (HUB_BULK_STORED | HUB_BULK_COMPLETE | HUB_BULK_ACK));
+
+  uint8_t expected_ack[HUB_BULK_ACK_LEN] = { OSNP_BULK_ACK_TAG, 4, 1, 0x00, 0x03, 0x00 };
+  HUB_CHECK(!memcmp(ack, expected_ack, sizeof(ack)));
+
+  HUB_CHECK(hub_bulk_reassemble(&bulk, stream, sizeof(stream)) == 40);
+
+  for (uint8_t i = 0; i < 40; i++) {
+    HUB_CHECK(stream[i] == i);
+  }
+
+  // the final fragment sent again only gets its acknowledgement, the transfer is complete once
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == HUB_BULK_ACK);
+  HUB_CHECK(!memcmp(ack, expected_ack, sizeof(ack)));
+}
+
+static void _test_selective_ack(void) {
+  hub_bulk_t bulk;
+  uint8_t value[128];
+  uint8_t ack[HUB_BULK_ACK_LEN];
+  uint8_t stream[128];
+  uint16_t len;
+
+  hub_bulk_init(&bulk);
+
+  // fragment 1 is lost in the first round of 0 to 3, then 5 arrives with 4 still missing
+  len = _hub_fragment(value, 7, 0, 0, 16);
+  hub_bulk_fragment_received(&bulk, value, len, ack);
+  len = _hub_fragment(value, 7, 2, 0, 16);
+  hub_bulk_fragment_received(&bulk, value, len, ack);
+  len = _hub_fragment(value, 7, 3, OSNP_BULK_ACK_REQ, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == (HUB_BULK_STORED | HUB_BULK_ACK));
+
+  uint8_t first_ack[HUB_BULK_ACK_LEN] = { OSNP_BULK_ACK_TAG, 4, 7, 0x00, 0x01, 0x03 };
+  HUB_CHECK(!memcmp(ack, first_ack, sizeof(ack)));
+
+  len = _hub_fragment(value, 7, 1, 0, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == HUB_BULK_STORED);
+  len = _hub_fragment(value, 7, 5, OSNP_BULK_LAST | OSNP_BULK_ACK_REQ, 4);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == (HUB_BULK_STORED | HUB_BULK_ACK));
+
+  uint8_t second_ack[HUB_BULK_ACK_LEN] = { OSNP_BULK_ACK_TAG, 4, 7, 0x00, 0x04, 0x01 };
+  HUB_CHECK(!memcmp(ack, second_ack, sizeof(ack)));
+  HUB_CHECK(hub_bulk_reassemble(&bulk, stream, sizeof(stream)) == 0);
+
+  // duplicates are ignored
+  len = _hub_fragment(value, 7, 2, 0, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == 0);
+
+  len = _hub_fragment(value, 7, 4, 0, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == (HUB_BULK_STORED | HUB_BULK_COMPLETE));
+  HUB_CHECK(hub_bulk_reassemble(&bulk, stream, sizeof(stream)) == 84);
+
+  for (uint8_t i = 0; i < 84; i++) {
+    HUB_CHECK(stream[i] == i);
+  }
+
+  // a stream longer than the buffer is not reassembled
+  HUB_CHECK(hub_bulk_reassemble(&bulk, stream, 83) == 0);
+}
+
+static void _test_new_transfer(void) {
+  hub_bulk_t bulk;
+  uint8_t value[128];
+  uint8_t ack[HUB_BULK_ACK_LEN];
+  uint8_t stream[64];
+  uint16_t len;
+
+  hub_bulk_init(&bulk);
+
+  len = _hub_fragment(value, 1, 0, 0, 16);
+  hub_bulk_fragment_received(&bulk, value, len, ack);
+  len = _hub_fragment(value, 1, 1, 0, 16);
+  hub_bulk_fragment_received(&bulk, value, len, ack);
+
+  // a new id abandons the fragments of the previous transfer
+  len = _hub_fragment(value, 2, 1, OSNP_BULK_LAST | OSNP_BULK_ACK_REQ, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == (HUB_BULK_STORED | HUB_BULK_ACK));
+
+  uint8_t expected_ack[HUB_BULK_ACK_LEN] = { OSNP_BULK_ACK_TAG, 4, 2, 0x00, 0x00, 0x01 };
+  HUB_CHECK(!memcmp(ack, expected_ack, sizeof(ack)));
+
+  len = _hub_fragment(value, 2, 0, 0, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == (HUB_BULK_STORED | HUB_BULK_COMPLETE));
+  HUB_CHECK(hub_bulk_reassemble(&bulk, stream, sizeof(stream)) == 32);
+}
+
+static void _test_malformed(void) {
+  hub_bulk_t bulk;
+  uint8_t value[160];
+  uint8_t ack[HUB_BULK_ACK_LEN];
+  uint16_t len;
+
+  hub_bulk_init(&bulk);
+
+  len = _hub_fragment(value, 1, 0, OSNP_BULK_ACK_REQ, 0);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, 2, ack) == 0);
+
+  len = _hub_fragment(value, 1, 0, OSNP_BULK_ACK_REQ, HUB_BULK_FRAGMENT_LEN + 1);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == 0);
+
+  len = _hub_fragment(value, 1, 0, 0, HUB_BULK_FRAGMENT_LEN);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == HUB_BULK_STORED);
+
+  // a fragment past the largest transfer is neither stored nor taken as the last one
+  len = _hub_fragment(value, 1, HUB_BULK_MAX_FRAGMENTS, OSNP_BULK_LAST | OSNP_BULK_ACK_REQ, 16);
+  HUB_CHECK(hub_bulk_fragment_received(&bulk, value, len, ack) == HUB_BULK_ACK);
+  HUB_CHECK(ack[3] == 0x00 && ack[4] == 0x01);
+  HUB_CHECK(bulk.last == -1 && !bulk.done);
+}
+
+static hub_table_t hub_table;
+
+static void _hub_eui(uint8_t *eui, uint16_t n) {
+  memcpy(eui, "OSNPDEV", 6);
+  eui[6] = n >> 8;
+  eui[7] = n;
+}
+
+/* Returns the home slot of a short address in the index, found by adding it alone to an empty table */
+static uint16_t _hub_home(uint16_t address) {
+  uint8_t eui[8];
+  uint8_t short_address[2] = { address, address >> 8 };
+
+  hub_table_init(&hub_table);
+  _hub_eui(eui, 0);
+
+  hub_device_t *device = hub_table_add(&hub_table, eui, short_address);
+
+  for (uint16_t slot = 0; slot < HUB_INDEX_LEN; slot++) {
+    if (hub_table.by_short[slot] == device - hub_table.devices) {
+      return slot;
+    }
+  }
+
+  return HUB_NONE;
+}
+
+/* Finds count short addresses from first on whose home slot is the given one */
+static void _hub_find_addresses(uint16_t home, uint16_t *addresses, uint8_t count, uint16_t first) {
+  for (uint16_t address = first; count; address++) {
+    if (_hub_home(address) == home) {
+      *addresses++ = address;
+      count--;
+    }
+  }
+}
+
+static hub_device_t *_hub_add(uint16_t n, uint16_t address) {
+  uint8_t eui[8];
+  uint8_t short_address[2] = { address, address >> 8 };
+
+  _hub_eui(eui, n);
+
+  return hub_table_add(&hub_table, eui, short_address);
+}
+
+static hub_device_t *_hub_find(uint16_t address) {
+  uint8_t short_address[2] = { address, address >> 8 };
+
+  return hub_table_find_short(&hub_table, short_address);
+}
+
+/*
+ * Entries whose probe sequence wraps around the end of the index are found, and removing an entry moves back those
+ * following it, so that the slots emptied end the probe sequences again.
+ */
+static void _test_index_wraparound(void) {
+  uint16_t last[3];
+  uint16_t first;
+
+  _hub_find_addresses(HUB_INDEX_LEN - 1, last, 3, 1);
+  _hub_find_addresses(0, &first, 1, 1);
+  hub_table_init(&hub_table);
+
+  hub_device_t *a = _hub_add(1, last[0]);
+  hub_device_t *b = _hub_add(2, last[1]);
+  hub_device_t *c = _hub_add(3, first);
+  hub_device_t *d = _hub_add(4, last[2]);
+
+  HUB_CHECK(a && b && c && d);
+  HUB_CHECK(hub_table.by_short[HUB_INDEX_LEN - 1] == a - hub_table.devices);
+  HUB_CHECK(hub_table.by_short[0] == b - hub_table.devices && hub_table.by_short[1] == c - hub_table.devices);
+  HUB_CHECK(hub_table.by_short[2] == d - hub_table.devices);
+  HUB_CHECK(_hub_find(last[0]) == a && _hub_find(last[1]) == b && _hub_find(first) == c && _hub_find(last[2]) == d);
+
+  // every entry moves back by one slot, across the end of the index
+  hub_table_remove(&hub_table, a);
+  HUB_CHECK(hub_table.by_short[HUB_INDEX_LEN - 1] == b - hub_table.devices);
+  HUB_CHECK(hub_table.by_short[0] == c - hub_table.devices && hub_table.by_short[1] == d - hub_table.devices);
+  HUB_CHECK(hub_table.by_short[2] == HUB_NONE);
+  HUB_CHECK(!_hub_find(last[0]) && _hub_find(last[1]) == b && _hub_find(first) == c && _hub_find(last[2]) == d);
+
+  // the entry at its home slot stays, the one after it moves back over the slot emptied
+  hub_table_remove(&hub_table, b);
+  HUB_CHECK(hub_table.by_short[HUB_INDEX_LEN - 1] == d - hub_table.devices);
+  HUB_CHECK(hub_table.by_short[0] == c - hub_table.devices && hub_table.by_short[1] == HUB_NONE);
+  HUB_CHECK(_hub_find(first) == c && _hub_find(last[2]) == d);
+  HUB_CHECK(hub_table.devices_len == 2);
+}
+
+/* A full table refuses new devices but still updates known ones, and a removed device frees its entry */
+static void _test_table_full(void) {
+  uint8_t eui[8];
+
+  hub_table_init(&hub_table);
+
+  for (uint16_t i = 0; i < HUB_MAX_DEVICES; i++) {
+    HUB_CHECK(_hub_add(i, 0x100 + i));
+  }
+
+  HUB_CHECK(hub_table.devices_len == HUB_MAX_DEVICES);
+  HUB_CHECK(!_hub_add(HUB_MAX_DEVICES, 0x200));
+
+  // a known EUI moves to a free short address, not to one in use
+  hub_device_t *device = _hub_add(0, 0x300);
+  HUB_CHECK(device && _hub_find(0x300) == device && !_hub_find(0x100));
+  HUB_CHECK(!_hub_add(0, 0x101) && _hub_find(0x300) == device);
+
+  hub_table_remove(&hub_table, _hub_find(0x105));
+  HUB_CHECK(_hub_add(HUB_MAX_DEVICES, 0x105));
+
+  _hub_eui(eui, 5);
+  HUB_CHECK(!hub_table_find_eui(&hub_table, eui) && hub_table.devices_len == HUB_MAX_DEVICES);
+}
+
+/* Frames are returned in the order queued, expired ones being dropped from the head */
+static void _test_queue_order(void) {
+  uint8_t payload[HUB_FRAME_PAYLOAD_LEN + 1] = { 0 };
+
+  hub_table_init(&hub_table);
+
+  hub_device_t *device = _hub_add(1, 0x0001);
+  hub_device_t *other = _hub_add(2, 0x0002);
+
+  for (uint8_t i = 0; i < HUB_DEVICE_QUEUE_LEN; i++) {
+    payload[0] = i;
+    HUB_CHECK(hub_enqueue(&hub_table, device, FCFRTYP_DATA, payload, 1, 100 + i, (i < 2) ? 10 : 0));
+  }
+
+  HUB_CHECK(!hub_enqueue(&hub_table, device, FCFRTYP_DATA, payload, 1, 200, 0));
+  HUB_CHECK(!hub_enqueue(&hub_table, other, FCFRTYP_DATA, payload, sizeof(payload), 200, 0));
+
+  hub_frame_t *frame = hub_peek(&hub_table, device, 105);
+  HUB_CHECK(frame && frame->payload[0] == 0);
+  hub_dequeue(&hub_table, device);
+
+  frame = hub_peek(&hub_table, device, 105);
+  HUB_CHECK(frame && frame->payload[0] == 1);
+
+  // the second frame has expired, frames without persistence never do
+  frame = hub_peek(&hub_table, device, 0xffffff);
+  HUB_CHECK(frame && frame->payload[0] == 2 && hub_table.expired == 1);
+  hub_dequeue(&hub_table, device);
+
+  frame = hub_peek(&hub_table, device, 0xffffff);
+  HUB_CHECK(frame && frame->payload[0] == 3);
+  hub_dequeue(&hub_table, device);
+  HUB_CHECK(!hub_peek(&hub_table, device, 0xffffff) && hub_table.frames_len == 0);
+
+  // the slab is shared, filled through two devices it has no frame left for a third one
+  hub_device_t *third = _hub_add(3, 0x0003);
+
+  for (uint8_t i = 0; i < HUB_SLAB_LEN; i++) {
+    HUB_CHECK(hub_enqueue(&hub_table, (i & 1) ? other : device, FCFRTYP_DATA, payload, 1, 300, 0));
+  }
+
+  HUB_CHECK(!hub_enqueue(&hub_table, third, FCFRTYP_DATA, payload, 1, 300, 0));
+  hub_table_remove(&hub_table, other);
+  HUB_CHECK(hub_table.frames_len == HUB_SLAB_LEN / 2);
+  HUB_CHECK(hub_enqueue(&hub_table, third, FCFRTYP_DATA, payload, 1, 300, 0));
+}
+
+/* Frame counters only move forward, and the last one is refused */
+static void _test_frame_counter(void) {
+  uint8_t buf[4];
+  ieee802_15_4_frame_t frame;
+  hub_device_t device;
+
+  memset(&device, 0, sizeof(device));
+  frame.frame_counter = buf;
+
+  uint32_t counters[5] = { 5, 4, 6, UINT32_MAX, 7 };
+  bool accepted[5] = { true, false, true, false, true };
+
+  for (uint8_t i = 0; i < 5; i++) {
+    buf[0] = counters[i];
+    buf[1] = counters[i] >> 8;
+    buf[2] = counters[i] >> 16;
+    buf[3] = counters[i] >> 24;
+    HUB_CHECK(hub_accept_frame_counter(&device, &frame) == accepted[i]);
+  }
+
+  HUB_CHECK(device.rx_frame_counter == 8);
+}
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+} hub_test_t;
+
+static const hub_test_t hub_tests[] = {
+  { "bulk fragments in order", _test_in_order },
+  { "bulk selective acknowledgement", _test_selective_ack },
+  { "bulk new transfer", _test_new_transfer },
+  { "bulk malformed fragments", _test_malformed },
+  { "table index wraparound and removal", _test_index_wraparound },
+  { "table full", _test_table_full },
+  { "table queue order", _test_queue_order },
+  { "table frame counter", _test_frame_counter },
+};
+
+int main(int argc, char **argv) {
+  int failed = 0;
+
+  for (uint8_t i = 0; i < sizeof(hub_tests) / sizeof(hub_tests[0]); i++) {
+    int before = hub_failures;
+
+    hub_tests[i].run();
+
+    if (hub_failures != before) {
+      failed++;
+    }
+
+    printf("%-48s %s\n", hub_tests[i].name, hub_failures != before ? "FAIL" : "ok");
+  }
+
+  printf("\n%d of %u tests failed\n", failed, (unsigned) (sizeof(hub_tests) / sizeof(hub_tests[0])));
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,1326 @@
+/*
+ * Copyright (C) 2014, Michele Balistreri
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "compact.h"
+#include "energy.h"
+#include "hub_bulk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Unit tests of the stack state machine. Each test runs a fresh OSNP_MULTI_INSTANCE instance built with the optional
+ * features enabled by the Makefile, whose callbacks below record what the stack does: the frames handed to the
+ * radio, the delivery reports and the counter log, kept in RAM. Frames from the hub are built by hand, unsecured
+ * data being all the stack sees of a secured frame once the radio has decrypted it.
+ *
+ * usage: osnp-stack
+ */
+
+#define STACK_MAX_TX 32
+
+/* Tag of the reading sent in notifications */
+#define STACK_READING_TAG 0x01
+
+/* Short address of the group joined by the tests, little endian */
+static const uint8_t stack_group_address[2] = { 0x01, 0x80 };
+
+#define STACK_CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); stack_failures++; } } while (0)
+
+typedef struct {
+  uint8_t eui[8];
+  uint8_t pan_id[2];
+  uint8_t short_address[2];
+  uint8_t channel;
+  uint8_t radio_channel;
+  uint8_t counter_log[OSNP_COUNTER_LOG_RECORDS * OSNP_COUNTER_LOG_RECORD_LEN];
+  uint8_t tx[STACK_MAX_TX][128];
+  uint8_t tx_payload[STACK_MAX_TX];
+  uint8_t tx_payload_len[STACK_MAX_TX];
+  uint8_t tx_len;
+  bool pending;
+  uint8_t deliveries;
+  uint8_t delivered_class[STACK_MAX_TX];
+  uint8_t delivered_status[STACK_MAX_TX];
+  bool compact_notifications;
+  compact_encoder_t compact;
+  uint8_t compact_deliveries;
+  uint8_t compact_report;
+  bool compact_in_flight;
+  int32_t reading;
+  uint16_t bulk_len;
+  uint8_t performed;
+  uint8_t notification_timers;
+  uint32_t poll_timer;
+  uint32_t scan_dwell;
+  uint8_t channel_energy[16];
+  bool in_interrupt;
+  uint8_t keys_locked;
+  uint8_t unlocked_key_loads;
+  uint8_t master_key_loads;
+  uint8_t session_key_loads;
+} stack_device_t;
+
+#define DEV(ctx) ((stack_device_t *) (ctx)->user_data)
+
+/* Internal to osnp.c, checked against the frame parser */
+bool _osnp_initialize_frame_from_template(OSNP_CTX_PARAM_ uint8_t index, ieee802_15_4_frame_t *frame);
+
+static const uint8_t stack_hub_eui[8] = { 'O', 'S', 'N', 'P', 'H', 'U', 'B', '0' };
+
+static uint32_t stack_clock;
+static uint32_t stack_hub_counter;
+static uint8_t stack_hub_seq_no;
+static int stack_failures;
+
+uint32_t stack_clock_ms(void) {
+  return stack_clock;
+}
+
+void stack_delivery(OSNP_CTX_PARAM_ uint8_t tx_class, uint8_t status) {
+  stack_device_t *dev = DEV(ctx);
+
+  if (dev->deliveries < STACK_MAX_TX) {
+    dev->delivered_class[dev->deliveries] = tx_class;
+    dev->delivered_status[dev->deliveries] = status;
+    dev->deliveries++;
+  }
+
+  if (tx_class == OSNP_TX_CLASS_NOTIFICATION && dev->compact_in_flight) {
+    dev->compact_deliveries++;
+    compact_encoder_delivered(&dev->compact, dev->compact_report, status == OSNP_TX_STATUS_OK);
+  }
+}
+
+/* Counts the commands performed, each answering with a result filling the rest of the response */
+uint8_t stack_perform(OSNP_CTX_PARAM_ tlv_reader_t *params, tlv_writer_t *response, bool secure) {
+  uint8_t result[128] = { 0 };
+  uint16_t room = response->cap - response->pos;
+
+  DEV(ctx)->performed++;
+
+  if (room > 2) {
+    tlv_writer_put(response, 0x81, result, room - 2);
+  }
+
+  return OSNP_SUCCESS;
+}
+
+void stack_keys_lock(OSNP_CTX_PARAM) {
+  DEV(ctx)->keys_locked++;
+}
+
+void stack_keys_unlock(OSNP_CTX_PARAM) {
+  DEV(ctx)->keys_locked--;
+}
+
+/* Keys loaded outside osnp_select_rx_key must be loaded with the interrupt calling it masked */
+static void _stack_key_loaded(osnp_ctx_t *ctx) {
+  if (!DEV(ctx)->in_interrupt && !DEV(ctx)->keys_locked) {
+    DEV(ctx)->unlocked_key_loads++;
+  }
+}
+
+void osnp_load_eui(OSNP_CTX_PARAM_ uint8_t *eui) {
+  memcpy(eui, DEV(ctx)->eui, 8);
+}
+
+void osnp_load_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id) {
+  memcpy(pan_id, DEV(ctx)->pan_id, 2);
+}
+
+void osnp_load_short_address(OSNP_CTX_PARAM_ uint8_t *short_address) {
+  memcpy(short_address, DEV(ctx)->short_address, 2);
+}
+
+void osnp_load_channel(OSNP_CTX_PARAM_ uint8_t *channel) {
+  *channel = DEV(ctx)->channel;
+}
+
+void osnp_load_master_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memset(tmp_buf, 0, 16);
+  _stack_key_loaded(ctx);
+  DEV(ctx)->master_key_loads++;
+}
+
+void osnp_load_rx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memset(tmp_buf, 0, 16);
+  _stack_key_loaded(ctx);
+  DEV(ctx)->session_key_loads++;
+}
+
+void osnp_load_tx_key(OSNP_CTX_PARAM_ uint8_t *tmp_buf) {
+  memset(tmp_buf, 0, 16);
+  _stack_key_loaded(ctx);
+}
+
+void osnp_load_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *tmp_buf) {
+  memset(tmp_buf, 0, 16);
+  _stack_key_loaded(ctx);
+}
+
+void osnp_read_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len) {
+  memcpy(buf, &DEV(ctx)->counter_log[offset], len);
+}
+
+void osnp_write_pan_id(OSNP_CTX_PARAM_ uint8_t *pan_id) {
+  memcpy(DEV(ctx)->pan_id, pan_id, 2);
+}
+
+void osnp_write_short_address(OSNP_CTX_PARAM_ uint8_t *short_address) {
+  memcpy(DEV(ctx)->short_address, short_address, 2);
+}
+
+void osnp_write_channel(OSNP_CTX_PARAM_ uint8_t *channel) {
+  DEV(ctx)->channel = *channel;
+}
+
+void osnp_write_rx_key(OSNP_CTX_PARAM_ uint8_t *key) {}
+void osnp_write_tx_key(OSNP_CTX_PARAM_ uint8_t *key) {}
+void osnp_write_group_key(OSNP_CTX_PARAM_ uint8_t group, uint8_t *key) {}
+
+void osnp_write_counter_log(OSNP_CTX_PARAM_ uint16_t offset, uint8_t *buf, uint8_t len) {
+  memcpy(&DEV(ctx)->counter_log[offset], buf, len);
+}
+
+void osnp_start_channel_scanning_timer(OSNP_CTX_PARAM_ uint32_t dwell) {
+  DEV(ctx)->scan_dwell = dwell;
+}
+
+uint8_t osnp_energy_detect(OSNP_CTX_PARAM_ uint8_t channel) {
+  return DEV(ctx)->channel_energy[channel];
+}
+void osnp_start_association_wait_timer(OSNP_CTX_PARAM) {}
+void osnp_start_poll_timer(OSNP_CTX_PARAM_ uint32_t interval) {
+  DEV(ctx)->poll_timer = interval;
+}
+void osnp_start_pending_data_wait_timer(OSNP_CTX_PARAM) {}
+void osnp_start_notification_timer(OSNP_CTX_PARAM) {
+  DEV(ctx)->notification_timers++;
+}
+void osnp_stop_active_timer(OSNP_CTX_PARAM) {}
+
+void osnp_switch_channel(OSNP_CTX_PARAM_ uint8_t channel) {
+  DEV(ctx)->radio_channel = channel;
+}
+
+void osnp_transmit_frame(OSNP_CTX_PARAM_ ieee802_15_4_frame_t *frame) {
+  stack_device_t *dev = DEV(ctx);
+
+  if (dev->tx_len == STACK_MAX_TX) {
+    return;
+  }
+
+  uint8_t payload = frame->payload - frame->backing_buffer;
+
+  // the last data frame handed to the radio is the one whose delivery is reported next
+  if (dev->compact_notifications && EXTRACT_FCFRTYP(*frame->fc_low) == FCFRTYP_DATA) {
+    dev->compact_in_flight = compact_report_id(frame->payload, frame->payload_len, &dev->compact_report);
+  }
+
+  memcpy(dev->tx[dev->tx_len], frame->backing_buffer, payload + frame->payload_len);
+  dev->tx_payload[dev->tx_len] = payload;
+  dev->tx_payload_len[dev->tx_len] = frame->payload_len;
+  dev->tx_len++;
+}
+
+bool osnp_get_pending_frames(OSNP_CTX_PARAM) {
+  return DEV(ctx)->pending;
+}
+
+bool osnp_read_item(OSNP_CTX_PARAM_ uint16_t tag, int32_t *value) {
+  if (tag != STACK_READING_TAG) {
+    return false;
+  }
+
+  *value = DEV(ctx)->reading;
+  return true;
+}
+
+void osnp_build_notification(OSNP_CTX_PARAM_ tlv_writer_t *notification) {
+  stack_device_t *dev = DEV(ctx);
+
+  if (dev->compact_notifications) {
+    compact_begin(&dev->compact, notification);
+    compact_put_int(&dev->compact, notification, STACK_READING_TAG, dev->reading);
+    compact_end(&dev->compact, notification);
+  } else {
+    uint8_t value[4] = { dev->reading >> 24, dev->reading >> 16, dev->reading >> 8, dev->reading };
+    tlv_writer_put(notification, STACK_READING_TAG, value, 4);
+  }
+}
+
+/* The bulk content is bulk_len bytes counting up from 0, written in pieces which straddle the fragments */
+void osnp_build_bulk(OSNP_CTX_PARAM_ uint8_t source, osnp_bulk_writer_t *writer) {
+  uint8_t piece[16];
+
+  for (uint16_t i = 0; i < DEV(ctx)->bulk_len; i += sizeof(piece)) {
+    uint16_t len = DEV(ctx)->bulk_len - i < sizeof(piece) ? DEV(ctx)->bulk_len - i : sizeof(piece);
+
+    for (uint8_t j = 0; j < len; j++) {
+      piece[j] = i + j;
+    }
+
+    if (!osnp_bulk_write(writer, piece, len)) {
+      return;
+    }
+  }
+}
+
+/* The payload of the last frame handed to the radio */
+static uint8_t *_stack_last_tx(osnp_ctx_t *ctx) {
+  stack_device_t *dev = DEV(ctx);
+
+  return dev->tx_len ? &dev->tx[dev->tx_len - 1][dev->tx_payload[dev->tx_len - 1]] : NULL;
+}
+
+/* Starts the stack from what the device has stored, as after a reset */
+static void _stack_boot(osnp_ctx_t *ctx, stack_device_t *dev) {
+  memset(ctx, 0, sizeof(*ctx));
+  dev->tx_len = 0;
+  dev->deliveries = 0;
+
+  ctx->user_data = dev;
+  osnp_ctx_initialize(ctx);
+}
+
+static void _stack_init(osnp_ctx_t *ctx, stack_device_t *dev) {
+  memset(dev, 0, sizeof(*dev));
+  memcpy(dev->eui, "OSNPTEST", 8);
+  dev->pan_id[0] = dev->pan_id[1] = 0xff;
+  dev->short_address[0] = dev->short_address[1] = 0xff;
+  dev->channel = 0xff;
+  memset(dev->counter_log, 0xff, sizeof(dev->counter_log));
+  compact_encoder_init(&dev->compact);
+
+  _stack_boot(ctx, dev);
+}
+
+/* Hands a received frame to the stack as the radio driver does, selecting the key in the interrupt */
+static void _stack_deliver(osnp_ctx_t *ctx, uint8_t *buf, uint8_t len) {
+  DEV(ctx)->in_interrupt = true;
+  bool accepted = osnp_ctx_select_rx_key(ctx, buf, len);
+  DEV(ctx)->in_interrupt = false;
+
+  if (accepted) {
+    osnp_ctx_frame_received_cb(ctx, buf, len);
+    osnp_ctx_process(ctx);
+  }
+}
+
+/*
+ * Hands a frame from the hub to the stack: extended addresses both ways, the device EUI as destination, and the
+ * frame counter and sec-ctl byte when secured. The MIC and FCS are left as zeroes.
+ */
+static void _stack_receive(osnp_ctx_t *ctx, uint8_t fc_low, uint8_t *payload, uint8_t payload_len) {
+  uint8_t buf[128];
+  uint8_t len = 0;
+
+  buf[len++] = fc_low;
+  buf[len++] = FCDSTADDR(FCADDR_EXT) | FCSRCADDR(FCADDR_EXT);
+  buf[len++] = stack_hub_seq_no++;
+  memcpy(&buf[len], ctx->pan_id, 2);
+  len += 2;
+  memcpy(&buf[len], DEV(ctx)->eui, 8);
+  len += 8;
+  buf[len++] = 0x34;
+  buf[len++] = 0x12;
+  memcpy(&buf[len], stack_hub_eui, 8);
+  len += 8;
+
+  if (fc_low & FCSECEN) {
+    uint32_t counter = ++stack_hub_counter;
+
+    buf[len++] = counter;
+    buf[len++] = counter >> 8;
+    buf[len++] = counter >> 16;
+    buf[len++] = counter >> 24;
+    buf[len++] = 0x01;
+  }
+
+  memcpy(&buf[len], payload, payload_len);
+  len += payload_len;
+  memset(&buf[len], 0, OSNP_MIC_LENGTH + IEEE802_15_4_FCS_LEN);
+  len += ((fc_low & FCSECEN) ? OSNP_MIC_LENGTH : 0) + IEEE802_15_4_FCS_LEN;
+
+  _stack_deliver(ctx, buf, len);
+}
+
+/* Hands a secured data frame from the hub to the members of the test group */
+static void _stack_receive_group(osnp_ctx_t *ctx, uint32_t counter, uint8_t *payload, uint8_t payload_len) {
+  uint8_t buf[128];
+  uint8_t len = 0;
+
+  buf[len++] = FCFRTYP(FCFRTYP_DATA) | FCSECEN;
+  buf[len++] = FCDSTADDR(FCADDR_SHORT) | FCSRCADDR(FCADDR_EXT);
+  buf[len++] = stack_hub_seq_no++;
+  memcpy(&buf[len], ctx->pan_id, 2);
+  len += 2;
+  memcpy(&buf[len], stack_group_address, 2);
+  len += 2;
+  buf[len++] = 0x34;
+  buf[len++] = 0x12;
+  memcpy(&buf[len], stack_hub_eui, 8);
+  len += 8;
+  buf[len++] = counter;
+  buf[len++] = counter >> 8;
+  buf[len++] = counter >> 16;
+  buf[len++] = counter >> 24;
+  buf[len++] = 0x01;
+  memcpy(&buf[len], payload, payload_len);
+  len += payload_len;
+  memset(&buf[len], 0, OSNP_MIC_LENGTH + IEEE802_15_4_FCS_LEN);
+  len += OSNP_MIC_LENGTH + IEEE802_15_4_FCS_LEN;
+
+  _stack_deliver(ctx, buf, len);
+}
+
+/* Makes the device join the test group, or update its membership, with the given flags and next frame counter */
+static void _stack_join_group(osnp_ctx_t *ctx, uint8_t flags, uint32_t counter) {
+  uint8_t join[24] = { OSNP_MCMD_GROUP, stack_group_address[0], stack_group_address[1], flags };
+
+  join[4] = counter;
+  join[5] = counter >> 8;
+  join[6] = counter >> 16;
+  join[7] = counter >> 24;
+
+  _stack_receive(ctx, FCFRTYP(FCFRTYP_MCMD) | FCSECEN, join, sizeof(join));
+}
+
+/* Associates the device with the test hub, PAN 0x1234, short address 0x0001, with the hub frame counter at 0 */
+static void _stack_associate(osnp_ctx_t *ctx) {
+  uint8_t req[35] = { OSNP_MCMD_ASSOCIATION_REQ };
+
+  req[33] = 0x01;
+  req[34] = 0x00;
+  stack_hub_counter = 0;
+
+  _stack_receive(ctx, FCFRTYP(FCFRTYP_MCMD), req, sizeof(req));
+  osnp_ctx_frame_sent_cb(ctx, OSNP_TX_STATUS_OK);
+}
+
+/*
+ * A notification delivered while the poll following it is already queued: the next frame is in flight by the time
+ * the delivery is reported, and must not change the class reported for the notification.
+ */
+static void _test_delivery_class_after_flush(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+  dev.deliveries = 0;
+
+  STACK_CHECK(osnp_ctx_send_notification(&ctx));
+
+  // the poll timer sends the queued notification first and the data request once it is sent
+  osnp_ctx_timer_expired_cb(&ctx);
+  STACK_CHECK(_stack_last_tx(&ctx)[0] == 0xE2);
+
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(_stack_last_tx(&ctx)[0] == OSNP_MCMD_DATA_REQ);
+  STACK_CHECK(dev.deliveries == 1);
+  STACK_CHECK(dev.delivered_class[0] == OSNP_TX_CLASS_NOTIFICATION);
+
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(dev.deliveries == 2);
+  STACK_CHECK(dev.delivered_class[1] == OSNP_TX_CLASS_MCMD);
+}
+
+/*
+ * Compact notifications: a report becomes the reference when the notification carrying it is reported delivered,
+ * and a lost keyframe is sent again as a keyframe. The following reports are differences from the reference.
+ */
+static void _test_compact_reference_on_delivery(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint8_t notifications = 0;
+
+  _stack_init(&ctx, &dev);
+  dev.compact_notifications = true;
+  _stack_associate(&ctx);
+
+  for (uint8_t round = 0; round < 6; round++) {
+    // the second notification is lost, after its retry
+    uint8_t status = (round == 1) ? OSNP_TX_STATUS_NOACK : OSNP_TX_STATUS_OK;
+    uint8_t reference_id = dev.compact.reference.id;
+    bool had_reference = dev.compact.has_reference;
+
+    dev.reading = 1000 + round;
+    STACK_CHECK(osnp_ctx_send_notification(&ctx));
+    osnp_ctx_timer_expired_cb(&ctx);
+
+    // E2 <len> C0 <len> <reference>
+    uint8_t *payload = _stack_last_tx(&ctx);
+    STACK_CHECK(payload[0] == 0xE2 && payload[2] == COMPACT_TAG);
+    STACK_CHECK(!(payload[4] & COMPACT_KEYFRAME) == had_reference);
+
+    // retries send the notification again, the final outcome is followed by the data request
+    while (_stack_last_tx(&ctx)[0] == 0xE2) {
+      osnp_ctx_frame_sent_cb(&ctx, status);
+    }
+
+    notifications++;
+    STACK_CHECK(dev.compact_deliveries == notifications);
+    STACK_CHECK(_stack_last_tx(&ctx)[0] == OSNP_MCMD_DATA_REQ);
+
+    if (status != OSNP_TX_STATUS_OK) {
+      STACK_CHECK(dev.compact.has_reference == had_reference && dev.compact.reference.id == reference_id);
+    } else {
+      STACK_CHECK(dev.compact.has_reference && dev.compact.reference.id == (payload[4] & ~COMPACT_KEYFRAME));
+    }
+
+    osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+    STACK_CHECK(dev.compact_deliveries == notifications);
+  }
+
+  STACK_CHECK(dev.compact.has_reference);
+}
+
+/* Writes a compact report of two readings, the second left out if absent, and decodes it */
+static uint8_t _stack_compact_report(compact_encoder_t *encoder, compact_decoder_t *decoder, int32_t first, int32_t second, bool absent) {
+  uint8_t buf[32];
+  tlv_writer_t writer;
+  tlv_reader_t reader;
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
+  uint8_t id;
+
+  tlv_writer_init(&writer, buf, sizeof(buf));
+  tlv_writer_open(&writer, 0xE2);
+  STACK_CHECK(compact_begin(encoder, &writer));
+  STACK_CHECK(compact_put_int(encoder, &writer, 0x01, first));
+
+  if (!absent) {
+    STACK_CHECK(compact_put_int(encoder, &writer, 0x02, second));
+  }
+
+  STACK_CHECK(compact_end(encoder, &writer));
+  tlv_writer_close(&writer);
+
+  tlv_reader_init(&reader, &buf[2], writer.pos - 2);
+  STACK_CHECK(tlv_reader_next(&reader, &tag, &len, &value) && tag == COMPACT_TAG);
+  STACK_CHECK(compact_report_id(buf, writer.pos, &id) && id == (value[0] & 0x7f));
+
+  if (decoder) {
+    int32_t decoded;
+
+    STACK_CHECK(compact_decode(decoder, value, len));
+    STACK_CHECK(compact_get_int(decoder, 0x01, &decoded) && decoded == first);
+    STACK_CHECK(compact_get_int(decoder, 0x02, &decoded) && decoded == second);
+  }
+
+  return id;
+}
+
+/*
+ * Compact reports confirmed late or out of order: the reference is the newest report confirmed, with the values it
+ * carried and not those of reports written since, and a reading left out of a report keeps its reference value.
+ */
+static void _test_compact_late_delivery(void) {
+  compact_encoder_t encoder;
+  compact_decoder_t decoder;
+
+  compact_encoder_init(&encoder);
+  compact_decoder_init(&decoder);
+
+  // two keyframes in flight, the first confirmed after the second is written and the second lost
+  uint8_t first = _stack_compact_report(&encoder, &decoder, 100, 200, false);
+  uint8_t second = _stack_compact_report(&encoder, NULL, 101, 201, false);
+
+  compact_encoder_delivered(&encoder, first, true);
+  compact_encoder_delivered(&encoder, second, false);
+  STACK_CHECK(encoder.has_reference && encoder.reference.id == first && encoder.reference.values[0] == 100);
+  compact_encoder_delivered(&encoder, second, true);
+  STACK_CHECK(encoder.reference.id == first);
+
+  // two differences in flight, confirmed in the reverse order
+  uint8_t third = _stack_compact_report(&encoder, &decoder, 102, 200, true);
+  uint8_t fourth = _stack_compact_report(&encoder, &decoder, 103, 203, false);
+
+  STACK_CHECK(encoder.reference.id == first);
+  compact_encoder_delivered(&encoder, fourth, true);
+  compact_encoder_delivered(&encoder, third, true);
+  STACK_CHECK(encoder.reference.id == fourth && encoder.reference.values[1] == 203);
+
+  // differences from the fourth report, the second reading left out then written again
+  uint8_t fifth = _stack_compact_report(&encoder, &decoder, 104, 203, true);
+
+  compact_encoder_delivered(&encoder, fifth, true);
+  _stack_compact_report(&encoder, &decoder, 105, 210, false);
+  STACK_CHECK(encoder.reference.id == fifth && encoder.reference.values[1] == 203);
+}
+
+/*
+ * Channels measuring quiet are scanned last and briefly in the first pass only, every channel gets the full dwell in
+ * the following passes.
+ */
+static void _test_quiet_channel_scan(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+
+  // booted again with two quiet channels among loud ones
+  memset(dev.channel_energy, 0xff, sizeof(dev.channel_energy));
+  dev.channel_energy[3] = 0;
+  dev.channel_energy[9] = 0;
+  _stack_boot(&ctx, &dev);
+
+  STACK_CHECK(ctx.state == SCANNING_CHANNELS);
+  STACK_CHECK(ctx.scan_order[14] == 3 && ctx.scan_order[15] == 9);
+
+  for (uint8_t pass = 0; pass < 2; pass++) {
+    for (uint8_t i = 0; i < 16; i++) {
+      bool quiet = (pass == 0) && (ctx.channel == 3 || ctx.channel == 9);
+
+      STACK_CHECK(ctx.channel == ctx.scan_order[i]);
+      STACK_CHECK(dev.scan_dwell == (quiet ? OSNP_SCAN_DWELL_QUIET : OSNP_SCAN_DWELL));
+      osnp_ctx_timer_expired_cb(&ctx);
+    }
+  }
+
+  STACK_CHECK(ctx.state == SCANNING_CHANNELS && ctx.stats.scan_cycles == 2);
+}
+
+static bool _stack_near(float value, float expected, float tolerance) {
+  return value > expected - tolerance && value < expected + tolerance;
+}
+
+/*
+ * A poll driven device listens only for the acknowledgement after its transmissions and sleeps the rest of the time,
+ * a listening one is never asleep.
+ */
+static void _test_energy_model(void) {
+  energy_profile_t profile = ENERGY_PROFILE_MRF24J40;
+  energy_report_t report;
+
+  energy_report_init(&report);
+
+  // one 10-byte frame in a second: 16 bytes and the turnaround on air, then the acknowledgement wait
+  energy_add(&report, &profile, ASSOCIATED, 1000, false, 1, 10);
+  STACK_CHECK(_stack_near(report.tx_s[ASSOCIATED], 704e-6f, 1e-7f));
+  STACK_CHECK(_stack_near(report.rx_s[ASSOCIATED], 544e-6f, 1e-7f));
+  STACK_CHECK(_stack_near(report.sleep_s[ASSOCIATED], 1 - 1248e-6f, 1e-6f));
+  STACK_CHECK(_stack_near(energy_average_ua(&report), 704e-6f * 23000 + 544e-6f * 19000 + (1 - 1248e-6f) * 2, 1e-3f));
+
+  energy_add(&report, &profile, SCANNING_CHANNELS, 1000, true, 1, 10);
+  STACK_CHECK(_stack_near(report.rx_s[SCANNING_CHANNELS], 1 - 704e-6f, 1e-6f) && report.sleep_s[SCANNING_CHANNELS] == 0);
+  STACK_CHECK(_stack_near(energy_battery_hours(&report, 1000), 1e6f / energy_average_ua(&report), 1e-2f));
+}
+
+/*
+ * The statistics are taken as differences between two copies, which hold across a wraparound of the counters.
+ */
+static void _test_energy_stats_wraparound(void) {
+  energy_profile_t profile = ENERGY_PROFILE_MRF24J40;
+  energy_report_t report;
+  osnp_stats_t since = { 0 };
+  osnp_stats_t stats = { 0 };
+
+  since.state_time[ASSOCIATED] = UINT32_MAX - 999;
+  since.tx_frames[ASSOCIATED] = UINT32_MAX;
+  since.tx_bytes[ASSOCIATED] = UINT32_MAX - 9;
+  stats.state_time[ASSOCIATED] = 1000;
+  stats.tx_frames[ASSOCIATED] = 1;
+  stats.tx_bytes[ASSOCIATED] = 10;
+
+  energy_report_init(&report);
+  energy_add_stats(&report, &profile, &since, &stats, false);
+
+  // two seconds, two frames of 20 bytes between them
+  float time = report.tx_s[ASSOCIATED] + report.rx_s[ASSOCIATED] + report.sleep_s[ASSOCIATED];
+  STACK_CHECK(_stack_near(time, 2, 1e-6f));
+  STACK_CHECK(_stack_near(report.tx_s[ASSOCIATED], 1408e-6f, 1e-7f));
+  STACK_CHECK(_stack_near(report.rx_s[ASSOCIATED], 1088e-6f, 1e-7f));
+
+  for (uint8_t state = 0; state < ENERGY_STATES; state++) {
+    STACK_CHECK(state == ASSOCIATED || report.charge_uah[state] == 0);
+  }
+}
+
+/*
+ * A bulk response streamed to a hub reassembling it with hub_bulk: every fragment is secured, and a fragment lost
+ * in the first round is sent again after the acknowledgement.
+ */
+static void _test_bulk_transfer(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  hub_bulk_t bulk;
+  uint8_t ack[HUB_BULK_ACK_LEN];
+  uint8_t stream[HUB_BULK_MAX_FRAGMENTS * HUB_BULK_FRAGMENT_LEN];
+  uint8_t fragments = 0;
+  bool completed = false;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+  hub_bulk_init(&bulk);
+  dev.bulk_len = 300;
+
+  uint8_t seen = dev.tx_len;
+  uint8_t id = osnp_ctx_start_bulk_transfer(&ctx, 0, 0xE1);
+  STACK_CHECK(id);
+
+  // every frame handed to the radio is reported sent, the hub answers the fragments asking for it
+  while (seen < dev.tx_len) {
+    uint8_t *frame = dev.tx[seen];
+    uint8_t *payload = &frame[dev.tx_payload[seen]];
+    uint8_t result = 0;
+
+    seen++;
+
+    if (payload[0] == OSNP_BULK_FRAGMENT_TAG) {
+      STACK_CHECK(EXTRACT_FCSECEN(frame[0]) && EXTRACT_FCFRTYP(frame[0]) == FCFRTYP_DATA);
+      STACK_CHECK(payload[1] == dev.tx_payload_len[seen - 1] - 2 && payload[2] == id);
+
+      // the second fragment is lost the first time
+      if (fragments++ != 1) {
+        result = hub_bulk_fragment_received(&bulk, &payload[2], payload[1], ack);
+      }
+
+      STACK_CHECK(!(completed && (result & HUB_BULK_COMPLETE)));
+      completed |= (result & HUB_BULK_COMPLETE) != 0;
+    }
+
+    osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+    if (result & HUB_BULK_ACK) {
+      _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, ack, sizeof(ack));
+    }
+  }
+
+  STACK_CHECK(completed && !ctx.bulk_active);
+  STACK_CHECK(fragments == 5);
+
+  uint16_t stream_len = hub_bulk_reassemble(&bulk, stream, sizeof(stream));
+  STACK_CHECK(stream_len == 2 + dev.bulk_len + 2);
+  STACK_CHECK(stream[0] == 0xE1 && stream[1] == 0x80);
+  STACK_CHECK(stream[stream_len - 2] == 0x00 && stream[stream_len - 1] == 0x00);
+
+  for (uint16_t i = 0; i < dev.bulk_len && i + 2 < stream_len; i++) {
+    STACK_CHECK(stream[2 + i] == (uint8_t) i);
+  }
+}
+
+/*
+ * Frame counters after a reset: an associated device goes on past every counter it may have used, from the newest
+ * valid record of the log, and forgets the association when no record is valid rather than counting from zero.
+ */
+static void _test_counter_log_recovery(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+
+  uint8_t channel = dev.channel;
+  uint8_t commands[2] = { 0xE0, 0x00 };
+
+  // secured responses, each using up the reservation as if it came after a window of frames
+  for (uint8_t i = 0; i < 3; i++) {
+    ctx.tx_frame_counter = ctx.tx_saved_frame_counter - 1;
+    _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+    STACK_CHECK(_stack_last_tx(&ctx)[0] == 0xE1);
+    osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  }
+
+  uint32_t used = ctx.tx_frame_counter;
+
+  _stack_boot(&ctx, &dev);
+  STACK_CHECK(ctx.state == ASSOCIATED);
+  STACK_CHECK(ctx.tx_frame_counter >= used);
+
+  // a record torn by a power loss leaves the previous one in force, whose reservation ends where the torn one started
+  uint8_t newest = (ctx.counter_log_slot + OSNP_COUNTER_LOG_RECORDS - 1) % OSNP_COUNTER_LOG_RECORDS;
+  dev.counter_log[newest * OSNP_COUNTER_LOG_RECORD_LEN + 1] ^= 0x01;
+
+  _stack_boot(&ctx, &dev);
+  STACK_CHECK(ctx.state == ASSOCIATED);
+  STACK_CHECK(ctx.tx_frame_counter == used);
+
+  for (uint8_t slot = 0; slot < OSNP_COUNTER_LOG_RECORDS; slot++) {
+    if (slot != newest) {
+      dev.counter_log[slot * OSNP_COUNTER_LOG_RECORD_LEN + 1] ^= 0x01;
+    }
+  }
+
+  _stack_boot(&ctx, &dev);
+  STACK_CHECK(ctx.state == SCANNING_CHANNELS);
+  STACK_CHECK(dev.channel == 0xff && dev.short_address[0] == 0xff && dev.short_address[1] == 0xff);
+  STACK_CHECK(ctx.last_channel == channel && ctx.scan_order[0] == channel);
+  STACK_CHECK(dev.tx_len == 0);
+
+  // nor does a blank log, and the device associates again from zero with the new keys
+  memset(dev.counter_log, 0xff, sizeof(dev.counter_log));
+  dev.channel = 0;
+
+  _stack_boot(&ctx, &dev);
+  STACK_CHECK(ctx.state == SCANNING_CHANNELS && dev.channel == 0xff);
+
+  _stack_associate(&ctx);
+  STACK_CHECK(ctx.state == ASSOCIATED && ctx.tx_frame_counter == 1);
+
+  _stack_boot(&ctx, &dev);
+  STACK_CHECK(ctx.state == ASSOCIATED && ctx.tx_frame_counter >= 1);
+}
+
+/*
+ * The reservation made by the first frame after each restart keeps the window, a reservation used up within a
+ * period doubles it.
+ */
+static void _test_counter_window_after_restart(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint8_t commands[2] = { 0xE0, 0x00 };
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+
+  for (uint8_t i = 0; i < 3; i++) {
+    _stack_boot(&ctx, &dev);
+    STACK_CHECK(ctx.state == ASSOCIATED && ctx.tx_frame_counter == ctx.tx_saved_frame_counter);
+
+    uint32_t first = ctx.tx_frame_counter;
+
+    // the hub counts on from the reserved value as well
+    stack_hub_counter = ctx.rx_frame_counter;
+    _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+    STACK_CHECK(_stack_last_tx(&ctx)[0] == 0xE1);
+    osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+    STACK_CHECK(ctx.frame_counter_window == OSNP_FRAME_COUNTER_WINDOW);
+    STACK_CHECK(ctx.tx_saved_frame_counter == first + OSNP_FRAME_COUNTER_WINDOW);
+  }
+
+  ctx.tx_frame_counter = ctx.tx_saved_frame_counter - 1;
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.frame_counter_window == 2 * OSNP_FRAME_COUNTER_WINDOW);
+}
+
+/*
+ * A command whose response object no longer fits in the frame is still performed, only its response is left out.
+ */
+static void _test_command_without_room(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+
+  uint8_t commands[6] = { 0xE0, 0x04, OSNP_PERFORM, 0x00, OSNP_PERFORM, 0x00 };
+
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+  STACK_CHECK(dev.performed == 2);
+
+  // the response holds the first result alone
+  uint8_t *response = _stack_last_tx(&ctx);
+  STACK_CHECK(response[0] == 0xE1 && response[2] == OSNP_PERFORM);
+  STACK_CHECK(2 + response[1] == dev.tx_payload_len[dev.tx_len - 1]);
+  STACK_CHECK(response[1] == 2 + response[3] && response[4] == 0x81);
+}
+
+/*
+ * The commands of a group frame run whether or not the group answers and whether or not a buffer is free, and a
+ * response which is not sent takes neither a sequence number nor a frame counter. Keys are only loaded outside the
+ * radio interrupt with it masked.
+ */
+static void _test_group_commands(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint8_t commands[4] = { 0xE0, 0x02, OSNP_PERFORM, 0x00 };
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+  _stack_join_group(&ctx, 0, 1);
+
+  uint8_t seq_no = ctx.seq_no;
+  uint32_t tx_frame_counter = ctx.tx_frame_counter;
+  uint8_t tx_len = dev.tx_len;
+
+  _stack_receive_group(&ctx, 1, commands, sizeof(commands));
+  STACK_CHECK(dev.performed == 1 && ctx.loaded_keys == OSNP_KEYS_GROUP);
+  STACK_CHECK(dev.tx_len == tx_len && ctx.tx_pool_used == 0);
+  STACK_CHECK(ctx.seq_no == seq_no && ctx.tx_frame_counter == tx_frame_counter);
+
+  ctx.tx_pool_used = (1 << OSNP_TX_POOL_LEN) - 1;
+  _stack_receive_group(&ctx, 2, commands, sizeof(commands));
+  STACK_CHECK(dev.performed == 2 && dev.tx_len == tx_len);
+  ctx.tx_pool_used = 0;
+
+  // answering, a full pool still leaves the counters alone
+  _stack_join_group(&ctx, OSNP_GROUP_RESPOND, 3);
+  seq_no = ctx.seq_no;
+  tx_frame_counter = ctx.tx_frame_counter;
+
+  ctx.tx_pool_used = (1 << OSNP_TX_POOL_LEN) - 1;
+  _stack_receive_group(&ctx, 3, commands, sizeof(commands));
+  STACK_CHECK(dev.performed == 3 && dev.tx_len == tx_len);
+  STACK_CHECK(ctx.seq_no == seq_no && ctx.tx_frame_counter == tx_frame_counter);
+  ctx.tx_pool_used = 0;
+
+  _stack_receive_group(&ctx, 4, commands, sizeof(commands));
+  STACK_CHECK(dev.performed == 4 && dev.tx_len == tx_len + 1);
+  STACK_CHECK((dev.tx[tx_len][0] & FCREQACK) && _stack_last_tx(&ctx)[0] == 0xE1);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.tx_pool_used == 0);
+
+  // a frame for the device brings the session keys back
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(dev.performed == 5 && ctx.loaded_keys == OSNP_KEYS_SESSION);
+  STACK_CHECK(dev.unlocked_key_loads == 0 && dev.keys_locked == 0);
+}
+
+/* Sends a command with the given frame counter, returning whether the device performed it */
+static bool _stack_perform_with_counter(osnp_ctx_t *ctx, uint32_t counter) {
+  uint8_t commands[4] = { 0xE0, 0x02, OSNP_PERFORM, 0x00 };
+  uint8_t performed = DEV(ctx)->performed;
+
+  stack_hub_counter = counter - 1;
+  _stack_receive(ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+
+  if (DEV(ctx)->performed == performed) {
+    return false;
+  }
+
+  osnp_ctx_frame_sent_cb(ctx, OSNP_TX_STATUS_OK);
+  return true;
+}
+
+/*
+ * Replay window: reordered frames are accepted once, duplicates are dropped silently, a jump past the window width
+ * starts a new window, and frames older than the window get at most one frame counter alignment per poll interval.
+ */
+static void _test_replay_window(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+  STACK_CHECK(_stack_perform_with_counter(&ctx, 5));
+  STACK_CHECK(_stack_perform_with_counter(&ctx, 3));
+  STACK_CHECK(_stack_perform_with_counter(&ctx, 4));
+
+  uint8_t tx_len = dev.tx_len;
+
+  STACK_CHECK(!_stack_perform_with_counter(&ctx, 3));
+  STACK_CHECK(!_stack_perform_with_counter(&ctx, 5));
+  STACK_CHECK(dev.tx_len == tx_len && ctx.stats.replay_rejects == 2);
+
+  // the window follows the newest counter, the bits of frames left behind are dropped
+  STACK_CHECK(_stack_perform_with_counter(&ctx, 45));
+  STACK_CHECK(ctx.rx_frame_counter == 45 && ctx.rx_replay_bitmap == 1);
+  STACK_CHECK(_stack_perform_with_counter(&ctx, 45 - (OSNP_REPLAY_WINDOW - 1)));
+
+  // the first stale frame asks the hub to align its counter with the next one expected
+  tx_len = dev.tx_len;
+  STACK_CHECK(!_stack_perform_with_counter(&ctx, 45 - OSNP_REPLAY_WINDOW));
+  STACK_CHECK(dev.tx_len == tx_len + 1 && ctx.stats.frame_counter_aligns == 1);
+
+  uint8_t *align = _stack_last_tx(&ctx);
+  STACK_CHECK(align[0] == OSNP_MCMD_FRAME_COUNTER_ALIGN && align[1] == 46 && align[2] == 0);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+  tx_len = dev.tx_len;
+  STACK_CHECK(!_stack_perform_with_counter(&ctx, 2));
+  STACK_CHECK(dev.tx_len == tx_len && ctx.stats.frame_counter_aligns == 1);
+
+  // the next poll interval allows another one
+  osnp_ctx_timer_expired_cb(&ctx);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+  tx_len = dev.tx_len;
+  STACK_CHECK(!_stack_perform_with_counter(&ctx, 1));
+  STACK_CHECK(dev.tx_len == tx_len + 1 && ctx.stats.frame_counter_aligns == 2);
+  STACK_CHECK(ctx.stats.replay_rejects == 5);
+}
+
+/*
+ * Polls finding nothing double the poll interval up to its maximum, a poll finding pending data brings it back to
+ * the minimum, and new bounds clamp it at once.
+ */
+static void _test_adaptive_poll_interval(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint32_t expected[] = { 2000, 4000, 5000, 5000 };
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+  osnp_ctx_set_poll_interval_bounds(&ctx, 1000, 5000);
+
+  for (uint8_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+    osnp_ctx_timer_expired_cb(&ctx);
+    STACK_CHECK(_stack_last_tx(&ctx)[0] == OSNP_MCMD_DATA_REQ);
+    osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+    STACK_CHECK(osnp_ctx_get_poll_interval(&ctx) == expected[i] && dev.poll_timer == expected[i]);
+  }
+
+  dev.pending = true;
+  osnp_ctx_timer_expired_cb(&ctx);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.state == WAITING_PENDING_DATA && osnp_ctx_get_poll_interval(&ctx) == 1000);
+
+  // the hub sent nothing after all, the next poll comes after the minimum interval
+  dev.pending = false;
+  osnp_ctx_timer_expired_cb(&ctx);
+  STACK_CHECK(ctx.state == ASSOCIATED && dev.poll_timer == 1000);
+
+  uint32_t min;
+  uint32_t max;
+
+  osnp_ctx_set_poll_interval_bounds(&ctx, 3000, 2000);
+  osnp_ctx_get_poll_interval_bounds(&ctx, &min, &max);
+  STACK_CHECK(min == 3000 && max == 3000 && osnp_ctx_get_poll_interval(&ctx) == 3000);
+}
+
+/*
+ * Keys are loaded when they change, not for every frame: the session keys once for the first frame after the
+ * association, and again only after osnp_invalidate_keys, at the next poll finding pending data.
+ */
+static void _test_key_cache(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint8_t commands[2] = { 0xE0, 0x00 };
+
+  _stack_init(&ctx, &dev);
+  STACK_CHECK(ctx.loaded_keys == OSNP_KEYS_MASTER && dev.master_key_loads == 1);
+
+  // the new session keys are left for the first frame needing them
+  _stack_associate(&ctx);
+  STACK_CHECK(dev.session_key_loads == 0);
+
+  for (uint8_t i = 0; i < 3; i++) {
+    dev.pending = (i == 1);
+    osnp_ctx_timer_expired_cb(&ctx);
+    osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+    _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+    STACK_CHECK(_stack_last_tx(&ctx)[0] == 0xE1);
+    osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  }
+
+  STACK_CHECK(ctx.loaded_keys == OSNP_KEYS_SESSION && dev.session_key_loads == 1 && dev.master_key_loads == 1);
+
+  // invalidated while associated, the keys wait for the next poll finding pending data
+  dev.pending = false;
+  osnp_ctx_invalidate_keys(&ctx);
+  osnp_ctx_timer_expired_cb(&ctx);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.loaded_keys == OSNP_KEYS_NONE && dev.session_key_loads == 1);
+
+  dev.pending = true;
+  osnp_ctx_timer_expired_cb(&ctx);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.loaded_keys == OSNP_KEYS_SESSION && dev.session_key_loads == 2 && dev.master_key_loads == 1);
+}
+
+/*
+ * A poll queued behind a response: the poll interval backs off when the poll is reported sent, not when the
+ * response before it is.
+ */
+static void _test_poll_back_off_on_poll(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint8_t commands[2] = { 0xE0, 0x00 };
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, commands, sizeof(commands));
+  STACK_CHECK(_stack_last_tx(&ctx)[0] == 0xE1);
+
+  uint32_t interval = ctx.poll_interval;
+  osnp_ctx_timer_expired_cb(&ctx);
+  STACK_CHECK(_stack_last_tx(&ctx)[0] == 0xE1);
+
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(_stack_last_tx(&ctx)[0] == OSNP_MCMD_DATA_REQ && ctx.poll_interval == interval);
+
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.poll_interval == 2 * interval);
+}
+
+/*
+ * A slot assigned with the association: the first poll is at the slot nearest to the poll interval after the
+ * association, the second one at the slot nearest to the backed off interval after the first.
+ */
+static void _test_first_poll_slot(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint8_t req[39] = { OSNP_MCMD_ASSOCIATION_REQ };
+
+  _stack_init(&ctx, &dev);
+
+  // period 1000 ms, the first slot 200 ms after the request
+  req[33] = 0x01;
+  req[35] = 0x03;
+  req[36] = 0xE8;
+  req[37] = 0x00;
+  req[38] = 0xC8;
+  stack_hub_counter = 0;
+  stack_clock = 100000;
+
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_MCMD), req, sizeof(req));
+  STACK_CHECK(ctx.slot_period == 1000 && ctx.poll_interval == 1000);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(dev.poll_timer == 1200);
+
+  stack_clock += dev.poll_timer;
+  osnp_ctx_timer_expired_cb(&ctx);
+  STACK_CHECK(_stack_last_tx(&ctx)[0] == OSNP_MCMD_DATA_REQ && ctx.polled_at == 101200);
+
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.poll_interval == 2000 && dev.poll_timer == 2000);
+}
+
+/*
+ * A subscribed reading is only taken as reported once its notification is queued: one which finds neither room in
+ * the queue nor a buffer to flush it is reported by a later notification.
+ */
+static void _test_report_after_queued(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+
+  uint8_t subscribe[6] = { 0xE0, 0x04, OSNP_SUBSCRIBE, 0x02, STACK_READING_TAG, 0x00 };
+
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, subscribe, sizeof(subscribe));
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+  STACK_CHECK(ctx.subscriptions_len == 1);
+
+  // another item fills the queue and every buffer is taken
+  memset(ctx.notification_queue, 0, OSNP_NOTIFICATION_QUEUE_LEN);
+  ctx.notification_queue[0] = 0x02;
+  ctx.notification_queue[1] = OSNP_NOTIFICATION_QUEUE_LEN - 2;
+  ctx.notification_queue_len = OSNP_NOTIFICATION_QUEUE_LEN;
+  ctx.tx_pool_used = (1 << OSNP_TX_POOL_LEN) - 1;
+
+  dev.reading = 10;
+  STACK_CHECK(!osnp_ctx_send_notification(&ctx));
+  STACK_CHECK(ctx.subscriptions[0].reported == 0 && ctx.subscriptions[0].reported_at == 0);
+
+  ctx.tx_pool_used = 0;
+  osnp_ctx_flush_notifications(&ctx);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+  stack_clock = 5000;
+  STACK_CHECK(osnp_ctx_send_notification(&ctx));
+  STACK_CHECK(ctx.subscriptions[0].reported == 10 && ctx.subscriptions[0].reported_at == 5000);
+}
+
+/*
+ * A flush finding every buffer taken keeps the queue for the timer to flush again, and a notification which then
+ * finds no room is dropped and counted.
+ */
+static void _test_flush_without_buffer(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+
+  dev.reading = 1;
+  STACK_CHECK(osnp_ctx_send_notification(&ctx));
+  STACK_CHECK(ctx.notification_queue_len == 6);
+
+  uint8_t tx_len = dev.tx_len;
+
+  ctx.tx_pool_used = (1 << OSNP_TX_POOL_LEN) - 1;
+  dev.notification_timers = 0;
+  osnp_ctx_flush_notifications(&ctx);
+  STACK_CHECK(ctx.notification_queue_len == 6 && dev.notification_timers == 1 && dev.tx_len == tx_len);
+
+  // another item fills the rest of the queue
+  ctx.notification_queue[6] = 0x02;
+  ctx.notification_queue[7] = OSNP_NOTIFICATION_QUEUE_LEN - 8;
+  ctx.notification_queue_len = OSNP_NOTIFICATION_QUEUE_LEN;
+
+  dev.reading = 2;
+  STACK_CHECK(!osnp_ctx_send_notification(&ctx));
+  STACK_CHECK(ctx.stats.notification_drops == 1);
+  STACK_CHECK(ctx.notification_queue_len == OSNP_NOTIFICATION_QUEUE_LEN);
+
+  // the timer flushes the queue as it was once a buffer is free
+  ctx.tx_pool_used = 0;
+  osnp_ctx_flush_notifications(&ctx);
+  STACK_CHECK(ctx.notification_queue_len == 0 && dev.tx_len == tx_len + 1);
+
+  uint8_t *notification = _stack_last_tx(&ctx);
+  STACK_CHECK(notification[0] == 0xE2 && notification[1] == OSNP_NOTIFICATION_QUEUE_LEN);
+  STACK_CHECK(notification[2] == STACK_READING_TAG && notification[7] == 1);
+}
+
+/*
+ * Frames the RX ring cannot take, because of their length or because it is full, are counted as dropped.
+ */
+static void _test_rx_ring_drops(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+  uint8_t frame[IEEE802_15_4_MAX_FRAME_LEN + 1] = { 0 };
+
+  _stack_init(&ctx, &dev);
+
+  osnp_ctx_frame_received_cb(&ctx, frame, -1);
+  osnp_ctx_frame_received_cb(&ctx, frame, IEEE802_15_4_MAX_FRAME_LEN + 1);
+  STACK_CHECK(ctx.rx_ring_dropped == 2 && ctx.rx_ring_head == 0);
+
+  for (uint8_t i = 0; i <= OSNP_RX_RING_LEN; i++) {
+    osnp_ctx_frame_received_cb(&ctx, frame, IEEE802_15_4_MAX_FRAME_LEN);
+  }
+
+  STACK_CHECK(ctx.rx_ring_dropped == 3 && ctx.rx_ring_head == OSNP_RX_RING_LEN);
+  STACK_CHECK(osnp_ctx_process(&ctx) == OSNP_RX_RING_LEN);
+}
+
+/*
+ * The statistics are read in pages which fit a response to a hub with an extended address.
+ */
+static void _test_stats_pages(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+
+  ctx.stats.notification_drops = 0x01020304;
+
+  uint8_t first_page[8] = { 0xE0, 0x06, OSNP_GET_DATA, 0x04, 0xDF, 0x7F, 0x01, 0x00 };
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, first_page, sizeof(first_page));
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+  uint8_t *response = _stack_last_tx(&ctx);
+  uint32_t rx_frames = ((uint32_t) response[8] << 24) | ((uint32_t) response[9] << 16) | (response[10] << 8) | response[11];
+
+  STACK_CHECK(response[0] == 0xE1 && response[2] == OSNP_GET_DATA);
+  STACK_CHECK(response[4] == 0xDF && response[5] == 0x7F && response[6] == 1 + OSNP_STATS_PAGE_FIELDS * 4);
+  STACK_CHECK(response[7] == 0 && rx_frames == 2);
+
+  uint8_t request[8] = { 0xE0, 0x06, OSNP_GET_DATA, 0x04, 0xDF, 0x7F, 0x01, 0x01 };
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, request, sizeof(request));
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+  response = _stack_last_tx(&ctx);
+  STACK_CHECK(response[6] == 1 + OSNP_STATS_PAGE_FIELDS * 4 && response[7] == 1);
+  STACK_CHECK(response[7 + OSNP_STATS_PAGE_FIELDS * 4 - 3] == 0x01 && response[7 + OSNP_STATS_PAGE_FIELDS * 4] == 0x04);
+
+  // there is no third page
+  request[7] = 0x02;
+  _stack_receive(&ctx, FCFRTYP(FCFRTYP_DATA) | FCSECEN, request, sizeof(request));
+
+  response = _stack_last_tx(&ctx);
+  STACK_CHECK(response[4] == OSNP_ERROR_TAG && response[6] == OSNP_UNSUPPORTED_PARAMETERS);
+}
+
+/*
+ * Frames built from the header templates, whose fields are found at the offsets recorded in the template, point to
+ * the same fields as a parse of the frame.
+ */
+static void _test_template_fields(void) {
+  osnp_ctx_t ctx;
+  stack_device_t dev;
+
+  _stack_init(&ctx, &dev);
+  _stack_associate(&ctx);
+  osnp_ctx_frame_sent_cb(&ctx, OSNP_TX_STATUS_OK);
+
+  for (uint8_t i = 0; i < OSNP_HEADER_TEMPLATES; i++) {
+    ieee802_15_4_frame_t frame;
+    ieee802_15_4_frame_t parsed;
+    uint32_t counter = ctx.tx_frame_counter;
+
+    ctx.tx_pool_used = 0;
+    STACK_CHECK(_osnp_initialize_frame_from_template(&ctx, i, &frame));
+
+    uint8_t len = (frame.payload - frame.backing_buffer) + (frame.sec_header_len ? OSNP_MIC_LENGTH : 0) + IEEE802_15_4_FCS_LEN;
+
+    STACK_CHECK(osnp_parse_frame(frame.backing_buffer, len, &parsed));
+    STACK_CHECK(parsed.header_len == frame.header_len && parsed.sec_header_len == frame.sec_header_len);
+    STACK_CHECK(parsed.payload == frame.payload && frame.payload_len == 0);
+    STACK_CHECK(parsed.fc_low == frame.fc_low && parsed.fc_high == frame.fc_high && parsed.seq_no == frame.seq_no);
+    STACK_CHECK(parsed.dst_pan == frame.dst_pan && parsed.dst_addr == frame.dst_addr);
+    STACK_CHECK(parsed.src_pan == frame.src_pan && parsed.src_addr == frame.src_addr);
+    STACK_CHECK(parsed.frame_counter == frame.frame_counter && parsed.key_counter == frame.key_counter);
+
+    if (frame.frame_counter) {
+      STACK_CHECK(frame.frame_counter[0] == (counter & 0xff) && *frame.key_counter == 0x01);
+    }
+  }
+
+  ctx.tx_pool_used = 0;
+}
+
+typedef struct {
+  const char *name;
+  void (*run)(void);
+} stack_test_t;
+
+static const stack_test_t stack_tests[] = {
+  { "delivery class after flush", _test_delivery_class_after_flush },
+  { "compact reference on delivery", _test_compact_reference_on_delivery },
+  { "compact late delivery", _test_compact_late_delivery },
+  { "bulk transfer", _test_bulk_transfer },
+  { "counter log recovery", _test_counter_log_recovery },
+  { "command without room for its response", _test_command_without_room },
+  { "template fields", _test_template_fields },
+  { "report after queued", _test_report_after_queued },
+  { "flush without buffer", _test_flush_without_buffer },
+  { "rx ring drops", _test_rx_ring_drops },
+  { "stats pages", _test_stats_pages },
+  { "replay window", _test_replay_window },
+  { "adaptive poll interval", _test_adaptive_poll_interval },
+  { "poll back off on poll", _test_poll_back_off_on_poll },
+  { "key cache", _test_key_cache },
+  { "first poll slot", _test_first_poll_slot },
+  { "counter window after restart", _test_counter_window_after_restart },
+  { "quiet channel scan", _test_quiet_channel_scan },
+  { "energy model", _test_energy_model },
+  { "energy stats wraparound", _test_energy_stats_wraparound },
+  { "group commands", _test_group_commands },
+};
+
+int main(int argc, char **argv) {
+  int failed = 0;
+
+  for (uint8_t i = 0; i < sizeof(stack_tests) / sizeof(stack_tests[0]); i++) {
+    int before = stack_failures;
+
+    stack_clock = 0;
+    stack_hub_seq_no = 0;
+    stack_tests[i].run();
+
+    if (stack_failures != before) {
+      failed++;
+    }
+
+    printf("%-48s %s\n", stack_tests[i].name, stack_failures != before ? "FAIL" : "ok");
+  }
+
+  printf("\n%d of %u tests failed\n", failed, (unsigned) (sizeof(stack_tests) / sizeof(stack_tests[0])));
+
+  return failed ? 1 : 0;
+}
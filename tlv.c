@@ -23,6 +23,8 @@
 #include "tlv.h"
 #include "config.h"
 
+#include <string.h>
+
 uint16_t tlv_read_tag(uint8_t *buf, uint16_t *out_tag) {
   uint16_t i = 0;
 
@@ -57,7 +59,8 @@ uint16_t tlv_write_tag(uint8_t *buf, uint16_t in_tag) {
   int max_shift = (sizeof(uint16_t) - 1) * 8;
   uint16_t i = 0;
 
-  while((in_tag >> max_shift) == 0x00) {
+  // tag 0x00 is written as a single byte
+  while(max_shift > 0 && (in_tag >> max_shift) == 0x00) {
     max_shift -= 8;
   }
 
@@ -97,4 +100,259 @@ uint16_t tlv_write_undefined_length_terminator(uint8_t *buf) {
   buf[1] = 0x00;
 
   return 2;
-}
\ No newline at end of file
+}
+
+/* Maximum nesting of indefinite length objects the reader follows to find their end */
+#define TLV_READER_MAX_DEPTH 8
+
+static uint16_t _tlv_read_bounded_tag(uint8_t *buf, uint16_t avail, uint16_t *out_tag) {
+  if (!avail) {
+    return 0;
+  }
+
+  *out_tag = buf[0];
+
+  if ((buf[0] & 0x1F) == 0x1F) {
+    // a 16-bit tag only has room for one subsequent byte, which must then be the last
+    if (avail < 2 || (buf[1] & 0x80)) {
+      return 0;
+    }
+
+    *out_tag = *out_tag << 8 | buf[1];
+    return 2;
+  }
+
+  return 1;
+}
+
+static uint16_t _tlv_read_bounded_length(uint8_t *buf, uint16_t avail, uint16_t *out_len) {
+  if (!avail) {
+    return 0;
+  }
+
+  *out_len = buf[0];
+
+  if (buf[0] > 0x80) {
+    uint16_t len_of_len = buf[0] & 0x7f;
+
+    if (len_of_len > 2 || len_of_len >= avail) {
+      return 0;
+    }
+
+    *out_len = 0;
+
+    for (uint16_t i = 1; i <= len_of_len; i++) {
+      *out_len = (*out_len << 8) | buf[i];
+    }
+
+    return len_of_len + 1;
+  }
+
+  return 1;
+}
+
+static bool _tlv_is_end_of_contents(uint8_t *buf, uint16_t pos, uint16_t end) {
+  return (end - pos) >= 2 && buf[pos] == 0x00 && buf[pos + 1] == 0x00;
+}
+
+/*
+ * Parses the object at pos, without reading at or after end. On success, returns the tag, the position and length
+ * of the value and the position of the next sibling. Definite length objects are skipped in constant time,
+ * indefinite length ones are walked to find their end-of-contents marker.
+ */
+static bool _tlv_parse_object(uint8_t *buf, uint16_t pos, uint16_t end, uint8_t depth, uint16_t *out_tag, uint16_t *out_value, uint16_t *out_len, uint16_t *out_next) {
+  bool constructed = buf[pos] & 0x20;
+  uint16_t n = _tlv_read_bounded_tag(&buf[pos], end - pos, out_tag);
+
+  // tag 0x00 is reserved for end-of-contents markers, an object with it could be written back as one
+  if (!n || !*out_tag) {
+    return false;
+  }
+
+  pos += n;
+
+  if (pos < end && buf[pos] == 0x80) {
+    if (!constructed || !depth) {
+      return false;
+    }
+
+    uint16_t child = ++pos;
+    uint16_t tag, value, len;
+
+    while (!_tlv_is_end_of_contents(buf, child, end)) {
+      if (child >= end || !_tlv_parse_object(buf, child, end, depth - 1, &tag, &value, &len, &child)) {
+        return false;
+      }
+    }
+
+    *out_value = pos;
+    *out_len = child - pos;
+    *out_next = child + 2;
+
+    return true;
+  }
+
+  n = _tlv_read_bounded_length(&buf[pos], end - pos, out_len);
+
+  if (!n) {
+    return false;
+  }
+
+  pos += n;
+
+  if (*out_len > end - pos) {
+    return false;
+  }
+
+  *out_value = pos;
+  *out_next = pos + *out_len;
+
+  return true;
+}
+
+void tlv_reader_init(tlv_reader_t *reader, uint8_t *buf, uint16_t len) {
+  reader->buf = buf;
+  reader->pos = 0;
+  reader->end = len;
+  reader->error = false;
+}
+
+bool tlv_reader_has_next(tlv_reader_t *reader) {
+  return !reader->error && reader->pos < reader->end && !_tlv_is_end_of_contents(reader->buf, reader->pos, reader->end);
+}
+
+bool tlv_reader_peek_tag(tlv_reader_t *reader, uint16_t *out_tag) {
+  if (!tlv_reader_has_next(reader)) {
+    return false;
+  }
+
+  if (!_tlv_read_bounded_tag(&reader->buf[reader->pos], reader->end - reader->pos, out_tag)) {
+    reader->error = true;
+    return false;
+  }
+
+  return true;
+}
+
+bool tlv_reader_next(tlv_reader_t *reader, uint16_t *out_tag, uint16_t *out_len, uint8_t **out_value) {
+  uint16_t value;
+
+  if (!tlv_reader_has_next(reader)) {
+    return false;
+  }
+
+  if (!_tlv_parse_object(reader->buf, reader->pos, reader->end, TLV_READER_MAX_DEPTH, out_tag, &value, out_len, &reader->pos)) {
+    reader->error = true;
+    return false;
+  }
+
+  *out_value = &reader->buf[value];
+
+  return true;
+}
+
+bool tlv_reader_enter(tlv_reader_t *reader, tlv_reader_t *child, uint16_t *out_tag) {
+  uint16_t len;
+  uint8_t *value;
+
+  if (!tlv_reader_next(reader, out_tag, &len, &value)) {
+    return false;
+  }
+
+  tlv_reader_init(child, value, len);
+
+  return true;
+}
+
+bool tlv_reader_skip(tlv_reader_t *reader) {
+  uint16_t tag;
+  uint16_t len;
+  uint8_t *value;
+
+  return tlv_reader_next(reader, &tag, &len, &value);
+}
+
+static uint16_t _tlv_tag_size(uint16_t tag) {
+  return (tag > 0xff) ? 2 : 1;
+}
+
+static uint16_t _tlv_length_size(uint16_t len) {
+  return (len <= 0x7f) ? 1 : ((len <= 0xff) ? 2 : 3);
+}
+
+void tlv_writer_init(tlv_writer_t *writer, uint8_t *buf, uint16_t cap) {
+  writer->buf = buf;
+  writer->pos = 0;
+  writer->cap = cap;
+  writer->depth = 0;
+  writer->error = false;
+}
+
+bool tlv_writer_open(tlv_writer_t *writer, uint16_t tag) {
+  if (writer->depth == TLV_WRITER_MAX_DEPTH || (writer->cap - writer->pos) < (_tlv_tag_size(tag) + 1)) {
+    writer->error = true;
+    return false;
+  }
+
+  writer->pos += tlv_write_tag(&writer->buf[writer->pos], tag);
+  writer->open[writer->depth++] = writer->pos++;
+
+  return true;
+}
+
+bool tlv_writer_close(tlv_writer_t *writer) {
+  if (!writer->depth) {
+    writer->error = true;
+    return false;
+  }
+
+  uint16_t slot = writer->open[writer->depth - 1];
+  uint16_t len = writer->pos - slot - 1;
+  uint16_t grow = _tlv_length_size(len) - 1;
+
+  if (grow) {
+    if ((writer->cap - writer->pos) < grow) {
+      writer->error = true;
+      return false;
+    }
+
+    memmove(&writer->buf[slot + 1 + grow], &writer->buf[slot + 1], len);
+    writer->pos += grow;
+  }
+
+  tlv_write_length(&writer->buf[slot], len);
+  writer->depth--;
+
+  return true;
+}
+
+bool tlv_writer_put(tlv_writer_t *writer, uint16_t tag, uint8_t *value, uint16_t len) {
+  uint16_t size = _tlv_tag_size(tag) + _tlv_length_size(len);
+
+  if ((writer->cap - writer->pos) < size || (writer->cap - writer->pos - size) < len) {
+    writer->error = true;
+    return false;
+  }
+
+  writer->pos += tlv_write_tag(&writer->buf[writer->pos], tag);
+  writer->pos += tlv_write_length(&writer->buf[writer->pos], len);
+
+  if (len) {
+    memcpy(&writer->buf[writer->pos], value, len);
+    writer->pos += len;
+  }
+
+  return true;
+}
+
+bool tlv_writer_put_raw(tlv_writer_t *writer, uint8_t *buf, uint16_t len) {
+  if ((writer->cap - writer->pos) < len) {
+    writer->error = true;
+    return false;
+  }
+
+  memcpy(&writer->buf[writer->pos], buf, len);
+  writer->pos += len;
+
+  return true;
+}
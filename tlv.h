@@ -26,6 +26,35 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/**
+ * A cursor over a sequence of sibling TLV objects stored in a buffer of known length. The reader never reads past
+ * the end of its buffer: a truncated or malformed object stops the iteration and sets the error flag. Values are
+ * not copied, the reader only returns pointers into the buffer.
+ */
+typedef struct {
+  uint8_t *buf;
+  uint16_t pos;
+  uint16_t end;
+  bool error;
+} tlv_reader_t;
+
+/* Maximum number of constructed objects a writer can have open at the same time */
+#define TLV_WRITER_MAX_DEPTH 4
+
+/**
+ * A cursor writing TLV objects with definite lengths into a buffer of known capacity. Constructed objects reserve a
+ * single length byte when opened and get their minimal length back-patched when closed. A write that does not fit
+ * leaves the buffer untouched and sets the error flag.
+ */
+typedef struct {
+  uint8_t *buf;
+  uint16_t pos;
+  uint16_t cap;
+  uint16_t open[TLV_WRITER_MAX_DEPTH];
+  uint8_t depth;
+  bool error;
+} tlv_writer_t;
+
 /**
  * Reads the TLV tag in the buffer and stores it in the out_tag parameter.
  *
@@ -78,5 +107,110 @@ uint16_t tlv_write_undefined_length(uint8_t *buf);
  */
 uint16_t tlv_write_undefined_length_terminator(uint8_t *buf);
 
+/**
+ * Initializes a reader over the given buffer.
+ *
+ * @param reader the reader
+ * @param buf the buffer
+ * @param len the length of the buffer
+ */
+void tlv_reader_init(tlv_reader_t *reader, uint8_t *buf, uint16_t len);
+
+/**
+ * Tells whether the reader has more objects. This is false at the end of the buffer, at an end-of-contents marker
+ * or after an error.
+ *
+ * @param reader the reader
+ * @return true if tlv_reader_next can be called
+ */
+bool tlv_reader_has_next(tlv_reader_t *reader);
+
+/**
+ * Reads the tag of the next object, without consuming it.
+ *
+ * @param reader the reader
+ * @param out_tag the output tag
+ * @return true on success, false if there are no more objects or the tag is truncated
+ */
+bool tlv_reader_peek_tag(tlv_reader_t *reader, uint16_t *out_tag);
+
+/**
+ * Reads the next object and moves the reader past it. The value of constructed objects is not parsed, use
+ * tlv_reader_enter to iterate over their content.
+ *
+ * @param reader the reader
+ * @param out_tag the output tag
+ * @param out_len the output length of the value
+ * @param out_value the output pointer to the value
+ * @return true on success, false if there are no more objects or the object is malformed
+ */
+bool tlv_reader_next(tlv_reader_t *reader, uint16_t *out_tag, uint16_t *out_len, uint8_t **out_value);
+
+/**
+ * Reads the next object and initializes child to iterate over its value. The reader moves past the object.
+ *
+ * @param reader the reader
+ * @param child the reader to initialize on the value of the object
+ * @param out_tag the output tag
+ * @return true on success, false if there are no more objects or the object is malformed
+ */
+bool tlv_reader_enter(tlv_reader_t *reader, tlv_reader_t *child, uint16_t *out_tag);
+
+/**
+ * Moves the reader past the next object.
+ *
+ * @param reader the reader
+ * @return true on success, false if there are no more objects or the object is malformed
+ */
+bool tlv_reader_skip(tlv_reader_t *reader);
+
+/**
+ * Initializes a writer over the given buffer.
+ *
+ * @param writer the writer
+ * @param buf the buffer
+ * @param cap the capacity of the buffer
+ */
+void tlv_writer_init(tlv_writer_t *writer, uint8_t *buf, uint16_t cap);
+
+/**
+ * Opens a constructed object. Everything written until the matching tlv_writer_close becomes its value.
+ *
+ * @param writer the writer
+ * @param tag the tag
+ * @return true on success, false if the tag does not fit or too many objects are open
+ */
+bool tlv_writer_open(tlv_writer_t *writer, uint16_t tag);
+
+/**
+ * Closes the innermost open object, writing its length. The value is moved forward only if its length does not fit
+ * in the single byte reserved by tlv_writer_open, i.e. if it is longer than 127 bytes.
+ *
+ * @param writer the writer
+ * @return true on success, false if there is no open object or the longer length does not fit
+ */
+bool tlv_writer_close(tlv_writer_t *writer);
+
+/**
+ * Writes a primitive object.
+ *
+ * @param writer the writer
+ * @param tag the tag
+ * @param value the value, can be NULL if len is 0
+ * @param len the length of the value
+ * @return true on success, false if the object does not fit
+ */
+bool tlv_writer_put(tlv_writer_t *writer, uint16_t tag, uint8_t *value, uint16_t len);
+
+/**
+ * Copies already encoded objects into the writer.
+ *
+ * @param writer the writer
+ * @param buf the encoded objects
+ * @param len the length of the encoded objects
+ * @return true on success, false if they do not fit
+ */
+bool tlv_writer_put_raw(tlv_writer_t *writer, uint8_t *buf, uint16_t len);
+
 #endif	/* TLV_H */
 